@@ -0,0 +1,103 @@
+/* Copyright (c) 2025 Peter Andersson (pelleplutt1976<at>gmail.com) */
+/* MIT License (see ./LICENSE) */
+
+#if CONFIG_NVMTNV_JOURNAL==1
+
+#include <stdbool.h>
+#include "nvmtnvj.h"
+#include "flash_driver.h"
+#include "cli.h"
+#include "minio.h"
+
+#ifndef HWPROBE_NVMTNVJ_SECTORS
+#define HWPROBE_NVMTNVJ_SECTORS 8
+#endif
+
+static bool nvmtnvj_initiated = false;
+
+static void nvmtnvj_lazy_init(void) {
+    if (!nvmtnvj_initiated) {
+        nvmtnvj_init();
+        nvmtnvj_initiated = true;
+    }
+}
+
+// journal defaults to the last sectors of code flash, unused by hwprobe
+static int nvmtnvj_sectors(uint32_t *sector) {
+    uint32_t num_sectors;
+    if (flash_get_sectors_for_type(FLASH_TYPE_CODE_BANK0, sector, &num_sectors) ||
+        num_sectors < HWPROBE_NVMTNVJ_SECTORS) {
+        return -1;
+    }
+    *sector += num_sectors - HWPROBE_NVMTNVJ_SECTORS;
+    return 0;
+}
+
+static int cli_nvmtnvj_format(int argc, const char **argv) {
+    if (argc != 2) {
+        printf("[<sectors_per_block>,<max_value_size>]\n");
+        return ERR_CLI_EINVAL;
+    }
+    uint32_t sector;
+    int spb = atoi(argv[0]);
+    if (spb <= 0 || nvmtnvj_sectors(&sector)) return ERR_CLI_EINVAL;
+    nvmtnvj_lazy_init();
+    int res = nvmtnvj_format(sector, spb, HWPROBE_NVMTNVJ_SECTORS / spb, atoi(argv[1]));
+    printf("format sector %d, %d blocks:%d\n", sector, HWPROBE_NVMTNVJ_SECTORS / spb, res);
+    return 0;
+}
+CLI_FUNCTION(cli_nvmtnvj_format, "nvmtnvj_format", "");
+
+static int cli_nvmtnvj_mount(int argc, const char **argv) {
+    uint32_t sector;
+    uint32_t lookahead = HWPROBE_NVMTNVJ_SECTORS;
+    if (argc == 2) {
+        sector = atoi(argv[0]);
+        lookahead = atoi(argv[1]);
+    } else if (argc != 0 || nvmtnvj_sectors(&sector)) {
+        printf("[<sector>,<lookahead_sectors>]\n");
+        return ERR_CLI_EINVAL;
+    }
+    nvmtnvj_lazy_init();
+    int res = nvmtnvj_mount(sector, lookahead);
+    printf("mount:%d\n", res);
+    return 0;
+}
+CLI_FUNCTION(cli_nvmtnvj_mount, "nvmtnvj_mount", "");
+
+static int cli_nvmtnvj_unmount(int argc, const char **argv) {
+    printf("unmount:%d\n", nvmtnvj_unmount());
+    return 0;
+}
+CLI_FUNCTION(cli_nvmtnvj_unmount, "nvmtnvj_unmount", "");
+
+static void print_tags(const char *name, uint32_t count) {
+    if (count == NVMTNVJ_STATS_UNKNOWN)
+        printf("%s\t-\n", name);
+    else
+        printf("%s\t%d\n", name, count);
+}
+
+static int cli_nvmtnvj_stats(int argc, const char **argv) {
+    nvmtnvj_stats_t st;
+    int res = nvmtnvj_stats(&st);
+    if (res) {
+        printf("stats:%d\n", res);
+        return 0;
+    }
+    printf("free slots\t%d\n", st.free_slots);
+    print_tags("live tags", st.live_tags);
+    print_tags("dead tags", st.dead_tags);
+    print_tags("freeable tags", st.freeable_tags);
+    printf("blocks\t\t%d data, %d free, %d spare\n", st.data_blocks, st.free_blocks, st.spare_blocks);
+    printf("seq span\t%d\n", st.seq_nbr_span);
+    printf("written\t\t%d bytes, %d sector erases\n", st.bytes_written, st.erases);
+    printf("gc\t\t%d, %d tags copied, %d bytes written, %d sector erases\n", st.gc_count, st.gc_copied_tags,
+           st.gc_bytes_written, st.gc_erases);
+    printf("lookups\t\t%d, depth %d.%02d blocks\n", st.lookups, st.lookup_depth_x100 / 100,
+           st.lookup_depth_x100 % 100);
+    return 0;
+}
+CLI_FUNCTION(cli_nvmtnvj_stats, "nvmtnvj_stats", "");
+
+#endif
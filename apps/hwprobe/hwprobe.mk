@@ -7,5 +7,8 @@ CONFIG_CLI := 1
 CONFIG_CRYSTAL_TEST := 1
 CONFIG_NRF52_TEST_BLE_DTM := 1
 CONFIG_NRF52_TEST_RADIO := 1
+CONFIG_NVMTNV_JOURNAL := 1
+# sectors at end of code flash for the nvmtnvj cli commands
+CFLAGS += -DHWPROBE_NVMTNVJ_SECTORS=8
 
 CFILES += $(wildcard apps/$(APP)/*.c)
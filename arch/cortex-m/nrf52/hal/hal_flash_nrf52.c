@@ -2,6 +2,7 @@
 /* MIT License (see ./LICENSE) */
 
 #include "flash_driver.h"
+#include "flash_async.h"
 #include "flash_nrf52.h"
 #include "nrf52.h"
 
@@ -85,7 +86,7 @@ static int validate_sector_and_flash_state(uint32_t sector) {
     return 0;
 }
 
-int flash_erase(uint32_t sector) {
+static int _flash_erase_sector(uint32_t sector) {
     int res = validate_sector_and_flash_state(sector);
     if (res) return res;
 
@@ -101,7 +102,7 @@ int flash_erase(uint32_t sector) {
     return 0;
 }
 
-int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
+static int _flash_write_sector(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
     int res = validate_sector_and_flash_state(sector);
     if (res) {
         return res;
@@ -150,6 +151,33 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
     return res;
 }
 
+int flash_erase(uint32_t sector) {
+    // completion of an asynchronous operation may still be pending
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
+    return _flash_erase_sector(sector);
+}
+
+int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
+    return _flash_write_sector(sector, offset, data, length);
+}
+
+// NVMC has no completion interrupt and the cpu stalls while it erases or writes
+// code flash, so the operation is done at once and completion delivered as if
+// asynchronous
+int flash_erase_async(uint32_t sector, flash_done_fn_t done, void *arg) {
+    return flash_async_erase_sync(_flash_erase_sector, sector, done, arg);
+}
+
+int flash_write_async(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                      flash_done_fn_t done, void *arg) {
+    return flash_async_write_sync(_flash_write_sector, sector, offset, data, length, done, arg);
+}
+
+int flash_busy(void) {
+    return _flash_async.busy;
+}
+
 int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length) {
     int res = validate_sector_and_flash_state(sector);
     if (res) {
@@ -3,6 +3,7 @@
 
 #include "bmtypes.h"
 #include "flash_driver.h"
+#include "flash_async.h"
 #include "flash_stm32f3.h"
 #include "stm32f3xx.h"
 
@@ -75,6 +76,55 @@ static FLASH_res _flash_write_hword(uint32_t addr, uint16_t data) {
     return res;
 }
 
+// asynchronous operation in progress, stepped by the flash interrupt
+static struct {
+    uint8_t erase;
+    uint32_t addr;
+    uint32_t offset;
+    uint32_t sector_size;
+    const uint8_t *data;
+    uint32_t length;
+    int written;
+} _async;
+
+// programs next halfword differing from flash, returns 0 when nothing is left
+static int _flash_async_write_next(void) {
+    while (_async.length > 0 && _async.offset < _async.sector_size) {
+        uint32_t addr = _async.addr + (_async.offset & ~1);
+        uint16_t d16;
+        uint32_t n = 1;
+        if (_async.offset & 1) {
+            d16 = (_async.data[0] << 8) | 0xff;
+        } else if (_async.length > 1) {
+            d16 = (_async.data[1] << 8) | _async.data[0];
+            n = 2;
+        } else {
+            d16 = 0xff00 | _async.data[0];
+        }
+        _async.offset += n;
+        _async.data += n;
+        _async.length -= n;
+        _async.written += n;
+        if (d16 != *((uint16_t *)addr)) {
+            FLASH->CR |= FLASH_CR_PG;
+            *(volatile uint16_t *)addr = d16;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void _flash_async_finish(FLASH_res res) {
+    FLASH->CR &= ~(FLASH_CR_EOPIE | FLASH_CR_ERRIE);
+    _flash_close();
+    switch (res) {
+    case FLASH_OK: flash_async_done(_async.erase ? 0 : _async.written); break;
+    case FLASH_ERR_BUSY: flash_async_done(ERR_FLASH_BUSY); break;
+    case FLASH_ERR_WRITE_PROTECTED: flash_async_done(ERR_FLASH_PROTECTED); break;
+    default: flash_async_done(ERR_FLASH_OTHER); break;
+    }
+}
+
 static uint8_t *_flash_addr_for_sector(uint32_t sector) {
     int sector_size = flash_get_sector_size(sector);
     if (sector_size <= 0) return 0;
@@ -97,6 +147,9 @@ int flash_init(void) {
     uint32_t size = *flash_size;
     _sector_size = 2048;
     _sectors = size * 1024 / _sector_size;
+    // only raised while an asynchronous operation has EOPIE/ERRIE set
+    NVIC_ClearPendingIRQ(FLASH_IRQn);
+    NVIC_EnableIRQ(FLASH_IRQn);
     return _sector_size != 0 ? 0 : ERR_FLASH_NOSUPPORT;
 }
 
@@ -144,6 +197,7 @@ int flash_is_protected(uint32_t sector) { (void)sector; return 0; }
 int flash_erase(uint32_t sector) {
     uint8_t *addr = _flash_addr_for_sector(sector);
     if (addr == 0) return ERR_FLASH_BADSECTOR;
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
     _flash_open();
     FLASH_res res = _flash_erase((uint32_t)(intptr_t)addr);
     _flash_close();
@@ -159,6 +213,7 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
     int sector_size = flash_get_sector_size(sector);
     if (sector_size < 0) return sector_size;
     if (length == 0 || offset >= (uint32_t)sector_size) return 0;
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
 
     uint8_t *addr = _flash_addr_for_sector(sector);
     int written = 0;
@@ -192,6 +247,57 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
     }
 }
 
+int flash_erase_async(uint32_t sector, flash_done_fn_t done, void *arg) {
+    uint8_t *addr = _flash_addr_for_sector(sector);
+    if (addr == 0) return ERR_FLASH_BADSECTOR;
+    if (FLASH->SR & FLASH_SR_BSY) return ERR_FLASH_BUSY;
+    int res = flash_async_begin(done, arg);
+    if (res) return res;
+    _async.erase = 1;
+    _flash_open();
+    FLASH->CR |= FLASH_CR_PER | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    FLASH->AR = (uint32_t)(intptr_t)addr;
+    FLASH->CR |= FLASH_CR_STRT;
+    return 0;
+}
+
+int flash_write_async(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                      flash_done_fn_t done, void *arg) {
+    int sector_size = flash_get_sector_size(sector);
+    if (sector_size < 0) return sector_size;
+    if (FLASH->SR & FLASH_SR_BSY) return ERR_FLASH_BUSY;
+    int res = flash_async_begin(done, arg);
+    if (res) return res;
+    _async.erase = 0;
+    _async.addr = (uint32_t)(intptr_t)_flash_addr_for_sector(sector);
+    _async.offset = offset;
+    _async.sector_size = (uint32_t)sector_size;
+    _async.data = data;
+    _async.length = length;
+    _async.written = 0;
+    _flash_open();
+    FLASH->CR |= FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+    if (!_flash_async_write_next()) {
+        // nothing to program
+        _flash_async_finish(FLASH_OK);
+    }
+    return 0;
+}
+
+int flash_busy(void) {
+    return _flash_async.busy;
+}
+
+void FLASH_IRQHandler(void);
+void FLASH_IRQHandler(void) {
+    FLASH_res res = _flash_status();
+    FLASH->SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPERR;
+    FLASH->CR &= ~(FLASH_CR_PER | FLASH_CR_PG);
+    if (!_flash_async.busy) return;
+    if (res == FLASH_OK && !_async.erase && _flash_async_write_next()) return;
+    _flash_async_finish(res);
+}
+
 int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length) {
     int sector_size = flash_get_sector_size(sector);
     if (sector_size < 0) return sector_size;
@@ -3,6 +3,7 @@
 
 #include "bmtypes.h"
 #include "flash_driver.h"
+#include "flash_async.h"
 #include "flash_stm32f1.h"
 #include "stm32f1xx.h"
 
@@ -181,7 +182,7 @@ int flash_is_protected(uint32_t sector) {
     return 0;
 }
 
-int flash_erase(uint32_t sector) {
+static int _flash_erase_sector(uint32_t sector) {
     // TODO
     uint8_t *addr = _flash_addr_for_sector(sector);
     if (addr == 0) return ERR_FLASH_BADSECTOR;
@@ -196,7 +197,7 @@ int flash_erase(uint32_t sector) {
     }
 }
 
-int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
+static int _flash_write_sector(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
     // TODO
     int sector_size = flash_get_sector_size(sector);
     if (sector_size < 0) return sector_size;
@@ -234,6 +235,31 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
     }
 }
 
+int flash_erase(uint32_t sector) {
+    // completion of an asynchronous operation may still be pending
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
+    return _flash_erase_sector(sector);
+}
+
+int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
+    return _flash_write_sector(sector, offset, data, length);
+}
+
+// the operation is done at once and completion delivered as if asynchronous
+int flash_erase_async(uint32_t sector, flash_done_fn_t done, void *arg) {
+    return flash_async_erase_sync(_flash_erase_sector, sector, done, arg);
+}
+
+int flash_write_async(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                      flash_done_fn_t done, void *arg) {
+    return flash_async_write_sync(_flash_write_sector, sector, offset, data, length, done, arg);
+}
+
+int flash_busy(void) {
+    return _flash_async.busy;
+}
+
 int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length) {
     // TODO
     int res;
@@ -3,6 +3,7 @@
 
 #include "bmtypes.h"
 #include "flash_driver.h"
+#include "flash_async.h"
 #include "stm32l0xx.h"
 
 #define DEBUG 0
@@ -112,6 +113,55 @@ static FLASH_res _flash_write_word(uint32_t addr, uint32_t data)
     return res;
 }
 
+// asynchronous operation in progress, stepped by the flash interrupt
+static struct
+{
+    uint8_t erase;
+    uint32_t addr;
+    uint32_t offset;
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t written;
+} _async;
+
+// programs next word, returns 0 when nothing is left
+static int _flash_async_write_next(void)
+{
+    if (_async.written >= _async.length)
+        return 0;
+    uint32_t d32 = 0;
+    for (int i = _async.offset & 3; i < 4 && _async.written < _async.length; i++)
+    {
+        d32 |= _async.data[_async.written] << (i * 8);
+        _async.written++;
+    }
+    FLASH->PECR |= FLASH_PECR_PROG;
+    *(volatile uint32_t *)(_async.addr + (_async.offset & ~3)) = d32;
+    _async.offset += 4 - (_async.offset & 3);
+    return 1;
+}
+
+static void _flash_async_finish(FLASH_res res)
+{
+    FLASH->PECR &= ~(FLASH_PECR_EOPIE | FLASH_PECR_ERRIE);
+    _flash_close();
+    switch (res)
+    {
+    case FLASH_OK:
+        flash_async_done(_async.erase ? 0 : (int)_async.written);
+        break;
+    case FLASH_ERR_BUSY:
+        flash_async_done(ERR_FLASH_BUSY);
+        break;
+    case FLASH_ERR_WRITE_PROTECTED:
+        flash_async_done(ERR_FLASH_PROTECTED);
+        break;
+    default:
+        flash_async_done(ERR_FLASH_OTHER);
+        break;
+    }
+}
+
 static uint8_t *_flash_addr_for_sector(uint32_t sector)
 {
     int sector_size = flash_get_sector_size(sector);
@@ -141,6 +191,9 @@ int flash_init(void)
     volatile uint16_t *flash_size_p = (uint16_t *)0x1ff8007c;
     uint32_t flash_size = (uint32_t)(*flash_size_p) * 1024;
     _sectors = flash_size / _sector_size;
+    // only raised while an asynchronous operation has EOPIE/ERRIE set
+    NVIC_ClearPendingIRQ(FLASH_IRQn);
+    NVIC_EnableIRQ(FLASH_IRQn);
     return 0;
 }
 
@@ -215,6 +268,8 @@ int flash_erase(uint32_t sector)
     int sector_size = flash_get_sector_size(sector);
     if (sector_size < 0)
         return sector_size;
+    if (_flash_async.busy)
+        return ERR_FLASH_BUSY;
     uint32_t addr = (uint32_t)_flash_addr_for_sector(sector);
     _flash_open();
     FLASH_res res = _flash_erase(addr);
@@ -249,6 +304,8 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
     if (length == 0)
         return 0;
 
+    if (_flash_async.busy)
+        return ERR_FLASH_BUSY;
 
     uint32_t addr = (uint32_t)_flash_addr_for_sector(sector);
     dbg("write %d bytes to %08x\n", length, addr + offset);
@@ -280,6 +337,73 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
     return written;
 }
 
+int flash_erase_async(uint32_t sector, flash_done_fn_t done, void *arg)
+{
+    uint8_t *addr = _flash_addr_for_sector(sector);
+    if (addr == 0)
+        return ERR_FLASH_BADSECTOR;
+    if (FLASH->SR & FLASH_SR_BSY)
+        return ERR_FLASH_BUSY;
+    int res = flash_async_begin(done, arg);
+    if (res)
+        return res;
+    _async.erase = 1;
+    _flash_open();
+    FLASH->PECR |= FLASH_PECR_EOPIE | FLASH_PECR_ERRIE | FLASH_PECR_ERASE | FLASH_PECR_PROG;
+    *(volatile uint32_t *)addr = 0xffffffff;
+    return 0;
+}
+
+int flash_write_async(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                      flash_done_fn_t done, void *arg)
+{
+    int sector_size = flash_get_sector_size(sector);
+    if (sector_size < 0)
+        return sector_size;
+    if (offset >= (uint32_t)sector_size)
+        length = 0;
+    else if (offset + length >= (uint32_t)sector_size)
+        length = sector_size - offset;
+    if (FLASH->SR & FLASH_SR_BSY)
+        return ERR_FLASH_BUSY;
+    int res = flash_async_begin(done, arg);
+    if (res)
+        return res;
+    _async.erase = 0;
+    _async.addr = (uint32_t)_flash_addr_for_sector(sector);
+    _async.offset = offset;
+    _async.data = data;
+    _async.length = length;
+    _async.written = 0;
+    _flash_open();
+    FLASH->PECR |= FLASH_PECR_EOPIE | FLASH_PECR_ERRIE;
+    if (!_flash_async_write_next())
+    {
+        // nothing to program
+        _flash_async_finish(FLASH_OK);
+    }
+    return 0;
+}
+
+int flash_busy(void)
+{
+    return _flash_async.busy;
+}
+
+void FLASH_IRQHandler(void);
+void FLASH_IRQHandler(void)
+{
+    // not busy anymore, only picks up errors
+    FLASH_res res = _flash_wait(STM32L0_FLASH_TIMEOUT);
+    FLASH->SR = FLASH_SR_EOP;
+    FLASH->PECR &= ~(FLASH_PECR_ERASE | FLASH_PECR_PROG);
+    if (!_flash_async.busy)
+        return;
+    if (res == FLASH_OK && !_async.erase && _flash_async_write_next())
+        return;
+    _flash_async_finish(res);
+}
+
 int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length)
 {
     int res;
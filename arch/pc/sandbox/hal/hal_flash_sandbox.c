@@ -2,30 +2,193 @@
 /* MIT License (see ./LICENSE) */
 
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bmtypes.h"
 #include "flash_driver.h"
+#include "flash_async.h"
+
+// Flash is backed by an image file given by command line option
+// --flash-image=<path> or environment variable FLASH_SANDBOX_IMAGE, else by memory
+// erased at each flash_init. Geometry is given likewise by --flash-sector-size=<n>
+// and --flash-sectors=<n>, or FLASH_SANDBOX_SECTOR_SIZE and FLASH_SANDBOX_SECTORS.
+// Without a sector count, the size of an existing image decides it.
+// The image is mapped as is, so it persists between runs and can be a dump of a
+// real flash. Only what is added when creating or growing an image is erased.
 
 #ifndef FLASH_SANDBOX_SECTOR_SIZE
+// default sector size
 #define FLASH_SANDBOX_SECTOR_SIZE   1024
 #endif
 
 #ifndef FLASH_SANDBOX_NUM_SECTORS
+// default number of sectors when there is no image to decide it
 #define FLASH_SANDBOX_NUM_SECTORS   512
 #endif
 
-static uint8_t mem[FLASH_SANDBOX_NUM_SECTORS * FLASH_SANDBOX_SECTOR_SIZE];
+// latencies of asynchronous operations, overridden by environment variables
+// FLASH_SANDBOX_ERASE_US and FLASH_SANDBOX_WRITE_US at flash_init
+#ifndef FLASH_SANDBOX_ERASE_LATENCY_US
+#define FLASH_SANDBOX_ERASE_LATENCY_US      20000
+#endif
+
+#ifndef FLASH_SANDBOX_WRITE_LATENCY_US
+// per written byte
+#define FLASH_SANDBOX_WRITE_LATENCY_US      20
+#endif
+
+static uint8_t *mem;
+static size_t mem_size;
+static uint32_t sector_size;
+static uint32_t sectors;
+
+static const char *arg_image;
+static const char *arg_sector_size;
+static const char *arg_sectors;
+
+// glibc passes the command line to constructors too, apps only have main(void)
+__attribute__((constructor))
+static void _flash_sandbox_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--flash-image=", 14) == 0) {
+            arg_image = argv[i] + 14;
+        } else if (strncmp(argv[i], "--flash-sector-size=", 20) == 0) {
+            arg_sector_size = argv[i] + 20;
+        } else if (strncmp(argv[i], "--flash-sectors=", 16) == 0) {
+            arg_sectors = argv[i] + 16;
+        }
+    }
+}
+
+static const char *_opt(const char *arg, const char *env) {
+    return arg ? arg : getenv(env);
+}
+
+// erases the part of the image file from size to new_size
+static int _flash_image_grow(int fd, size_t size, size_t new_size) {
+    uint8_t ff[65536];
+    memset(ff, 0xff, sizeof(ff));
+    while (size < new_size) {
+        size_t len = new_size - size < sizeof(ff) ? new_size - size : sizeof(ff);
+        ssize_t res = pwrite(fd, ff, len, (off_t)size);
+        if (res <= 0) {
+            return ERR_FLASH_OTHER;
+        }
+        size += (size_t)res;
+    }
+    return 0;
+}
+
+static int _flash_map(void) {
+    const char *image = _opt(arg_image, "FLASH_SANDBOX_IMAGE");
+    const char *v = _opt(arg_sector_size, "FLASH_SANDBOX_SECTOR_SIZE");
+    sector_size = v ? (uint32_t)strtoul(v, 0, 0) : FLASH_SANDBOX_SECTOR_SIZE;
+    v = _opt(arg_sectors, "FLASH_SANDBOX_SECTORS");
+    sectors = v ? (uint32_t)strtoul(v, 0, 0) : 0;
+    if (sector_size == 0 || sector_size > INT32_MAX) {
+        sectors = 0;
+        return ERR_FLASH_OTHER;
+    }
+
+    int fd = -1;
+    if (image) {
+        struct stat st;
+        fd = open(image, O_RDWR | O_CREAT, 0644);
+        if (fd < 0 || fstat(fd, &st)) {
+            goto fail;
+        }
+        if (sectors == 0) {
+            sectors = (uint32_t)(st.st_size / sector_size);
+        }
+        if (sectors == 0) {
+            sectors = FLASH_SANDBOX_NUM_SECTORS;
+        }
+        mem_size = (size_t)sectors * sector_size;
+        if ((size_t)st.st_size < mem_size && _flash_image_grow(fd, (size_t)st.st_size, mem_size)) {
+            goto fail;
+        }
+        mem = mmap(0, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // mapping is kept after close
+        close(fd);
+        fd = -1;
+    } else {
+        if (sectors == 0) {
+            sectors = FLASH_SANDBOX_NUM_SECTORS;
+        }
+        mem_size = (size_t)sectors * sector_size;
+        mem = mmap(0, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem != MAP_FAILED) {
+            memset(mem, 0xff, mem_size);
+        }
+    }
+    if (mem == MAP_FAILED) {
+        goto fail;
+    }
+    return 0;
+fail:
+    if (fd >= 0) {
+        close(fd);
+    }
+    mem = 0;
+    sectors = 0;
+    return ERR_FLASH_OTHER;
+}
+
+static void _flash_unmap(void) {
+    if (mem) {
+        munmap(mem, mem_size);
+    }
+    mem = 0;
+    sectors = 0;
+}
 
 int flash_get_address_for_sector(uint32_t sector, void **address) {
-    if (sector >= FLASH_SANDBOX_NUM_SECTORS) {
+    if (sector >= sectors) {
         return ERR_FLASH_OTHER;
     }
-    *address = mem + sector * FLASH_SANDBOX_SECTOR_SIZE;
+    *address = mem + (size_t)sector * sector_size;
     return 0;
 }
 
+// asynchronous operations are performed by a worker thread standing in for the
+// flash interrupt, completion callbacks are called from it
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t running;
+    uint8_t pending;
+    uint8_t quit;
+    uint8_t erase;
+    uint32_t sector;
+    uint32_t offset;
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t erase_us;
+    uint32_t write_us;
+} async = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static int _flash_erase(uint32_t sector);
+static int _flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length);
+static void _flash_async_stop(void);
+
+static uint32_t _env_us(const char *name, uint32_t def) {
+    const char *v = getenv(name);
+    return v ? (uint32_t)strtoul(v, 0, 0) : def;
+}
+
 int flash_init(void) {
-    memset(mem, 0xff, sizeof(mem));
-    return 0;
+    // the worker may still be writing to the image
+    _flash_async_stop();
+    _flash_unmap();
+    int res = _flash_map();
+    async.erase_us = _env_us("FLASH_SANDBOX_ERASE_US", FLASH_SANDBOX_ERASE_LATENCY_US);
+    async.write_us = _env_us("FLASH_SANDBOX_WRITE_US", FLASH_SANDBOX_WRITE_LATENCY_US);
+    return res;
 }
 
 int flash_get_sectors_for_type(flash_type_t type, uint32_t *sector, uint32_t *num_sectors) {
@@ -33,29 +196,29 @@ int flash_get_sectors_for_type(flash_type_t type, uint32_t *sector, uint32_t *nu
         return ERR_FLASH_OTHER;
     }
     *sector = 0;
-    *num_sectors = FLASH_SANDBOX_NUM_SECTORS;
+    *num_sectors = sectors;
     return 0;
 }
 
-int flash_get_sector_for_address(const void *address, uint32_t *sector, uint32_t *offset, uint32_t *sector_size) {
-    if ((intptr_t)address < (intptr_t)mem && (intptr_t)address >= (intptr_t)(mem + sizeof(mem))) {
+int flash_get_sector_for_address(const void *address, uint32_t *sector, uint32_t *offset, uint32_t *size) {
+    if (mem == 0 || (intptr_t)address < (intptr_t)mem || (intptr_t)address >= (intptr_t)(mem + mem_size)) {
         return ERR_FLASH_OTHER;
     }
-    *sector = ((intptr_t)address - (intptr_t)mem) / FLASH_SANDBOX_SECTOR_SIZE;
-    *offset = ((intptr_t)address - (intptr_t)mem) % FLASH_SANDBOX_SECTOR_SIZE;
-    *sector_size = FLASH_SANDBOX_SECTOR_SIZE;
+    *sector = ((intptr_t)address - (intptr_t)mem) / sector_size;
+    *offset = ((intptr_t)address - (intptr_t)mem) % sector_size;
+    *size = sector_size;
     return 0;
 }
 
 int flash_get_sector_size(uint32_t sector) {
-    if (sector >= FLASH_SANDBOX_NUM_SECTORS) {
+    if (sector >= sectors) {
         return ERR_FLASH_OTHER;
     }
-    return FLASH_SANDBOX_SECTOR_SIZE;
+    return (int)sector_size;
 }
 
 int flash_get_sector_alignment(uint32_t sector, flash_op_t operation) {
-    if (sector >= FLASH_SANDBOX_NUM_SECTORS) {
+    if (sector >= sectors) {
         return ERR_FLASH_OTHER;
     }
     return 1;
@@ -73,42 +236,142 @@ int flash_is_protected(uint32_t sector) {
     return ERR_FLASH_NOSUPPORT;
 }
 
-int flash_erase(uint32_t sector) {
-    if (sector >= FLASH_SANDBOX_NUM_SECTORS) {
+static int _flash_erase(uint32_t sector) {
+    if (sector >= sectors) {
         return ERR_FLASH_OTHER;
     }
-    memset(mem + sector * FLASH_SANDBOX_SECTOR_SIZE, 0xff, FLASH_SANDBOX_SECTOR_SIZE);
+    memset(mem + (size_t)sector * sector_size, 0xff, sector_size);
     return 0;
 }
 
-int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
-    if (sector >= FLASH_SANDBOX_NUM_SECTORS) {
+static int _flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
+    if (sector >= sectors) {
         return ERR_FLASH_OTHER;
     }
-    if (offset > FLASH_SANDBOX_SECTOR_SIZE)
+    if (offset > sector_size)
         return 0;
-    int remaining_size = FLASH_SANDBOX_SECTOR_SIZE - offset;
+    int remaining_size = sector_size - offset;
     if (length > (uint32_t)remaining_size) 
         length = remaining_size;
     for (uint32_t i = 0; i < length; i++) {
-        mem[sector * FLASH_SANDBOX_SECTOR_SIZE + offset + i] &= data[i];
+        mem[(size_t)sector * sector_size + offset + i] &= data[i];
     }
     return length;
 }
 
+int flash_erase(uint32_t sector) {
+    if (_flash_async.busy) {
+        return ERR_FLASH_BUSY;
+    }
+    return _flash_erase(sector);
+}
+
+int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length) {
+    if (_flash_async.busy) {
+        return ERR_FLASH_BUSY;
+    }
+    return _flash_write(sector, offset, data, length);
+}
+
+static void *_flash_async_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&async.lock);
+    while (1) {
+        while (!async.pending && !async.quit) {
+            pthread_cond_wait(&async.cond, &async.lock);
+        }
+        if (!async.pending) {
+            break;
+        }
+        async.pending = 0;
+        pthread_mutex_unlock(&async.lock);
+        int res;
+        if (async.erase) {
+            usleep(async.erase_us);
+            res = _flash_erase(async.sector);
+        } else {
+            usleep((uint64_t)async.write_us * async.length);
+            res = _flash_write(async.sector, async.offset, async.data, async.length);
+        }
+        // unlocked, the callback may start the next operation
+        flash_async_done(res);
+        pthread_mutex_lock(&async.lock);
+    }
+    pthread_mutex_unlock(&async.lock);
+    return 0;
+}
+
+static int _flash_async_start(uint8_t erase, uint32_t sector, uint32_t offset, const uint8_t *data,
+                              uint32_t length, flash_done_fn_t done, void *arg) {
+    if (sector >= sectors) {
+        return ERR_FLASH_OTHER;
+    }
+    int res = flash_async_begin(done, arg);
+    if (res) {
+        return res;
+    }
+    pthread_mutex_lock(&async.lock);
+    if (!async.running) {
+        async.quit = 0;
+        if (pthread_create(&async.thread, 0, _flash_async_worker, 0)) {
+            pthread_mutex_unlock(&async.lock);
+            _flash_async.busy = 0;
+            return ERR_FLASH_OTHER;
+        }
+        async.running = 1;
+    }
+    async.erase = erase;
+    async.sector = sector;
+    async.offset = offset;
+    async.data = data;
+    async.length = length;
+    async.pending = 1;
+    pthread_cond_signal(&async.cond);
+    pthread_mutex_unlock(&async.lock);
+    return 0;
+}
+
+int flash_erase_async(uint32_t sector, flash_done_fn_t done, void *arg) {
+    return _flash_async_start(1, sector, 0, 0, 0, done, arg);
+}
+
+int flash_write_async(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                      flash_done_fn_t done, void *arg) {
+    return _flash_async_start(0, sector, offset, data, length, done, arg);
+}
+
+int flash_busy(void) {
+    return _flash_async.busy;
+}
+
 int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length) {
-    if (sector >= FLASH_SANDBOX_NUM_SECTORS) {
+    if (sector >= sectors) {
         return ERR_FLASH_OTHER;
     }
-    if (offset > FLASH_SANDBOX_SECTOR_SIZE)
+    if (offset > sector_size)
         return 0;
-    int remaining_size = FLASH_SANDBOX_SECTOR_SIZE - offset;
+    int remaining_size = sector_size - offset;
     if (length > (uint32_t)remaining_size) 
         length = remaining_size;
-    memcpy(data, mem + sector * FLASH_SANDBOX_SECTOR_SIZE + offset, length);
+    memcpy(data, mem + (size_t)sector * sector_size + offset, length);
     return length;
 }
 
+static void _flash_async_stop(void) {
+    pthread_mutex_lock(&async.lock);
+    uint8_t running = async.running;
+    async.quit = 1;
+    async.running = 0;
+    pthread_cond_signal(&async.cond);
+    pthread_mutex_unlock(&async.lock);
+    if (running) {
+        // lets an ongoing operation finish first
+        pthread_join(async.thread, 0);
+    }
+}
+
 int flash_deinit(void) {
+    _flash_async_stop();
+    _flash_unmap();
     return 0;
 }
@@ -0,0 +1,91 @@
+/* Copyright (c) 2026 Peter Andersson (pelleplutt1976<at>gmail.com) */
+/* MIT License (see ./LICENSE) */
+
+// Book keeping of the ongoing asynchronous flash operation, shared by the hal
+// implementations. Include from the hal implementation only.
+// The hal calls flash_async_begin when starting an operation, and flash_async_done
+// with the result when the operation is finished, typically from the flash interrupt.
+
+#ifndef _FLASH_ASYNC_H
+#define _FLASH_ASYNC_H
+
+#include "flash_driver.h"
+
+#ifndef CONFIG_FLASH_ASYNC_EVENTQ
+// 1 delivers completion callbacks from eventq_run instead of from the flash
+// interrupt. EVENTQ_CRITICAL_REGION_ENTER/EXIT must then guard against the flash
+// interrupt
+#define CONFIG_FLASH_ASYNC_EVENTQ 0
+#endif
+
+#if CONFIG_FLASH_ASYNC_EVENTQ
+#include "eventqueue.h"
+#endif
+
+typedef struct {
+    // set from begin until the done callback is called
+    volatile uint8_t busy;
+    int res;
+    flash_done_fn_t done;
+    void *arg;
+} flash_async_t;
+
+static flash_async_t _flash_async;
+
+static inline int flash_async_begin(flash_done_fn_t done, void *arg) {
+    // completion is only ever delivered while busy, so no need to guard against it
+    if (_flash_async.busy) return ERR_FLASH_BUSY;
+    _flash_async.done = done;
+    _flash_async.arg = arg;
+    _flash_async.busy = 1;
+    return 0;
+}
+
+static inline void _flash_async_deliver(void) {
+    flash_done_fn_t done = _flash_async.done;
+    void *done_arg = _flash_async.arg;
+    int res = _flash_async.res;
+    // cleared before calling so the callback can start the next operation
+    _flash_async.busy = 0;
+    if (done) done(res, done_arg);
+}
+
+#if CONFIG_FLASH_ASYNC_EVENTQ
+static void _flash_async_event(eventq_type_t type, void *arg) {
+    (void)type;
+    (void)arg;
+    _flash_async_deliver();
+}
+#endif
+
+static inline void flash_async_done(int res) {
+    _flash_async.res = res;
+#if CONFIG_FLASH_ASYNC_EVENTQ
+    if (eventq_add(0, 0, _flash_async_event)) return;
+    // no free events, deliver at once rather than losing it
+#endif
+    _flash_async_deliver();
+}
+
+// for hals without a completion interrupt, runs the synchronous operation and
+// delivers the completion as if asynchronous. erase and write are the hal's own,
+// not turned away while busy as flash_erase and flash_write are.
+static inline int flash_async_erase_sync(int (*erase)(uint32_t sector), uint32_t sector, flash_done_fn_t done,
+                                         void *arg) {
+    int res = flash_async_begin(done, arg);
+    if (res) return res;
+    flash_async_done(erase(sector));
+    return 0;
+}
+
+static inline int flash_async_write_sync(int (*write)(uint32_t sector, uint32_t offset, const uint8_t *data,
+                                                      uint32_t length),
+                                         uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                                         flash_done_fn_t done, void *arg) {
+    int res = flash_async_begin(done, arg);
+    if (res) return res;
+    flash_async_done(write(sector, offset, data, length));
+    return 0;
+}
+
+#endif // _FLASH_ASYNC_H
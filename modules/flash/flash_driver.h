@@ -91,6 +91,31 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
  *  Returns number of bytes read. */
 int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length);
 
+/**
+ * Completion of an asynchronous operation, res is what the synchronous call would
+ * have returned. Called from the flash interrupt or, with CONFIG_FLASH_ASYNC_EVENTQ,
+ * from eventq_run.
+ */
+typedef void (*flash_done_fn_t)(int res, void *arg);
+/**
+ * Starts erasing sector and returns at once, done is called when finished. Only one
+ * asynchronous operation at a time, ERR_FLASH_BUSY if one is ongoing.
+ * Reading the flash bank being erased or written stalls the CPU until the operation
+ * is done, and this includes fetching code, constants and interrupt vectors from it.
+ * On single bank parts like STM32F1/F3 the CPU thus only gets work done meanwhile
+ * when running from RAM, else the asynchronous call merely frees it from polling.
+ * @return 0 if started, else error and done is never called
+ */
+int flash_erase_async(uint32_t sector, flash_done_fn_t done, void *arg);
+/**
+ * Starts writing data to sector and returns at once, done is called when finished.
+ * data must be kept until then. Same restrictions as flash_erase_async.
+ */
+int flash_write_async(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length,
+                      flash_done_fn_t done, void *arg);
+/** Returns nonzero while an asynchronous operation has not yet been completed. */
+int flash_busy(void);
+
 int flash_deinit(void);
 
 #endif // _FLASH_DRIVER_H
@@ -0,0 +1,9 @@
+#pragma once
+
+// completion events are added from the sandbox flash worker thread
+#include <pthread.h>
+
+extern pthread_mutex_t eventq_test_lock;
+
+#define EVENTQ_CRITICAL_REGION_ENTER() pthread_mutex_lock(&eventq_test_lock)
+#define EVENTQ_CRITICAL_REGION_EXIT() pthread_mutex_unlock(&eventq_test_lock)
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "testrunner.h"
+#include "flash_driver.h"
+#include "flash_async.h"
+#include "eventqueue.h"
+
+#define SECTOR_SIZE 256
+#define SECTORS 8
+
+pthread_mutex_t eventq_test_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// completions seen by the done callbacks
+static struct
+{
+	volatile int calls;
+	volatile int res[8];
+	void *volatile arg;
+	int chain_left;
+	uint8_t data[SECTOR_SIZE];
+} done;
+
+static void done_fn(int res, void *arg)
+{
+	done.res[done.calls % 8] = res;
+	done.arg = arg;
+	done.calls++;
+}
+
+// waits until the done callbacks have been called calls times, running the
+// eventqueue if completion goes through it
+static int wait_done(int calls)
+{
+	for (int i = 0; i < 5000 && done.calls < calls; i++)
+	{
+#if CONFIG_FLASH_ASYNC_EVENTQ
+		while (eventq_run())
+			;
+#endif
+		usleep(1000);
+	}
+	return done.calls;
+}
+
+static int sector_is(uint32_t sector, const uint8_t *data)
+{
+	uint8_t buf[SECTOR_SIZE];
+	if (flash_read(sector, 0, buf, sizeof(buf)) != SECTOR_SIZE)
+		return 0;
+	if (data)
+		return memcmp(buf, data, sizeof(buf)) == 0;
+	for (uint32_t i = 0; i < sizeof(buf); i++)
+		if (buf[i] != 0xff)
+			return 0;
+	return 1;
+}
+
+SUITE(flash_async)
+
+static void setup(test_t *t)
+{
+	setenv("FLASH_SANDBOX_SECTOR_SIZE", "256", 1);
+	setenv("FLASH_SANDBOX_SECTORS", "8", 1);
+	setenv("FLASH_SANDBOX_ERASE_US", "20000", 1);
+	setenv("FLASH_SANDBOX_WRITE_US", "20", 1);
+	memset(&done, 0, sizeof(done));
+	for (int i = 0; i < SECTOR_SIZE; i++)
+		done.data[i] = i * 7 + 1;
+	eventq_init(0);
+	flash_init();
+}
+
+static void teardown(test_t *t)
+{
+	flash_deinit();
+}
+
+TEST(erase_write)
+{
+	TEST_CHECK_EQ(flash_write(1, 0, done.data, SECTOR_SIZE), SECTOR_SIZE);
+	int arg;
+	TEST_CHECK_EQ(flash_erase_async(1, done_fn, &arg), 0);
+	TEST_CHECK(flash_busy());
+	TEST_CHECK_EQ(wait_done(1), 1);
+	TEST_CHECK_EQ(done.res[0], 0);
+	TEST_CHECK(done.arg == &arg);
+	TEST_CHECK(!flash_busy());
+	TEST_CHECK(sector_is(1, 0));
+
+	TEST_CHECK_EQ(flash_write_async(1, 0, done.data, SECTOR_SIZE, done_fn, 0), 0);
+	TEST_CHECK(flash_busy());
+	TEST_CHECK_EQ(wait_done(2), 2);
+	// same result as the synchronous call
+	TEST_CHECK_EQ(done.res[1], SECTOR_SIZE);
+	TEST_CHECK(done.arg == 0);
+	TEST_CHECK(sector_is(1, done.data));
+
+	// writes beyond the sector are cut
+	TEST_CHECK_EQ(flash_erase(1), 0);
+	TEST_CHECK_EQ(flash_write_async(1, SECTOR_SIZE - 4, done.data, 8, done_fn, 0), 0);
+	TEST_CHECK_EQ(wait_done(3), 3);
+	TEST_CHECK_EQ(done.res[2], 4);
+
+	TEST_CHECK_EQ(flash_erase_async(SECTORS, done_fn, 0), ERR_FLASH_OTHER);
+	TEST_CHECK(!flash_busy());
+	return 0;
+}
+TEST_END;
+
+TEST(busy)
+{
+	TEST_CHECK_EQ(flash_erase_async(2, done_fn, 0), 0);
+	TEST_CHECK_EQ(flash_erase(3), ERR_FLASH_BUSY);
+	TEST_CHECK_EQ(flash_write(3, 0, done.data, 4), ERR_FLASH_BUSY);
+	TEST_CHECK_EQ(flash_erase_async(3, done_fn, 0), ERR_FLASH_BUSY);
+	TEST_CHECK_EQ(flash_write_async(3, 0, done.data, 4, done_fn, 0), ERR_FLASH_BUSY);
+	TEST_CHECK(flash_busy());
+	TEST_CHECK_EQ(wait_done(1), 1);
+	// rejected calls never complete
+	usleep(50000);
+	TEST_CHECK_EQ(wait_done(2), 1);
+	TEST_CHECK_EQ(done.res[0], 0);
+	TEST_CHECK_EQ(flash_write(3, 0, done.data, 4), 4);
+	return 0;
+}
+TEST_END;
+
+// erases a sector and writes it, then the next one, from the callbacks
+static void chain_fn(int res, void *arg)
+{
+	done_fn(res, arg);
+	const uint32_t sector = (uint32_t)(intptr_t)arg;
+	if (res < 0 || done.chain_left == 0)
+		return;
+	done.chain_left--;
+	if (done.calls & 1)
+		res = flash_write_async(sector, 0, done.data, SECTOR_SIZE, chain_fn, arg);
+	else
+		res = flash_erase_async(sector + 1, chain_fn, (void *)(intptr_t)(sector + 1));
+	if (res)
+		done.res[done.calls % 8] = res;
+}
+
+TEST(chain)
+{
+	for (uint32_t s = 0; s < 4; s++)
+		TEST_CHECK_EQ(flash_write(s, 0, done.data, 16), 16);
+	done.chain_left = 7;
+	TEST_CHECK_EQ(flash_erase_async(0, chain_fn, 0), 0);
+	TEST_CHECK_EQ(wait_done(8), 8);
+	TEST_CHECK(!flash_busy());
+	for (int i = 0; i < 8; i++)
+		TEST_CHECK_EQ(done.res[i], i & 1 ? SECTOR_SIZE : 0);
+	for (uint32_t s = 0; s < 4; s++)
+		TEST_CHECK(sector_is(s, done.data));
+	return 0;
+}
+TEST_END;
+
+TEST(delivery)
+{
+	TEST_CHECK_EQ(flash_erase_async(4, done_fn, 0), 0);
+	// long after the erase is done
+	usleep(100000);
+#if CONFIG_FLASH_ASYNC_EVENTQ
+	// completion waits for the eventqueue, and the operation counts as ongoing
+	TEST_CHECK_EQ(done.calls, 0);
+	TEST_CHECK(flash_busy());
+	TEST_CHECK_EQ(flash_erase(5), ERR_FLASH_BUSY);
+	TEST_CHECK(eventq_run());
+	TEST_CHECK_EQ(done.calls, 1);
+	TEST_CHECK(!eventq_run());
+#else
+	// completion called from the worker standing in for the flash interrupt
+	TEST_CHECK_EQ(done.calls, 1);
+#endif
+	TEST_CHECK(!flash_busy());
+	TEST_CHECK_EQ(done.res[0], 0);
+	TEST_CHECK_EQ(flash_erase(5), 0);
+	return 0;
+}
+TEST_END;
+
+SUITE_TESTS(flash_async);
+ADD_TEST(erase_write);
+ADD_TEST(busy);
+ADD_TEST(chain);
+ADD_TEST(delivery);
+SUITE_END(flash_async)
+
+void add_suites(void)
+{
+	ADD_SUITE(flash_async);
+}
+
+int main(int argc, char **argv)
+{
+	printf("completion delivered %s\n", CONFIG_FLASH_ASYNC_EVENTQ ? "through eventqueue" : "from flash worker");
+	test_init(NULL);
+	run_tests(argc, argv);
+	return get_error_count() ? 1 : 0;
+}
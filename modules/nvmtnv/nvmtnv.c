@@ -10,6 +10,18 @@
 
 #define _dbg(...) NVMTNV_DBG( __VA_ARGS__ )
 
+#ifndef CONFIG_NVMTNV_TAG_MAP_SIZE
+// number of tags whose location is kept in ram for lookups without scanning flash,
+// 0 disables the map
+#define CONFIG_NVMTNV_TAG_MAP_SIZE 0
+#endif
+
+#ifndef CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+// max number of sectors to keep a ram cursor to the next free tag slot for, 0
+// disables. Filesystems with more sectors than this scan for free slots.
+#define CONFIG_NVMTNV_FREE_CURSOR_SECTORS 0
+#endif
+
 #define MAGIC               0xb0ba
 
 // sector state transitions
@@ -86,6 +98,27 @@ static struct {
     uint8_t max_value_size;
     uint32_t tags_per_sect;
     uint32_t free, dele;
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+    struct {
+        uint8_t valid;      // built and in sync with flash
+        uint8_t complete;   // all tags fit, tags not in map do not exist
+        struct {
+            uint32_t tagloc; // TAGLOC_NONE if tag is deleted
+            uint16_t tag;
+            uint8_t used;
+        } entries[CONFIG_NVMTNV_TAG_MAP_SIZE];
+    } map;
+#endif
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+    struct {
+        uint8_t valid;
+        // per sector index past the last used tag slot
+        uint16_t next_free[CONFIG_NVMTNV_FREE_CURSOR_SECTORS];
+    } cursor;
+#endif
+#if NVMTNV_TEST
+    uint8_t lookup_off; // map and cursor kept up to date but not used for lookups
+#endif
 } sys = {0};
 
 static int update_tag(tnv_header_t *src_hdr, uint32_t src_tagloc, uint32_t dst_tagloc, const uint8_t *new_data, uint8_t new_size);
@@ -108,9 +141,172 @@ static int tag_read_hdr(uint32_t tagloc,  tnv_header_t *thdr) {
     return flash_read(sect, offs, (uint8_t *)thdr, sizeof(tnv_header_t));
 }
 
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+// open addressing, linear probing. Entries are never removed, deleted tags are kept
+// with TAGLOC_NONE.
+static uint32_t *map_find(uint16_t tag, char insert) {
+    uint32_t ix = ((uint32_t)tag * 40503u) % CONFIG_NVMTNV_TAG_MAP_SIZE;
+    for (uint32_t probes = 0; probes < CONFIG_NVMTNV_TAG_MAP_SIZE; probes++) {
+        if (!sys.map.entries[ix].used) {
+            if (!insert) return 0;
+            sys.map.entries[ix].used = 1;
+            sys.map.entries[ix].tag = tag;
+            sys.map.entries[ix].tagloc = TAGLOC_NONE;
+            return &sys.map.entries[ix].tagloc;
+        }
+        if (sys.map.entries[ix].tag == tag) return &sys.map.entries[ix].tagloc;
+        if (++ix >= CONFIG_NVMTNV_TAG_MAP_SIZE) ix = 0;
+    }
+    if (insert) sys.map.complete = 0; // out of ram, lookups of unmapped tags must scan
+    return 0;
+}
+
+static void map_set(uint16_t tag, uint32_t tagloc) {
+    uint32_t *e = map_find(tag, 1);
+    if (e) *e = tagloc;
+}
+
+static void map_reset(void) {
+    for (uint32_t i = 0; i < CONFIG_NVMTNV_TAG_MAP_SIZE; i++) sys.map.entries[i].used = 0;
+    sys.map.valid = 0;
+    sys.map.complete = 1;
+}
+#define MAP_SET(tag, tagloc)    map_set((tag), (tagloc))
+#else
+#define MAP_SET(tag, tagloc)
+#endif
+
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+static void cursor_set(uint32_t sector, uint32_t tagix) {
+    if (sector - sys.sect_start < CONFIG_NVMTNV_FREE_CURSOR_SECTORS) {
+        sys.cursor.next_free[sector - sys.sect_start] = tagix;
+    }
+}
+static void cursor_used(uint32_t tagloc) {
+    if (SECTOR(tagloc) - sys.sect_start < CONFIG_NVMTNV_FREE_CURSOR_SECTORS &&
+        sys.cursor.next_free[SECTOR(tagloc) - sys.sect_start] <= TAGIX(tagloc)) {
+        sys.cursor.next_free[SECTOR(tagloc) - sys.sect_start] = TAGIX(tagloc) + 1;
+    }
+}
+#define CURSOR_SET(sector, tagix)   cursor_set((sector), (tagix))
+#define CURSOR_USED(tagloc)         cursor_used(tagloc)
+#else
+#define CURSOR_SET(sector, tagix)
+#define CURSOR_USED(tagloc)
+#endif
+
+// registers a scanned tag slot in map and cursor while building them
+static void map_cursor_add(uint32_t tagloc, const tnv_header_t *thdr) {
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+    if (thdr->state == STATE_TAG_WRITTEN) {
+        map_set(thdr->tag, tagloc);
+    } else if (thdr->state == STATE_TAG_CHANGING) {
+        // a written tag with same id takes precedence
+        uint32_t *e = map_find(thdr->tag, 1);
+        if (e && *e == TAGLOC_NONE) *e = tagloc;
+    }
+#endif
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+    if (thdr->state != STATE_TAG_FREE) {
+        cursor_used(tagloc);
+    }
+#endif
+    (void)tagloc; (void)thdr;
+}
+
+static void map_cursor_reset(void) {
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+    map_reset();
+#endif
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+    for (uint32_t i = 0; i < CONFIG_NVMTNV_FREE_CURSOR_SECTORS; i++) sys.cursor.next_free[i] = 0;
+    sys.cursor.valid = 0;
+#endif
+}
+
+static void map_cursor_validate(void) {
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+    sys.map.valid = 1;
+#endif
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+    sys.cursor.valid = sys.sect_count <= CONFIG_NVMTNV_FREE_CURSOR_SECTORS;
+#endif
+}
+
+// scans all tag headers and builds map and cursor
+static int map_cursor_build(void) {
+    int res;
+    map_cursor_reset();
+    for (uint32_t s = sys.sect_start; s < sys.sect_start + sys.sect_count; s++) {
+        if (s == sys.sect_spare) continue;
+        for (uint32_t t = 0; t < sys.tags_per_sect; t++) {
+            tnv_header_t thdr;
+            res = tag_read_hdr(TAGLOC(s,t), &thdr);
+            if (res < 0) return res;
+            map_cursor_add(TAGLOC(s,t), &thdr);
+        }
+    }
+    map_cursor_validate();
+    return 0;
+}
+
+// Looks up tag using map or cursor. Returns 1 if found or known not to exist, 0 if
+// flash must be scanned.
+static int find_tag_fast(uint16_t tag, uint32_t tagloc_exclude, uint8_t state_mask, uint32_t *tagloc,
+                         tnv_header_t *thdr, int *res) {
+    *res = 0;
+    uint32_t found = TAGLOC_NONE;
+#if NVMTNV_TEST
+    if (sys.lookup_off) return 0;
+#endif
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+    if (sys.cursor.valid && state_mask == STATE_TAG_MASK_FREE && tagloc_exclude == TAGLOC_NONE) {
+        for (uint32_t s = sys.sect_start; found == TAGLOC_NONE && s < sys.sect_start + sys.sect_count; s++) {
+            if (s == sys.sect_spare) continue;
+            uint16_t *next_free = &sys.cursor.next_free[s - sys.sect_start];
+            for (; *next_free < sys.tags_per_sect; (*next_free)++) {
+                *res = tag_read_hdr(TAGLOC(s, *next_free), thdr);
+                if (*res < 0) return 1;
+                if (thdr->state == STATE_TAG_FREE) {
+                    found = TAGLOC(s, *next_free);
+                    break;
+                }
+            }
+        }
+        // free slots behind cursors, left by interrupted writes, are only found by scanning
+        if (found == TAGLOC_NONE) return 0;
+        _dbg("found free @ tl %08x by cursor\n", found);
+        if (tagloc) *tagloc = found;
+        return 1;
+    }
+#endif
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+    if (sys.map.valid && (state_mask & (STATE_TAG_MASK_FREE | STATE_TAG_MASK_DELETED)) == 0) {
+        const uint32_t *e = map_find(tag, 0);
+        if (e == 0 && !sys.map.complete) return 0;
+        if (e && *e != TAGLOC_NONE && *e != tagloc_exclude) {
+            *res = tag_read_hdr(*e, thdr);
+            if (*res < 0) return 1;
+            if (thdr->tag == tag &&
+                ((thdr->state == STATE_TAG_WRITING && (state_mask & STATE_TAG_MASK_WRITING)) ||
+                 (thdr->state == STATE_TAG_WRITTEN && (state_mask & STATE_TAG_MASK_WRITTEN)) ||
+                 (thdr->state == STATE_TAG_CHANGING && (state_mask & STATE_TAG_MASK_CHANGING)))) {
+                found = *e;
+            }
+        }
+        _dbg("found @ tl %08x by map\n", found);
+        if (tagloc) *tagloc = found;
+        return 1;
+    }
+#endif
+    (void)tag; (void)tagloc_exclude; (void)state_mask; (void)tagloc; (void)thdr; (void)found;
+    return 0;
+}
+
 static int find_tag(uint16_t tag, uint32_t tagloc_exclude, uint8_t state_mask, uint32_t *tagloc, tnv_header_t *thdr) {
     int res;
     _dbg("find tag %04x, exclude tl %08x, states %02x\n", tag, tagloc_exclude, state_mask);
+    if (find_tag_fast(tag, tagloc_exclude, state_mask, tagloc, thdr, &res)) return res;
     for (uint32_t s = sys.sect_start; s < sys.sect_start + sys.sect_count; s++) {
         if (s == sys.sect_spare) continue;
         for (uint32_t t = 0; t < sys.tags_per_sect; t++) {
@@ -163,7 +359,8 @@ static int evict(uint32_t sector_to, uint32_t sector_from) {
         _dbg("  tag %04x, state %02x\n", thdr.tag, thdr.state);
         if (thdr.state != STATE_TAG_FREE) {
             sys.free++;
-        } else if (thdr.state == STATE_TAG_DELETED) {
+        }
+        if (thdr.state == STATE_TAG_DELETED) {
             sys.dele--;
         }
         if (thdr.state == STATE_TAG_WRITTEN) {
@@ -200,6 +397,8 @@ static int evict(uint32_t sector_to, uint32_t sector_from) {
     if (res < 0) return res;
 
     sys.sect_spare = sector_from;
+    CURSOR_SET(sector_to, new_t);
+    CURSOR_SET(sector_from, 0);
 
     _dbg("evicted sector %08x, free %d, dele %d\n", sector_from, sys.free, sys.dele);
 
@@ -220,7 +419,8 @@ static int gc(void) {
         for (uint32_t t = 0; t < sys.tags_per_sect; t++) {
             res = tag_read_hdr(TAGLOC(s,t), &thdr);
             if (res < 0) return res;
-            if (thdr.state == STATE_TAG_DELETED || thdr.state == STATE_TAG_WRITTEN) {
+            // only deleted tags are reclaimed by evicting
+            if (thdr.state == STATE_TAG_DELETED) {
                 score++;
             }
         }
@@ -286,6 +486,7 @@ static int update_tag(tnv_header_t *src_hdr, uint32_t src_tagloc, uint32_t dst_t
         res = tag_write_hdr(dst_tagloc, &dst_hdr);
         if (res < 0) return res;
         sys.free--;
+        CURSOR_USED(dst_tagloc);
     }
 
     // write data
@@ -315,6 +516,7 @@ static int update_tag(tnv_header_t *src_hdr, uint32_t src_tagloc, uint32_t dst_t
     dst_hdr.state = STATE_TAG_WRITTEN;
     res = tag_write_hdr(dst_tagloc, &dst_hdr);
     if (res < 0) return res;
+    MAP_SET(dst_hdr.tag, dst_tagloc);
 
     // if there is a source location, set that to deleted
     if (!is_evict && src_tagloc != TAGLOC_NONE && src_hdr->state != STATE_TAG_FREE && src_hdr->state != STATE_TAG_DELETED) {
@@ -334,6 +536,7 @@ static int check_tag_consistency(void) {
     uint32_t tagloc_writing = TAGLOC_NONE;
     int res = 0;
     sys.free = sys.dele = 0;
+    map_cursor_reset();
     for (uint32_t s = sys.sect_start; res >= 0 && s < sys.sect_start + sys.sect_count; s++) {
         tnv_sector_header_t shdr;
         res = flash_read(s, 0, (uint8_t *)&shdr, sizeof(shdr));
@@ -343,6 +546,7 @@ static int check_tag_consistency(void) {
             tnv_header_t thdr;
             res = tag_read_hdr(TAGLOC(s,t), &thdr);
             if (res < 0) return res;
+            map_cursor_add(TAGLOC(s,t), &thdr);
             switch (thdr.state) {
                 case STATE_TAG_WRITTEN: break;
                 case STATE_TAG_FREE:    sys.free++; break;
@@ -362,6 +566,16 @@ static int check_tag_consistency(void) {
                 break;
 
                 default:
+                if ((thdr.state & STATE_TAG_WRITTEN) == thdr.state &&
+                    (thdr.state & STATE_TAG_CHANGING) == STATE_TAG_CHANGING) {
+                    // interrupted while marking a written tag as changing, value is intact
+                    _dbg("tag cons found half changing tag %04x @ tl %08x\n", thdr.tag, TAGLOC(s,t));
+                    thdr.state = STATE_TAG_CHANGING;
+                    res = tag_write_hdr(TAGLOC(s, t), &thdr);
+                    if (res < 0) return res;
+                    tagloc_changing = TAGLOC(s,t);
+                    break;
+                }
                 _dbg("tag cons found bad state %08x tag %04x @ tl %08x, deleting\n", thdr.state, thdr.tag, TAGLOC(s,t));
                 thdr.state = STATE_TAG_DELETED;
                 res = tag_write_hdr(TAGLOC(s, t), &thdr);
@@ -372,6 +586,12 @@ static int check_tag_consistency(void) {
         }
     }
 
+    if (tagloc_changing == TAGLOC_NONE && tagloc_writing == TAGLOC_NONE) {
+        // nothing to repair, map and cursor built by scan above
+        map_cursor_validate();
+        return res;
+    }
+
     if (tagloc_changing != TAGLOC_NONE) {
         tnv_header_t thdr_changing, thdr_other;
         uint32_t tagloc_other;
@@ -432,10 +652,11 @@ static int check_tag_consistency(void) {
         thdr.state = STATE_TAG_DELETED;
         res = tag_write_hdr(tagloc_writing, &thdr);
         if (res < 0) return res;
-        sys.free++;
+        sys.dele++;
     }
 
-    return res;
+    // tags were repaired, rebuild map and cursor
+    return map_cursor_build();
 }
 
 static int get_valid_tag(uint16_t tag, uint32_t *tagloc, tnv_header_t *thdr) {
@@ -464,6 +685,7 @@ static int get_valid_tag(uint16_t tag, uint32_t *tagloc, tnv_header_t *thdr) {
             thdr->size = thdr_wrt.size;
             thdr->state = thdr_wrt.state;
             *tagloc = tagloc_wrt;
+            MAP_SET(tag, tagloc_wrt);
         }
     }
     return 0;
@@ -473,6 +695,7 @@ int nvmtnv_mount(uint32_t sector_start) {
     int res;
     tnv_sector_header_t shdr, shdr_n;
     tnv_sector_header_t *shdr_ref;
+    map_cursor_reset();
     int sect_size = flash_get_sector_size(sector_start);
     if (sect_size < 0) return sect_size;
     res = flash_read(sector_start, 0, (uint8_t *)&shdr, sizeof(tnv_sector_header_t));
@@ -674,6 +897,7 @@ int nvmtnv_delete(uint16_t tag) {
         res = tag_write_hdr(tagloc, &thdr);
         if (res < 0) return res;
         sys.dele++;
+        MAP_SET(tag, TAGLOC_NONE);
     }
     return res;
 }
@@ -688,6 +912,39 @@ int nvmtnv_size(uint16_t tag) {
     return thdr.size;
 }
 
+int nvmtnv_next(uint32_t *pos, uint16_t *tag, uint8_t *dst, uint8_t max_size) {
+    int res;
+    if ((res = state_ok())) return res;
+    for (; *pos < sys.sect_count * sys.tags_per_sect; (*pos)++) {
+        uint32_t s = sys.sect_start + *pos / sys.tags_per_sect;
+        if (s == sys.sect_spare) continue;
+        uint32_t tagloc = TAGLOC(s, *pos % sys.tags_per_sect);
+        tnv_header_t thdr;
+        res = tag_read_hdr(tagloc, &thdr);
+        if (res < 0) return res;
+        if (thdr.state == STATE_TAG_CHANGING) {
+            // only live if there is no written tag with same id
+            uint32_t tagloc_wrt;
+            tnv_header_t thdr_wrt;
+            res = find_tag(thdr.tag, tagloc, STATE_TAG_MASK_WRITTEN, &tagloc_wrt, &thdr_wrt);
+            if (res < 0) return res;
+            if (tagloc_wrt != TAGLOC_NONE) continue;
+        } else if (thdr.state != STATE_TAG_WRITTEN) {
+            continue;
+        }
+        uint8_t size = max_size < thdr.size ? max_size : thdr.size;
+        res = flash_read(SECTOR(tagloc),
+            sizeof(tnv_sector_header_t) + TAGIX(tagloc)*(sizeof(tnv_header_t) + sys.max_value_size) + sizeof(tnv_header_t),
+            dst, size);
+        if (res < 0) return res;
+        _dbg("next tag %04x @ tl %08x\n", thdr.tag, tagloc);
+        *tag = thdr.tag;
+        (*pos)++;
+        return size;
+    }
+    return ERR_NVMTNV_NOENT;
+}
+
 int nvmtnv_gc(void) {
     int res;
     if ((res = state_ok())) return res;
@@ -707,7 +964,7 @@ static int remake_spare_sector(void) {
         .state = STATE_SECT_SPARE
     };
     res = flash_write(sys.sect_spare, 0, (uint8_t *)&shdr, sizeof(shdr));
-    return res;
+    return res < 0 ? res : 0;
 }
 
 int nvmtnv_fix(void) {
@@ -775,5 +1032,75 @@ int nvmtnv_format(uint32_t sector_start, uint16_t sector_count, uint8_t max_valu
         if (res < 0) return res;
     }
     sys.mount_state = UNMOUNTED;
+    map_cursor_reset();
     return 0;
 }
+
+#if NVMTNV_TEST
+// expose some privates to ease unittests
+void nvmtnv_test_lookup(int enable) {
+    sys.lookup_off = enable == 0;
+}
+
+int nvmtnv_test_check_lookup(void) {
+    int res;
+    for (uint32_t s = sys.sect_start; s < sys.sect_start + sys.sect_count; s++) {
+        if (s == sys.sect_spare) continue;
+        for (uint32_t t = 0; t < sys.tags_per_sect; t++) {
+            tnv_header_t thdr;
+            res = tag_read_hdr(TAGLOC(s,t), &thdr);
+            if (res < 0) return res;
+#if CONFIG_NVMTNV_FREE_CURSOR_SECTORS
+            if (sys.cursor.valid && t >= sys.cursor.next_free[s - sys.sect_start] && thdr.state != STATE_TAG_FREE) {
+                _dbg("check cursor sect %08x at %d, used tag %d behind\n", s, sys.cursor.next_free[s - sys.sect_start], t);
+                return -1;
+            }
+#endif
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+            if (sys.map.valid && thdr.state == STATE_TAG_WRITTEN) {
+                const uint32_t *e = map_find(thdr.tag, 0);
+                if ((e || sys.map.complete) && (e == 0 || *e != TAGLOC(s,t))) {
+                    _dbg("check map tag %04x @ tl %08x, mapped to %08x\n", thdr.tag, TAGLOC(s,t), e ? *e : TAGLOC_NONE);
+                    return -1;
+                }
+            }
+#endif
+        }
+    }
+#if CONFIG_NVMTNV_TAG_MAP_SIZE
+    for (uint32_t i = 0; sys.map.valid && i < CONFIG_NVMTNV_TAG_MAP_SIZE; i++) {
+        if (!sys.map.entries[i].used || sys.map.entries[i].tagloc == TAGLOC_NONE) continue;
+        tnv_header_t thdr;
+        res = tag_read_hdr(sys.map.entries[i].tagloc, &thdr);
+        if (res < 0) return res;
+        if (thdr.tag != sys.map.entries[i].tag ||
+            (thdr.state != STATE_TAG_WRITTEN && thdr.state != STATE_TAG_CHANGING)) {
+            _dbg("check map tag %04x mapped to tl %08x holding tag %04x state %08x\n", sys.map.entries[i].tag,
+                 sys.map.entries[i].tagloc, thdr.tag, thdr.state);
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+int nvmtnv_test_check_counts(void) {
+    int res;
+    uint32_t nfree = 0, ndele = 0;
+    for (uint32_t s = sys.sect_start; s < sys.sect_start + sys.sect_count; s++) {
+        if (s == sys.sect_spare) continue;
+        for (uint32_t t = 0; t < sys.tags_per_sect; t++) {
+            tnv_header_t thdr;
+            res = tag_read_hdr(TAGLOC(s,t), &thdr);
+            if (res < 0) return res;
+            if (thdr.state == STATE_TAG_FREE) nfree++;
+            else if (thdr.state == STATE_TAG_DELETED) ndele++;
+        }
+    }
+    if (nfree != sys.free || ndele != sys.dele) {
+        _dbg("check counts free %d dele %d, in flash free %d dele %d\n", sys.free, sys.dele, nfree, ndele);
+        return -1;
+    }
+    return 0;
+}
+#endif
@@ -26,6 +26,21 @@ int nvmtnv_size(uint16_t tag);
 int nvmtnv_gc(void);
 int nvmtnv_fix(void);
 int nvmtnv_format(uint32_t sector_start, uint16_t sector_count, uint8_t max_value_size);
+// Iterates live tags in flash order, pos being 0 at start. Sets tag, copies at most
+// max_size bytes of its value to dst and returns the number of bytes copied. Returns
+// ERR_NVMTNV_NOENT when there are no more tags. pos can be stored and iteration
+// resumed from it, as long as the filesystem is not modified in between.
+int nvmtnv_next(uint32_t *pos, uint16_t *tag, uint8_t *dst, uint8_t max_size);
+
+#if NVMTNV_TEST
+// expose some privates to ease unittests
+// 0 makes lookups scan flash, ram map and free cursors are still kept up to date
+void nvmtnv_test_lookup(int enable);
+// checks ram map and free cursors against flash, 0 if in sync
+int nvmtnv_test_check_lookup(void);
+// recounts free and deleted tag slots in flash, 0 if in sync with the counts in ram
+int nvmtnv_test_check_counts(void);
+#endif
 
 #ifndef NVMTNV_DBG
 #define NVMTNV_DBG(...)
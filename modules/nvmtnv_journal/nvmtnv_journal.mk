@@ -1,3 +1,6 @@
 INCLUDE += $(modules_dir)/nvmtnv_journal
 CFILES += $(modules_dir)/nvmtnv_journal/nvmtnvj.c
 CONFIG_FLASH := 1
+ifeq "$(CONFIG_NVMTNV)" "1"
+CFILES += $(modules_dir)/nvmtnv_journal/nvmtnvj_migrate.c
+endif
@@ -38,7 +38,51 @@
  * Keep track of current non-full block. Block history traversal by sequence
  * numbers.
  *
- * NB: Scales horribly! A GC can take (tags_per_block * number_of_blocks) ^ 2 reads.
+ * Optionally, a ram index maps tag ids to their most recent entry
+ * (CONFIG_NVMTNVJ_TAG_INDEX_SIZE). It is built at mount and kept up to date on
+ * writes, deletes and evictions. If there are more tag ids on flash than the index
+ * can hold, lookups of unindexed ids fall back to traversing the journal.
+ *
+ * With the index and CONFIG_NVMTNVJ_BLOCK_INFO_COUNT, freeable tags are also
+ * accounted per block, so finding the evict candidate needs no tag reads and only
+ * the chosen block is mapped.
+ *
+ * CONFIG_NVMTNVJ_BLOCK_INFO_COUNT also caches the block headers in ram, along with
+ * the Data blocks sorted newest first. Traversing the journal and sorting blocks
+ * then needs no block header reads.
+ *
+ * NB: Without these, scales horribly! A GC can take (tags_per_block * number_of_blocks) ^ 2
+ * reads.
+ *
+ * Scratch sized by geometry, as sorted block lists and tag infos of a block, is put
+ * on stack unless a work buffer is given at mount by nvmtnvj_mount_work. For more
+ * blocks than CONFIG_NVMTNVJ_BLOCK_INFO_COUNT, the work buffer also holds the block
+ * book keeping, so large journals on external flash keep the cached block headers.
+ *
+ * With CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK, GC can also be run incrementally by
+ * nvmtnvj_gc_step in idle time, a bounded amount of work at a time. The steps go
+ * through the same block state transitions as below, and the filled Spare block is
+ * taken as next Data block when B_current is full. When fewer Data_Free blocks than
+ * CONFIG_NVMTNVJ_GC_FREE_BLOCKS_WATERMARK remain, a new incremental GC is started.
+ *
+ * Formatted with NVMTNVJ_FORMAT_VARIABLE_SIZE, a block is divided in word sized
+ * slots instead, and an entry takes as many slots as its header and value need.
+ * Entries are then found by walking the block from the start by their lengths, see
+ * slot_map_build. As entries are still only appended, a torn entry is the last one
+ * in its block and the walk stays the same before and after a power loss.
+ *
+ * Batches are written as consecutive batch entries in one block, followed by a
+ * commit marker holding the number of entries. A run of batch entries not followed
+ * by a matching marker is void, as if never written. When evicted, entries of
+ * committed batches are copied as plain entries.
+ *
+ * With CONFIG_NVMTNVJ_HOT_COLD_WINDOW, tags rewritten within the last few writes
+ * are hot and go to a second open block, so blocks of hot tags end up mostly
+ * freeable and static tags are not copied over and over at GC. The second head is
+ * older than B_current, and only written if the tag has no entry in a more recent
+ * block - otherwise the entry goes to B_current, keeping last entry wins. A new
+ * head is only opened when it takes no GC, and free slots left in a closed head
+ * count as freeable. Needs HOT_COLD_MIN_BLOCKS blocks to leave GC some choice.
  *
  * Block types:
  *   Spare: singleton, used to fill up with live data when GC
@@ -75,6 +119,8 @@
  *   Magic + FS metainfo
  *   Flags: data evict
  *   sequence number
+ *   erase count, carried over from the header erased
+ *   16-bit number of blocks and sectors per block, see hdr_rev_t
  *
  * X = unwritten
  * Spare        !data !evict seq:X
@@ -123,7 +169,19 @@
 
 #define _dbg(...) NVMTNVJ_DBG(__VA_ARGS__)
 
-#define MAGIC 0xba
+// block header revisions, older ones still mounted
+typedef enum
+{
+    HDR_REV_LEGACY, // no erase count
+    HDR_REV_NARROW, // geometry in fs_descr_t only, max 255 blocks of 255 sectors
+    HDR_REV_WIDE,   // 16-bit geometry
+} hdr_rev_t;
+#define MAGIC_LEGACY 0xba
+#define MAGIC_LEGACY_VARIABLE_SIZE 0xbb
+#define MAGIC_NARROW 0xbc
+#define MAGIC_NARROW_VARIABLE_SIZE 0xbd
+#define MAGIC 0xbe
+#define MAGIC_VARIABLE_SIZE 0xbf
 
 #ifndef CONFIG_NVMTNVJ_FLASH_WORD_SIZE
 // minimal writable flash unit in bytes
@@ -151,11 +209,92 @@ _Static_assert(0, "CONFIG_NVMTNVJ_FLASH_WORD_SIZE invalid configured");
                    CONFIG_NVMTNVJ_FLASH_WORD_SIZE) *            \
                       CONFIG_NVMTNVJ_FLASH_WORD_SIZE
 
+#ifndef CONFIG_NVMTNVJ_TAG_INDEX_SIZE
+// number of tag ids kept in ram index for fast lookups, 0 disables the index
+#define CONFIG_NVMTNVJ_TAG_INDEX_SIZE 0
+#endif
+
+#ifndef CONFIG_NVMTNVJ_BLOCK_INFO_COUNT
+// max number of blocks to keep ram book keeping for, 0 disables. Filesystems with
+// more blocks than this fall back to reading flash.
+#define CONFIG_NVMTNVJ_BLOCK_INFO_COUNT 0
+#endif
+
+#ifndef CONFIG_NVMTNVJ_READ_AHEAD_SIZE
+// bytes of tag headers fetched per flash read when scanning blocks, 0 disables
+#define CONFIG_NVMTNVJ_READ_AHEAD_SIZE 0
+#endif
+
+#ifndef CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS
+// max slots per block supported by the variable size format, a slot being one flash
+// word. 0 disables the format.
+#define CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS 0
+#endif
+
+#ifndef CONFIG_NVMTNVJ_WRITE_CACHE_SIZE
+// number of tags held in ram by nvmtnvj_write_cached before written to flash, 0
+// disables the write cache
+#define CONFIG_NVMTNVJ_WRITE_CACHE_SIZE 0
+#endif
+#ifndef CONFIG_NVMTNVJ_WRITE_CACHE_VALUE_SIZE
+// max value size held in write cache, larger values are written directly
+#define CONFIG_NVMTNVJ_WRITE_CACHE_VALUE_SIZE 8
+#endif
+#ifndef CONFIG_NVMTNVJ_WRITE_CACHE_WATERMARK
+// write cache is flushed when this many entries are dirty
+#define CONFIG_NVMTNVJ_WRITE_CACHE_WATERMARK CONFIG_NVMTNVJ_WRITE_CACHE_SIZE
+#endif
+#ifndef CONFIG_NVMTNVJ_WRITE_CACHE_DIRTY_HOOK
+// called when write cache gets its first dirty entry, e.g. to schedule a call to
+// nvmtnvj_flush by eventq_add
+#define CONFIG_NVMTNVJ_WRITE_CACHE_DIRTY_HOOK()
+#endif
+
+#ifndef CONFIG_NVMTNVJ_HOT_COLD_WINDOW
+// number of recent writes remembered, a tag rewritten within as many writes is hot
+// and written to its own block. 0 disables hot/cold separation
+#define CONFIG_NVMTNVJ_HOT_COLD_WINDOW 0
+#endif
+#ifndef CONFIG_NVMTNVJ_HOT_TAG_HINT
+// 1 if given tag is hot, 0 if cold, -1 to let the write history decide
+#define CONFIG_NVMTNVJ_HOT_TAG_HINT(tag_id) (-1)
+#endif
+
+#ifndef CONFIG_NVMTNVJ_WEAR_LEVEL_DELTA
+// a block erased this many times less than the most worn block is evicted even if
+// nothing in it is freeable. 0 disables static wear levelling
+#define CONFIG_NVMTNVJ_WEAR_LEVEL_DELTA 0
+#endif
+
+#ifndef CONFIG_NVMTNVJ_INSTANCES
+// number of journal instances, see nvmtnvj_ctx_get
+#define CONFIG_NVMTNVJ_INSTANCES 1
+#endif
+
+#ifndef CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK
+// max tags per block supported by incremental gc, 0 disables nvmtnvj_gc_step
+#define CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK 0
+#endif
+#ifndef CONFIG_NVMTNVJ_GC_FREE_BLOCKS_WATERMARK
+// nvmtnvj_gc_step starts a new gc when fewer free data blocks than this remain
+#define CONFIG_NVMTNVJ_GC_FREE_BLOCKS_WATERMARK 1
+#endif
+
+#ifndef CONFIG_NVMTNVJ_CHECKPOINT
+// 1 writes a checkpoint of the ram index and block accounting to the spare block at
+// unmount, so that next mount needs not scan the journal. Needs the index.
+#define CONFIG_NVMTNVJ_CHECKPOINT 0
+#endif
+#if CONFIG_NVMTNVJ_CHECKPOINT && CONFIG_NVMTNVJ_TAG_INDEX_SIZE == 0
+_Static_assert(0, "CONFIG_NVMTNVJ_CHECKPOINT needs CONFIG_NVMTNVJ_TAG_INDEX_SIZE");
+#endif
+
 #define SEQ_NBR_UNWRITTEN (word_t)(CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
 
 #define SEQ_NBR_HALF_RANGE (1ull << (8 * CONFIG_NVMTNVJ_FLASH_WORD_SIZE - 1))
 
 #define UNDEF_IX (uint32_t)-1
+#define INDEX_NO_BLOCK (uint16_t)-1
 
 #define ERR_INTERNAL_ABORTED 0x201
 
@@ -181,6 +320,10 @@ typedef struct
     ADDR_ALIGNW word_t seq_nbr;
     ADDR_ALIGNW word_t data_flag;
     ADDR_ALIGNW word_t evict_flag;
+    ADDR_ALIGNW word_t erase_count; // carried over when block is erased, not in legacy format
+    // from HDR_REV_WIDE, descr then holds geometry saturated to 0xff
+    ADDR_ALIGNW uint16_t nbr_of_blocks;
+    uint16_t sectors_per_block;
 } block_header_t;
 
 enum __attribute__((packed)) tag_state_t
@@ -188,6 +331,13 @@ enum __attribute__((packed)) tag_state_t
     TAG_FREE = (uint8_t)CONFIG_NVMTNVJ_FLASH_WORD_ERASED,
     TAG_WRITTEN = 1,
     TAG_DELETED = 2,
+    TAG_BATCH_WRITTEN = 3,
+    TAG_BATCH_DELETED = 4,
+    TAG_BATCH_COMMIT = 5, // id is number of batch entries preceding
+    // never on flash, batch marker or entry of uncommitted batch
+    TAG_VOID = 0x7f,
+    // never on flash, slot within a variable size entry
+    TAG_CONT = 0x7e,
 };
 
 typedef uint8_t tag_state_t;
@@ -202,6 +352,44 @@ typedef ADDR_ALIGNW struct
 
 _Static_assert(sizeof(tag_header_t) == 5, "unexpected tag_header_t size");
 
+#define CHECKPOINT_MAGIC 0x5ac8
+#define CHECKPOINT_NO_BLOCK 0xffff
+#define CHECKPOINT_COMMIT (word_t)0xc0de5ac7
+#define CHECKPOINT_VOID (word_t)(~CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
+
+// Checkpoint record, appended to spare block after its header. Followed by
+// index_count ram index entries and block_count pairs of used and freeable tag
+// counts, the sum of these bytes being zero. Then state_count block states, summing
+// to zero with state_chk. Ends with an aligned unit starting with CHECKPOINT_COMMIT,
+// programmed last, and an erased unit programmed with CHECKPOINT_VOID when the
+// block states no longer hold.
+typedef struct
+{
+    uint16_t magic;
+    uint8_t index_complete;
+    uint8_t chk;
+    uint16_t size; // bytes from this record to the next
+    uint16_t index_count;
+    uint32_t max_seq_nbr;
+    uint16_t current_block_ix;
+    uint16_t current_tag_ix;
+    uint16_t head_block_ix; // CHECKPOINT_NO_BLOCK if none
+    uint16_t head_tag_ix;
+    uint16_t block_count; // nbr_of_blocks, or 0 if without block accounting
+    uint16_t gcs_since_wear_level;
+    uint16_t state_count; // nbr_of_blocks, or 0 if without block header cache
+    uint8_t state_chk;
+    uint8_t reserved;
+} checkpoint_t;
+
+// block header state in a checkpoint
+typedef struct
+{
+    word_t seq_nbr;
+    word_t erase_count;
+    word_t type;
+} checkpoint_block_t;
+
 typedef enum
 {
     BLOCK_TYPE_UNKNOWN,
@@ -221,7 +409,7 @@ typedef struct
 typedef struct
 {
     uint16_t id;
-    enum
+    enum __attribute__((packed))
     {
         TI_FREE,
         TI_WRITTEN,
@@ -232,9 +420,76 @@ typedef struct
     } status;
 } tag_evict_info_t;
 
+// ram index entry, refers to the most recent entry of given tag id on flash
+typedef struct
+{
+    uint16_t id;
+    tag_state_t state; // TAG_FREE for unused index entries
+    uint16_t block_ix;
+    uint16_t tag_ix;
+} tag_index_entry_t;
+
+// ram write cache entry
+typedef struct
+{
+    uint16_t id;
+    uint8_t len;
+    bool valid;
+    bool dirty; // not yet written to flash
+    uint8_t data[CONFIG_NVMTNVJ_WRITE_CACHE_VALUE_SIZE];
+} cache_entry_t;
+
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+typedef enum
+{
+    GC_IDLE,
+    GC_MAP,   // find block to evict and its live tags, mark it evicting
+    GC_COPY,  // copy live tags to spare block, one by one
+    GC_READY, // spare block filled, committed when current block is full
+    GC_ERASE, // erase block sector by sector and make it spare
+} gc_phase_t;
+#endif
+
+// ram book keeping per block
+typedef struct
+{
+    uint16_t used;     // written tag slots
+    uint16_t freeable; // written tag slots known to be freeable
+    word_t seq_nbr;    // cached block header state, valid if hdr_cached
+    word_t erase_count;
+    uint8_t type;
+    uint8_t hdr_cached;
+    uint16_t chain_pos; // position in block chain, valid if chain is valid
+} block_info_t;
+
+// counters since mount, see nvmtnvj_stats
+typedef struct
+{
+    uint32_t used;     // sum of block_info used
+    uint32_t freeable; // sum of block_info freeable
+    uint32_t live;     // index entries of written tags
+    uint32_t bytes_written;
+    uint32_t erases; // sectors erased
+    uint32_t gcs;
+    uint32_t copied_tags; // live tags copied by gc
+    uint32_t gc_bytes_written;
+    uint32_t gc_erases;
+    uint32_t lookups;
+    uint32_t lookup_blocks; // blocks searched by lookups
+    uint32_t hdr_reads;     // block headers read from flash
+} stats_t;
+
+// tag info arrays in work buffer
+enum
+{
+    WORK_TAG_INFO_EVICT, // live tags of block to evict
+    WORK_TAG_INFO_SCAN,  // tags of block being scored
+    WORK_TAG_INFOS
+};
+
 #define tag_evict_status_to_str(x) (const char *[]){"FREE", "WRIT", "DELE", "FREEABLE", "LIVE_WRIT", "LIVE_DELE"}[x]
 
-static struct
+struct nvmtnvj_s
 {
     enum
     {
@@ -242,6 +497,8 @@ static struct
         STATE_MOUNTED,
         STATE_MOUNTED_INCONSISTENT
     } state;
+    // flash driver, set at format or mount if not given
+    const nvmtnvj_flash_t *flash;
     uint32_t starting_sector;
     uint32_t sector_size;
     uint32_t current_block_ix;
@@ -250,12 +507,251 @@ static struct
     uint32_t unknown_block_ix;
     uint32_t evict_block_ix;
     uint32_t tags_per_block;
+    uint32_t free_block_count;
+    uint32_t write_alignment;
     word_t min_seq_nbr;
     word_t max_seq_nbr;
-    uint8_t sectors_per_block;
-    uint8_t nbr_of_blocks;
+    uint16_t sectors_per_block;
+    uint32_t nbr_of_blocks;
     uint8_t max_value_size;
-} sys;
+    // entries take as many slots as their value needs, instead of one slot each
+    bool variable_size;
+    hdr_rev_t rev;
+    // gcs since least worn block was evicted by static wear levelling
+    uint32_t gcs_since_wear_level;
+    // last evicted block was picked by static wear levelling, not by score
+    bool wear_levelled;
+    stats_t stats;
+    // bytes of checkpoints after spare block header, spare must be erased before gc
+    uint32_t spare_used;
+    // offset of last checkpoint in spare block, 0 if none
+    uint32_t spare_last;
+    // nothing written since last checkpoint was written or loaded
+    bool checkpointed;
+    // a flash write or erase failed since mount, flash may not be as ram says
+    bool flash_failed;
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    struct
+    {
+        // second block open for writing, older than current block, UNDEF_IX if none
+        uint32_t block_ix;
+        uint32_t tag_ix;
+        bool current_hot; // current block takes hot tags, second head cold, or vice versa
+        uint32_t recent_ix;
+        uint32_t recent_count;
+        uint16_t recent[CONFIG_NVMTNVJ_HOT_COLD_WINDOW];
+#if NVMTNVJ_TEST
+        bool enabled; // off unless asked for, keeps other tests deterministic
+#endif
+    } head;
+#endif
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    struct
+    {
+        // index reflects flash contents
+        bool valid;
+        // all tag ids on flash fit in index, a miss means there is no such tag
+        bool complete;
+        tag_index_entry_t entries[CONFIG_NVMTNVJ_TAG_INDEX_SIZE];
+    } index;
+#endif
+    struct
+    {
+        // caller provided buffer, NULL if none and scratch is taken from stack
+        uint8_t *buf;
+        uint32_t *sorted_blocks;
+        word_t *sorted_seq_nbrs;
+        tag_evict_info_t *tag_info[WORK_TAG_INFOS];
+    } work;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    // block_info_ram, or in work buffer for more blocks than it holds
+    block_info_t *block_info;
+    uint32_t block_info_count;
+    block_info_t block_info_ram[CONFIG_NVMTNVJ_BLOCK_INFO_COUNT];
+    struct
+    {
+        // chain reflects cached block headers
+        bool valid;
+        uint32_t count;
+        // Data and Evicting blocks, newest first
+        uint16_t *blocks;
+        uint16_t blocks_ram[CONFIG_NVMTNVJ_BLOCK_INFO_COUNT];
+    } chain;
+#endif
+#if CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS > 0
+    struct
+    {
+        // slots of a block starting an entry, for variable size format
+        uint32_t block_ix; // UNDEF_IX when empty
+        uint32_t end;      // first free slot, all slots from here on are free
+        uint8_t starts[(CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS + 7) / 8];
+    } slots;
+#endif
+#if CONFIG_NVMTNVJ_WRITE_CACHE_SIZE > 0
+    struct
+    {
+        uint32_t dirty_count;
+        cache_entry_t entries[CONFIG_NVMTNVJ_WRITE_CACHE_SIZE];
+    } cache;
+#endif
+    struct
+    {
+        bool open;
+        uint32_t count; // reserved entries
+        uint32_t added;
+        uint32_t first_tag_ix;
+    } batch;
+    struct
+    {
+        // last resolved run of batch entries
+        uint32_t block_ix; // UNDEF_IX when none
+        uint32_t first_tag_ix;
+        uint32_t last_tag_ix;
+        bool committed;
+    } batch_run;
+#if CONFIG_NVMTNVJ_READ_AHEAD_SIZE > 0
+    struct
+    {
+        uint32_t block_ix; // UNDEF_IX when empty
+        uint32_t offset;
+        uint32_t len;
+        uint8_t buf[CONFIG_NVMTNVJ_READ_AHEAD_SIZE];
+    } ra;
+#endif
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    struct
+    {
+        gc_phase_t phase;
+        uint32_t evict_block_ix; // block being evicted, if set in GC_MAP it is reevicted
+        uint32_t tag_ix_src;     // next tag to copy from evicted block
+        uint32_t tag_ix_dst;     // next free tag in spare block
+        uint32_t erase_block_ix;
+        uint32_t erase_sector_ix;
+        word_t erase_seq_nbr;
+        word_t erase_count; // read before the header is erased
+        tag_evict_info_t tag_info[CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK];
+    } gc;
+#endif
+};
+
+static nvmtnvj_t instances[CONFIG_NVMTNVJ_INSTANCES];
+// instance of the nvmtnvj_ functions not taking one
+#define default_fs (&instances[0])
+
+// flash driver of instances not given one
+static const nvmtnvj_flash_t flash_driver = {
+    .read = flash_read,
+    .write = flash_write,
+    .erase = flash_erase,
+    .get_sector_size = flash_get_sector_size,
+    .get_sector_alignment = flash_get_sector_alignment,
+    .get_address_for_sector = flash_get_address_for_sector,
+};
+
+// takes size bytes from work buffer at offset, keeping word alignment
+static void *work_take(uint8_t *buf, uint32_t *offset, uint32_t size)
+{
+    void *p = buf ? buf + *offset : NULL;
+    *offset += (size + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+    return p;
+}
+
+// Lays out work buffer for given geometry, returns its size. Block info is only
+// put in the buffer when there are more blocks than CONFIG_NVMTNVJ_BLOCK_INFO_COUNT.
+// Only returns the size if fs is NULL.
+static uint32_t work_layout(nvmtnvj_t *fs, uint8_t *buf, uint32_t blocks, uint32_t tags_per_block)
+{
+    uint32_t offset = 0;
+    uint32_t *sorted_blocks = work_take(buf, &offset, blocks * sizeof(uint32_t));
+    word_t *sorted_seq_nbrs = work_take(buf, &offset, blocks * sizeof(word_t));
+    tag_evict_info_t *tag_info[WORK_TAG_INFOS];
+    for (uint32_t i = 0; i < WORK_TAG_INFOS; i++)
+        tag_info[i] = work_take(buf, &offset, tags_per_block * sizeof(tag_evict_info_t));
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    block_info_t *block_info = NULL;
+    uint16_t *chain_blocks = NULL;
+    if (blocks > CONFIG_NVMTNVJ_BLOCK_INFO_COUNT)
+    {
+        block_info = work_take(buf, &offset, blocks * sizeof(block_info_t));
+        chain_blocks = work_take(buf, &offset, blocks * sizeof(uint16_t));
+    }
+#endif
+    if (fs == NULL)
+        return offset;
+    fs->work.buf = buf;
+    fs->work.sorted_blocks = sorted_blocks;
+    fs->work.sorted_seq_nbrs = sorted_seq_nbrs;
+    for (uint32_t i = 0; i < WORK_TAG_INFOS; i++)
+        fs->work.tag_info[i] = tag_info[i];
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (block_info)
+    {
+        fs->block_info = block_info;
+        fs->block_info_count = blocks;
+        fs->chain.blocks = chain_blocks;
+    }
+#endif
+    return offset;
+}
+
+// drops work buffer, scratch is then taken from stack
+static void work_reset(nvmtnvj_t *fs)
+{
+    fs->work.buf = NULL;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    fs->block_info = fs->block_info_ram;
+    fs->block_info_count = CONFIG_NVMTNVJ_BLOCK_INFO_COUNT;
+    fs->chain.blocks = fs->chain.blocks_ram;
+#endif
+}
+
+// Scratch sized by geometry is taken from the work buffer if there is one, else
+// from stack arrays of the caller, declared WORK_VLA_LEN long.
+#define WORK_VLA_LEN(fs, n) ((fs)->work.buf ? 1 : (n))
+
+static sorted_blocks_t work_sorted_blocks(nvmtnvj_t *fs, uint32_t *blocks, word_t *seq_nbrs)
+{
+    sorted_blocks_t sorted_blocks = {
+        .blocks = fs->work.buf ? fs->work.sorted_blocks : blocks,
+        .seq_nbrs = fs->work.buf ? fs->work.sorted_seq_nbrs : seq_nbrs,
+        .count = 0};
+    return sorted_blocks;
+}
+
+static tag_evict_info_t *work_tag_info(nvmtnvj_t *fs, uint32_t ix, tag_evict_info_t *tag_info)
+{
+    return fs->work.buf ? fs->work.tag_info[ix] : tag_info;
+}
+
+typedef bool (*sort_before_t)(void *ctx, uint32_t a, uint32_t b);
+typedef void (*sort_swap_t)(void *ctx, uint32_t a, uint32_t b);
+
+static void heap_sift(void *ctx, sort_before_t before, sort_swap_t swap, uint32_t root, uint32_t count)
+{
+    while (2 * root + 1 < count)
+    {
+        uint32_t child = 2 * root + 1;
+        if (child + 1 < count && before(ctx, child, child + 1))
+            child++;
+        if (!before(ctx, root, child))
+            return;
+        swap(ctx, root, child);
+        root = child;
+    }
+}
+
+// Sorts count elements so that before(a, b) holds for a ahead of b. In place and
+// O(n log n), as there may be tens of thousands of blocks.
+static void heap_sort(void *ctx, sort_before_t before, sort_swap_t swap, uint32_t count)
+{
+    for (uint32_t i = count / 2; i-- > 0;)
+        heap_sift(ctx, before, swap, i, count);
+    for (uint32_t end = count; end-- > 1;)
+    {
+        swap(ctx, 0, end);
+        heap_sift(ctx, before, swap, 0, end);
+    }
+}
 
 static bool is_flag(word_t w)
 {
@@ -267,47 +763,143 @@ static bool flag(word_t w)
     return w == BLOCK_HEADER_FLAG_SET;
 }
 
-static bool block_is_valid(const block_header_t *b)
+// Set, or torn while being set. The evicting flag is written alone on a data block
+// before anything is moved, torn it counts as set and the eviction is redone.
+static bool flag_or_torn(word_t w)
 {
-    if (b->descr.magic != MAGIC)
+    const word_t bits = w ^ BLOCK_HEADER_FLAG_CLR;
+    return bits != 0 && (bits & (word_t)(BLOCK_HEADER_FLAG_SET ^ BLOCK_HEADER_FLAG_CLR)) == bits;
+}
+
+static const uint8_t magics[][2] = {
+    [HDR_REV_LEGACY] = {MAGIC_LEGACY, MAGIC_LEGACY_VARIABLE_SIZE},
+    [HDR_REV_NARROW] = {MAGIC_NARROW, MAGIC_NARROW_VARIABLE_SIZE},
+    [HDR_REV_WIDE] = {MAGIC, MAGIC_VARIABLE_SIZE},
+};
+
+static uint8_t fs_magic(nvmtnvj_t *fs)
+{
+    return magics[fs->rev][fs->variable_size];
+}
+
+// finds revision and format of given magic, returns false if not a magic
+static bool magic_parse(uint8_t magic, hdr_rev_t *rev, bool *variable_size)
+{
+    for (uint32_t r = 0; r < sizeof(magics) / sizeof(magics[0]); r++)
+    {
+        for (uint32_t v = 0; v < 2; v++)
+        {
+            if (magics[r][v] != magic)
+                continue;
+            *rev = (hdr_rev_t)r;
+            *variable_size = v != 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t block_hdr_size(nvmtnvj_t *fs)
+{
+    switch (fs->rev)
+    {
+    case HDR_REV_LEGACY:
+        return offsetof(block_header_t, erase_count);
+    case HDR_REV_NARROW:
+        return offsetof(block_header_t, nbr_of_blocks);
+    default:
+        return sizeof(block_header_t);
+    }
+}
+
+static uint8_t descr_saturate(uint32_t x)
+{
+    return x > 0xff ? 0xff : (uint8_t)x;
+}
+
+// geometry of a header of given revision, 0 if not written
+static uint32_t hdr_nbr_of_blocks(hdr_rev_t rev, const block_header_t *b)
+{
+    return rev == HDR_REV_WIDE ? b->nbr_of_blocks : b->descr.nbr_of_blocks;
+}
+
+static uint32_t hdr_sectors_per_block(hdr_rev_t rev, const block_header_t *b)
+{
+    return rev == HDR_REV_WIDE ? b->sectors_per_block : b->descr.sectors_per_block;
+}
+
+static bool block_is_valid(nvmtnvj_t *fs, const block_header_t *b)
+{
+    if (b->descr.magic != fs_magic(fs))
         return false;
-    if (b->descr.max_value_size == 0 || b->descr.max_value_size != sys.max_value_size)
+    if (b->descr.max_value_size == 0 || b->descr.max_value_size != fs->max_value_size)
         return false;
-    if (b->descr.nbr_of_blocks == 0 || b->descr.nbr_of_blocks != sys.nbr_of_blocks)
+    if (b->descr.nbr_of_blocks != descr_saturate(fs->nbr_of_blocks) ||
+        hdr_nbr_of_blocks(fs->rev, b) != fs->nbr_of_blocks)
         return false;
-    if (b->descr.sectors_per_block == 0 || b->descr.sectors_per_block != sys.sectors_per_block)
+    if (b->descr.sectors_per_block != descr_saturate(fs->sectors_per_block) ||
+        hdr_sectors_per_block(fs->rev, b) != fs->sectors_per_block)
         return false;
     if (!is_flag(b->data_flag))
         return false;
-    if (!is_flag(b->evict_flag))
+    if (!is_flag(b->evict_flag) && !flag_or_torn(b->evict_flag))
         return false;
     return true;
 }
 
-static block_type_t block_type(const block_header_t *bhdr)
+static block_type_t block_type(nvmtnvj_t *fs, const block_header_t *bhdr)
 {
     bool seq_nbr_written = bhdr->seq_nbr != SEQ_NBR_UNWRITTEN;
-    if (!block_is_valid(bhdr))
+    if (!block_is_valid(fs, bhdr))
         return BLOCK_TYPE_UNKNOWN;
-    if (!seq_nbr_written && !flag(bhdr->data_flag) && !flag(bhdr->evict_flag))
+    if (!seq_nbr_written && !flag(bhdr->data_flag) && !flag_or_torn(bhdr->evict_flag))
         return BLOCK_TYPE_SPARE;
-    if (!seq_nbr_written && flag(bhdr->data_flag) && !flag(bhdr->evict_flag))
+    if (!seq_nbr_written && flag(bhdr->data_flag) && !flag_or_torn(bhdr->evict_flag))
         return BLOCK_TYPE_DATA_FREE;
-    if (seq_nbr_written && flag(bhdr->data_flag) && !flag(bhdr->evict_flag))
+    if (seq_nbr_written && flag(bhdr->data_flag) && !flag_or_torn(bhdr->evict_flag))
         return BLOCK_TYPE_DATA;
-    if (seq_nbr_written && flag(bhdr->data_flag) && flag(bhdr->evict_flag))
+    if (seq_nbr_written && flag(bhdr->data_flag) && flag_or_torn(bhdr->evict_flag))
         return BLOCK_TYPE_EVICTING;
     return BLOCK_TYPE_UNKNOWN;
 }
 
-static uint32_t tag_size(void)
+static uint32_t tag_size(nvmtnvj_t *fs)
+{
+    return ALIGNW(sizeof(tag_header_t) + fs->max_value_size);
+}
+
+static uint32_t slot_size(nvmtnvj_t *fs)
+{
+    return fs->variable_size ? CONFIG_NVMTNVJ_FLASH_WORD_SIZE : tag_size(fs);
+}
+
+// number of slots taken by an entry with given value length
+static uint32_t tag_slots(nvmtnvj_t *fs, uint8_t len)
+{
+    if (!fs->variable_size)
+        return 1;
+    if (len > fs->max_value_size)
+        len = fs->max_value_size;
+    return ALIGNW(sizeof(tag_header_t) + len) / CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
+}
+
+static uint32_t tag_offset(nvmtnvj_t *fs, uint32_t tag_ix)
 {
-    return ALIGNW(sizeof(tag_header_t) + sys.max_value_size);
+    return ALIGNW(block_hdr_size(fs)) + tag_ix * slot_size(fs);
 }
 
-static word_t seq_nbr_new(void)
+static uint32_t tags_per_block_for(nvmtnvj_t *fs, uint32_t block_size)
 {
-    word_t nxt = sys.max_seq_nbr + 1;
+    uint32_t slots = (block_size - ALIGNW(block_hdr_size(fs))) / slot_size(fs);
+    // an entry may only start in a slot where at least its header fits
+    if (slots < tag_slots(fs, 0))
+        return 0;
+    return slots - (tag_slots(fs, 0) - 1);
+}
+
+static word_t seq_nbr_new(nvmtnvj_t *fs)
+{
+    word_t nxt = fs->max_seq_nbr + 1;
     if (nxt == SEQ_NBR_UNWRITTEN)
         nxt++;
     return nxt;
@@ -340,18 +932,141 @@ static void seq_nbr_update_extrema(word_t seq_nbr, uint32_t block_ix,
     }
 }
 
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0 && CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+// Freeable tag accounting needs a complete index, as every superseded entry is
+// found via the index. Deleted entries are counted as live, even though they might
+// be freeable if the tag is not written in any older block.
+static bool accounting_valid(nvmtnvj_t *fs)
+{
+    return fs->index.valid && fs->index.complete && fs->nbr_of_blocks <= fs->block_info_count;
+}
+
+static void account_reset(nvmtnvj_t *fs, uint32_t block_ix, uint32_t used)
+{
+    if (block_ix >= fs->block_info_count)
+        return;
+    fs->stats.used += used - fs->block_info[block_ix].used;
+    fs->stats.freeable -= fs->block_info[block_ix].freeable;
+    fs->block_info[block_ix].used = (uint16_t)used;
+    fs->block_info[block_ix].freeable = 0;
+}
+
+static void account_used(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    if (block_ix >= fs->block_info_count)
+        return;
+    fs->block_info[block_ix].used++;
+    fs->stats.used++;
+}
+
+static void account_freeable(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    if (block_ix >= fs->block_info_count)
+        return;
+    fs->block_info[block_ix].freeable++;
+    fs->stats.freeable++;
+}
+
+// an entry that is never live, i.e. batch markers and entries of aborted batches
+static void account_void(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    if (!fs->index.valid)
+        return;
+    account_used(fs, block_ix);
+    account_freeable(fs, block_ix);
+}
+
+static void account_clear(nvmtnvj_t *fs)
+{
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
+        account_reset(fs, b, 0);
+    // sums held counts of unaccounted or former blocks
+    fs->stats.used = 0;
+    fs->stats.freeable = 0;
+}
+
+// restores accounting of a block, see checkpoint_load
+static void account_set(nvmtnvj_t *fs, uint32_t block_ix, uint32_t used, uint32_t freeable)
+{
+    account_reset(fs, block_ix, used);
+    if (block_ix >= fs->block_info_count)
+        return;
+    fs->block_info[block_ix].freeable = (uint16_t)freeable;
+    fs->stats.freeable += freeable;
+}
+#else
+#define accounting_valid(fs) false
+#define account_reset(fs, block_ix, used) \
+    do                                    \
+    {                                     \
+    } while (0)
+#define account_used(fs, block_ix) \
+    do                             \
+    {                              \
+    } while (0)
+#define account_freeable(fs, block_ix) \
+    do                                 \
+    {                                  \
+    } while (0)
+#define account_void(fs, block_ix) \
+    do                             \
+    {                              \
+    } while (0)
+#define account_clear(fs) \
+    do                    \
+    {                     \
+    } while (0)
+#define account_set(fs, block_ix, used, freeable) \
+    do                                            \
+    {                                             \
+    } while (0)
+#endif
+
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+// Block header states are cached when there is room for all blocks, in ram or in
+// the work buffer. Any write to a block header or erase of a block drops the cached
+// state of that block.
+static bool block_cache_enabled(nvmtnvj_t *fs)
+{
+    return fs->nbr_of_blocks <= fs->block_info_count;
+}
+
+static void block_cache_clear(nvmtnvj_t *fs)
+{
+    for (uint32_t b = 0; b < fs->block_info_count; b++)
+        fs->block_info[b].hdr_cached = false;
+    fs->chain.valid = false;
+}
+
+static void block_cache_invalidate(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    if (block_ix < fs->block_info_count)
+        fs->block_info[block_ix].hdr_cached = false;
+    fs->chain.valid = false;
+}
+#else
+#define block_cache_clear(fs) \
+    do                        \
+    {                         \
+    } while (0)
+#define block_cache_invalidate(fs, block_ix) \
+    do                                       \
+    {                                        \
+    } while (0)
+#endif
+
 // reads across sector boundaries which flash_* api does not
-static int block_read(uint32_t block_ix, uint32_t offset, uint8_t *dst, uint32_t size)
+static int block_read(nvmtnvj_t *fs, uint32_t block_ix, uint32_t offset, uint8_t *dst, uint32_t size)
 {
-    if (block_ix >= sys.nbr_of_blocks)
+    if (block_ix >= fs->nbr_of_blocks)
         return ERR_NVMTNVJ_INVAL;
-    uint32_t sector = sys.starting_sector + sys.sectors_per_block * block_ix;
-    sector += offset / sys.sector_size;
+    uint32_t sector = fs->starting_sector + fs->sectors_per_block * block_ix;
+    sector += offset / fs->sector_size;
     while (size > 0)
     {
-        uint32_t remaining_in_sector = sys.sector_size - (offset % sys.sector_size);
+        uint32_t remaining_in_sector = fs->sector_size - (offset % fs->sector_size);
         uint32_t to_read_in_sector = size > remaining_in_sector ? remaining_in_sector : size;
-        int res = flash_read(sector, offset % sys.sector_size, dst, to_read_in_sector);
+        int res = fs->flash->read(sector, offset % fs->sector_size, dst, to_read_in_sector);
         ERR_RET(res);
         dst += to_read_in_sector;
         offset += to_read_in_sector;
@@ -361,128 +1076,349 @@ static int block_read(uint32_t block_ix, uint32_t offset, uint8_t *dst, uint32_t
     return 0;
 }
 
-static int block_write_word(uint32_t block_ix, uint32_t offset, word_t w)
+#if CONFIG_NVMTNVJ_READ_AHEAD_SIZE > 0
+static void read_ahead_invalidate(nvmtnvj_t *fs, uint32_t block_ix)
 {
-    uint32_t sector = sys.starting_sector + sys.sectors_per_block * block_ix;
-    sector += offset / sys.sector_size;
-    int res = flash_write(sector, offset % sys.sector_size, (const uint8_t *)&w,
-                          CONFIG_NVMTNVJ_FLASH_WORD_SIZE);
-    return res < 0 ? res : 0;
+    if (block_ix == fs->ra.block_ix || block_ix == UNDEF_IX)
+        fs->ra.block_ix = UNDEF_IX;
+}
+
+// Reads from a window of the block, refilled with one flash read within a sector.
+// Windows are aligned within the sector so scans in either direction benefit.
+static int read_ahead(nvmtnvj_t *fs, uint32_t block_ix, uint32_t offset, uint8_t *dst, uint32_t size)
+{
+    if (block_ix != fs->ra.block_ix || offset < fs->ra.offset || offset + size > fs->ra.offset + fs->ra.len)
+    {
+        const uint32_t offset_in_sector = offset % fs->sector_size;
+        uint32_t win_offset = offset - offset_in_sector % CONFIG_NVMTNVJ_READ_AHEAD_SIZE;
+        if (offset + size > win_offset + CONFIG_NVMTNVJ_READ_AHEAD_SIZE)
+            win_offset = offset;
+        uint32_t win_len = fs->sector_size - win_offset % fs->sector_size;
+        if (win_len > CONFIG_NVMTNVJ_READ_AHEAD_SIZE)
+            win_len = CONFIG_NVMTNVJ_READ_AHEAD_SIZE;
+        if (offset + size > win_offset + win_len)
+            return block_read(fs, block_ix, offset, dst, size); // straddles sector
+        fs->ra.block_ix = UNDEF_IX;
+        uint32_t sector = fs->starting_sector + fs->sectors_per_block * block_ix + win_offset / fs->sector_size;
+        int res = fs->flash->read(sector, win_offset % fs->sector_size, fs->ra.buf, win_len);
+        ERR_RET(res);
+        fs->ra.block_ix = block_ix;
+        fs->ra.offset = win_offset;
+        fs->ra.len = win_len;
+    }
+    _memcpy(dst, &fs->ra.buf[offset - fs->ra.offset], size);
+    return 0;
+}
+#else
+#define read_ahead_invalidate(fs, block_ix) \
+    do                                      \
+    {                                       \
+    } while (0)
+#define read_ahead(fs, block_ix, offset, dst, size) block_read(fs, (block_ix), (offset), (dst), (size))
+#endif
+
+// drops what is known in ram about contents of given block, UNDEF_IX for all blocks
+static void block_content_changed(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    read_ahead_invalidate(fs, block_ix);
+    fs->checkpointed = false;
+    if (block_ix == fs->batch_run.block_ix || block_ix == UNDEF_IX)
+        fs->batch_run.block_ix = UNDEF_IX;
+#if CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS > 0
+    if (block_ix == fs->slots.block_ix || block_ix == UNDEF_IX)
+        fs->slots.block_ix = UNDEF_IX;
+#endif
 }
 
-static int block_write_seq_nbr(uint32_t block_ix, word_t seq_nbr)
+static int block_write_word(nvmtnvj_t *fs, uint32_t block_ix, uint32_t offset, word_t w)
 {
-    return block_write_word(block_ix, offsetof(block_header_t, seq_nbr), seq_nbr);
+    block_content_changed(fs, block_ix);
+    if (offset < sizeof(block_header_t))
+        block_cache_invalidate(fs, block_ix);
+    uint32_t sector = fs->starting_sector + fs->sectors_per_block * block_ix;
+    sector += offset / fs->sector_size;
+    int res = fs->flash->write(sector, offset % fs->sector_size, (const uint8_t *)&w,
+                          CONFIG_NVMTNVJ_FLASH_WORD_SIZE);
+    fs->flash_failed |= res < 0;
+    ERR_RET(res);
+    fs->stats.bytes_written += CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
+    return 0;
 }
 
-static int block_write_evicting_flag(uint32_t block_ix)
+static int block_write_seq_nbr(nvmtnvj_t *fs, uint32_t block_ix, word_t seq_nbr)
 {
-    return block_write_word(block_ix, offsetof(block_header_t, evict_flag), BLOCK_HEADER_FLAG_SET);
+    return block_write_word(fs, block_ix, offsetof(block_header_t, seq_nbr), seq_nbr);
 }
 
-static int block_write_data_flag(uint32_t block_ix)
+static int block_write_evicting_flag(nvmtnvj_t *fs, uint32_t block_ix)
 {
-    return block_write_word(block_ix, offsetof(block_header_t, data_flag), BLOCK_HEADER_FLAG_SET);
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    // live tags are mapped before eviction, stop appending to it
+    if (block_ix == fs->head.block_ix)
+        fs->head.block_ix = UNDEF_IX;
+#endif
+    return block_write_word(fs, block_ix, offsetof(block_header_t, evict_flag), BLOCK_HEADER_FLAG_SET);
 }
 
-static int block_write_data_concat(uint32_t block_ix, uint32_t offset, const uint8_t *data1, uint8_t len1,
-                                   const uint8_t *data2, uint8_t len2)
+static int block_write_data_flag(nvmtnvj_t *fs, uint32_t block_ix)
 {
-    int res;
-    word_t w = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
-    while (len1 >= CONFIG_NVMTNVJ_FLASH_WORD_SIZE)
-    {
-        _memcpy(&w, data1, CONFIG_NVMTNVJ_FLASH_WORD_SIZE);
-        res = block_write_word(block_ix, offset, w);
-        ERR_RET(res);
-        data1 += CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-        len1 -= CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-        offset += CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-    }
-    if (len1 > 0)
-    {
-        w = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
-        uint8_t *pw = (uint8_t *)&w;
-        _memcpy(pw, data1, len1);
-        pw += len1;
+    return block_write_word(fs, block_ix, offsetof(block_header_t, data_flag), BLOCK_HEADER_FLAG_SET);
+}
 
-        uint8_t rem_in_w = (uint8_t)(CONFIG_NVMTNVJ_FLASH_WORD_SIZE - len1);
-        uint8_t take = len2 > rem_in_w ? rem_in_w : len2;
-        if (take)
-        {
-            _memcpy(pw, data2, take);
-            data2 += take;
-            len2 -= take;
-        }
-        res = block_write_word(block_ix, offset, w);
-        ERR_RET(res);
-        offset += CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-    }
-    while (len2 >= CONFIG_NVMTNVJ_FLASH_WORD_SIZE)
-    {
-        _memcpy(&w, data2, CONFIG_NVMTNVJ_FLASH_WORD_SIZE);
-        res = block_write_word(block_ix, offset, w);
-        ERR_RET(res);
-        data2 += CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-        len2 -= CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-        offset += CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
-    }
-    if (len2 > 0)
+// writes across sector boundaries which flash_* api does not, one flash_write per sector
+static int block_write(nvmtnvj_t *fs, uint32_t block_ix, uint32_t offset, const uint8_t *src, uint32_t size)
+{
+    block_content_changed(fs, block_ix);
+    uint32_t sector = fs->starting_sector + fs->sectors_per_block * block_ix;
+    sector += offset / fs->sector_size;
+    while (size > 0)
     {
-        w = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
-        _memcpy(&w, data2, len2);
-        res = block_write_word(block_ix, offset, w);
+        uint32_t remaining_in_sector = fs->sector_size - (offset % fs->sector_size);
+        uint32_t to_write_in_sector = size > remaining_in_sector ? remaining_in_sector : size;
+        int res = fs->flash->write(sector, offset % fs->sector_size, src, to_write_in_sector);
+        fs->flash_failed |= res < 0;
         ERR_RET(res);
+        // only what reached the flash is counted
+        fs->stats.bytes_written += to_write_in_sector;
+        src += to_write_in_sector;
+        offset += to_write_in_sector;
+        size -= to_write_in_sector;
+        sector++;
     }
     return 0;
 }
 
-static int block_erase(uint32_t block_ix, block_type_t type)
+static int block_erase_sector(nvmtnvj_t *fs, uint32_t block_ix, uint32_t sector_ix)
 {
-    _dbg("erase block %d, type %d\n", block_ix, type);
-    const uint32_t block_sector = sys.starting_sector + block_ix * sys.sectors_per_block;
-    int res = 0;
-    for (uint32_t s = block_sector; s < block_sector + sys.sectors_per_block; s++)
-    {
-        res = flash_erase(s);
-        ERR_RET(res);
-    }
-    block_header_t bhdr = {
-        .descr.magic = MAGIC,
-        .descr.max_value_size = sys.max_value_size,
-        .descr.nbr_of_blocks = sys.nbr_of_blocks,
-        .descr.sectors_per_block = sys.sectors_per_block,
+    block_content_changed(fs, block_ix);
+    block_cache_invalidate(fs, block_ix);
+    fs->stats.erases++;
+    int res = fs->flash->erase(fs->starting_sector + block_ix * fs->sectors_per_block + sector_ix);
+    fs->flash_failed |= res < 0;
+    return res;
+}
+
+// writes header to an erased block
+static int block_write_hdr(nvmtnvj_t *fs, uint32_t block_ix, block_type_t type, word_t erase_count)
+{
+    const uint32_t block_sector = fs->starting_sector + block_ix * fs->sectors_per_block;
+    int res;
+    block_header_t bhdr = {
+        .descr.magic = fs_magic(fs),
+        .descr.max_value_size = fs->max_value_size,
+        .descr.nbr_of_blocks = descr_saturate(fs->nbr_of_blocks),
+        .descr.sectors_per_block = descr_saturate(fs->sectors_per_block),
+        .nbr_of_blocks = fs->nbr_of_blocks,
+        .sectors_per_block = fs->sectors_per_block,
         .data_flag = type == BLOCK_TYPE_SPARE ? BLOCK_HEADER_FLAG_CLR : BLOCK_HEADER_FLAG_SET,
         .evict_flag = BLOCK_HEADER_FLAG_CLR,
         .seq_nbr = SEQ_NBR_UNWRITTEN,
+        .erase_count = erase_count,
     };
-    res = flash_write(block_sector, 0, (const uint8_t *)&bhdr, sizeof(bhdr));
+    block_cache_invalidate(fs, block_ix);
+    block_content_changed(fs, block_ix);
+    res = fs->flash->write(block_sector, 0, (const uint8_t *)&bhdr, block_hdr_size(fs));
     if (res > 0)
         res = 0;
+    fs->flash_failed |= res < 0;
     ERR_RET(res);
+    fs->stats.bytes_written += block_hdr_size(fs);
+    account_reset(fs, block_ix, 0);
+    if (type == BLOCK_TYPE_SPARE)
+    {
+        fs->spare_used = 0;
+        fs->spare_last = 0;
+    }
     return res;
 }
 
-static int block_read_hdr(uint32_t block_ix, block_header_t *h)
+static int block_read_erase_count(nvmtnvj_t *fs, uint32_t block_ix, word_t *erase_count);
+
+static int block_erase(nvmtnvj_t *fs, uint32_t block_ix, block_type_t type)
+{
+    _dbg("erase block %d, type %d\n", block_ix, type);
+    word_t erase_count;
+    int res = block_read_erase_count(fs, block_ix, &erase_count);
+    ERR_RET(res);
+    for (uint32_t s = 0; s < fs->sectors_per_block; s++)
+    {
+        res = block_erase_sector(fs, block_ix, s);
+        ERR_RET(res);
+    }
+    return block_write_hdr(fs, block_ix, type, erase_count + 1);
+}
+
+// spare block holding checkpoints is erased before tags are copied to it
+static int spare_clean(nvmtnvj_t *fs)
+{
+    if (fs->spare_used == 0)
+        return 0;
+    _dbg("erase checkpoints in spare block %d\n", fs->spare_block_ix);
+    return block_erase(fs, fs->spare_block_ix, BLOCK_TYPE_SPARE);
+}
+
+static int block_read_hdr(nvmtnvj_t *fs, uint32_t block_ix, block_header_t *h)
 {
-    if (block_ix >= sys.nbr_of_blocks)
+    if (block_ix >= fs->nbr_of_blocks)
         return ERR_NVMTNVJ_INVAL;
-    return flash_read(sys.starting_sector + sys.sectors_per_block * block_ix, 0, (uint8_t *)h,
+    fs->stats.hdr_reads++;
+    return fs->flash->read(fs->starting_sector + fs->sectors_per_block * block_ix, 0, (uint8_t *)h,
                       sizeof(block_header_t));
 }
 
-static int block_find_prev(word_t seq_nbr, uint32_t *prev_block_ix, word_t *prev_seq_nbr)
+// returns type and seq_nbr of block, from ram if cached
+static int block_read_state(nvmtnvj_t *fs, uint32_t block_ix, block_type_t *type, word_t *seq_nbr)
+{
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    const bool cache = block_cache_enabled(fs) && block_ix < fs->nbr_of_blocks;
+    if (cache && fs->block_info[block_ix].hdr_cached)
+    {
+        const block_info_t *bi = &fs->block_info[block_ix];
+        *type = (block_type_t)bi->type;
+        if (seq_nbr)
+            *seq_nbr = bi->seq_nbr;
+        return 0;
+    }
+#endif
+    block_header_t bhdr;
+    int res = block_read_hdr(fs, block_ix, &bhdr);
+    ERR_RET(res);
+    *type = block_type(fs, &bhdr);
+    if (seq_nbr)
+        *seq_nbr = bhdr.seq_nbr;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (cache)
+    {
+        block_info_t *bi = &fs->block_info[block_ix];
+        bi->type = (uint8_t)*type;
+        bi->seq_nbr = bhdr.seq_nbr;
+        bi->erase_count = fs->rev == HDR_REV_LEGACY ? 0 : bhdr.erase_count;
+        bi->hdr_cached = true;
+    }
+#endif
+    return 0;
+}
+
+// Returns how many times block has been erased. If lost by an aborted erase while
+// mounted, the most worn other block is a safe guess. At format, it starts over.
+static int block_read_erase_count(nvmtnvj_t *fs, uint32_t block_ix, word_t *erase_count)
+{
+    *erase_count = 0;
+    if (fs->rev == HDR_REV_LEGACY)
+        return 0;
+    block_type_t btype;
+    int res = block_read_state(fs, block_ix, &btype, NULL);
+    ERR_RET(res);
+    if (btype != BLOCK_TYPE_UNKNOWN)
+    {
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+        if (block_cache_enabled(fs))
+        {
+            *erase_count = fs->block_info[block_ix].erase_count;
+            return 0;
+        }
+#endif
+        block_header_t bhdr;
+        res = block_read_hdr(fs, block_ix, &bhdr);
+        ERR_RET(res);
+        *erase_count = bhdr.erase_count;
+        return 0;
+    }
+    if (fs->state == STATE_UNMOUNTED)
+        return 0;
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
+    {
+        if (b == block_ix)
+            continue;
+        res = block_read_state(fs, b, &btype, NULL);
+        ERR_RET(res);
+        if (btype == BLOCK_TYPE_UNKNOWN)
+            continue;
+        word_t count;
+        res = block_read_erase_count(fs, b, &count);
+        ERR_RET(res);
+        if (count > *erase_count)
+            *erase_count = count;
+    }
+    return 0;
+}
+
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+static bool chain_before(void *ctx, uint32_t a, uint32_t b)
+{
+    nvmtnvj_t *fs = ctx;
+    const word_t seq_a = fs->block_info[fs->chain.blocks[a]].seq_nbr;
+    const word_t seq_b = fs->block_info[fs->chain.blocks[b]].seq_nbr;
+    return seq_a != seq_b && seq_nbr_is_newer(seq_a, seq_b);
+}
+
+static void chain_swap(void *ctx, uint32_t a, uint32_t b)
+{
+    nvmtnvj_t *fs = ctx;
+    const uint16_t t = fs->chain.blocks[a];
+    fs->chain.blocks[a] = fs->chain.blocks[b];
+    fs->chain.blocks[b] = t;
+}
+
+// Sorts Data and Evicting blocks newest first from cached block headers.
+// O(n log n) n=nbr_of_blocks, but only in ram and only after block headers changed.
+static int block_chain_build(nvmtnvj_t *fs)
+{
+    fs->chain.count = 0;
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
+    {
+        block_type_t btype;
+        int res = block_read_state(fs, b, &btype, NULL);
+        ERR_RET(res);
+        if (btype != BLOCK_TYPE_DATA && btype != BLOCK_TYPE_EVICTING)
+            continue;
+        fs->chain.blocks[fs->chain.count++] = (uint16_t)b;
+    }
+    heap_sort(fs, chain_before, chain_swap, fs->chain.count);
+    for (uint32_t i = 0; i < fs->chain.count; i++)
+        fs->block_info[fs->chain.blocks[i]].chain_pos = (uint16_t)i;
+    fs->chain.valid = true;
+    return 0;
+}
+
+static int block_chain_get(nvmtnvj_t *fs)
+{
+    if (fs->chain.valid)
+        return 0;
+    return block_chain_build(fs);
+}
+#endif
+
+static int block_find_prev(nvmtnvj_t *fs, word_t seq_nbr, uint32_t *prev_block_ix, word_t *prev_seq_nbr)
 {
     block_header_t bhdr;
     int res;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (block_cache_enabled(fs))
+    {
+        res = block_chain_get(fs);
+        ERR_RET(res);
+        for (uint32_t i = 0; i < fs->chain.count; i++)
+        {
+            const uint32_t b = fs->chain.blocks[i];
+            if (seq_nbr_is_newer(fs->block_info[b].seq_nbr, seq_nbr))
+                continue;
+            *prev_block_ix = b;
+            if (prev_seq_nbr)
+                *prev_seq_nbr = fs->block_info[b].seq_nbr;
+            return 0;
+        }
+        return ERR_NVMTNVJ_NOENT;
+    }
+#endif
     word_t min_diff = (word_t)-1;
     word_t seq_nbr_cand = SEQ_NBR_UNWRITTEN;
     uint32_t block_ix = UNDEF_IX;
-    for (uint8_t b = 0; b < sys.nbr_of_blocks; b++)
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
     {
-        res = block_read_hdr(b, &bhdr);
+        res = block_read_hdr(fs, b, &bhdr);
         ERR_RET(res);
-        block_type_t btype = block_type(&bhdr);
+        block_type_t btype = block_type(fs, &bhdr);
         if (btype != BLOCK_TYPE_DATA && btype != BLOCK_TYPE_EVICTING)
             continue;
         if (seq_nbr_is_newer(bhdr.seq_nbr, seq_nbr))
@@ -503,20 +1439,52 @@ static int block_find_prev(word_t seq_nbr, uint32_t *prev_block_ix, word_t *prev
     return 0;
 }
 
-static int block_alloc(uint32_t *block_ix, word_t *seq_nbr)
+// finds the block preceding given Data or Evicting block in history
+static int block_find_older(nvmtnvj_t *fs, uint32_t block_ix, uint32_t *prev_block_ix)
 {
-    block_header_t bhdr;
-    for (uint8_t b = 0; b < sys.nbr_of_blocks; b++)
+    int res;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (block_cache_enabled(fs))
+    {
+        res = block_chain_get(fs);
+        ERR_RET(res);
+        const uint32_t pos = fs->block_info[block_ix].chain_pos;
+        if (pos < fs->chain.count && fs->chain.blocks[pos] == block_ix)
+        {
+            if (pos + 1 >= fs->chain.count)
+                return ERR_NVMTNVJ_NOENT;
+            *prev_block_ix = fs->chain.blocks[pos + 1];
+            return 0;
+        }
+    }
+#endif
+    block_type_t btype;
+    word_t seq_nbr;
+    res = block_read_state(fs, block_ix, &btype, &seq_nbr);
+    ERR_RET(res);
+    return block_find_prev(fs, seq_nbr, prev_block_ix, NULL);
+}
+
+static int checkpoint_void(nvmtnvj_t *fs);
+
+static int block_alloc(nvmtnvj_t *fs, uint32_t *block_ix, word_t *seq_nbr)
+{
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
     {
-        int res = block_read_hdr(b, &bhdr);
+        block_type_t btype;
+        int res = block_read_state(fs, b, &btype, NULL);
         ERR_RET(res);
-        if (block_type(&bhdr) != BLOCK_TYPE_DATA_FREE)
+        if (btype != BLOCK_TYPE_DATA_FREE)
             continue;
-        *seq_nbr = seq_nbr_new();
+        // last checkpoint holds the block states as before
+        res = checkpoint_void(fs);
+        ERR_RET(res);
+        *seq_nbr = seq_nbr_new(fs);
         _dbg("alloc bix %d seq %d\n", b, *seq_nbr);
-        res = block_write_seq_nbr(b, *seq_nbr);
+        res = block_write_seq_nbr(fs, b, *seq_nbr);
         ERR_RET(res);
         *block_ix = b;
+        fs->free_block_count--;
         return 0;
     }
     return ERR_NVMTNVJ_NOENT;
@@ -530,34 +1498,269 @@ static uint8_t chk(const uint8_t *data, uint8_t len)
     return (uint8_t)(0 - s);
 }
 
-static int tag_read_hdr_in_block(uint32_t block_ix, uint32_t tag_ix, tag_header_t *t)
+static int tag_read_hdr_in_block(nvmtnvj_t *fs, uint32_t block_ix, uint32_t tag_ix, tag_header_t *t)
+{
+    if (tag_ix >= fs->tags_per_block)
+        return ERR_NVMTNVJ_INVAL;
+    return block_read(fs, block_ix, tag_offset(fs, tag_ix), (uint8_t *)t, sizeof(tag_header_t));
+}
+
+static int tag_scan_raw_hdr_in_block(nvmtnvj_t *fs, uint32_t block_ix, uint32_t tag_ix, tag_header_t *t)
 {
-    if (tag_ix >= sys.tags_per_block)
+    if (tag_ix >= fs->tags_per_block)
         return ERR_NVMTNVJ_INVAL;
-    return block_read(block_ix, ALIGNW(sizeof(block_header_t)) + tag_ix * tag_size(), (uint8_t *)t,
-                      sizeof(tag_header_t));
+    return read_ahead(fs, block_ix, tag_offset(fs, tag_ix), (uint8_t *)t, sizeof(tag_header_t));
+}
+
+// slot after given entry
+static uint32_t tag_next_ix(nvmtnvj_t *fs, const tag_header_t *t, uint32_t tag_ix)
+{
+    if (t->state == TAG_FREE)
+        return tag_ix + 1;
+    return tag_ix + tag_slots(fs, t->len);
+}
+
+#if CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS > 0
+// Entries of variable size can only be told apart by walking them from the start of
+// the block, the walk is kept in ram for the last walked block.
+static int slot_map_build(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    if (fs->slots.block_ix == block_ix)
+        return 0;
+    for (uint32_t i = 0; i < sizeof(fs->slots.starts); i++)
+        fs->slots.starts[i] = 0;
+    uint32_t tag_ix = 0;
+    while (tag_ix < fs->tags_per_block)
+    {
+        tag_header_t thdr;
+        int res = tag_scan_raw_hdr_in_block(fs, block_ix, tag_ix, &thdr);
+        ERR_RET(res);
+        if (thdr.state == TAG_FREE)
+            break;
+        fs->slots.starts[tag_ix / 8] |= 1 << (tag_ix % 8);
+        tag_ix = tag_next_ix(fs, &thdr, tag_ix);
+    }
+    // a torn header may claim more than is left
+    fs->slots.end = tag_ix < fs->tags_per_block ? tag_ix : fs->tags_per_block;
+    fs->slots.block_ix = block_ix;
+    return 0;
+}
+
+static bool slot_starts_entry(nvmtnvj_t *fs, uint32_t tag_ix)
+{
+    return tag_ix >= fs->slots.end || (fs->slots.starts[tag_ix / 8] & (1 << (tag_ix % 8)));
+}
+#endif
+
+// finds entry before given entry, ERR_NVMTNVJ_NOENT if first
+static int tag_prev_ix(nvmtnvj_t *fs, uint32_t block_ix, uint32_t tag_ix, uint32_t *prev_tag_ix)
+{
+    if (tag_ix == 0)
+        return ERR_NVMTNVJ_NOENT;
+#if CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS > 0
+    if (fs->variable_size)
+    {
+        int res = slot_map_build(fs, block_ix);
+        ERR_RET(res);
+        while (--tag_ix > 0 && !slot_starts_entry(fs, tag_ix))
+            ;
+    }
+    else
+#endif
+    {
+        (void)block_ix;
+        tag_ix--;
+    }
+    *prev_tag_ix = tag_ix;
+    return 0;
+}
+
+static bool tag_state_is_batch(tag_state_t state)
+{
+    return state == TAG_BATCH_WRITTEN || state == TAG_BATCH_DELETED;
+}
+
+// A batch is a run of batch entries immediately followed by a commit marker
+// counting the run. Entries of committed batches resolve to plain written or
+// deleted entries, anything else to TAG_VOID.
+static int tag_resolve_batch(nvmtnvj_t *fs, uint32_t block_ix, uint32_t tag_ix, tag_header_t *t)
+{
+    if (!tag_state_is_batch(t->state))
+    {
+        t->state = TAG_VOID;
+        return 0;
+    }
+    if (block_ix != fs->batch_run.block_ix || tag_ix < fs->batch_run.first_tag_ix ||
+        tag_ix > fs->batch_run.last_tag_ix)
+    {
+        tag_header_t thdr;
+        int res;
+        uint32_t first_tag_ix = tag_ix;
+        uint32_t last_tag_ix = tag_ix;
+        uint32_t entries = 1;
+        while (first_tag_ix > 0)
+        {
+            uint32_t prev_tag_ix;
+            res = tag_prev_ix(fs, block_ix, first_tag_ix, &prev_tag_ix);
+            ERR_RET(res);
+            res = tag_scan_raw_hdr_in_block(fs, block_ix, prev_tag_ix, &thdr);
+            ERR_RET(res);
+            if (!tag_state_is_batch(thdr.state))
+                break;
+            first_tag_ix = prev_tag_ix;
+            entries++;
+        }
+        bool committed = false;
+        uint32_t next_tag_ix = tag_next_ix(fs, t, tag_ix);
+        while (next_tag_ix < fs->tags_per_block)
+        {
+            res = tag_scan_raw_hdr_in_block(fs, block_ix, next_tag_ix, &thdr);
+            ERR_RET(res);
+            if (!tag_state_is_batch(thdr.state))
+            {
+                // chk is programmed before state and id, a torn marker never commits
+                committed = thdr.state == TAG_BATCH_COMMIT && thdr.chk == chk(NULL, 0) && thdr.id == entries;
+                break;
+            }
+            last_tag_ix = next_tag_ix;
+            entries++;
+            next_tag_ix = tag_next_ix(fs, &thdr, next_tag_ix);
+        }
+        fs->batch_run.block_ix = block_ix;
+        fs->batch_run.first_tag_ix = first_tag_ix;
+        fs->batch_run.last_tag_ix = last_tag_ix;
+        fs->batch_run.committed = committed;
+    }
+    if (!fs->batch_run.committed)
+        t->state = TAG_VOID;
+    else
+        t->state = t->state == TAG_BATCH_WRITTEN ? TAG_WRITTEN : TAG_DELETED;
+    return 0;
+}
+
+// as tag_read_hdr_in_block, for when scanning many tag headers in a block
+static int tag_scan_hdr_in_block(nvmtnvj_t *fs, uint32_t block_ix, uint32_t tag_ix, tag_header_t *t)
+{
+    int res;
+#if CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS > 0
+    if (fs->variable_size && tag_ix < fs->tags_per_block)
+    {
+        res = slot_map_build(fs, block_ix);
+        ERR_RET(res);
+        if (tag_ix >= fs->slots.end)
+        {
+            // known to be free, no need to read
+            for (uint32_t i = 0; i < sizeof(tag_header_t); i++)
+                ((uint8_t *)t)[i] = (uint8_t)CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
+            return 0;
+        }
+        if (!slot_starts_entry(fs, tag_ix))
+        {
+            t->state = TAG_CONT;
+            t->id = 0;
+            t->len = 0;
+            return 0;
+        }
+    }
+#endif
+    res = tag_scan_raw_hdr_in_block(fs, block_ix, tag_ix, t);
+    ERR_RET(res);
+    if (t->state == TAG_FREE || t->state == TAG_WRITTEN || t->state == TAG_DELETED)
+        return res;
+    return tag_resolve_batch(fs, block_ix, tag_ix, t);
+}
+
+// first program unit of an entry, holding state, len and id
+static uint32_t tag_commit_size(nvmtnvj_t *fs)
+{
+    return fs->write_alignment > CONFIG_NVMTNVJ_FLASH_WORD_SIZE ? fs->write_alignment
+                                                                : CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
 }
 
-static int tag_write(uint32_t block_ix, uint32_t tag_ix, uint16_t tag_id, tag_state_t state, const uint8_t *data,
-                     uint8_t len)
+// Tag header and value are assembled in a word aligned staging buffer. All after
+// the first program unit is programmed in one go, then the first unit, so the
+// state is committed last. A torn write leaves a free slot, see tag_spend_torn.
+static int tag_write(nvmtnvj_t *fs, uint32_t block_ix, uint32_t tag_ix, uint16_t tag_id, tag_state_t state,
+                     const uint8_t *data, uint8_t len)
 {
-    if (len > sys.max_value_size)
-        len = sys.max_value_size;
+    if (len > fs->max_value_size)
+        len = fs->max_value_size;
     tag_header_t thdr = {
         .id = tag_id,
         .len = len,
         .state = state,
         .chk = chk(data, len)};
-    return block_write_data_concat(block_ix, ALIGNW(sizeof(block_header_t)) + tag_ix * tag_size(),
-                                   (const uint8_t *)&thdr, sizeof(tag_header_t), data, len);
+    word_t staging[tag_size(fs) / CONFIG_NVMTNVJ_FLASH_WORD_SIZE];
+    uint32_t prog_len = ALIGNW(sizeof(tag_header_t) + len);
+    if (fs->write_alignment > CONFIG_NVMTNVJ_FLASH_WORD_SIZE)
+    {
+        prog_len = (prog_len + fs->write_alignment - 1) / fs->write_alignment * fs->write_alignment;
+        if (prog_len > tag_slots(fs, len) * slot_size(fs))
+            prog_len = tag_slots(fs, len) * slot_size(fs);
+    }
+    for (uint32_t w = 0; w < prog_len / CONFIG_NVMTNVJ_FLASH_WORD_SIZE; w++)
+        staging[w] = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
+    _memcpy(staging, &thdr, sizeof(tag_header_t));
+    if (len > 0)
+        _memcpy((uint8_t *)staging + sizeof(tag_header_t), data, len);
+    const uint32_t commit_len = tag_commit_size(fs);
+    if (prog_len > commit_len)
+    {
+        int res = block_write(fs, block_ix, tag_offset(fs, tag_ix) + commit_len,
+                              (const uint8_t *)staging + commit_len, prog_len - commit_len);
+        ERR_RET(res);
+        prog_len = commit_len;
+    }
+    return block_write(fs, block_ix, tag_offset(fs, tag_ix), (const uint8_t *)staging, prog_len);
+}
+
+// A write cut before its first program unit leaves a free slot with the rest of the
+// entry programmed. Such a slot must not be programmed again, it is spent with a
+// never live marker and tag_ix moved past it.
+static int tag_spend_torn(nvmtnvj_t *fs, uint32_t block_ix, uint32_t *tag_ix)
+{
+    if (block_ix == UNDEF_IX || *tag_ix >= fs->tags_per_block)
+        return 0;
+    const uint32_t commit_len = tag_commit_size(fs);
+    uint32_t span = tag_slots(fs, fs->max_value_size) * slot_size(fs);
+    if (span > (fs->tags_per_block - *tag_ix) * slot_size(fs))
+        span = (fs->tags_per_block - *tag_ix) * slot_size(fs);
+    if (span <= commit_len)
+        return 0;
+    uint8_t buf[span - commit_len];
+    int res = block_read(fs, block_ix, tag_offset(fs, *tag_ix) + commit_len, buf, sizeof(buf));
+    ERR_RET(res);
+    uint32_t i = 0;
+    while (i < sizeof(buf) && buf[i] == (uint8_t)CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
+        i++;
+    if (i == sizeof(buf))
+        return 0;
+    _dbg("torn write in block %d at tag %d, spent\n", block_ix, *tag_ix);
+    // id 0 never commits a batch run before it, see nvmtnvj_ctx_batch_begin
+    tag_header_t thdr = {
+        .id = 0,
+        .len = fs->variable_size ? fs->max_value_size : 0,
+        .state = TAG_BATCH_COMMIT,
+        .chk = (uint8_t)CONFIG_NVMTNVJ_FLASH_WORD_ERASED};
+    word_t staging[commit_len / CONFIG_NVMTNVJ_FLASH_WORD_SIZE];
+    for (uint32_t w = 0; w < commit_len / CONFIG_NVMTNVJ_FLASH_WORD_SIZE; w++)
+        staging[w] = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
+    _memcpy(staging, &thdr, commit_len < sizeof(tag_header_t) ? commit_len : sizeof(tag_header_t));
+    res = block_write(fs, block_ix, tag_offset(fs, *tag_ix), (const uint8_t *)staging, commit_len);
+    ERR_RET(res);
+    account_void(fs, block_ix);
+    *tag_ix = tag_next_ix(fs, &thdr, *tag_ix);
+    if (*tag_ix > fs->tags_per_block)
+        *tag_ix = fs->tags_per_block;
+    return 0;
 }
 
-static int tag_find_next_free_in_block(uint32_t block_ix, uint32_t *tag_ix)
+static int tag_find_next_free_in_block(nvmtnvj_t *fs, uint32_t block_ix, uint32_t *tag_ix)
 {
-    for (uint32_t tix = 0; tix < sys.tags_per_block; tix++)
+    for (uint32_t tix = 0; tix < fs->tags_per_block; tix++)
     {
         tag_header_t thdr;
-        int res = tag_read_hdr_in_block(block_ix, tix, &thdr);
+        int res = tag_scan_hdr_in_block(fs, block_ix, tix, &thdr);
         ERR_RET(res);
         if (thdr.state == TAG_FREE)
         {
@@ -568,11 +1771,10 @@ static int tag_find_next_free_in_block(uint32_t block_ix, uint32_t *tag_ix)
     return ERR_NVMTNVJ_NOENT;
 }
 
-static int tag_read(const tag_header_t *thdr, uint32_t block_ix, uint32_t tag_ix, uint8_t *dst)
+static int tag_read(nvmtnvj_t *fs, const tag_header_t *thdr, uint32_t block_ix, uint32_t tag_ix, uint8_t *dst)
 {
-    uint8_t len = thdr->len > sys.max_value_size ? sys.max_value_size : thdr->len;
-    int res = block_read(block_ix,
-                         ALIGNW(sizeof(block_header_t)) + tag_ix * tag_size() + sizeof(tag_header_t), dst, len);
+    uint8_t len = thdr->len > fs->max_value_size ? fs->max_value_size : thdr->len;
+    int res = block_read(fs, block_ix, tag_offset(fs, tag_ix) + sizeof(tag_header_t), dst, len);
     ERR_RET(res);
     if (chk(dst, len) != thdr->chk)
     {
@@ -582,86 +1784,325 @@ static int tag_read(const tag_header_t *thdr, uint32_t block_ix, uint32_t tag_ix
     return len;
 }
 
-static int tag_find_and_read(uint16_t tag_id, uint8_t *dst)
+// Points to value of tag in memory mapped flash, without copying. Values spanning
+// two sectors are only mapped if the sectors are adjacent in memory.
+static int tag_map(nvmtnvj_t *fs, const tag_header_t *thdr, uint32_t block_ix, uint32_t tag_ix, const uint8_t **ptr)
+{
+    uint8_t len = thdr->len > fs->max_value_size ? fs->max_value_size : thdr->len;
+    uint32_t offset = tag_offset(fs, tag_ix) + sizeof(tag_header_t);
+    uint32_t sector = fs->starting_sector + fs->sectors_per_block * block_ix + offset / fs->sector_size;
+    offset %= fs->sector_size;
+    void *addr;
+    if (fs->flash->get_address_for_sector == NULL || fs->flash->get_address_for_sector(sector, &addr) < 0)
+        return ERR_NVMTNVJ_NOMAP;
+    if (offset + len > fs->sector_size)
+    {
+        void *next_addr;
+        if (fs->flash->get_address_for_sector(sector + 1, &next_addr) < 0 ||
+            (uint8_t *)next_addr != (uint8_t *)addr + fs->sector_size)
+            return ERR_NVMTNVJ_NOMAP;
+    }
+    const uint8_t *p = (const uint8_t *)addr + offset;
+    if (chk(p, len) != thdr->chk)
+    {
+        _dbg("aborted tag write, id %04x, len %d, chk %02x != %02x\n", thdr->id, len, chk(p, len), thdr->chk);
+        return ERR_INTERNAL_ABORTED;
+    }
+    *ptr = p;
+    return len;
+}
+
+// reads value to dst, or maps it if dst is NULL
+static int tag_get(nvmtnvj_t *fs, const tag_header_t *thdr, uint32_t block_ix, uint32_t tag_ix, uint8_t *dst,
+                   const uint8_t **ptr)
+{
+    if (dst == NULL)
+        return tag_map(fs, thdr, block_ix, tag_ix, ptr);
+    return tag_read(fs, thdr, block_ix, tag_ix, dst);
+}
+
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+static void index_clear(nvmtnvj_t *fs)
+{
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_TAG_INDEX_SIZE; i++)
+        fs->index.entries[i].state = TAG_FREE;
+    fs->index.valid = false;
+    fs->index.complete = true;
+    fs->stats.live = 0;
+}
+
+// updates index entry, keeping count of live tags
+static void index_set(nvmtnvj_t *fs, tag_index_entry_t *e, tag_state_t state, uint32_t block_ix, uint32_t tag_ix)
+{
+    fs->stats.live += (state == TAG_WRITTEN) - (e->state == TAG_WRITTEN);
+    e->state = state;
+    e->block_ix = (uint16_t)block_ix;
+    e->tag_ix = (uint16_t)tag_ix;
+}
+
+// open addressing, linear probing. Entries are never removed, only updated.
+static tag_index_entry_t *index_find(nvmtnvj_t *fs, uint16_t tag_id, bool insert)
+{
+    uint32_t ix = ((uint32_t)tag_id * 40503u) % CONFIG_NVMTNVJ_TAG_INDEX_SIZE;
+    for (uint32_t probes = 0; probes < CONFIG_NVMTNVJ_TAG_INDEX_SIZE; probes++)
+    {
+        tag_index_entry_t *e = &fs->index.entries[ix];
+        if (e->state == TAG_FREE)
+        {
+            if (!insert)
+                return NULL;
+            e->id = tag_id;
+            return e;
+        }
+        if (e->id == tag_id)
+            return e;
+        if (++ix >= CONFIG_NVMTNVJ_TAG_INDEX_SIZE)
+            ix = 0;
+    }
+    if (insert)
+        fs->index.complete = false; // out of ram, lookups of unindexed tags must scan
+    return NULL;
+}
+
+// registers a newly appended tag entry, superseding any earlier entry
+static void index_add(nvmtnvj_t *fs, uint16_t tag_id, tag_state_t state, uint32_t block_ix, uint32_t tag_ix)
+{
+    if (!fs->index.valid)
+        return;
+    account_used(fs, block_ix);
+    tag_index_entry_t *e = index_find(fs, tag_id, true);
+    if (e == NULL)
+        return;
+    if (e->state != TAG_FREE && e->block_ix != INDEX_NO_BLOCK)
+        account_freeable(fs, e->block_ix);
+    index_set(fs, e, state, block_ix, tag_ix);
+}
+
+// moves index entry referring to given source location to new location, or
+// detaches it from flash if new block is INDEX_NO_BLOCK
+static void index_relocate(nvmtnvj_t *fs, uint16_t tag_id, uint32_t block_ix_src, uint32_t tag_ix_src,
+                           uint32_t block_ix_dst, uint32_t tag_ix_dst)
+{
+    if (!fs->index.valid)
+        return;
+    tag_index_entry_t *e = index_find(fs, tag_id, false);
+    if (e == NULL || e->block_ix != block_ix_src || e->tag_ix != tag_ix_src)
+        return;
+    e->block_ix = (uint16_t)block_ix_dst;
+    e->tag_ix = (uint16_t)tag_ix_dst;
+}
+
+// Builds index in one pass, traversing from most recent tag entry to the oldest.
+// First valid entry found for each id is the live one.
+static int index_build(nvmtnvj_t *fs)
 {
     int res;
-    uint8_t blocks_left = sys.nbr_of_blocks - 1;
-    block_header_t bhdr;
-    uint32_t cur_block_ix = sys.current_block_ix;
+    index_clear(fs);
+    account_clear(fs);
+    uint32_t blocks_left = fs->nbr_of_blocks - 1;
+    uint8_t tmp_buf[fs->max_value_size];
+    uint32_t cur_block_ix = fs->current_block_ix;
     while (blocks_left > 0) // safe-guard
     {
-        res = block_read_hdr(cur_block_ix, &bhdr);
-        ERR_RET(res);
-        for (uint32_t t = 0; t < sys.tags_per_block; t++)
+        for (uint32_t t = 0; t < fs->tags_per_block; t++)
         {
             tag_header_t thdr;
-            uint32_t tag_ix = sys.tags_per_block - 1 - t;
-            res = tag_read_hdr_in_block(cur_block_ix, tag_ix, &thdr);
+            uint32_t tag_ix = fs->tags_per_block - 1 - t;
+            res = tag_scan_hdr_in_block(fs, cur_block_ix, tag_ix, &thdr);
             ERR_RET(res);
-            if (thdr.state == TAG_FREE)
+            if (thdr.state == TAG_FREE || thdr.state == TAG_CONT)
                 continue;
-            if (thdr.id != tag_id)
+            account_used(fs, cur_block_ix);
+            if (thdr.state != TAG_WRITTEN && thdr.state != TAG_DELETED)
+            {
+                account_freeable(fs, cur_block_ix);
                 continue;
-            if (thdr.state == TAG_DELETED)
-                return ERR_NVMTNVJ_NOENT;
-            res = tag_read(&thdr, cur_block_ix, tag_ix, dst);
-            ERR_RET(res);
-            if (res == ERR_INTERNAL_ABORTED)
+            }
+            tag_index_entry_t *e = index_find(fs, thdr.id, true);
+            if (e == NULL)
+                continue; // not indexable
+            if (e->state != TAG_FREE)
+            {
+                account_freeable(fs, cur_block_ix); // already found more recent
                 continue;
-            return res;
+            }
+            if (thdr.state == TAG_WRITTEN)
+            {
+                res = tag_read(fs, &thdr, cur_block_ix, tag_ix, tmp_buf);
+                ERR_RET(res);
+                if (res == ERR_INTERNAL_ABORTED)
+                {
+                    account_freeable(fs, cur_block_ix);
+                    continue;
+                }
+            }
+            index_set(fs, e, thdr.state, cur_block_ix, tag_ix);
         }
 
         uint32_t prev_block_ix;
-        res = block_find_prev(bhdr.seq_nbr, &prev_block_ix, NULL);
+        res = block_find_older(fs, cur_block_ix, &prev_block_ix);
+        if (res == ERR_NVMTNVJ_NOENT)
+            break;
         ERR_RET(res);
         cur_block_ix = prev_block_ix;
         blocks_left--;
     }
-    return ERR_NVMTNVJ_NOENT;
+    fs->index.valid = true;
+    _dbg("index built, %s\n", fs->index.complete ? "complete" : "incomplete");
+    return 0;
 }
+#else
+#define index_add(fs, tag_id, state, block_ix, tag_ix) \
+    do                                                 \
+    {                                                  \
+    } while (0)
+#define index_relocate(fs, tag_id, block_ix_src, tag_ix_src, block_ix_dst, tag_ix_dst) \
+    do                                                                                 \
+    {                                                                                  \
+    } while (0)
+#endif
 
-// Sorts blocks in historical order, newest first. O(n²) n=nbr_of_blocks
-// Only Data and Evicting (when present, during fixing) blocks are included.
-static int blocks_sort(sorted_blocks_t *sorted_blocks)
+// finds most recent value of tag, and reads it to dst or maps it to ptr if dst is NULL
+static int tag_find_and_read(nvmtnvj_t *fs, uint16_t tag_id, uint8_t *dst, const uint8_t **ptr)
 {
-    for (uint32_t i = 0; i < sys.nbr_of_blocks; i++)
-        sorted_blocks->blocks[i] = UNDEF_IX;
-    // pick newest seed among current DATA and EVICTING (if any)
-    uint32_t seed_block = sys.current_block_ix;
-    word_t seed_seq = sys.max_seq_nbr;
-    if (sys.evict_block_ix != UNDEF_IX)
+    int res;
+    fs->stats.lookups++;
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    if (fs->index.valid)
     {
-        block_header_t bhdr;
-        int r = block_read_hdr(sys.evict_block_ix, &bhdr);
+        const tag_index_entry_t *e = index_find(fs, tag_id, false);
+        if (e == NULL && fs->index.complete)
+            return ERR_NVMTNVJ_NOENT;
+        if (e != NULL && e->state == TAG_DELETED)
+            return ERR_NVMTNVJ_NOENT;
+        if (e != NULL)
+        {
+            tag_header_t thdr;
+            fs->stats.lookup_blocks++;
+            res = tag_read_hdr_in_block(fs, e->block_ix, e->tag_ix, &thdr);
+            ERR_RET(res);
+            res = tag_get(fs, &thdr, e->block_ix, e->tag_ix, dst, ptr);
+            ERR_RET(res);
+            if (res != ERR_INTERNAL_ABORTED)
+                return res;
+            // index is stale, should not happen - do it the hard way
+        }
+    }
+#endif
+    uint32_t blocks_left = fs->nbr_of_blocks - 1;
+    uint32_t cur_block_ix = fs->current_block_ix;
+    while (blocks_left > 0) // safe-guard
+    {
+        fs->stats.lookup_blocks++;
+        for (uint32_t t = 0; t < fs->tags_per_block; t++)
+        {
+            tag_header_t thdr;
+            uint32_t tag_ix = fs->tags_per_block - 1 - t;
+            res = tag_scan_hdr_in_block(fs, cur_block_ix, tag_ix, &thdr);
+            ERR_RET(res);
+            if (thdr.state != TAG_WRITTEN && thdr.state != TAG_DELETED)
+                continue;
+            if (thdr.id != tag_id)
+                continue;
+            if (thdr.state == TAG_DELETED)
+                return ERR_NVMTNVJ_NOENT;
+            res = tag_get(fs, &thdr, cur_block_ix, tag_ix, dst, ptr);
+            ERR_RET(res);
+            if (res == ERR_INTERNAL_ABORTED)
+                continue;
+            return res;
+        }
+
+        uint32_t prev_block_ix;
+        res = block_find_older(fs, cur_block_ix, &prev_block_ix);
+        ERR_RET(res);
+        cur_block_ix = prev_block_ix;
+        blocks_left--;
+    }
+    return ERR_NVMTNVJ_NOENT;
+}
+
+static bool sorted_blocks_before(void *ctx, uint32_t a, uint32_t b)
+{
+    const sorted_blocks_t *sorted_blocks = ctx;
+    const word_t seq_a = sorted_blocks->seq_nbrs[a];
+    const word_t seq_b = sorted_blocks->seq_nbrs[b];
+    return seq_a != seq_b && seq_nbr_is_newer(seq_a, seq_b);
+}
+
+static void sorted_blocks_swap(void *ctx, uint32_t a, uint32_t b)
+{
+    sorted_blocks_t *sorted_blocks = ctx;
+    const uint32_t block_ix = sorted_blocks->blocks[a];
+    const word_t seq_nbr = sorted_blocks->seq_nbrs[a];
+    sorted_blocks->blocks[a] = sorted_blocks->blocks[b];
+    sorted_blocks->seq_nbrs[a] = sorted_blocks->seq_nbrs[b];
+    sorted_blocks->blocks[b] = block_ix;
+    sorted_blocks->seq_nbrs[b] = seq_nbr;
+}
+
+// Sorts blocks in historical order, newest first. Reads each block header once
+// and sorts in ram, O(n log n) n=nbr_of_blocks. No reads if headers are cached.
+// Only Data and Evicting (when present, during fixing) blocks are included.
+static int blocks_sort(nvmtnvj_t *fs, sorted_blocks_t *sorted_blocks)
+{
+    for (uint32_t i = 0; i < fs->nbr_of_blocks; i++)
+        sorted_blocks->blocks[i] = UNDEF_IX;
+    // pick newest seed among current DATA and EVICTING (if any)
+    uint32_t seed_block = fs->current_block_ix;
+    word_t seed_seq = fs->max_seq_nbr;
+    if (fs->evict_block_ix != UNDEF_IX)
+    {
+        block_type_t btype;
+        word_t seq_nbr;
+        int r = block_read_state(fs, fs->evict_block_ix, &btype, &seq_nbr);
         ERR_RET(r);
-        if (block_type(&bhdr) == BLOCK_TYPE_EVICTING &&
-            seq_nbr_is_newer(bhdr.seq_nbr, seed_seq))
+        if (btype == BLOCK_TYPE_EVICTING && seq_nbr_is_newer(seq_nbr, seed_seq))
         {
-            seed_block = sys.evict_block_ix;
-            seed_seq = bhdr.seq_nbr;
+            seed_block = fs->evict_block_ix;
+            seed_seq = seq_nbr;
         }
     }
-    sorted_blocks->blocks[0] = seed_block;
-    sorted_blocks->seq_nbrs[0] = seed_seq;
-    sorted_blocks->count = 1;
-    word_t cur_seq_nbr = seed_seq;
-    while (sorted_blocks->count < sys.nbr_of_blocks)
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (block_cache_enabled(fs))
     {
-        word_t prev_seq_nbr;
-        int res = block_find_prev(cur_seq_nbr,
-                                  &sorted_blocks->blocks[sorted_blocks->count], &prev_seq_nbr);
-        if (res == ERR_NVMTNVJ_NOENT)
-            break;
+        int res = block_chain_get(fs);
+        ERR_RET(res);
+        sorted_blocks->count = 0;
+        for (uint32_t i = 0; i < fs->chain.count; i++)
+        {
+            const uint32_t b = fs->chain.blocks[i];
+            const word_t seq_nbr = fs->block_info[b].seq_nbr;
+            if (b != seed_block && seq_nbr_is_newer(seq_nbr, seed_seq))
+                continue;
+            sorted_blocks->blocks[sorted_blocks->count] = b;
+            sorted_blocks->seq_nbrs[sorted_blocks->count] = seq_nbr;
+            sorted_blocks->count++;
+        }
+        return 0;
+    }
+#endif
+    sorted_blocks->count = 0;
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
+    {
+        block_type_t btype;
+        word_t seq_nbr;
+        int res = block_read_state(fs, b, &btype, &seq_nbr);
         ERR_RET(res);
-        cur_seq_nbr = prev_seq_nbr;
-        sorted_blocks->seq_nbrs[sorted_blocks->count] = cur_seq_nbr;
+        if (btype != BLOCK_TYPE_DATA && btype != BLOCK_TYPE_EVICTING)
+            continue;
+        if (b != seed_block && seq_nbr_is_newer(seq_nbr, seed_seq))
+            continue;
+        sorted_blocks->blocks[sorted_blocks->count] = b;
+        sorted_blocks->seq_nbrs[sorted_blocks->count] = seq_nbr;
         sorted_blocks->count++;
     }
+    heap_sort(sorted_blocks, sorted_blocks_before, sorted_blocks_swap, sorted_blocks->count);
     return 0;
 }
 
 // figures out live tags within the same block
-static int block_map_live_tags(uint32_t sorted_block_ix, const sorted_blocks_t *sorted_blocks,
+static int block_map_live_tags(nvmtnvj_t *fs, uint32_t sorted_block_ix, const sorted_blocks_t *sorted_blocks,
                                tag_evict_info_t *tag_info)
 {
     int res = 0;
@@ -670,14 +2111,14 @@ static int block_map_live_tags(uint32_t sorted_block_ix, const sorted_blocks_t *
     tag_header_t thdr;
 
     // read out id:s and states
-    for (uint32_t tag_ix = 0; tag_ix < sys.tags_per_block; tag_ix++)
+    for (uint32_t tag_ix = 0; tag_ix < fs->tags_per_block; tag_ix++)
     {
         if (rest_is_free)
         {
             tag_info[tag_ix].status = TI_FREE;
             continue;
         }
-        res = tag_read_hdr_in_block(cur_block_ix, tag_ix, &thdr);
+        res = tag_scan_hdr_in_block(fs, cur_block_ix, tag_ix, &thdr);
         ERR_RET(res);
         tag_info[tag_ix].id = thdr.id;
         switch (thdr.state)
@@ -692,22 +2133,28 @@ static int block_map_live_tags(uint32_t sorted_block_ix, const sorted_blocks_t *
         case TAG_WRITTEN:
             tag_info[tag_ix].status = TI_WRITTEN;
             break;
+        case TAG_VOID:
+            tag_info[tag_ix].status = TI_FREEABLE;
+            break;
+        case TAG_CONT:
+            tag_info[tag_ix].status = TI_FREE;
+            break;
         default:
             return ERR_NVMTNVJ_FATAL;
         }
     }
 
     // mark old duplicate ids in same block as freeable, if deleted or truly written
-    uint8_t tmp_buf[sys.max_value_size];
-    for (uint32_t t = 0; t < sys.tags_per_block; t++)
+    uint8_t tmp_buf[fs->max_value_size];
+    for (uint32_t t = 0; t < fs->tags_per_block; t++)
     {
-        uint32_t tag_ix = sys.tags_per_block - 1 - t;
+        uint32_t tag_ix = fs->tags_per_block - 1 - t;
         if (tag_info[tag_ix].status == TI_WRITTEN)
         {
             // if aborted written tag, mark FREEABLE directly
-            res = tag_read_hdr_in_block(cur_block_ix, tag_ix, &thdr);
+            res = tag_scan_hdr_in_block(fs, cur_block_ix, tag_ix, &thdr);
             ERR_RET(res);
-            res = tag_read(&thdr, cur_block_ix, tag_ix, tmp_buf);
+            res = tag_read(fs, &thdr, cur_block_ix, tag_ix, tmp_buf);
             ERR_RET(res);
             if (res == ERR_INTERNAL_ABORTED)
                 tag_info[tag_ix].status = TI_FREEABLE;
@@ -721,7 +2168,7 @@ static int block_map_live_tags(uint32_t sorted_block_ix, const sorted_blocks_t *
         // tag is defined in this block, mark all previous with same id as freeable
         for (uint32_t t2 = 0; t2 < tag_ix; t2++)
         {
-            if (tag_info[t2].id == tag_info[tag_ix].id)
+            if (tag_info[t2].status != TI_FREE && tag_info[t2].id == tag_info[tag_ix].id)
                 tag_info[t2].status = TI_FREEABLE;
         }
     }
@@ -729,8 +2176,8 @@ static int block_map_live_tags(uint32_t sorted_block_ix, const sorted_blocks_t *
 }
 
 // returns 1 if a tag is defined later in another block, 0 if not, and negative if error
-static int block_is_tag_defined_later(uint32_t current_sorted_block_ix, const sorted_blocks_t *sorted_blocks,
-                                      uint16_t tag_id)
+static int block_is_tag_defined_later(nvmtnvj_t *fs, uint32_t current_sorted_block_ix,
+                                      const sorted_blocks_t *sorted_blocks, uint16_t tag_id)
 {
     int res;
     if (current_sorted_block_ix == 0)
@@ -739,19 +2186,19 @@ static int block_is_tag_defined_later(uint32_t current_sorted_block_ix, const so
     for (uint32_t sorted_block_ix = 0; sorted_block_ix < current_sorted_block_ix; sorted_block_ix++)
     {
         uint32_t block_ix = sorted_blocks->blocks[sorted_block_ix];
-        uint8_t tmp_buf[sys.max_value_size];
-        for (uint32_t t = 0; t < sys.tags_per_block; t++)
+        uint8_t tmp_buf[fs->max_value_size];
+        for (uint32_t t = 0; t < fs->tags_per_block; t++)
         {
-            uint32_t tag_ix = sys.tags_per_block - 1 - t;
+            uint32_t tag_ix = fs->tags_per_block - 1 - t;
             tag_header_t thdr;
-            res = tag_read_hdr_in_block(block_ix, tag_ix, &thdr);
+            res = tag_scan_hdr_in_block(fs, block_ix, tag_ix, &thdr);
             ERR_RET(res);
             if (thdr.state == TAG_DELETED && thdr.id == tag_id)
                 return 1;
             if (thdr.state == TAG_WRITTEN && thdr.id == tag_id)
             {
                 // check tag is not aborted, ignore if so
-                res = tag_read(&thdr, block_ix, tag_ix, tmp_buf);
+                res = tag_read(fs, &thdr, block_ix, tag_ix, tmp_buf);
                 ERR_RET(res);
                 if (res != ERR_INTERNAL_ABORTED)
                     return 1;
@@ -762,8 +2209,8 @@ static int block_is_tag_defined_later(uint32_t current_sorted_block_ix, const so
 }
 
 // returns 1 if a tag is written earlier in another block, 0 if not, and negative if error
-static int block_is_tag_written_earlier(uint32_t current_sorted_block_ix, const sorted_blocks_t *sorted_blocks,
-                                        uint16_t tag_id)
+static int block_is_tag_written_earlier(nvmtnvj_t *fs, uint32_t current_sorted_block_ix,
+                                        const sorted_blocks_t *sorted_blocks, uint16_t tag_id)
 {
     int res;
     if (current_sorted_block_ix >= sorted_blocks->count - 1)
@@ -772,17 +2219,17 @@ static int block_is_tag_written_earlier(uint32_t current_sorted_block_ix, const
     for (uint32_t sorted_block_ix = current_sorted_block_ix + 1; sorted_block_ix < sorted_blocks->count; sorted_block_ix++)
     {
         uint32_t block_ix = sorted_blocks->blocks[sorted_block_ix];
-        uint8_t tmp_buf[sys.max_value_size];
-        for (uint32_t t = 0; t < sys.tags_per_block; t++)
+        uint8_t tmp_buf[fs->max_value_size];
+        for (uint32_t t = 0; t < fs->tags_per_block; t++)
         {
-            uint32_t tag_ix = sys.tags_per_block - 1 - t;
+            uint32_t tag_ix = fs->tags_per_block - 1 - t;
             tag_header_t thdr;
-            res = tag_read_hdr_in_block(block_ix, tag_ix, &thdr);
+            res = tag_scan_hdr_in_block(fs, block_ix, tag_ix, &thdr);
             ERR_RET(res);
             if (thdr.state == TAG_WRITTEN && thdr.id == tag_id)
             {
                 // check tag is not aborted, ignore if so
-                res = tag_read(&thdr, block_ix, tag_ix, tmp_buf);
+                res = tag_read(fs, &thdr, block_ix, tag_ix, tmp_buf);
                 ERR_RET(res);
                 if (res != ERR_INTERNAL_ABORTED)
                     return 1;
@@ -792,19 +2239,36 @@ static int block_is_tag_written_earlier(uint32_t current_sorted_block_ix, const
     return 0;
 }
 
-static int block_find_freeables(uint32_t sorted_block_ix, const sorted_blocks_t *sorted_blocks,
+// returns 1 if given live tag entry is redefined in a more recent block, 0 if not,
+// and negative if error
+static int tag_is_defined_later(nvmtnvj_t *fs, uint32_t sorted_block_ix, const sorted_blocks_t *sorted_blocks,
+                                uint32_t tag_ix, uint16_t tag_id)
+{
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    if (fs->index.valid)
+    {
+        // index always refers to the most recent entry
+        const tag_index_entry_t *e = index_find(fs, tag_id, false);
+        if (e != NULL)
+            return (e->block_ix != sorted_blocks->blocks[sorted_block_ix] || e->tag_ix != tag_ix) ? 1 : 0;
+    }
+#endif
+    return block_is_tag_defined_later(fs, sorted_block_ix, sorted_blocks, tag_id);
+}
+
+static int block_find_freeables(nvmtnvj_t *fs, uint32_t sorted_block_ix, const sorted_blocks_t *sorted_blocks,
                                 tag_evict_info_t *tag_info)
 {
     // find live tags internally in same block
-    int res = block_map_live_tags(sorted_block_ix, sorted_blocks, tag_info);
+    int res = block_map_live_tags(fs, sorted_block_ix, sorted_blocks, tag_info);
     ERR_RET(res);
     // find live tags when looking externally at other blocks
-    for (uint32_t t = 0; t < sys.tags_per_block; t++)
+    for (uint32_t t = 0; t < fs->tags_per_block; t++)
     {
         if (tag_info[t].status == TI_LIVE_DELETED || tag_info[t].status == TI_LIVE_WRITTEN)
         {
             // if defined later, this tag info is old - freeable
-            res = block_is_tag_defined_later(sorted_block_ix, sorted_blocks, tag_info[t].id);
+            res = tag_is_defined_later(fs, sorted_block_ix, sorted_blocks, t, tag_info[t].id);
             ERR_RET(res);
             if (res > 0)
                 tag_info[t].status = TI_FREEABLE;
@@ -813,7 +2277,7 @@ static int block_find_freeables(uint32_t sorted_block_ix, const sorted_blocks_t
         {
             // we can only free a live deleted tag in this block iff it is not defined as
             // written in any earlier block - lest it would reappear upon freeing this block
-            res = block_is_tag_written_earlier(sorted_block_ix, sorted_blocks, tag_info[t].id);
+            res = block_is_tag_written_earlier(fs, sorted_block_ix, sorted_blocks, tag_info[t].id);
             ERR_RET(res);
             if (res == 0)
                 tag_info[t].status = TI_FREEABLE;
@@ -823,247 +2287,1526 @@ static int block_find_freeables(uint32_t sorted_block_ix, const sorted_blocks_t
     return res;
 }
 
-static int block_find_evict_candidate(uint32_t *cand_block_ix, tag_evict_info_t *cand_tag_info)
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+// with fewer blocks, two heads leave too little for gc to choose from
+#define HOT_COLD_MIN_BLOCKS 6
+// blocks of cold tags are old with few freeable, so weigh age less
+#define HOT_COLD_AGE_DIV 4
+
+static bool head_active(nvmtnvj_t *fs)
+{
+#if NVMTNVJ_TEST
+    if (!fs->head.enabled)
+        return false;
+#endif
+    return fs->nbr_of_blocks >= HOT_COLD_MIN_BLOCKS;
+}
+
+// free slots left behind in a closed head are as good as freeable
+static uint32_t head_stranded_slots(nvmtnvj_t *fs, uint32_t block_ix, uint32_t free_slots)
+{
+    if (!head_active(fs) || block_ix == fs->current_block_ix || block_ix == fs->head.block_ix)
+        return 0;
+    return free_slots;
+}
+#else
+#define HOT_COLD_AGE_DIV 1
+#define head_active(fs) false
+#define head_stranded_slots(fs, block_ix, free_slots) 0
+#endif
+
+// Erase count extrema over all blocks with a valid header. Legacy formats keep no
+// counts, and report all zero.
+static int blocks_wear(nvmtnvj_t *fs, word_t *min, word_t *max, uint64_t *sum, uint32_t *count)
+{
+    *min = (word_t)-1;
+    *max = 0;
+    if (sum)
+        *sum = 0;
+    if (count)
+        *count = 0;
+    for (uint32_t b = 0; fs->rev != HDR_REV_LEGACY && b < fs->nbr_of_blocks; b++)
+    {
+        block_type_t btype;
+        int res = block_read_state(fs, b, &btype, NULL);
+        ERR_RET(res);
+        if (btype == BLOCK_TYPE_UNKNOWN)
+            continue;
+        word_t erase_count;
+        res = block_read_erase_count(fs, b, &erase_count);
+        ERR_RET(res);
+        if (erase_count < *min)
+            *min = erase_count;
+        if (erase_count > *max)
+            *max = erase_count;
+        if (sum)
+            *sum += erase_count;
+        if (count)
+            (*count)++;
+    }
+    if (*min > *max)
+        *min = *max;
+    return 0;
+}
+
+// among equally good candidates, prefer the least worn
+static int block_wear_score(nvmtnvj_t *fs, uint32_t block_ix, word_t wear_min, word_t wear_max, uint32_t *score)
+{
+    *score = 0;
+    if (wear_max == wear_min)
+        return 0;
+    word_t erase_count;
+    int res = block_read_erase_count(fs, block_ix, &erase_count);
+    ERR_RET(res);
+    if (erase_count < wear_max)
+        *score = 0x40 * (wear_max - erase_count) / (wear_max - wear_min);
+    return 0;
+}
+
+static uint32_t block_evict_score(nvmtnvj_t *fs, const sorted_blocks_t *sorted_blocks, uint32_t sorted_block_ix,
+                                  uint32_t freeables, uint32_t wear_score)
+{
+    // calculate normalized candidate score
+    const word_t age_diff_max = seq_nbr_diff(fs->max_seq_nbr, fs->min_seq_nbr);
+    uint32_t age_score = 0;
+    if (age_diff_max > 0)
+    {
+        word_t age_diff = seq_nbr_diff(fs->max_seq_nbr, sorted_blocks->seq_nbrs[sorted_block_ix]);
+        if (age_diff > (uint32_t)(1 << 16)) // avoid overflow on age_score
+            age_score = 0x100;
+        else
+            age_score = 0x100 * age_diff / age_diff_max;
+    }
+    uint32_t freeable_score = 0x100 * freeables / fs->tags_per_block;
+    if (head_active(fs))
+        age_score /= HOT_COLD_AGE_DIV;
+    uint32_t score = freeables == 0 ? 0 : (freeable_score + age_score + wear_score);
+    _dbg("score [age:%d free:%d wear:%d]: %d\n", age_score, freeable_score, wear_score, score);
+    return score;
+}
+
+// finds live tags of given block
+static int block_map_for_evict(nvmtnvj_t *fs, uint32_t block_ix, tag_evict_info_t *tag_info)
+{
+    uint32_t sorted_block_list[WORK_VLA_LEN(fs, fs->nbr_of_blocks)];
+    word_t sorted_seq_nbr_list[WORK_VLA_LEN(fs, fs->nbr_of_blocks)];
+    sorted_blocks_t sorted_blocks = work_sorted_blocks(fs, sorted_block_list, sorted_seq_nbr_list);
+    int res = blocks_sort(fs, &sorted_blocks);
+    ERR_RET(res);
+    for (uint32_t b = 0; b < sorted_blocks.count; b++)
+    {
+        if (sorted_blocks.blocks[b] == block_ix)
+            return block_find_freeables(fs, b, &sorted_blocks, tag_info);
+    }
+    return ERR_NVMTNVJ_FATAL;
+}
+
+#if CONFIG_NVMTNVJ_WEAR_LEVEL_DELTA > 0
+// Static wear levelling. Blocks of tags never rewritten are never freeable, and
+// would otherwise never be erased. Every nbr_of_blocks gcs, if the least worn data
+// block lags the most worn by more than CONFIG_NVMTNVJ_WEAR_LEVEL_DELTA erases, it
+// is evicted regardless of score so that its erases go to a worn block instead.
+static int block_find_wear_level_candidate(nvmtnvj_t *fs, uint32_t exclude_block_ix,
+                                           const sorted_blocks_t *sorted_blocks, word_t wear_max,
+                                           uint32_t *cand_block_ix, tag_evict_info_t *cand_tag_info)
+{
+    fs->wear_levelled = false;
+    if (fs->rev == HDR_REV_LEGACY || ++fs->gcs_since_wear_level < fs->nbr_of_blocks)
+        return 0;
+    uint32_t cand_sorted_block_ix = UNDEF_IX;
+    word_t cand_erase_count = wear_max;
+    for (uint32_t i = 0; i < sorted_blocks->count; i++)
+    {
+        const uint32_t block_ix = sorted_blocks->blocks[i];
+        if (block_ix == exclude_block_ix || block_ix == fs->current_block_ix)
+            continue;
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+        if (block_ix == fs->head.block_ix)
+            continue;
+#endif
+        word_t erase_count;
+        int res = block_read_erase_count(fs, block_ix, &erase_count);
+        ERR_RET(res);
+        if (erase_count < cand_erase_count)
+        {
+            cand_erase_count = erase_count;
+            cand_sorted_block_ix = i;
+        }
+    }
+    if (cand_sorted_block_ix == UNDEF_IX || wear_max - cand_erase_count <= CONFIG_NVMTNVJ_WEAR_LEVEL_DELTA)
+        return 0;
+    _dbg("wear levelling block %d, erased %d, max %d\n", sorted_blocks->blocks[cand_sorted_block_ix],
+         cand_erase_count, wear_max);
+    fs->gcs_since_wear_level = 0;
+    fs->wear_levelled = true;
+    *cand_block_ix = sorted_blocks->blocks[cand_sorted_block_ix];
+    return block_find_freeables(fs, cand_sorted_block_ix, sorted_blocks, cand_tag_info);
+}
+#endif
+
+// finds best block to evict, never picking given excluded block
+static int block_find_evict_candidate(nvmtnvj_t *fs, uint32_t exclude_block_ix, uint32_t *cand_block_ix,
+                                      tag_evict_info_t *cand_tag_info)
 {
     int res;
     *cand_block_ix = UNDEF_IX;
     uint32_t cand_score = 0;
-    const word_t age_diff_max = seq_nbr_diff(sys.max_seq_nbr, sys.min_seq_nbr);
-    uint32_t sorted_block_list[sys.nbr_of_blocks];
-    word_t sorted_seq_nbr_list[sys.nbr_of_blocks];
-    sorted_blocks_t sorted_blocks = {
-        .blocks = sorted_block_list,
-        .seq_nbrs = sorted_seq_nbr_list,
-        .count = 0};
-    res = blocks_sort(&sorted_blocks);
+    uint32_t sorted_block_list[WORK_VLA_LEN(fs, fs->nbr_of_blocks)];
+    word_t sorted_seq_nbr_list[WORK_VLA_LEN(fs, fs->nbr_of_blocks)];
+    sorted_blocks_t sorted_blocks = work_sorted_blocks(fs, sorted_block_list, sorted_seq_nbr_list);
+    res = blocks_sort(fs, &sorted_blocks);
+    ERR_RET(res);
+    word_t wear_min, wear_max;
+    res = blocks_wear(fs, &wear_min, &wear_max, NULL, NULL);
     ERR_RET(res);
+#if CONFIG_NVMTNVJ_WEAR_LEVEL_DELTA > 0
+    res = block_find_wear_level_candidate(fs, exclude_block_ix, &sorted_blocks, wear_max, cand_block_ix,
+                                          cand_tag_info);
+    if (res < 0 || *cand_block_ix != UNDEF_IX)
+        return res;
+#endif
+
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0 && CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (accounting_valid(fs))
+    {
+        // score blocks by ram book keeping, only the winner needs to be mapped
+        uint32_t cand_sorted_block_ix = UNDEF_IX;
+        for (uint32_t i = 0; i < sorted_blocks.count; i++)
+        {
+            if (sorted_blocks.blocks[i] == exclude_block_ix)
+                continue;
+            _dbg("block %d\n", sorted_blocks.blocks[i]);
+            const block_info_t *info = &fs->block_info[sorted_blocks.blocks[i]];
+            uint32_t wear_score;
+            res = block_wear_score(fs, sorted_blocks.blocks[i], wear_min, wear_max, &wear_score);
+            ERR_RET(res);
+            uint32_t score = block_evict_score(fs, &sorted_blocks, i,
+                                               info->freeable + head_stranded_slots(fs, sorted_blocks.blocks[i],
+                                                                                    fs->tags_per_block - info->used),
+                                               wear_score);
+            if (score > cand_score)
+            {
+                cand_score = score;
+                cand_sorted_block_ix = i;
+            }
+        }
+        if (cand_sorted_block_ix != UNDEF_IX)
+        {
+            *cand_block_ix = sorted_blocks.blocks[cand_sorted_block_ix];
+            return block_find_freeables(fs, cand_sorted_block_ix, &sorted_blocks, cand_tag_info);
+        }
+        // deleted tags are not accounted as freeable, so when nothing else is
+        // freeable do the full scan to find out for sure
+    }
+#endif
 
     // for each block, check all tags within, count live and dead tags
     // O(n²) n=tags_per_block*nbr_of_blocks
     for (uint32_t i = 0; i < sorted_blocks.count; i++)
     {
+        if (sorted_blocks.blocks[i] == exclude_block_ix)
+            continue;
         _dbg("block %d\n", sorted_blocks.blocks[i]);
-        tag_evict_info_t tag_info[sys.tags_per_block];
-        res = block_find_freeables(i, &sorted_blocks, tag_info);
+        tag_evict_info_t tag_info_vla[WORK_VLA_LEN(fs, fs->tags_per_block)];
+        tag_evict_info_t *tag_info = work_tag_info(fs, WORK_TAG_INFO_SCAN, tag_info_vla);
+        res = block_find_freeables(fs, i, &sorted_blocks, tag_info);
         ERR_RET(res);
-        // calculate normalized candidate score
-        uint32_t age_score = 0;
-        if (age_diff_max > 0)
-        {
-            word_t age_diff = seq_nbr_diff(sys.max_seq_nbr, sorted_blocks.seq_nbrs[i]);
-            if (age_diff > (uint32_t)(1 << 16)) // avoid overflow on age_score
-                age_score = 0x100;
-            else
-                age_score = 0x100 * age_diff / age_diff_max;
-        }
         uint32_t freeables = 0;
-        for (uint32_t t = 0; t < sys.tags_per_block; t++)
+        uint32_t free_slots = 0;
+        for (uint32_t t = 0; t < fs->tags_per_block; t++)
         {
             if (tag_info[t].status == TI_FREEABLE)
                 freeables++;
+            else if (tag_info[t].status == TI_FREE)
+                free_slots++;
         }
-        uint32_t freeable_score = 0x100 * freeables / sys.tags_per_block;
-        uint32_t score = freeables == 0 ? 0 : (freeable_score + age_score);
-        _dbg("score [age:%d free:%d]: %d\n", age_score, freeable_score, score);
+        freeables += head_stranded_slots(fs, sorted_blocks.blocks[i], free_slots);
+        uint32_t wear_score;
+        res = block_wear_score(fs, sorted_blocks.blocks[i], wear_min, wear_max, &wear_score);
+        ERR_RET(res);
+        uint32_t score = block_evict_score(fs, &sorted_blocks, i, freeables, wear_score);
         if (score > cand_score)
         {
             cand_score = score;
             *cand_block_ix = sorted_blocks.blocks[i];
-            _memcpy(cand_tag_info, tag_info, sizeof(tag_info));
+            _memcpy(cand_tag_info, tag_info, fs->tags_per_block * sizeof(tag_evict_info_t));
+        }
+    }
+    return 0;
+}
+
+// copies a live tag from evicting block to spare block, returns the value length
+static int tag_copy(nvmtnvj_t *fs, uint32_t block_ix_src, uint32_t tag_ix_src, const tag_evict_info_t *info,
+                    uint32_t block_ix_dst, uint32_t tag_ix_dst)
+{
+    int res;
+    if (info->status == TI_LIVE_DELETED)
+    {
+        _dbg("evicting tag %d as DELETED\n", info->id);
+        res = tag_write(fs, block_ix_dst, tag_ix_dst, info->id, TAG_DELETED, NULL, 0);
+        return res < 0 ? res : 0;
+    }
+    tag_header_t thdr;
+    uint8_t data[fs->max_value_size];
+    res = tag_read_hdr_in_block(fs, block_ix_src, tag_ix_src, &thdr);
+    ERR_RET(res);
+    uint8_t len = thdr.len > fs->max_value_size ? fs->max_value_size : thdr.len;
+    _dbg("evicting tag %d as WRITTEN len %d\n", info->id, len);
+    res = block_read(fs, block_ix_src, tag_offset(fs, tag_ix_src) + sizeof(tag_header_t), data, len);
+    ERR_RET(res);
+    res = tag_write(fs, block_ix_dst, tag_ix_dst, info->id, TAG_WRITTEN, data, len);
+    return res < 0 ? res : len;
+}
+
+// called when block with given seq_nbr is erased
+static int seq_nbr_refresh_min(nvmtnvj_t *fs, word_t erased_seq_nbr)
+{
+    if (fs->min_seq_nbr != erased_seq_nbr)
+        return 0;
+    // just erased the minimum seq_nbr, dig out new minimum from all blocks
+    fs->min_seq_nbr = fs->max_seq_nbr;
+    word_t max_diff = 0;
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
+    {
+        block_type_t btype;
+        word_t seq_nbr;
+        int res = block_read_state(fs, b, &btype, &seq_nbr);
+        ERR_RET(res);
+        if (btype != BLOCK_TYPE_DATA)
+            continue;
+        if (seq_nbr_is_newer(fs->max_seq_nbr, seq_nbr) &&
+            seq_nbr_diff(fs->max_seq_nbr, seq_nbr) > max_diff)
+        {
+            max_diff = seq_nbr_diff(fs->max_seq_nbr, seq_nbr);
+            fs->min_seq_nbr = seq_nbr;
         }
     }
     return 0;
 }
 
-static int block_evict(uint32_t block_ix_src, const tag_evict_info_t *evict_tag_info, uint32_t block_ix_dst)
+// accounts flash traffic since bytes_written and erases were sampled to gc
+static void stats_gc_cost(nvmtnvj_t *fs, uint32_t bytes_written, uint32_t erases)
+{
+    fs->stats.gc_bytes_written += fs->stats.bytes_written - bytes_written;
+    fs->stats.gc_erases += fs->stats.erases - erases;
+}
+
+static int block_evict(nvmtnvj_t *fs, uint32_t block_ix_src, const tag_evict_info_t *evict_tag_info,
+                       uint32_t block_ix_dst)
 {
-    block_header_t bhdr_src;
+    const uint32_t bytes_written = fs->stats.bytes_written;
+    const uint32_t erases = fs->stats.erases;
+    block_type_t btype_src;
+    word_t seq_nbr_src;
     _dbg("evicting block %d to %d\n", block_ix_src, block_ix_dst);
-    int res = block_read_hdr(block_ix_src, &bhdr_src);
+    int res = spare_clean(fs);
+    ERR_RET(res);
+    res = block_read_state(fs, block_ix_src, &btype_src, &seq_nbr_src);
     ERR_RET(res);
     // mark as evicting
-    if (!flag(bhdr_src.evict_flag))
+    if (btype_src != BLOCK_TYPE_EVICTING)
     {
-        res = block_write_evicting_flag(block_ix_src);
+        res = block_write_evicting_flag(fs, block_ix_src);
         ERR_RET(res);
     }
     // copy live tags from src to dest
     uint32_t tag_ix_dst = 0;
-    for (uint32_t tag_ix_src = 0; tag_ix_src < sys.tags_per_block; tag_ix_src++)
+    uint32_t copied = 0;
+    for (uint32_t tag_ix_src = 0; tag_ix_src < fs->tags_per_block; tag_ix_src++)
     {
-        if (evict_tag_info[tag_ix_src].status == TI_LIVE_DELETED)
-        {
-            _dbg("evicting tag %d as DELETED\n", evict_tag_info[tag_ix_src].id);
-            res = tag_write(block_ix_dst, tag_ix_dst, evict_tag_info[tag_ix_src].id, TAG_DELETED, NULL, 0);
-            ERR_RET(res);
-        }
-        else if (evict_tag_info[tag_ix_src].status == TI_LIVE_WRITTEN)
-        {
-            tag_header_t thdr;
-            uint8_t data[sys.max_value_size];
-            res = tag_read_hdr_in_block(block_ix_src, tag_ix_src, &thdr);
-            ERR_RET(res);
-            uint8_t len = thdr.len > sys.max_value_size ? sys.max_value_size : thdr.len;
-            _dbg("evicting tag %d as WRITTEN len %d\n", evict_tag_info[tag_ix_src].id, len);
-            res = block_read(block_ix_src,
-                             ALIGNW(sizeof(block_header_t)) + tag_ix_src * tag_size() + sizeof(tag_header_t),
-                             data, len);
-            ERR_RET(res);
-            res = tag_write(block_ix_dst, tag_ix_dst, evict_tag_info[tag_ix_src].id, TAG_WRITTEN, data, len);
-            ERR_RET(res);
-        }
-        else
+        const tag_evict_info_t *info = &evict_tag_info[tag_ix_src];
+        if (info->status != TI_LIVE_DELETED && info->status != TI_LIVE_WRITTEN)
         {
+            if (info->status == TI_FREEABLE)
+                index_relocate(fs, info->id, block_ix_src, tag_ix_src, INDEX_NO_BLOCK, 0);
             continue;
         }
-        tag_ix_dst++;
+        res = tag_copy(fs, block_ix_src, tag_ix_src, info, block_ix_dst, tag_ix_dst);
+        ERR_RET(res);
+        index_relocate(fs, info->id, block_ix_src, tag_ix_src, block_ix_dst, tag_ix_dst);
+        tag_ix_dst += tag_slots(fs, res);
+        copied++;
     }
-    _dbg("evicted %d tags\n", tag_ix_dst);
+    fs->stats.copied_tags += copied;
+    _dbg("evicted %d tags\n", copied);
 
     // mark destination as data block, transform source to spare block
-    word_t new_seq_nbr = seq_nbr_new();
-    res = block_write_seq_nbr(block_ix_dst, new_seq_nbr);
+    word_t new_seq_nbr = seq_nbr_new(fs);
+    res = block_write_seq_nbr(fs, block_ix_dst, new_seq_nbr);
     ERR_RET(res);
-    res = block_write_data_flag(block_ix_dst);
+    res = block_write_data_flag(fs, block_ix_dst);
     ERR_RET(res);
-    res = block_erase(block_ix_src, BLOCK_TYPE_SPARE);
+    res = block_erase(fs, block_ix_src, BLOCK_TYPE_SPARE);
     ERR_RET(res);
+    account_reset(fs, block_ix_dst, copied);
 
     // update state
-    sys.current_block_ix = block_ix_dst;
-    sys.current_tag_ix = tag_ix_dst;
-    sys.spare_block_ix = block_ix_src;
-    sys.max_seq_nbr = new_seq_nbr;
-    if (sys.min_seq_nbr == bhdr_src.seq_nbr)
-    {
-        // just erased the minimum seq_nbr, dig out new minimum from all blocks
-        word_t max_diff = 0;
-        for (uint8_t b = 0; b < sys.nbr_of_blocks; b++)
+    fs->current_block_ix = block_ix_dst;
+    fs->current_tag_ix = tag_ix_dst;
+    fs->spare_block_ix = block_ix_src;
+    fs->max_seq_nbr = new_seq_nbr;
+    res = seq_nbr_refresh_min(fs, seq_nbr_src);
+    ERR_RET(res);
+    fs->stats.gcs++;
+    stats_gc_cost(fs, bytes_written, erases);
+    _dbg("post-evict, spare block:%d, min seq:%d, max_seq:%d\n", fs->spare_block_ix, fs->min_seq_nbr, fs->max_seq_nbr);
+    return 0;
+}
+
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+/*
+ * Incremental gc. Same flash state transitions as a full gc, so an aborted
+ * incremental gc is mended by nvmtnvj_fix like any other.
+ *
+ * Entries written while gc is ongoing go to current block as usual. As the
+ * spare block becomes the most recent block when committed, live tags not yet
+ * copied are dropped from the eviction, and tags already copied get the new
+ * entry appended in spare block too. If spare block runs out of room for these,
+ * it is erased and the eviction starts over.
+ *
+ * Spare block is committed first when current block is full, so that no free
+ * tag slots are left behind in current block.
+ */
+static int block_mark_evicting(nvmtnvj_t *fs, uint32_t block_ix)
+{
+    block_type_t btype;
+    int res = block_read_state(fs, block_ix, &btype, NULL);
+    ERR_RET(res);
+    if (btype == BLOCK_TYPE_EVICTING)
+        return 0;
+    return block_write_evicting_flag(fs, block_ix);
+}
+
+static int gc_start_erase(nvmtnvj_t *fs, uint32_t block_ix, word_t seq_nbr)
+{
+    int res = block_read_erase_count(fs, block_ix, &fs->gc.erase_count);
+    ERR_RET(res);
+    fs->gc.phase = GC_ERASE;
+    fs->gc.erase_block_ix = block_ix;
+    fs->gc.erase_sector_ix = 0;
+    fs->gc.erase_seq_nbr = seq_nbr;
+    return 0;
+}
+
+static bool gc_step_done(nvmtnvj_t *fs)
+{
+    return (fs->gc.phase == GC_IDLE && fs->free_block_count >= CONFIG_NVMTNVJ_GC_FREE_BLOCKS_WATERMARK) ||
+           fs->gc.phase == GC_READY;
+}
+
+static int gc_step_work(nvmtnvj_t *fs)
+{
+    int res;
+    switch (fs->gc.phase)
+    {
+    case GC_IDLE:
+        fs->gc.evict_block_ix = UNDEF_IX;
+        fs->gc.phase = GC_MAP;
+        // fall through
+    case GC_MAP:
+        if (fs->spare_used)
+            return gc_start_erase(fs, fs->spare_block_ix, SEQ_NBR_UNWRITTEN); // erase checkpoints first
+        if (fs->gc.evict_block_ix == UNDEF_IX)
         {
-            block_header_t bhdr;
-            res = block_read_hdr(b, &bhdr);
+            // current block is still written to, cannot be evicted
+            res = block_find_evict_candidate(fs, fs->current_block_ix, &fs->gc.evict_block_ix, fs->gc.tag_info);
             ERR_RET(res);
-            if (block_type(&bhdr) != BLOCK_TYPE_DATA)
-                continue;
-            if (seq_nbr_is_newer(sys.max_seq_nbr, bhdr.seq_nbr) &&
-                seq_nbr_diff(sys.max_seq_nbr, bhdr.seq_nbr) > max_diff)
+            if (fs->gc.evict_block_ix == UNDEF_IX)
             {
-                max_diff = seq_nbr_diff(sys.max_seq_nbr, bhdr.seq_nbr);
-                sys.min_seq_nbr = bhdr.seq_nbr;
+                fs->gc.phase = GC_IDLE;
+                return ERR_NVMTNVJ_FULL;
             }
         }
+        else
+        {
+            res = block_map_for_evict(fs, fs->gc.evict_block_ix, fs->gc.tag_info);
+            ERR_RET(res);
+        }
+        _dbg("gc step evicting block %d to %d\n", fs->gc.evict_block_ix, fs->spare_block_ix);
+        res = block_mark_evicting(fs, fs->gc.evict_block_ix);
+        ERR_RET(res);
+        fs->gc.tag_ix_src = 0;
+        fs->gc.tag_ix_dst = 0;
+        fs->gc.phase = GC_COPY;
+        return 0;
+    case GC_COPY:
+        while (fs->gc.tag_ix_src < fs->tags_per_block)
+        {
+            const uint32_t tag_ix_src = fs->gc.tag_ix_src++;
+            const tag_evict_info_t *info = &fs->gc.tag_info[tag_ix_src];
+            if (info->status != TI_LIVE_DELETED && info->status != TI_LIVE_WRITTEN)
+                continue;
+            res = tag_copy(fs, fs->gc.evict_block_ix, tag_ix_src, info, fs->spare_block_ix, fs->gc.tag_ix_dst);
+            ERR_RET(res);
+            fs->gc.tag_ix_dst += tag_slots(fs, res);
+            fs->stats.copied_tags++;
+            return 0;
+        }
+        fs->gc.phase = GC_READY;
+        return 0;
+    case GC_READY:
+        return 0;
+    case GC_ERASE:
+        if (fs->gc.erase_sector_ix < fs->sectors_per_block)
+        {
+            res = block_erase_sector(fs, fs->gc.erase_block_ix, fs->gc.erase_sector_ix);
+            ERR_RET(res);
+            fs->gc.erase_sector_ix++;
+            return 0;
+        }
+        res = block_write_hdr(fs, fs->gc.erase_block_ix, BLOCK_TYPE_SPARE, fs->gc.erase_count + 1);
+        ERR_RET(res);
+        fs->spare_block_ix = fs->gc.erase_block_ix;
+        // if spare block was erased to start over, reevict same block
+        fs->gc.phase = fs->gc.evict_block_ix != UNDEF_IX ? GC_MAP : GC_IDLE;
+        return seq_nbr_refresh_min(fs, fs->gc.erase_seq_nbr);
     }
-    _dbg("post-evict, spare block:%d, min seq:%d, max_seq:%d\n", sys.spare_block_ix, sys.min_seq_nbr, sys.max_seq_nbr);
-    return 0;
+    return ERR_NVMTNVJ_FATAL;
 }
 
-int nvmtnvj_gc(void)
+// performs one bounded unit of gc work, at most one tag copy or one sector erase
+static int gc_step_once(nvmtnvj_t *fs)
 {
-    if (sys.state == STATE_UNMOUNTED)
-        return ERR_NVMTNVJ_MOUNT;
-    if (sys.state == STATE_MOUNTED_INCONSISTENT)
-        return ERR_NVMTNVJ_FS_ABORTED;
-    int res;
-    uint32_t evict_block_ix;
-    tag_evict_info_t evict_tag_info[sys.tags_per_block];
-    res = block_find_evict_candidate(&evict_block_ix, evict_tag_info);
-    ERR_RET(res);
-    if (evict_block_ix == UNDEF_IX)
-        return ERR_NVMTNVJ_FULL;
-    res = block_evict(evict_block_ix, evict_tag_info, sys.spare_block_ix);
+    const uint32_t bytes_written = fs->stats.bytes_written;
+    const uint32_t erases = fs->stats.erases;
+    int res = gc_step_work(fs);
+    stats_gc_cost(fs, bytes_written, erases);
     return res;
 }
 
-static int prepare_for_new_entry(void)
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+// Entries in committed block are now the most recent. Copies of tags rewritten
+// during gc are followed by their new entries in the same block.
+static int gc_commit_index(nvmtnvj_t *fs, uint32_t block_ix_dst)
 {
-    if (sys.state == STATE_UNMOUNTED)
-        return ERR_NVMTNVJ_MOUNT;
-    if (sys.state == STATE_MOUNTED_INCONSISTENT)
-        return ERR_NVMTNVJ_FS_ABORTED;
-    if (sys.current_tag_ix < sys.tags_per_block)
+    if (!fs->index.valid)
         return 0;
-
-    // find next free block
-    uint32_t free_block_ix;
-    word_t seq_nbr;
-    int res = block_alloc(&free_block_ix, &seq_nbr);
-    if (res >= 0)
+    account_reset(fs, block_ix_dst, 0);
+    for (uint32_t tag_ix = 0; tag_ix < fs->gc.tag_ix_dst; tag_ix++)
     {
-        uint32_t free_tag_ix;
-        // should in all cases always return tag index 0, but keep this for symmetry
-        res = tag_find_next_free_in_block(free_block_ix, &free_tag_ix);
+        tag_header_t thdr;
+        int res = tag_scan_hdr_in_block(fs, block_ix_dst, tag_ix, &thdr);
         ERR_RET(res);
-        // found free
-        sys.current_block_ix = free_block_ix;
-        sys.current_tag_ix = free_tag_ix;
-        sys.max_seq_nbr = seq_nbr;
-        return 0;
+        if (thdr.state == TAG_CONT)
+            continue;
+        account_used(fs, block_ix_dst);
+        tag_index_entry_t *e = index_find(fs, thdr.id, true);
+        if (e == NULL)
+            continue;
+        if (e->state != TAG_FREE && e->block_ix != INDEX_NO_BLOCK && e->block_ix != fs->gc.evict_block_ix)
+            account_freeable(fs, e->block_ix);
+        index_set(fs, e, thdr.state, block_ix_dst, tag_ix);
     }
-    if (res != ERR_NVMTNVJ_NOENT)
-        return res;
-
-    // no free, gc
-    return nvmtnvj_gc();
+    for (uint32_t tag_ix = 0; tag_ix < fs->tags_per_block; tag_ix++)
+    {
+        if (fs->gc.tag_info[tag_ix].status == TI_FREEABLE)
+            index_relocate(fs, fs->gc.tag_info[tag_ix].id, fs->gc.evict_block_ix, tag_ix, INDEX_NO_BLOCK, 0);
+    }
+    return 0;
 }
+#else
+#define gc_commit_index(fs, block_ix_dst) 0
+#endif
 
-int nvmtnvj_write(uint16_t tag_id, const uint8_t *src, uint8_t size)
+// makes filled spare block current data block, and starts erasing the evicted block
+static int gc_commit(nvmtnvj_t *fs)
 {
-    int res = prepare_for_new_entry();
+    const uint32_t bytes_written = fs->stats.bytes_written;
+    block_type_t btype_src;
+    word_t seq_nbr_src;
+    int res = block_read_state(fs, fs->gc.evict_block_ix, &btype_src, &seq_nbr_src);
     ERR_RET(res);
-    res = tag_write(sys.current_block_ix, sys.current_tag_ix, tag_id, TAG_WRITTEN, src, size);
+    const uint32_t block_ix_dst = fs->spare_block_ix;
+    word_t new_seq_nbr = seq_nbr_new(fs);
+    res = block_write_seq_nbr(fs, block_ix_dst, new_seq_nbr);
     ERR_RET(res);
-    sys.current_tag_ix++;
-    return 0;
+    res = block_write_data_flag(fs, block_ix_dst);
+    ERR_RET(res);
+    res = gc_commit_index(fs, block_ix_dst);
+    ERR_RET(res);
+    _dbg("gc step committed block %d, %d tags\n", block_ix_dst, fs->gc.tag_ix_dst);
+    fs->current_block_ix = block_ix_dst;
+    fs->current_tag_ix = fs->gc.tag_ix_dst;
+    fs->spare_block_ix = UNDEF_IX;
+    fs->max_seq_nbr = new_seq_nbr;
+    fs->stats.gcs++;
+    stats_gc_cost(fs, bytes_written, fs->stats.erases);
+    res = gc_start_erase(fs, fs->gc.evict_block_ix, seq_nbr_src);
+    fs->gc.evict_block_ix = UNDEF_IX;
+    return res;
 }
 
-int nvmtnvj_read(uint16_t tag_id, uint8_t *dst)
+// runs ongoing gc until spare block is committed or gc is idle
+static int gc_finish(nvmtnvj_t *fs)
 {
-    if (sys.state == STATE_UNMOUNTED)
-        return ERR_NVMTNVJ_MOUNT;
-    if (sys.state == STATE_MOUNTED_INCONSISTENT)
-        return ERR_NVMTNVJ_FS_ABORTED;
-    return tag_find_and_read(tag_id, dst);
+    int res;
+    while (fs->gc.phase != GC_IDLE && fs->gc.phase != GC_READY)
+    {
+        res = gc_step_once(fs);
+        ERR_RET(res);
+    }
+    if (fs->gc.phase == GC_READY)
+    {
+        res = gc_commit(fs);
+        ERR_RET(res);
+    }
+    return 0;
+}
+
+// Keeps ongoing gc coherent with an entry just appended to current block.
+static int gc_note_entry(nvmtnvj_t *fs, uint16_t tag_id, tag_state_t state, const uint8_t *data, uint8_t len)
+{
+    if (fs->gc.phase != GC_COPY && fs->gc.phase != GC_READY)
+        return 0;
+    bool copied = false;
+    for (uint32_t tag_ix = 0; tag_ix < fs->tags_per_block; tag_ix++)
+    {
+        tag_evict_info_t *info = &fs->gc.tag_info[tag_ix];
+        if (info->status != TI_LIVE_WRITTEN && info->status != TI_LIVE_DELETED)
+            continue;
+        if (info->id != tag_id)
+            continue;
+        if (tag_ix < fs->gc.tag_ix_src)
+            copied = true;
+        else
+            info->status = TI_FREEABLE; // superseded before copied
+    }
+    if (!copied)
+        return 0;
+    if (fs->gc.tag_ix_dst + tag_slots(fs, len) > fs->tags_per_block)
+    {
+        _dbg("gc step spare block full, restarting\n");
+        return gc_start_erase(fs, fs->spare_block_ix, SEQ_NBR_UNWRITTEN);
+    }
+    const uint32_t bytes_written = fs->stats.bytes_written;
+    int res = tag_write(fs, fs->spare_block_ix, fs->gc.tag_ix_dst, tag_id, state, data, len);
+    ERR_RET(res);
+    stats_gc_cost(fs, bytes_written, fs->stats.erases);
+    fs->gc.tag_ix_dst += tag_slots(fs, len);
+    return 0;
+}
+#else
+#define gc_note_entry(fs, tag_id, state, data, len) 0
+#endif
+
+int nvmtnvj_ctx_gc_step(nvmtnvj_t *fs, uint32_t budget)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (fs->batch.open)
+        return 0; // batch entries are not tracked by incremental gc
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    if (fs->tags_per_block > CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK)
+        return ERR_NVMTNVJ_INVAL;
+    for (; budget > 0; budget--)
+    {
+        if (gc_step_done(fs))
+            return 0;
+        int res = gc_step_once(fs);
+        ERR_RET(res);
+    }
+    return gc_step_done(fs) ? 0 : 1;
+#else
+    (void)budget;
+    return ERR_NVMTNVJ_INVAL;
+#endif
+}
+
+int nvmtnvj_ctx_gc(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    int res;
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    if (fs->gc.phase != GC_IDLE)
+    {
+        // complete ongoing incremental gc instead
+        res = gc_finish(fs);
+        ERR_RET(res);
+        while (fs->gc.phase != GC_IDLE)
+        {
+            res = gc_step_once(fs);
+            ERR_RET(res);
+        }
+        return 0;
+    }
+#endif
+    uint32_t evict_block_ix;
+    tag_evict_info_t evict_tag_info_vla[WORK_VLA_LEN(fs, fs->tags_per_block)];
+    tag_evict_info_t *evict_tag_info = work_tag_info(fs, WORK_TAG_INFO_EVICT, evict_tag_info_vla);
+    res = block_find_evict_candidate(fs, UNDEF_IX, &evict_block_ix, evict_tag_info);
+    ERR_RET(res);
+    if (evict_block_ix == UNDEF_IX)
+        return ERR_NVMTNVJ_FULL;
+    res = block_evict(fs, evict_block_ix, evict_tag_info, fs->spare_block_ix);
+    ERR_RET(res);
+    if (fs->wear_levelled && fs->current_tag_ix >= fs->tags_per_block)
+    {
+        // a wear levelled block may free nothing, gc once more by score
+        res = block_find_evict_candidate(fs, UNDEF_IX, &evict_block_ix, evict_tag_info);
+        ERR_RET(res);
+        if (evict_block_ix == UNDEF_IX)
+            return ERR_NVMTNVJ_FULL;
+        res = block_evict(fs, evict_block_ix, evict_tag_info, fs->spare_block_ix);
+    }
+    return res;
+}
+
+// makes a block with free tag slots current, current block must be full
+static int current_block_switch(nvmtnvj_t *fs)
+{
+    int res;
+
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    // prefer prepared spare block, keeping free blocks in reserve
+    if (fs->gc.phase == GC_READY)
+    {
+        res = gc_commit(fs);
+        // a wear levelled block may free nothing, then go on as if no gc was ready
+        if (res < 0 || fs->current_tag_ix < fs->tags_per_block)
+            return res;
+    }
+#endif
+
+    // find next free block
+    uint32_t free_block_ix;
+    word_t seq_nbr;
+    res = block_alloc(fs, &free_block_ix, &seq_nbr);
+    if (res >= 0)
+    {
+        uint32_t free_tag_ix;
+        // should in all cases always return tag index 0, but keep this for symmetry
+        res = tag_find_next_free_in_block(fs, free_block_ix, &free_tag_ix);
+        ERR_RET(res);
+        // found free
+        fs->current_block_ix = free_block_ix;
+        fs->current_tag_ix = free_tag_ix;
+        fs->max_seq_nbr = seq_nbr;
+        return 0;
+    }
+    if (res != ERR_NVMTNVJ_NOENT)
+        return res;
+
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    if (fs->gc.phase != GC_IDLE)
+    {
+        // incremental gc did not keep up, do the rest now
+        res = gc_finish(fs);
+        ERR_RET(res);
+        if (fs->current_tag_ix < fs->tags_per_block)
+            return 0;
+    }
+#endif
+
+    // no free, gc
+    return nvmtnvj_ctx_gc(fs);
+}
+
+// makes sure current block has room for given number of consecutive slots
+static int prepare_for_new_slots(nvmtnvj_t *fs, uint32_t count)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    if (fs->current_tag_ix + count <= fs->tags_per_block)
+        return 0;
+    // remaining slots in current block are left unused
+    const uint32_t block_ix = fs->current_block_ix;
+    const uint32_t tag_ix = fs->current_tag_ix;
+    fs->current_tag_ix = fs->tags_per_block;
+    int res = current_block_switch(fs);
+    if (res >= 0 && fs->current_tag_ix + count > fs->tags_per_block)
+        res = ERR_NVMTNVJ_FULL;
+    if (res < 0 && fs->current_block_ix == block_ix)
+        fs->current_tag_ix = tag_ix;
+    return res;
+}
+
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+// a tag is hot if written within the last CONFIG_NVMTNVJ_HOT_COLD_WINDOW writes
+static bool head_classify(nvmtnvj_t *fs, uint16_t tag_id)
+{
+    int hint = CONFIG_NVMTNVJ_HOT_TAG_HINT(tag_id);
+    bool hot = hint > 0;
+    for (uint32_t i = 0; hint < 0 && !hot && i < fs->head.recent_count; i++)
+        hot = fs->head.recent[i] == tag_id;
+    fs->head.recent[fs->head.recent_ix] = tag_id;
+    fs->head.recent_ix = (fs->head.recent_ix + 1) % CONFIG_NVMTNVJ_HOT_COLD_WINDOW;
+    if (fs->head.recent_count < CONFIG_NVMTNVJ_HOT_COLD_WINDOW)
+        fs->head.recent_count++;
+    return hot;
+}
+
+// returns 1 if tag has an entry in a block more recent than second head, so that a
+// new entry in second head would not be the last one
+static int head_is_superseded(nvmtnvj_t *fs, uint16_t tag_id)
+{
+    int res;
+    block_type_t btype;
+    word_t head_seq_nbr;
+    res = block_read_state(fs, fs->head.block_ix, &btype, &head_seq_nbr);
+    ERR_RET(res);
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    if (fs->index.valid)
+    {
+        // earlier entries are never in blocks more recent than the indexed one
+        const tag_index_entry_t *e = index_find(fs, tag_id, false);
+        if (e == NULL && fs->index.complete)
+            return 0;
+        if (e != NULL && e->block_ix != INDEX_NO_BLOCK)
+        {
+            word_t seq_nbr;
+            res = block_read_state(fs, e->block_ix, &btype, &seq_nbr);
+            ERR_RET(res);
+            return seq_nbr_is_newer(seq_nbr, head_seq_nbr) ? 1 : 0;
+        }
+    }
+#endif
+    uint32_t cur_block_ix = fs->current_block_ix;
+    uint32_t blocks_left = fs->nbr_of_blocks - 1;
+    while (cur_block_ix != fs->head.block_ix && blocks_left-- > 0)
+    {
+        for (uint32_t tag_ix = 0; tag_ix < fs->tags_per_block; tag_ix++)
+        {
+            tag_header_t thdr;
+            res = tag_scan_hdr_in_block(fs, cur_block_ix, tag_ix, &thdr);
+            ERR_RET(res);
+            if (thdr.state == TAG_FREE)
+                break;
+            if ((thdr.state == TAG_WRITTEN || thdr.state == TAG_DELETED) && thdr.id == tag_id)
+                return 1;
+        }
+        res = block_find_older(fs, cur_block_ix, &cur_block_ix);
+        if (res == ERR_NVMTNVJ_NOENT)
+            return 1; // second head not in history, should not happen
+        ERR_RET(res);
+    }
+    return 0;
+}
+
+// Makes a new current block, keeping the current one with its free slots as second
+// head for the other class of tags.
+static int head_open(nvmtnvj_t *fs)
+{
+    const uint32_t block_ix = fs->current_block_ix;
+    const uint32_t tag_ix = fs->current_tag_ix;
+    fs->head.block_ix = block_ix;
+    fs->head.tag_ix = tag_ix;
+    fs->current_tag_ix = fs->tags_per_block;
+    int res = current_block_switch(fs);
+    if (res < 0)
+    {
+        if (fs->current_block_ix == block_ix)
+            fs->current_tag_ix = tag_ix;
+        fs->head.block_ix = UNDEF_IX;
+    }
+    return res;
+}
+
+// returns 1 if second head has room for the entry and keeps entry order
+static int head_can_take(nvmtnvj_t *fs, uint16_t tag_id, uint32_t count)
+{
+    if (fs->head.block_ix == UNDEF_IX || fs->head.tag_ix + count > fs->tags_per_block)
+        return 0;
+    int res = head_is_superseded(fs, tag_id);
+    ERR_RET(res);
+    return res == 0 ? 1 : 0;
+}
+
+// makes room in current block, or in second head if there is no more room
+static int head_prepare_current(nvmtnvj_t *fs, uint16_t tag_id, uint32_t count)
+{
+    int res = prepare_for_new_slots(fs, count);
+    if (res == ERR_NVMTNVJ_FULL)
+    {
+        int res_head = head_can_take(fs, tag_id, count);
+        ERR_RET(res_head);
+        if (res_head)
+            return 1;
+    }
+    return res;
+}
+
+// Makes room for an entry of given tag, in current block or second head depending
+// on if tag is hot. Returns 1 if entry goes to second head, 0 if to current block.
+static int head_prepare(nvmtnvj_t *fs, uint16_t tag_id, uint32_t count)
+{
+    if (fs->state != STATE_MOUNTED || fs->batch.open)
+        return prepare_for_new_slots(fs, count);
+    if (!head_active(fs))
+        return prepare_for_new_slots(fs, count);
+    const bool hot = head_classify(fs, tag_id);
+    if (hot == fs->head.current_hot)
+        return head_prepare_current(fs, tag_id, count);
+    int res = head_can_take(fs, tag_id, count);
+    ERR_RET(res);
+    if (res)
+        return 1;
+    // Second head is full, or has an older entry of the tag than a more recent
+    // block. Latter is then likely for more tags of its class, leave it for gc.
+    fs->head.block_ix = UNDEF_IX;
+    // only open a new head when it takes no gc, an early gc copies more
+    bool gc_ready = false;
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    gc_ready = fs->gc.phase == GC_READY;
+#endif
+    if (fs->current_tag_ix < fs->tags_per_block && (fs->free_block_count > 0 || gc_ready))
+    {
+        res = head_open(fs);
+        ERR_RET(res);
+    }
+    fs->head.current_hot = hot;
+    return head_prepare_current(fs, tag_id, count);
+}
+
+// after mount, picks up the block before current if it has free slots
+static int head_recover(nvmtnvj_t *fs)
+{
+    fs->head.block_ix = UNDEF_IX;
+    fs->head.current_hot = true;
+    uint32_t block_ix;
+    int res = block_find_older(fs, fs->current_block_ix, &block_ix);
+    if (res == ERR_NVMTNVJ_NOENT)
+        return 0;
+    ERR_RET(res);
+    uint32_t tag_ix;
+    res = tag_find_next_free_in_block(fs, block_ix, &tag_ix);
+    if (res == ERR_NVMTNVJ_NOENT)
+        return 0;
+    ERR_RET(res);
+    fs->head.block_ix = block_ix;
+    fs->head.tag_ix = tag_ix;
+    return 0;
+}
+#else
+#define head_prepare(fs, tag_id, count) prepare_for_new_slots(fs, count)
+#define head_recover(fs) 0
+#endif
+
+// spends slots torn by a cut write where the next entries go
+static int heads_spend_torn(nvmtnvj_t *fs)
+{
+    int res = tag_spend_torn(fs, fs->current_block_ix, &fs->current_tag_ix);
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    if (res >= 0)
+        res = tag_spend_torn(fs, fs->head.block_ix, &fs->head.tag_ix);
+#endif
+    return res;
+}
+
+static int tag_append(nvmtnvj_t *fs, uint16_t tag_id, const uint8_t *src, uint8_t size)
+{
+    int res = head_prepare(fs, tag_id, tag_slots(fs, size));
+    ERR_RET(res);
+    uint32_t block_ix = fs->current_block_ix;
+    uint32_t *tag_ix = &fs->current_tag_ix;
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    if (res == 1)
+    {
+        block_ix = fs->head.block_ix;
+        tag_ix = &fs->head.tag_ix;
+    }
+#endif
+    res = tag_write(fs, block_ix, *tag_ix, tag_id, TAG_WRITTEN, src, size);
+    ERR_RET(res);
+    index_add(fs, tag_id, TAG_WRITTEN, block_ix, *tag_ix);
+    *tag_ix += tag_slots(fs, size);
+    return gc_note_entry(fs, tag_id, TAG_WRITTEN, src, size);
+}
+
+#if CONFIG_NVMTNVJ_WRITE_CACHE_SIZE > 0
+static cache_entry_t *cache_find(nvmtnvj_t *fs, uint16_t tag_id)
+{
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_WRITE_CACHE_SIZE; i++)
+    {
+        if (fs->cache.entries[i].valid && fs->cache.entries[i].id == tag_id)
+            return &fs->cache.entries[i];
+    }
+    return NULL;
+}
+
+static bool cache_equals(const cache_entry_t *c, const uint8_t *src, uint8_t size)
+{
+    if (c->len != size)
+        return false;
+    for (uint8_t i = 0; i < size; i++)
+    {
+        if (c->data[i] != src[i])
+            return false;
+    }
+    return true;
+}
+
+static void cache_set(nvmtnvj_t *fs, cache_entry_t *c, uint16_t tag_id, const uint8_t *src, uint8_t size, bool dirty)
+{
+    if (dirty && !c->dirty)
+    {
+        if (fs->cache.dirty_count++ == 0)
+        {
+            CONFIG_NVMTNVJ_WRITE_CACHE_DIRTY_HOOK();
+        }
+    }
+    else if (!dirty && c->dirty)
+    {
+        fs->cache.dirty_count--;
+    }
+    c->id = tag_id;
+    c->len = size;
+    c->valid = true;
+    c->dirty = dirty;
+    if (size > 0)
+        _memcpy(c->data, src, size);
+}
+
+static void cache_drop(nvmtnvj_t *fs, uint16_t tag_id)
+{
+    cache_entry_t *c = cache_find(fs, tag_id);
+    if (c == NULL)
+        return;
+    if (c->dirty)
+        fs->cache.dirty_count--;
+    c->valid = false;
+    c->dirty = false;
+}
+
+static void cache_clear(nvmtnvj_t *fs)
+{
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_WRITE_CACHE_SIZE; i++)
+    {
+        fs->cache.entries[i].valid = false;
+        fs->cache.entries[i].dirty = false;
+    }
+    fs->cache.dirty_count = 0;
+}
+
+// reads value from cache, ERR_NVMTNVJ_NOENT if not cached
+static int cache_read(nvmtnvj_t *fs, uint16_t tag_id, uint8_t *dst, const uint8_t **ptr)
+{
+    cache_entry_t *c = cache_find(fs, tag_id);
+    if (c == NULL)
+        return ERR_NVMTNVJ_NOENT;
+    if (dst == NULL)
+        *ptr = c->data;
+    else if (c->len > 0)
+        _memcpy(dst, c->data, c->len);
+    return c->len;
+}
+
+// gets an entry to put a new tag in, a clean one if possible
+static int cache_alloc(nvmtnvj_t *fs, cache_entry_t **entry)
+{
+    cache_entry_t *clean = NULL;
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_WRITE_CACHE_SIZE; i++)
+    {
+        cache_entry_t *c = &fs->cache.entries[i];
+        if (!c->valid)
+        {
+            *entry = c;
+            return 0;
+        }
+        if (!c->dirty && clean == NULL)
+            clean = c;
+    }
+    if (clean == NULL)
+    {
+        int res = nvmtnvj_ctx_flush(fs);
+        ERR_RET(res);
+        clean = &fs->cache.entries[0];
+    }
+    *entry = clean;
+    return 0;
+}
+#else
+#define cache_find(fs, tag_id) NULL
+#define cache_drop(fs, tag_id) \
+    do                         \
+    {                          \
+    } while (0)
+#define cache_clear(fs) \
+    do                  \
+    {                   \
+    } while (0)
+#define cache_read(fs, tag_id, dst, ptr) ERR_NVMTNVJ_NOENT
+#endif
+
+int nvmtnvj_ctx_write(nvmtnvj_t *fs, uint16_t tag_id, const uint8_t *src, uint8_t size)
+{
+#if CONFIG_NVMTNVJ_WRITE_CACHE_SIZE > 0
+    if (size > fs->max_value_size)
+        size = fs->max_value_size;
+    cache_entry_t *c = cache_find(fs, tag_id);
+    if (c != NULL && !c->dirty && cache_equals(c, src, size))
+        return 0; // already on flash
+    int res = tag_append(fs, tag_id, src, size);
+    ERR_RET(res);
+    if (c != NULL)
+    {
+        if (size <= CONFIG_NVMTNVJ_WRITE_CACHE_VALUE_SIZE)
+            cache_set(fs, c, tag_id, src, size, false);
+        else
+            cache_drop(fs, tag_id);
+    }
+    return res;
+#else
+    return tag_append(fs, tag_id, src, size);
+#endif
+}
+
+int nvmtnvj_ctx_write_cached(nvmtnvj_t *fs, uint16_t tag_id, const uint8_t *src, uint8_t size)
+{
+#if CONFIG_NVMTNVJ_WRITE_CACHE_SIZE > 0
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    if (size > fs->max_value_size)
+        size = fs->max_value_size;
+    if (size > CONFIG_NVMTNVJ_WRITE_CACHE_VALUE_SIZE)
+        return nvmtnvj_ctx_write(fs, tag_id, src, size);
+    int res;
+    cache_entry_t *c = cache_find(fs, tag_id);
+    if (c != NULL && cache_equals(c, src, size))
+        return 0;
+    bool dirty = true;
+    if (c == NULL)
+    {
+        // first write since cached, compare against flash
+        uint8_t tmp_buf[fs->max_value_size];
+        res = tag_find_and_read(fs, tag_id, tmp_buf, NULL);
+        if (res != ERR_NVMTNVJ_NOENT)
+            ERR_RET(res);
+        dirty = res != size;
+        for (uint8_t i = 0; !dirty && i < size; i++)
+            dirty = tmp_buf[i] != src[i];
+        res = cache_alloc(fs, &c);
+        ERR_RET(res);
+    }
+    cache_set(fs, c, tag_id, src, size, dirty);
+    if (fs->cache.dirty_count >= CONFIG_NVMTNVJ_WRITE_CACHE_WATERMARK)
+        return nvmtnvj_ctx_flush(fs);
+    return 0;
+#else
+    return nvmtnvj_ctx_write(fs, tag_id, src, size);
+#endif
+}
+
+int nvmtnvj_ctx_flush(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+#if CONFIG_NVMTNVJ_WRITE_CACHE_SIZE > 0
+    for (uint32_t i = 0; fs->cache.dirty_count > 0 && i < CONFIG_NVMTNVJ_WRITE_CACHE_SIZE; i++)
+    {
+        cache_entry_t *c = &fs->cache.entries[i];
+        if (!c->valid || !c->dirty)
+            continue;
+        int res = tag_append(fs, c->id, c->data, c->len);
+        ERR_RET(res);
+        c->dirty = false;
+        fs->cache.dirty_count--;
+    }
+#endif
+    return 0;
+}
+
+int nvmtnvj_ctx_read(nvmtnvj_t *fs, uint16_t tag_id, uint8_t *dst)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    int res = cache_read(fs, tag_id, dst, NULL);
+    if (res != ERR_NVMTNVJ_NOENT)
+        return res;
+    return tag_find_and_read(fs, tag_id, dst, NULL);
+}
+
+int nvmtnvj_ctx_read_ptr(nvmtnvj_t *fs, uint16_t tag_id, const uint8_t **ptr)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    int res = cache_read(fs, tag_id, NULL, ptr);
+    if (res != ERR_NVMTNVJ_NOENT)
+        return res;
+    return tag_find_and_read(fs, tag_id, NULL, ptr);
+}
+
+// resolves requested ids matching given entry, returns number resolved
+static int read_multi_resolve(nvmtnvj_t *fs, const tag_header_t *thdr, uint32_t block_ix, uint32_t tag_ix,
+                              const uint16_t *tag_ids, uint32_t count, bool *resolved, uint8_t *buf,
+                              nvmtnvj_read_cb_t cb, void *user)
+{
+    int len = ERR_NVMTNVJ_NOENT;
+    int hits = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (resolved[i] || tag_ids[i] != thdr->id)
+            continue;
+        if (hits == 0 && thdr->state == TAG_WRITTEN)
+        {
+            len = tag_read(fs, thdr, block_ix, tag_ix, buf);
+            ERR_RET(len);
+            if (len == ERR_INTERNAL_ABORTED)
+                return 0; // look further back
+        }
+        resolved[i] = true;
+        hits++;
+        cb(tag_ids[i], len < 0 ? NULL : buf, len, user);
+    }
+    return hits;
+}
+
+int nvmtnvj_ctx_read_multi(nvmtnvj_t *fs, const uint16_t *tag_ids, uint32_t count, nvmtnvj_read_cb_t cb, void *user)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (count == 0)
+        return 0;
+    int res;
+    uint8_t buf[fs->max_value_size];
+    bool resolved[count];
+    uint32_t left = count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        res = cache_read(fs, tag_ids[i], buf, NULL);
+        resolved[i] = res != ERR_NVMTNVJ_NOENT;
+        if (!resolved[i])
+            continue;
+        cb(tag_ids[i], buf, res, user);
+        left--;
+    }
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    // if any id needs the sweep, resolve all in the sweep
+    bool indexed = fs->index.valid;
+    for (uint32_t i = 0; indexed && !fs->index.complete && i < count; i++)
+        indexed = resolved[i] || index_find(fs, tag_ids[i], false) != NULL;
+    if (indexed)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (resolved[i])
+                continue;
+            const tag_index_entry_t *e = index_find(fs, tag_ids[i], false);
+            tag_header_t thdr = {.state = TAG_DELETED, .id = tag_ids[i]};
+            if (e != NULL && e->state == TAG_WRITTEN)
+            {
+                res = tag_read_hdr_in_block(fs, e->block_ix, e->tag_ix, &thdr);
+                ERR_RET(res);
+                // raw header, entries of committed batches are indexed as written
+                thdr.state = TAG_WRITTEN;
+            }
+            res = read_multi_resolve(fs, &thdr, e ? e->block_ix : 0, e ? e->tag_ix : 0, tag_ids + i, count - i,
+                                     resolved + i, buf, cb, user);
+            ERR_RET(res);
+            left -= res;
+        }
+    }
+#endif
+    // one sweep from most recent entry for the rest
+    uint32_t blocks_left = fs->nbr_of_blocks - 1;
+    uint32_t cur_block_ix = fs->current_block_ix;
+    while (left > 0 && blocks_left > 0)
+    {
+        for (uint32_t t = 0; left > 0 && t < fs->tags_per_block; t++)
+        {
+            tag_header_t thdr;
+            uint32_t tag_ix = fs->tags_per_block - 1 - t;
+            res = tag_scan_hdr_in_block(fs, cur_block_ix, tag_ix, &thdr);
+            ERR_RET(res);
+            if (thdr.state != TAG_WRITTEN && thdr.state != TAG_DELETED)
+                continue;
+            res = read_multi_resolve(fs, &thdr, cur_block_ix, tag_ix, tag_ids, count, resolved, buf, cb, user);
+            ERR_RET(res);
+            left -= res;
+        }
+        if (left == 0)
+            break;
+        uint32_t prev_block_ix;
+        res = block_find_older(fs, cur_block_ix, &prev_block_ix);
+        if (res == ERR_NVMTNVJ_NOENT)
+            break; // oldest block
+        ERR_RET(res);
+        cur_block_ix = prev_block_ix;
+        blocks_left--;
+    }
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!resolved[i])
+            cb(tag_ids[i], NULL, ERR_NVMTNVJ_NOENT, user);
+    }
+    return 0;
+}
+
+int nvmtnvj_ctx_iter_init(nvmtnvj_t *fs, nvmtnvj_iter_t *it, uint16_t min_id, uint16_t max_id, uint8_t *seen,
+                          uint32_t seen_size)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (min_id > max_id || seen == NULL || seen_size < NVMTNVJ_ITER_SEEN_SIZE(min_id, max_id))
+        return ERR_NVMTNVJ_INVAL;
+    // iterates what is on flash
+    int res = nvmtnvj_ctx_flush(fs);
+    ERR_RET(res);
+    for (uint32_t i = 0; i < NVMTNVJ_ITER_SEEN_SIZE(min_id, max_id); i++)
+        seen[i] = 0;
+    it->fs = fs;
+    it->min_id = min_id;
+    it->max_id = max_id;
+    it->seen = seen;
+    it->block_ix = fs->current_block_ix;
+    it->tag_ix = fs->tags_per_block;
+    it->blocks_left = fs->nbr_of_blocks - 1;
+    return 0;
+}
+
+int nvmtnvj_iter_next(nvmtnvj_iter_t *it, uint16_t *tag_id, uint8_t *dst)
+{
+    nvmtnvj_t *fs = it->fs;
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    int res;
+    while (it->blocks_left > 0)
+    {
+        while (it->tag_ix > 0)
+        {
+            const uint32_t tag_ix = --it->tag_ix;
+            tag_header_t thdr;
+            res = tag_scan_hdr_in_block(fs, it->block_ix, tag_ix, &thdr);
+            ERR_RET(res);
+            if (thdr.state != TAG_WRITTEN && thdr.state != TAG_DELETED)
+                continue;
+            if (thdr.id < it->min_id || thdr.id > it->max_id)
+                continue;
+            const uint32_t bit = thdr.id - it->min_id;
+            if (it->seen[bit / 8] & (1 << (bit % 8)))
+                continue; // superseded
+            int len = 0;
+            if (thdr.state == TAG_WRITTEN)
+            {
+                len = tag_read(fs, &thdr, it->block_ix, tag_ix, dst);
+                ERR_RET(len);
+                if (len == ERR_INTERNAL_ABORTED)
+                    continue;
+            }
+            it->seen[bit / 8] |= 1 << (bit % 8);
+            if (thdr.state == TAG_DELETED)
+                continue;
+            *tag_id = thdr.id;
+            return len;
+        }
+        uint32_t prev_block_ix;
+        res = block_find_older(fs, it->block_ix, &prev_block_ix);
+        if (res == ERR_NVMTNVJ_NOENT)
+            break; // oldest block
+        ERR_RET(res);
+        it->block_ix = prev_block_ix;
+        it->tag_ix = fs->tags_per_block;
+        it->blocks_left--;
+    }
+    it->blocks_left = 0;
+    return ERR_NVMTNVJ_NOENT;
 }
 
-int nvmtnvj_size(uint16_t tag_id)
+int nvmtnvj_ctx_size(nvmtnvj_t *fs, uint16_t tag_id)
 {
-    if (sys.state == STATE_UNMOUNTED)
+    if (fs->state == STATE_UNMOUNTED)
         return ERR_NVMTNVJ_MOUNT;
-    if (sys.state == STATE_MOUNTED_INCONSISTENT)
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
         return ERR_NVMTNVJ_FS_ABORTED;
-    uint8_t tmp_buf[sys.max_value_size];
-    return tag_find_and_read(tag_id, tmp_buf);
+    uint8_t tmp_buf[fs->max_value_size];
+    int res = cache_read(fs, tag_id, tmp_buf, NULL);
+    if (res != ERR_NVMTNVJ_NOENT)
+        return res;
+    return tag_find_and_read(fs, tag_id, tmp_buf, NULL);
 }
 
-int nvmtnvj_delete(uint16_t tag_id)
+int nvmtnvj_ctx_delete(nvmtnvj_t *fs, uint16_t tag_id)
 {
-    if (sys.state == STATE_UNMOUNTED)
+    if (fs->state == STATE_UNMOUNTED)
         return ERR_NVMTNVJ_MOUNT;
-    if (sys.state == STATE_MOUNTED_INCONSISTENT)
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
         return ERR_NVMTNVJ_FS_ABORTED;
-    uint8_t tmp_buf[sys.max_value_size];
-    int res = tag_find_and_read(tag_id, tmp_buf);
+    if (fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    // a cached value not yet on flash is deleted by dropping it
+    cache_drop(fs, tag_id);
+    uint8_t tmp_buf[fs->max_value_size];
+    int res = tag_find_and_read(fs, tag_id, tmp_buf, NULL);
     if (res == ERR_NVMTNVJ_NOENT)
         return 0; // no need to delete
-    res = prepare_for_new_entry();
+    res = prepare_for_new_slots(fs, tag_slots(fs, 0));
+    ERR_RET(res);
+    res = tag_write(fs, fs->current_block_ix, fs->current_tag_ix, tag_id, TAG_DELETED, NULL, 0);
+    ERR_RET(res);
+    index_add(fs, tag_id, TAG_DELETED, fs->current_block_ix, fs->current_tag_ix);
+    fs->current_tag_ix += tag_slots(fs, 0);
+    return gc_note_entry(fs, tag_id, TAG_DELETED, NULL, 0);
+}
+
+int nvmtnvj_ctx_batch_begin(nvmtnvj_t *fs, uint32_t count)
+{
+    // room for the entries, the commit marker and possibly a marker ending an
+    // aborted batch
+    const uint32_t slots = count * tag_slots(fs, fs->max_value_size) + 2 * tag_slots(fs, 0);
+    if (count == 0 || slots > fs->tags_per_block)
+        return ERR_NVMTNVJ_INVAL;
+    int res;
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    if (fs->state == STATE_MOUNTED && !fs->batch.open &&
+        (fs->gc.phase == GC_COPY || fs->gc.phase == GC_READY))
+    {
+        // batch entries are not tracked by incremental gc, get it out of the way
+        res = gc_finish(fs);
+        ERR_RET(res);
+    }
+#endif
+    if (fs->state == STATE_MOUNTED && !fs->batch.open)
+    {
+        // cached values are older than the batch, get them on flash first
+        res = nvmtnvj_ctx_flush(fs);
+        ERR_RET(res);
+    }
+    res = prepare_for_new_slots(fs, slots);
     ERR_RET(res);
-    res = tag_write(sys.current_block_ix, sys.current_tag_ix, tag_id, TAG_DELETED, NULL, 0);
+    uint32_t prev_tag_ix;
+    res = tag_prev_ix(fs, fs->current_block_ix, fs->current_tag_ix, &prev_tag_ix);
+    if (res != ERR_NVMTNVJ_NOENT)
+    {
+        ERR_RET(res);
+        // an aborted batch right before would merge with this batch, end it
+        tag_header_t thdr;
+        res = tag_read_hdr_in_block(fs, fs->current_block_ix, prev_tag_ix, &thdr);
+        ERR_RET(res);
+        if (tag_state_is_batch(thdr.state))
+        {
+            res = tag_write(fs, fs->current_block_ix, fs->current_tag_ix, 0, TAG_BATCH_COMMIT, NULL, 0);
+            ERR_RET(res);
+            account_void(fs, fs->current_block_ix);
+            fs->current_tag_ix += tag_slots(fs, 0);
+        }
+    }
+    fs->batch.open = true;
+    fs->batch.count = count;
+    fs->batch.added = 0;
+    fs->batch.first_tag_ix = fs->current_tag_ix;
+    return 0;
+}
+
+static int batch_add(nvmtnvj_t *fs, uint16_t tag_id, tag_state_t state, const uint8_t *src, uint8_t size)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (!fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    if (fs->batch.added >= fs->batch.count)
+        return ERR_NVMTNVJ_FULL;
+    cache_drop(fs, tag_id);
+    int res = tag_write(fs, fs->current_block_ix, fs->current_tag_ix, tag_id, state, src, size);
+    // slot is spent even if the write failed
+    fs->current_tag_ix += tag_slots(fs, size);
+    fs->batch.added++;
+    return res < 0 ? res : 0;
+}
+
+int nvmtnvj_ctx_batch_write(nvmtnvj_t *fs, uint16_t tag_id, const uint8_t *src, uint8_t size)
+{
+    return batch_add(fs, tag_id, TAG_BATCH_WRITTEN, src, size);
+}
+
+int nvmtnvj_ctx_batch_delete(nvmtnvj_t *fs, uint16_t tag_id)
+{
+    return batch_add(fs, tag_id, TAG_BATCH_DELETED, NULL, 0);
+}
+
+int nvmtnvj_ctx_batch_commit(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (!fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    int res = 0;
+    if (fs->batch.added > 0)
+    {
+        res = tag_write(fs, fs->current_block_ix, fs->current_tag_ix, (uint16_t)fs->batch.added,
+                        TAG_BATCH_COMMIT, NULL, 0);
+        fs->current_tag_ix += tag_slots(fs, 0);
+    }
+    fs->batch.open = false;
     ERR_RET(res);
-    sys.current_tag_ix++;
+    if (fs->batch.added == 0)
+        return 0;
+    account_void(fs, fs->current_block_ix);
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    // committed, now entries are the most recent
+    uint32_t tag_ix = fs->batch.first_tag_ix;
+    for (uint32_t i = 0; i < fs->batch.added; i++)
+    {
+        tag_header_t thdr;
+        res = tag_read_hdr_in_block(fs, fs->current_block_ix, tag_ix, &thdr);
+        ERR_RET(res);
+        index_add(fs, thdr.id, thdr.state == TAG_BATCH_WRITTEN ? TAG_WRITTEN : TAG_DELETED,
+                  fs->current_block_ix, tag_ix);
+        tag_ix = tag_next_ix(fs, &thdr, tag_ix);
+    }
+#endif
+    return 0;
+}
+
+int nvmtnvj_ctx_batch_abort(nvmtnvj_t *fs)
+{
+    if (!fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+    // written entries are left uncommitted, and void
+    for (uint32_t i = 0; i < fs->batch.added; i++)
+        account_void(fs, fs->current_block_ix);
+    fs->batch.open = false;
     return 0;
 }
 
-int nvmtnvj_format(uint32_t sector_start, uint8_t sectors_per_block, uint8_t block_count, uint8_t max_value_size)
+int nvmtnvj_ctx_format(nvmtnvj_t *fs, uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count,
+                       uint8_t max_value_size)
+{
+    return nvmtnvj_ctx_format_ext(fs, sector_start, sectors_per_block, block_count, max_value_size, 0);
+}
+
+int nvmtnvj_ctx_format_ext(nvmtnvj_t *fs, uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count,
+                           uint8_t max_value_size, uint32_t flags)
 {
-    if (block_count < 2 || sectors_per_block < 1)
+    // block and tag indices are kept in 16 bits
+    if (block_count < 2 || block_count >= INDEX_NO_BLOCK || sectors_per_block < 1)
         return ERR_NVMTNVJ_INVAL;
+    if ((flags & NVMTNVJ_FORMAT_VARIABLE_SIZE) && CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS == 0)
+        return ERR_NVMTNVJ_INVAL;
+    if (fs->flash == NULL)
+        fs->flash = &flash_driver;
 
     // check that all sectors exist and are of same size
     int sect_size = 0;
     uint32_t sector_count = sectors_per_block * block_count;
     for (uint32_t s = sector_start; s < sector_start + sector_count; s++)
     {
-        int cur_sect_size = flash_get_sector_size(s);
+        int cur_sect_size = fs->flash->get_sector_size(s);
         if (cur_sect_size < 0)
             return cur_sect_size;
         if (sect_size && sect_size != cur_sect_size)
@@ -1073,127 +3816,681 @@ int nvmtnvj_format(uint32_t sector_start, uint8_t sectors_per_block, uint8_t blo
     if (sect_size % CONFIG_NVMTNVJ_FLASH_WORD_SIZE != 0)
         return ERR_NVMTNVJ_FATAL; // sector size is not aligned with configuration for flash word size
 
-    sys.state = STATE_UNMOUNTED;
-    sys.max_value_size = max_value_size;
-    sys.starting_sector = sector_start;
-    sys.nbr_of_blocks = block_count;
-    sys.sectors_per_block = sectors_per_block;
+    fs->state = STATE_UNMOUNTED;
+    fs->max_value_size = max_value_size;
+    fs->starting_sector = sector_start;
+    fs->nbr_of_blocks = block_count;
+    fs->sectors_per_block = sectors_per_block;
+    fs->variable_size = (flags & NVMTNVJ_FORMAT_VARIABLE_SIZE) != 0;
+    fs->rev = HDR_REV_WIDE;
+    work_reset(fs);
+    block_cache_clear(fs);
 
     uint32_t block_size = sect_size * sectors_per_block;
-    uint32_t tags_per_block = (block_size - ALIGNW(sizeof(block_header_t))) / tag_size();
+    uint32_t tags_per_block = tags_per_block_for(fs, block_size);
     if (tags_per_block == 0)
         return ERR_NVMTNVJ_FATAL;
+    if (fs->variable_size && tags_per_block > CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS)
+        return ERR_NVMTNVJ_INVAL;
+    if (tags_per_block > UINT16_MAX)
+        return ERR_NVMTNVJ_INVAL;
 
-    sys.state = STATE_UNMOUNTED;
+    fs->state = STATE_UNMOUNTED;
 
     // erase all and write headers
     int res = 0;
-    for (uint8_t b = 0; res == 0 && b < sys.nbr_of_blocks; b++)
+    for (uint32_t b = 0; res == 0 && b < fs->nbr_of_blocks; b++)
+    {
+        // make last block spare
+        block_type_t t = BLOCK_TYPE_DATA_FREE;
+        if (b == fs->nbr_of_blocks - 1)
+            t = BLOCK_TYPE_SPARE;
+        res = block_erase(fs, b, t);
+    }
+    return res;
+}
+
+int nvmtnvj_ctx_fix(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED)
+        return 0; // allow calling fix even if unnecessary
+    int res;
+    if (fs->evict_block_ix != UNDEF_IX && (fs->spare_block_ix != UNDEF_IX || fs->unknown_block_ix != UNDEF_IX))
+    {
+        // eviction aborted during moving live tags
+        // clean aborted spare block
+        uint32_t block_ix_to_make_spare = fs->spare_block_ix != UNDEF_IX ? fs->spare_block_ix : fs->unknown_block_ix;
+        res = block_erase(fs, block_ix_to_make_spare, BLOCK_TYPE_SPARE);
+        ERR_RET(res);
+        fs->spare_block_ix = block_ix_to_make_spare;
+
+        // evict the marked evicted block to cleaned spare block
+        tag_evict_info_t tag_info_vla[WORK_VLA_LEN(fs, fs->tags_per_block)];
+        tag_evict_info_t *tag_info = work_tag_info(fs, WORK_TAG_INFO_EVICT, tag_info_vla);
+        res = block_map_for_evict(fs, fs->evict_block_ix, tag_info);
+        ERR_RET(res);
+
+        res = block_evict(fs, fs->evict_block_ix, tag_info, fs->spare_block_ix);
+        ERR_RET(res);
+    }
+    else if (fs->spare_block_ix == UNDEF_IX && fs->current_block_ix != UNDEF_IX &&
+             ((fs->evict_block_ix != UNDEF_IX && fs->unknown_block_ix == UNDEF_IX) ||
+              (fs->evict_block_ix == UNDEF_IX && fs->unknown_block_ix != UNDEF_IX)))
+    {
+        // eviction of live tags done, but old evicting block not yet made spare
+        uint32_t block_ix_to_make_spare = fs->evict_block_ix != UNDEF_IX ? fs->evict_block_ix : fs->unknown_block_ix;
+        res = block_erase(fs, block_ix_to_make_spare, BLOCK_TYPE_SPARE);
+        ERR_RET(res);
+        fs->spare_block_ix = block_ix_to_make_spare;
+        // refresh cursor so first write after fix needs no lookups
+        res = tag_find_next_free_in_block(fs, fs->current_block_ix, &fs->current_tag_ix);
+        if (res == ERR_NVMTNVJ_NOENT)
+        {
+            fs->current_tag_ix = fs->tags_per_block;
+            res = 0;
+        }
+        ERR_RET(res);
+    }
+    else
+    {
+        return ERR_NVMTNVJ_FATAL;
+    }
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    res = index_build(fs);
+    ERR_RET(res);
+#endif
+    res = heads_spend_torn(fs);
+    ERR_RET(res);
+    fs->state = STATE_MOUNTED;
+    return 0;
+}
+
+/*
+ * Checkpoints are appended to the spare block, which otherwise is left erased until
+ * next gc. A checkpoint holds the ram index, block accounting, open heads and the
+ * block header states. It is valid for the journal state it was written in, i.e. as
+ * long as the most recent block is the same. Entries appended after it are found
+ * from the recorded heads.
+ *
+ * Mount reads block headers until it finds the spare block, and takes the states of
+ * the remaining blocks from its last checkpoint, so the headers after it and the
+ * tags before the heads are not read. A block switch voids the checkpoint first, as
+ * the states would no longer hold, and mount then reads all headers and scans the
+ * journal. Any gc erases the spare block before tags are copied to it, which is an
+ * extra erase for the first gc after checkpoints were written.
+ */
+static uint32_t checkpoint_align(nvmtnvj_t *fs, uint32_t x)
+{
+    const uint32_t a =
+        fs->write_alignment > CONFIG_NVMTNVJ_FLASH_WORD_SIZE ? fs->write_alignment : CONFIG_NVMTNVJ_FLASH_WORD_SIZE;
+    return (x + a - 1) / a * a;
+}
+
+// Finds the end of checkpoints in spare block, and offset of the last one or 0 if
+// none. Unrecognised contents are seen as filling the block.
+static int spare_probe(nvmtnvj_t *fs, uint32_t *last)
+{
+    const uint32_t start = checkpoint_align(fs, block_hdr_size(fs));
+    const uint32_t block_size = fs->sector_size * fs->sectors_per_block;
+    uint32_t offset = start;
+    *last = 0;
+    fs->spare_used = 0;
+    fs->spare_last = 0;
+    if (fs->spare_block_ix == UNDEF_IX)
+        return 0;
+    while (offset + sizeof(checkpoint_t) <= block_size)
+    {
+        checkpoint_t cp;
+        int res = block_read(fs, fs->spare_block_ix, offset, (uint8_t *)&cp, sizeof(checkpoint_t));
+        ERR_RET(res);
+        if (cp.magic == (uint16_t)CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
+            break;
+        if (cp.magic != CHECKPOINT_MAGIC || cp.size < sizeof(checkpoint_t) || offset + cp.size > block_size)
+        {
+            *last = 0;
+            offset = block_size;
+            break;
+        }
+        *last = offset;
+        offset += cp.size;
+    }
+    fs->spare_used = offset - start;
+    fs->spare_last = *last;
+    return 0;
+}
+
+// reads the commit and void units ending checkpoint of given size at offset
+static int checkpoint_seal(nvmtnvj_t *fs, uint32_t offset, uint32_t size, word_t *commit, word_t *voided)
+{
+    const uint32_t unit = checkpoint_align(fs, 1);
+    int res = block_read(fs, fs->spare_block_ix, offset + size - 2 * unit, (uint8_t *)commit, sizeof(word_t));
+    ERR_RET(res);
+    return block_read(fs, fs->spare_block_ix, offset + size - unit, (uint8_t *)voided, sizeof(word_t));
+}
+
+// Voids last checkpoint in spare block so that mount does not take block states
+// from it. Done whatever the configuration, a checkpoint may be left by another.
+static int checkpoint_void(nvmtnvj_t *fs)
+{
+    if (fs->spare_last == 0)
+        return 0;
+    const uint32_t offset = fs->spare_last;
+    fs->spare_last = 0;
+    checkpoint_t cp;
+    int res = block_read(fs, fs->spare_block_ix, offset, (uint8_t *)&cp, sizeof(checkpoint_t));
+    ERR_RET(res);
+    word_t commit, voided;
+    res = checkpoint_seal(fs, offset, cp.size, &commit, &voided);
+    ERR_RET(res);
+    if (commit != CHECKPOINT_COMMIT || voided != CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
+        return 0; // never loaded anyway
+    _dbg("void checkpoint at %d\n", offset);
+    word_t unit[checkpoint_align(fs, 1) / CONFIG_NVMTNVJ_FLASH_WORD_SIZE];
+    for (uint32_t i = 0; i < sizeof(unit) / sizeof(word_t); i++)
+        unit[i] = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
+    unit[0] = CHECKPOINT_VOID;
+    return block_write(fs, fs->spare_block_ix, offset + cp.size - sizeof(unit), (uint8_t *)unit, sizeof(unit));
+}
+
+#if CONFIG_NVMTNVJ_CHECKPOINT
+static uint8_t checkpoint_sum(uint8_t sum, const void *data, uint32_t len)
+{
+    const uint8_t *d = data;
+    for (uint32_t i = 0; i < len; i++)
+        sum += d[i];
+    return sum;
+}
+
+// offset of block states from start of checkpoint
+static uint32_t checkpoint_states_offset(const checkpoint_t *cp)
+{
+    return sizeof(checkpoint_t) + cp->index_count * sizeof(tag_index_entry_t) + cp->block_count * 2 * sizeof(uint16_t);
+}
+
+static uint32_t checkpoint_size(nvmtnvj_t *fs, const checkpoint_t *cp)
+{
+    return checkpoint_align(fs, checkpoint_states_offset(cp) + cp->state_count * sizeof(checkpoint_block_t)) +
+           2 * checkpoint_align(fs, 1);
+}
+
+// reads from checkpoint at offset, advancing it
+static int checkpoint_read(nvmtnvj_t *fs, uint32_t *offset, void *dst, uint32_t len, uint8_t *sum)
+{
+    int res = block_read(fs, fs->spare_block_ix, *offset, dst, len);
+    ERR_RET(res);
+    *offset += len;
+    *sum = checkpoint_sum(*sum, dst, len);
+    return 0;
+}
+
+// Adds entries appended to block since checkpoint, from tag_ix on, as a write would.
+// Leaves tag_ix at first free slot.
+static int checkpoint_replay(nvmtnvj_t *fs, uint32_t block_ix, uint32_t *tag_ix)
+{
+    uint8_t tmp_buf[fs->max_value_size];
+    while (*tag_ix < fs->tags_per_block)
+    {
+        tag_header_t thdr;
+        int res = tag_scan_hdr_in_block(fs, block_ix, *tag_ix, &thdr);
+        ERR_RET(res);
+        if (thdr.state == TAG_FREE)
+            break;
+        if (thdr.state == TAG_WRITTEN)
+        {
+            res = tag_read(fs, &thdr, block_ix, *tag_ix, tmp_buf);
+            ERR_RET(res);
+        }
+        if ((thdr.state == TAG_WRITTEN && res != ERR_INTERNAL_ABORTED) || thdr.state == TAG_DELETED)
+            index_add(fs, thdr.id, thdr.state, block_ix, *tag_ix);
+        else
+            account_void(fs, block_ix);
+        *tag_ix = tag_next_ix(fs, &thdr, *tag_ix);
+    }
+    return 0;
+}
+
+// Restores ram state from checkpoint at given offset in spare block. Returns 1 if
+// restored, 0 if there is no valid checkpoint for the journal state.
+static int checkpoint_load(nvmtnvj_t *fs, uint32_t offset)
+{
+    if (offset == 0)
+        return 0;
+    checkpoint_t cp;
+    uint8_t sum = 0;
+    int res = checkpoint_read(fs, &offset, &cp, sizeof(checkpoint_t), &sum);
+    ERR_RET(res);
+    if (cp.max_seq_nbr != fs->max_seq_nbr || cp.current_block_ix != fs->current_block_ix ||
+        cp.current_tag_ix > fs->tags_per_block || cp.head_tag_ix > fs->tags_per_block ||
+        (cp.head_block_ix != CHECKPOINT_NO_BLOCK && cp.head_block_ix >= fs->nbr_of_blocks) ||
+        (cp.block_count != 0 && cp.block_count != fs->nbr_of_blocks) || checkpoint_size(fs, &cp) > cp.size)
+    {
+        _dbg("checkpoint stale\n");
+        return 0;
+    }
+    word_t commit, voided;
+    res = checkpoint_seal(fs, offset - sizeof(checkpoint_t), cp.size, &commit, &voided);
+    ERR_RET(res);
+    if (commit != CHECKPOINT_COMMIT || voided != CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
+    {
+        _dbg("checkpoint torn or void\n");
+        return 0;
+    }
+    // restored as read, a bad sum leaves it all to index_build
+    index_clear(fs);
+    account_clear(fs);
+    for (uint32_t i = 0; i < cp.index_count; i++)
+    {
+        tag_index_entry_t ce;
+        res = checkpoint_read(fs, &offset, &ce, sizeof(tag_index_entry_t), &sum);
+        ERR_RET(res);
+        tag_index_entry_t *e = index_find(fs, ce.id, true);
+        if (e != NULL)
+            index_set(fs, e, ce.state, ce.block_ix, ce.tag_ix);
+    }
+    for (uint32_t b = 0; b < cp.block_count; b++)
+    {
+        uint16_t counts[2];
+        res = checkpoint_read(fs, &offset, counts, sizeof(counts), &sum);
+        ERR_RET(res);
+        account_set(fs, b, counts[0], counts[1]);
+    }
+    if (sum != 0)
+    {
+        _dbg("checkpoint broken\n");
+        return 0;
+    }
+    fs->index.valid = true;
+    fs->index.complete = fs->index.complete && cp.index_complete;
+    if (cp.block_count == 0 && accounting_valid(fs))
+        return 0; // written without block accounting
+    fs->gcs_since_wear_level = cp.gcs_since_wear_level;
+
+    // head is older than current block, its entries go first
+    uint32_t head_tag_ix = cp.head_tag_ix;
+    if (cp.head_block_ix != CHECKPOINT_NO_BLOCK)
+    {
+        res = checkpoint_replay(fs, cp.head_block_ix, &head_tag_ix);
+        ERR_RET(res);
+    }
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    fs->head.current_hot = true;
+    fs->head.block_ix = cp.head_block_ix == CHECKPOINT_NO_BLOCK ? UNDEF_IX : cp.head_block_ix;
+    fs->head.tag_ix = head_tag_ix;
+#endif
+    fs->current_tag_ix = cp.current_tag_ix;
+    res = checkpoint_replay(fs, fs->current_block_ix, &fs->current_tag_ix);
+    ERR_RET(res);
+    fs->checkpointed = fs->current_tag_ix == cp.current_tag_ix && head_tag_ix == cp.head_tag_ix;
+    _dbg("checkpoint loaded, %d tags since\n", fs->current_tag_ix - cp.current_tag_ix + head_tag_ix - cp.head_tag_ix);
+    return 1;
+}
+
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+// Reads block headers up to the spare block, and takes the states of the others
+// from its last checkpoint if that holds, leaving all in the block cache. Sets
+// offset of the checkpoint, or UNDEF_IX if the spare block was not probed.
+static int checkpoint_load_blocks(nvmtnvj_t *fs, uint32_t *offset)
+{
+    *offset = UNDEF_IX;
+    if (!block_cache_enabled(fs))
+        return 0;
+    int res;
+    uint32_t spare_block_ix = UNDEF_IX;
+    for (uint32_t b = 0; b < fs->nbr_of_blocks && spare_block_ix == UNDEF_IX; b++)
+    {
+        block_type_t btype;
+        res = block_read_state(fs, b, &btype, NULL);
+        ERR_RET(res);
+        if (btype == BLOCK_TYPE_SPARE)
+            spare_block_ix = b;
+    }
+    if (spare_block_ix == UNDEF_IX)
+        return 0;
+    fs->spare_block_ix = spare_block_ix;
+    res = spare_probe(fs, offset);
+    ERR_RET(res);
+    if (*offset == 0)
+        return 0;
+    checkpoint_t cp;
+    res = block_read(fs, spare_block_ix, *offset, (uint8_t *)&cp, sizeof(checkpoint_t));
+    ERR_RET(res);
+    if (cp.state_count != fs->nbr_of_blocks || checkpoint_size(fs, &cp) > cp.size)
+        return 0;
+    word_t commit, voided;
+    res = checkpoint_seal(fs, *offset, cp.size, &commit, &voided);
+    ERR_RET(res);
+    if (commit != CHECKPOINT_COMMIT || voided != CONFIG_NVMTNVJ_FLASH_WORD_ERASED)
+        return 0;
+
+    // headers already read must match, the others are taken as read
+    bool match = true;
+    uint8_t sum = cp.state_chk;
+    uint32_t state_offset = *offset + checkpoint_states_offset(&cp);
+    checkpoint_block_t states[8];
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
+    {
+        const uint32_t i = b % (sizeof(states) / sizeof(states[0]));
+        if (i == 0)
+        {
+            uint32_t len = (fs->nbr_of_blocks - b) * sizeof(checkpoint_block_t);
+            if (len > sizeof(states))
+                len = sizeof(states);
+            res = block_read(fs, spare_block_ix, state_offset, (uint8_t *)states, len);
+            ERR_RET(res);
+            state_offset += len;
+            sum = checkpoint_sum(sum, states, len);
+        }
+        block_info_t *bi = &fs->block_info[b];
+        if (bi->hdr_cached)
+        {
+            match = match && bi->type == states[i].type && bi->seq_nbr == states[i].seq_nbr &&
+                    bi->erase_count == states[i].erase_count;
+            continue;
+        }
+        bi->type = (uint8_t)states[i].type;
+        bi->seq_nbr = states[i].seq_nbr;
+        bi->erase_count = states[i].erase_count;
+        bi->hdr_cached = true;
+    }
+    if (!match || sum != 0)
+    {
+        _dbg("checkpoint block states do not hold\n");
+        block_cache_clear(fs);
+        return 0;
+    }
+    _dbg("block states from checkpoint, %d headers read\n", spare_block_ix + 1);
+    return 0;
+}
+#else
+#define checkpoint_load_blocks(fs, offset) (*(offset) = UNDEF_IX, 0)
+#endif
+
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+static int checkpoint_block_state(nvmtnvj_t *fs, uint32_t block_ix, checkpoint_block_t *state)
+{
+    block_type_t btype;
+    word_t seq_nbr, erase_count;
+    int res = block_read_state(fs, block_ix, &btype, &seq_nbr);
+    ERR_RET(res);
+    res = block_read_erase_count(fs, block_ix, &erase_count);
+    ERR_RET(res);
+    *state = (checkpoint_block_t){.seq_nbr = seq_nbr, .erase_count = erase_count, .type = btype};
+    return 0;
+}
+#endif
+
+typedef struct
+{
+    nvmtnvj_t *fs;
+    uint8_t *buf; // NULL when only summing
+    uint32_t buf_size;
+    uint32_t fill;
+    uint32_t offset; // of buf in spare block
+    uint8_t sum;
+} checkpoint_writer_t;
+
+static int checkpoint_emit(checkpoint_writer_t *w, const void *data, uint32_t len)
+{
+    const uint8_t *d = data;
+    w->sum = checkpoint_sum(w->sum, data, len);
+    if (w->buf == NULL)
+        return 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        w->buf[w->fill++] = d[i];
+        if (w->fill < w->buf_size)
+            continue;
+        int res = block_write(w->fs, w->fs->spare_block_ix, w->offset, w->buf, w->fill);
+        ERR_RET(res);
+        w->offset += w->fill;
+        w->fill = 0;
+    }
+    return 0;
+}
+
+static int checkpoint_emit_all(nvmtnvj_t *fs, checkpoint_writer_t *w, const checkpoint_t *cp)
+{
+    int res = checkpoint_emit(w, cp, sizeof(checkpoint_t));
+    ERR_RET(res);
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_TAG_INDEX_SIZE; i++)
     {
-        // make last block spare
-        block_type_t t = BLOCK_TYPE_DATA_FREE;
-        if (b == sys.nbr_of_blocks - 1)
-            t = BLOCK_TYPE_SPARE;
-        res = block_erase(b, t);
+        if (fs->index.entries[i].state == TAG_FREE)
+            continue;
+        res = checkpoint_emit(w, &fs->index.entries[i], sizeof(tag_index_entry_t));
+        ERR_RET(res);
     }
-    return res;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    for (uint32_t b = 0; b < cp->block_count; b++)
+    {
+        const uint16_t counts[2] = {fs->block_info[b].used, fs->block_info[b].freeable};
+        res = checkpoint_emit(w, counts, sizeof(counts));
+        ERR_RET(res);
+    }
+    // block states are summed by state_chk, not by chk
+    const uint8_t sum = w->sum;
+    for (uint32_t b = 0; b < cp->state_count; b++)
+    {
+        checkpoint_block_t state;
+        res = checkpoint_block_state(fs, b, &state);
+        ERR_RET(res);
+        res = checkpoint_emit(w, &state, sizeof(state));
+        ERR_RET(res);
+    }
+    w->sum = sum;
+#endif
+    return 0;
 }
 
-int nvmtnvj_fix(void)
+// Appends checkpoint of ram state to spare block, erasing the block first if full.
+// Nothing is written if nothing changed since last checkpoint.
+static int checkpoint_write(nvmtnvj_t *fs)
 {
-    if (sys.state == STATE_UNMOUNTED)
-        return ERR_NVMTNVJ_MOUNT;
-    if (sys.state == STATE_MOUNTED)
-        return 0; // allow calling fix even if unnecessary
+    if (fs->checkpointed || fs->flash_failed || !fs->index.valid || fs->spare_block_ix == UNDEF_IX)
+        return 0;
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    if (fs->gc.phase != GC_IDLE)
+        return 0; // spare block is taken
+#endif
+    checkpoint_t cp = {
+        .magic = CHECKPOINT_MAGIC,
+        .index_complete = fs->index.complete,
+        .max_seq_nbr = fs->max_seq_nbr,
+        .current_block_ix = (uint16_t)fs->current_block_ix,
+        .current_tag_ix = (uint16_t)fs->current_tag_ix,
+        .head_block_ix = CHECKPOINT_NO_BLOCK,
+        .block_count = accounting_valid(fs) ? (uint16_t)fs->nbr_of_blocks : 0,
+        .gcs_since_wear_level = fs->gcs_since_wear_level > UINT16_MAX ? UINT16_MAX : fs->gcs_since_wear_level,
+    };
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    if (fs->head.block_ix != UNDEF_IX)
+    {
+        cp.head_block_ix = (uint16_t)fs->head.block_ix;
+        cp.head_tag_ix = (uint16_t)fs->head.tag_ix;
+    }
+#endif
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_TAG_INDEX_SIZE; i++)
+        cp.index_count += fs->index.entries[i].state != TAG_FREE;
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    if (block_cache_enabled(fs))
+        cp.state_count = (uint16_t)fs->nbr_of_blocks;
+#endif
+    const uint32_t start = checkpoint_align(fs, block_hdr_size(fs));
+    const uint32_t block_size = fs->sector_size * fs->sectors_per_block;
+    if (start + checkpoint_size(fs, &cp) > block_size)
+        cp.state_count = 0; // without block states, mount reads all headers
+    const uint32_t size = checkpoint_size(fs, &cp);
+    if (start + size > block_size || size > UINT16_MAX)
+        return ERR_NVMTNVJ_FULL;
+    cp.size = (uint16_t)size;
     int res;
-    if (sys.evict_block_ix != UNDEF_IX && (sys.spare_block_ix != UNDEF_IX || sys.unknown_block_ix != UNDEF_IX))
+    if (start + fs->spare_used + size > block_size)
     {
-        // eviction aborted during moving live tags
-        // clean aborted spare block
-        uint32_t block_ix_to_make_spare = sys.spare_block_ix != UNDEF_IX ? sys.spare_block_ix : sys.unknown_block_ix;
-        res = block_erase(block_ix_to_make_spare, BLOCK_TYPE_SPARE);
+        res = spare_clean(fs);
         ERR_RET(res);
-        sys.spare_block_ix = block_ix_to_make_spare;
-
-        // evict the marked evicted block to cleaned spare block
-        uint32_t sorted_block_list[sys.nbr_of_blocks];
-        word_t sorted_seq_nbr_list[sys.nbr_of_blocks];
-        sorted_blocks_t sorted_blocks = {
-            .blocks = sorted_block_list,
-            .seq_nbrs = sorted_seq_nbr_list,
-            .count = 0};
-        res = blocks_sort(&sorted_blocks);
-        ERR_RET(res);
-
-        tag_evict_info_t tag_info[sys.tags_per_block];
-        uint32_t sorted_evict_block_ix = UNDEF_IX;
-        for (uint32_t b = 0; b < sorted_blocks.count; b++)
-        {
-            if (sorted_blocks.blocks[b] == sys.evict_block_ix)
-            {
-                sorted_evict_block_ix = b;
-                break;
-            }
-        }
-        if (sorted_evict_block_ix == UNDEF_IX)
-            return ERR_NVMTNVJ_FATAL;
-
-        res = block_find_freeables(sorted_evict_block_ix, &sorted_blocks, tag_info);
+    }
+#if CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    // after cleaning, which counts an erase of the spare block
+    for (uint32_t b = 0; b < cp.state_count; b++)
+    {
+        checkpoint_block_t state;
+        res = checkpoint_block_state(fs, b, &state);
         ERR_RET(res);
+        cp.state_chk = checkpoint_sum(cp.state_chk, &state, sizeof(state));
+    }
+    cp.state_chk = (uint8_t)(0 - cp.state_chk);
+#endif
 
-        res = block_evict(sys.evict_block_ix, tag_info, sys.spare_block_ix);
+    // sum first, for the record to sum up to zero
+    checkpoint_writer_t w = {.fs = fs};
+    res = checkpoint_emit_all(fs, &w, &cp);
+    ERR_RET(res);
+    cp.chk = (uint8_t)(0 - w.sum);
+    word_t staging[checkpoint_align(fs, 64) / CONFIG_NVMTNVJ_FLASH_WORD_SIZE];
+    w = (checkpoint_writer_t){
+        .fs = fs, .buf = (uint8_t *)staging, .buf_size = sizeof(staging), .offset = start + fs->spare_used};
+    res = checkpoint_emit_all(fs, &w, &cp);
+    ERR_RET(res);
+    if (w.fill > 0)
+    {
+        const uint32_t len = checkpoint_align(fs, w.fill);
+        for (uint32_t i = w.fill; i < len; i++)
+            w.buf[i] = (uint8_t)CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
+        res = block_write(fs, fs->spare_block_ix, w.offset, w.buf, len);
         ERR_RET(res);
     }
-    else if (sys.spare_block_ix == UNDEF_IX && sys.current_block_ix != UNDEF_IX &&
-             ((sys.evict_block_ix != UNDEF_IX && sys.unknown_block_ix == UNDEF_IX) ||
-              (sys.evict_block_ix == UNDEF_IX && sys.unknown_block_ix != UNDEF_IX)))
+    // commit last, a torn record is never loaded and its size still known from header.
+    // The void unit after it is left erased
+    word_t commit[checkpoint_align(fs, 1) / CONFIG_NVMTNVJ_FLASH_WORD_SIZE];
+    for (uint32_t i = 0; i < sizeof(commit) / sizeof(word_t); i++)
+        commit[i] = CONFIG_NVMTNVJ_FLASH_WORD_ERASED;
+    commit[0] = CHECKPOINT_COMMIT;
+    res = block_write(fs, fs->spare_block_ix, start + fs->spare_used + size - 2 * sizeof(commit),
+                      (uint8_t *)commit, sizeof(commit));
+    ERR_RET(res);
+    _dbg("checkpoint at %d, %d bytes\n", start + fs->spare_used, size);
+    fs->spare_last = start + fs->spare_used;
+    fs->spare_used += size;
+    fs->checkpointed = true;
+    return 0;
+}
+#else
+#define checkpoint_load(fs, offset) ((void)(offset), 0)
+#define checkpoint_load_blocks(fs, offset) (*(offset) = UNDEF_IX, 0)
+#define checkpoint_write(fs) 0
+#endif
+
+int nvmtnvj_ctx_checkpoint(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED_INCONSISTENT)
+        return ERR_NVMTNVJ_FS_ABORTED;
+    if (fs->batch.open)
+        return ERR_NVMTNVJ_BATCH;
+#if CONFIG_NVMTNVJ_CHECKPOINT
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    // ongoing incremental gc has the spare block
+    if (fs->gc.phase != GC_IDLE)
     {
-        // eviction of live tags done, but old evicting block not yet made spare
-        uint32_t block_ix_to_make_spare = sys.evict_block_ix != UNDEF_IX ? sys.evict_block_ix : sys.unknown_block_ix;
-        res = block_erase(block_ix_to_make_spare, BLOCK_TYPE_SPARE);
+        int res = gc_finish(fs);
         ERR_RET(res);
-        sys.spare_block_ix = block_ix_to_make_spare;
-        // refresh cursor so first write after fix needs no lookups
-        res = tag_find_next_free_in_block(sys.current_block_ix, &sys.current_tag_ix);
-        if (res == ERR_NVMTNVJ_NOENT)
+        while (fs->gc.phase != GC_IDLE)
         {
-            sys.current_tag_ix = sys.tags_per_block;
-            res = 0;
+            res = gc_step_once(fs);
+            ERR_RET(res);
         }
-        ERR_RET(res);
     }
-    else
+#endif
+    return checkpoint_write(fs);
+#else
+    return ERR_NVMTNVJ_INVAL;
+#endif
+}
+
+int nvmtnvj_ctx_unmount(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->state == STATE_MOUNTED && !fs->batch.open)
     {
-        return ERR_NVMTNVJ_FATAL;
+        int res = nvmtnvj_ctx_flush(fs);
+        ERR_RET(res);
+        res = checkpoint_write(fs);
+        if (res != ERR_NVMTNVJ_FULL) // index too large, next mount scans
+            ERR_RET(res);
     }
-    sys.state = STATE_MOUNTED;
+    cache_clear(fs);
+    fs->state = STATE_UNMOUNTED;
+    work_reset(fs);
+    // an open batch is never committed
+    fs->batch.open = false;
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    fs->index.valid = false;
+#endif
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    // an ongoing incremental gc is mended by nvmtnvj_fix after next mount
+    fs->gc.phase = GC_IDLE;
+#endif
     return 0;
 }
 
-int nvmtnvj_unmount(void)
+uint32_t nvmtnvj_work_size(uint32_t block_size, uint32_t block_count, uint8_t max_value_size, uint32_t flags)
 {
-    if (sys.state == STATE_UNMOUNTED)
-        return ERR_NVMTNVJ_MOUNT;
-    sys.state = STATE_UNMOUNTED;
-    return 0;
+    // bound by the smallest block header of all revisions
+    uint32_t hdr_size = ALIGNW(offsetof(block_header_t, erase_count));
+    uint32_t slot_size = (flags & NVMTNVJ_FORMAT_VARIABLE_SIZE) ? CONFIG_NVMTNVJ_FLASH_WORD_SIZE
+                                                                : ALIGNW(sizeof(tag_header_t) + max_value_size);
+    uint32_t tags_per_block = block_size > hdr_size ? (block_size - hdr_size) / slot_size : 0;
+    return work_layout(NULL, NULL, block_count, tags_per_block);
+}
+
+int nvmtnvj_ctx_mount(nvmtnvj_t *fs, uint32_t sector_start, uint32_t max_lookahead_sectors)
+{
+    return nvmtnvj_ctx_mount_work(fs, sector_start, max_lookahead_sectors, NULL, 0);
 }
 
-int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors)
+int nvmtnvj_ctx_mount_work(nvmtnvj_t *fs, uint32_t sector_start, uint32_t max_lookahead_sectors, void *work,
+                           uint32_t work_size)
 {
     int res;
     block_header_t bhdr;
 
-    if (sys.state != STATE_UNMOUNTED)
+    if (fs->state != STATE_UNMOUNTED)
         return ERR_NVMTNVJ_MOUNT;
-    sys.starting_sector = sector_start;
+    if ((uintptr_t)work % sizeof(uint32_t) != 0)
+        return ERR_NVMTNVJ_INVAL;
+    if (fs->flash == NULL)
+        fs->flash = &flash_driver;
+    work_reset(fs);
+    fs->starting_sector = sector_start;
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    fs->index.valid = false;
+#endif
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    fs->gc.phase = GC_IDLE;
+#endif
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    fs->head.block_ix = UNDEF_IX;
+#endif
+    fs->gcs_since_wear_level = 0;
+    fs->stats = (stats_t){0};
+    fs->spare_used = 0;
+    fs->spare_last = 0;
+    fs->flash_failed = false;
 
     // find first valid block header
     uint32_t phys_sector_start = sector_start - 1;
     for (uint32_t s = sector_start; s <= sector_start + max_lookahead_sectors; s++)
     {
-        res = flash_read(s, 0, (uint8_t *)&bhdr, sizeof(block_header_t));
+        res = fs->flash->read(s, 0, (uint8_t *)&bhdr, sizeof(block_header_t));
         ERR_RET(res);
-        if (bhdr.descr.magic != MAGIC)
+        if (!magic_parse(bhdr.descr.magic, &fs->rev, &fs->variable_size))
+            continue;
+        // header of a block being erased may be partly written
+        if (hdr_sectors_per_block(fs->rev, &bhdr) == 0 || hdr_nbr_of_blocks(fs->rev, &bhdr) == 0 ||
+            bhdr.descr.max_value_size == 0)
             continue;
         phys_sector_start = s;
         break;
@@ -1201,24 +4498,40 @@ int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors)
     if (phys_sector_start == sector_start - 1)
         return ERR_NVMTNVJ_NOFS; // no block header found in any sector
     if (phys_sector_start != sector_start &&
-        phys_sector_start - sector_start != bhdr.descr.sectors_per_block)
+        phys_sector_start - sector_start != hdr_sectors_per_block(fs->rev, &bhdr))
         return ERR_NVMTNVJ_NOFS; // sectors per block mismatch
 
-    sys.nbr_of_blocks = bhdr.descr.nbr_of_blocks;
-    sys.sectors_per_block = bhdr.descr.sectors_per_block;
-    sys.max_value_size = bhdr.descr.max_value_size;
+    fs->nbr_of_blocks = hdr_nbr_of_blocks(fs->rev, &bhdr);
+    fs->sectors_per_block = hdr_sectors_per_block(fs->rev, &bhdr);
+    fs->max_value_size = bhdr.descr.max_value_size;
+    if (fs->nbr_of_blocks >= INDEX_NO_BLOCK)
+        return ERR_NVMTNVJ_NOFS;
 
     // sector size validation
-    int sect_size = flash_get_sector_size(sector_start);
+    int sect_size = fs->flash->get_sector_size(sector_start);
     if (sect_size < 0)
         return sect_size;
-    sys.sector_size = sect_size;
+    fs->sector_size = sect_size;
     if (sect_size % CONFIG_NVMTNVJ_FLASH_WORD_SIZE != 0)
         return ERR_NVMTNVJ_FATAL; // sector size is not aligned with configuration for flash word size
-    uint32_t block_size = sect_size * sys.sectors_per_block;
-    sys.tags_per_block = (block_size - ALIGNW(sizeof(block_header_t))) / tag_size();
-    if (sys.tags_per_block == 0)
+    int write_alignment = fs->flash->get_sector_alignment(sector_start, FLASH_OP_WRITE);
+    if (write_alignment < 0)
+        return write_alignment;
+    fs->write_alignment = write_alignment;
+    uint32_t block_size = sect_size * fs->sectors_per_block;
+    fs->tags_per_block = tags_per_block_for(fs, block_size);
+    if (fs->tags_per_block == 0)
         return ERR_NVMTNVJ_FATAL; // this prevents the purpose of this module
+    if (fs->variable_size && fs->tags_per_block > CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS)
+        return ERR_NVMTNVJ_INVAL; // not supported by configuration
+    if (fs->tags_per_block > UINT16_MAX)
+        return ERR_NVMTNVJ_INVAL;
+    if (work)
+    {
+        if (work_layout(NULL, NULL, fs->nbr_of_blocks, fs->tags_per_block) > work_size)
+            return ERR_NVMTNVJ_INVAL;
+        work_layout(fs, work, fs->nbr_of_blocks, fs->tags_per_block);
+    }
 
     // check fs consistency
     uint32_t data_min_seq_block_ix = UNDEF_IX;
@@ -1226,22 +4539,32 @@ int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors)
     uint32_t unknown_block_ix = UNDEF_IX;
     uint32_t spare_block_ix = UNDEF_IX;
     uint32_t evict_block_ix = UNDEF_IX;
-    uint8_t data_block_count = 0;
-    sys.min_seq_nbr = SEQ_NBR_UNWRITTEN;
-    sys.max_seq_nbr = SEQ_NBR_UNWRITTEN;
-    for (uint8_t b = 0; b < sys.nbr_of_blocks; b++)
+    uint32_t data_block_count = 0;
+    fs->free_block_count = 0;
+    fs->min_seq_nbr = SEQ_NBR_UNWRITTEN;
+    fs->max_seq_nbr = SEQ_NBR_UNWRITTEN;
+    block_cache_clear(fs);
+    block_content_changed(fs, UNDEF_IX);
+    fs->spare_block_ix = UNDEF_IX;
+    uint32_t checkpoint_offset;
+    res = checkpoint_load_blocks(fs, &checkpoint_offset);
+    ERR_RET(res);
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
     {
-        res = block_read_hdr(b, &bhdr);
+        block_type_t btype;
+        word_t seq_nbr;
+        res = block_read_state(fs, b, &btype, &seq_nbr);
         ERR_RET(res);
-        switch (block_type(&bhdr))
+        switch (btype)
         {
         case BLOCK_TYPE_DATA:
-            seq_nbr_update_extrema(bhdr.seq_nbr, b, &sys.min_seq_nbr, &data_min_seq_block_ix,
-                                   &sys.max_seq_nbr, &data_max_seq_block_ix);
+            seq_nbr_update_extrema(seq_nbr, b, &fs->min_seq_nbr, &data_min_seq_block_ix,
+                                   &fs->max_seq_nbr, &data_max_seq_block_ix);
             data_block_count++;
             break;
         case BLOCK_TYPE_DATA_FREE:
             data_block_count++;
+            fs->free_block_count++;
             break;
         // there can be only one (of each) by design - else borked beyond repair
         case BLOCK_TYPE_EVICTING:
@@ -1261,7 +4584,7 @@ int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors)
             break;
         }
     }
-    if (data_block_count < sys.nbr_of_blocks - 2 || data_block_count > sys.nbr_of_blocks - 1)
+    if (data_block_count < fs->nbr_of_blocks - 2 || data_block_count > fs->nbr_of_blocks - 1)
         return ERR_NVMTNVJ_NOFS;
     // cannot have all
     if (unknown_block_ix != UNDEF_IX && spare_block_ix != UNDEF_IX && evict_block_ix != UNDEF_IX)
@@ -1270,58 +4593,79 @@ int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors)
     if (unknown_block_ix == UNDEF_IX && spare_block_ix == UNDEF_IX && evict_block_ix == UNDEF_IX)
         return ERR_NVMTNVJ_NOFS;
 
-    sys.spare_block_ix = spare_block_ix;
-    sys.evict_block_ix = evict_block_ix;
-    sys.unknown_block_ix = unknown_block_ix;
+    fs->spare_block_ix = spare_block_ix;
+    fs->evict_block_ix = evict_block_ix;
+    fs->unknown_block_ix = unknown_block_ix;
 
-    if (sys.min_seq_nbr == SEQ_NBR_UNWRITTEN)
+    if (fs->min_seq_nbr == SEQ_NBR_UNWRITTEN)
     {
         // no data pages, only data_free, just formatted - make our data page
-        res = block_alloc(&data_max_seq_block_ix, &sys.max_seq_nbr);
+        res = block_alloc(fs, &data_max_seq_block_ix, &fs->max_seq_nbr);
         ERR_RET(res);
-        sys.min_seq_nbr = sys.max_seq_nbr;
+        fs->min_seq_nbr = fs->max_seq_nbr;
         data_min_seq_block_ix = data_max_seq_block_ix;
     }
 
-    sys.current_block_ix = data_max_seq_block_ix;
+    fs->current_block_ix = data_max_seq_block_ix;
 
     // sort out mount state
-    if (data_block_count == sys.nbr_of_blocks - 1 && spare_block_ix != UNDEF_IX)
-        sys.state = STATE_MOUNTED;
-    else if ((data_block_count == sys.nbr_of_blocks - 2 && evict_block_ix != UNDEF_IX && spare_block_ix != UNDEF_IX) ||
-             (data_block_count == sys.nbr_of_blocks - 2 && evict_block_ix != UNDEF_IX && unknown_block_ix != UNDEF_IX) ||
-             (data_block_count == sys.nbr_of_blocks - 1 && evict_block_ix != UNDEF_IX) ||
-             (data_block_count == sys.nbr_of_blocks - 1 && unknown_block_ix != UNDEF_IX))
-        sys.state = STATE_MOUNTED_INCONSISTENT;
-
-    sys.current_tag_ix = UNDEF_IX;
-    if (sys.state == STATE_MOUNTED)
-    {
-        res = tag_find_next_free_in_block(sys.current_block_ix, &sys.current_tag_ix);
+    if (data_block_count == fs->nbr_of_blocks - 1 && spare_block_ix != UNDEF_IX)
+        fs->state = STATE_MOUNTED;
+    else if ((data_block_count == fs->nbr_of_blocks - 2 && evict_block_ix != UNDEF_IX && spare_block_ix != UNDEF_IX) ||
+             (data_block_count == fs->nbr_of_blocks - 2 && evict_block_ix != UNDEF_IX && unknown_block_ix != UNDEF_IX) ||
+             (data_block_count == fs->nbr_of_blocks - 1 && evict_block_ix != UNDEF_IX) ||
+             (data_block_count == fs->nbr_of_blocks - 1 && unknown_block_ix != UNDEF_IX))
+        fs->state = STATE_MOUNTED_INCONSISTENT;
+
+    fs->current_tag_ix = UNDEF_IX;
+    if (fs->state == STATE_MOUNTED)
+    {
+        if (checkpoint_offset == UNDEF_IX)
+        {
+            res = spare_probe(fs, &checkpoint_offset);
+            ERR_RET(res);
+        }
+        res = checkpoint_load(fs, checkpoint_offset);
+        ERR_RET(res);
+    }
+    if (fs->state == STATE_MOUNTED && res == 0)
+    {
+        res = tag_find_next_free_in_block(fs, fs->current_block_ix, &fs->current_tag_ix);
         if (res == ERR_NVMTNVJ_NOENT)
         {
-            sys.current_tag_ix = sys.tags_per_block;
+            fs->current_tag_ix = fs->tags_per_block;
             res = 0;
         }
         ERR_RET(res);
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+        res = index_build(fs);
+        ERR_RET(res);
+#endif
+        res = head_recover(fs);
+        ERR_RET(res);
+    }
+    if (fs->state == STATE_MOUNTED)
+    {
+        res = heads_spend_torn(fs);
+        ERR_RET(res);
     }
 
-    _dbg("sys.state:                %d\n", sys.state);
-    _dbg("sys.starting_sector:      %d\n", sys.starting_sector);
-    _dbg("sys.sector_size:          %d\n", sys.sector_size);
-    _dbg("sys.sectors_per_block:    %d\n", sys.sectors_per_block);
-    _dbg("sys.nbr_of_blocks:        %d\n", sys.nbr_of_blocks);
-    _dbg("sys.tags_per_block:       %d\n", sys.tags_per_block);
-    _dbg("sys.max_value_size:       %d\n", sys.max_value_size);
-    _dbg("sys.current_block_ix:     %d\n", sys.current_block_ix);
-    _dbg("sys.current_tag_ix:       %d\n", sys.current_tag_ix);
-    _dbg("sys.spare_block_ix:       %d\n", sys.spare_block_ix);
-    _dbg("sys.evict_block_ix:       %d\n", sys.evict_block_ix);
-    _dbg("sys.unknown_block_ix:     %d\n", sys.unknown_block_ix);
-    _dbg("sys.min_seq_nbr:          %d\n", sys.min_seq_nbr);
-    _dbg("sys.max_seq_nbr:          %d\n", sys.max_seq_nbr);
+    _dbg("fs->state:                %d\n", fs->state);
+    _dbg("fs->starting_sector:      %d\n", fs->starting_sector);
+    _dbg("fs->sector_size:          %d\n", fs->sector_size);
+    _dbg("fs->sectors_per_block:    %d\n", fs->sectors_per_block);
+    _dbg("fs->nbr_of_blocks:        %d\n", fs->nbr_of_blocks);
+    _dbg("fs->tags_per_block:       %d\n", fs->tags_per_block);
+    _dbg("fs->max_value_size:       %d\n", fs->max_value_size);
+    _dbg("fs->current_block_ix:     %d\n", fs->current_block_ix);
+    _dbg("fs->current_tag_ix:       %d\n", fs->current_tag_ix);
+    _dbg("fs->spare_block_ix:       %d\n", fs->spare_block_ix);
+    _dbg("fs->evict_block_ix:       %d\n", fs->evict_block_ix);
+    _dbg("fs->unknown_block_ix:     %d\n", fs->unknown_block_ix);
+    _dbg("fs->min_seq_nbr:          %d\n", fs->min_seq_nbr);
+    _dbg("fs->max_seq_nbr:          %d\n", fs->max_seq_nbr);
 
-    switch (sys.state)
+    switch (fs->state)
     {
     case STATE_MOUNTED:
         return 0;
@@ -1332,34 +4676,337 @@ int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors)
     }
 }
 
+void nvmtnvj_ctx_init(nvmtnvj_t *fs)
+{
+    fs->state = STATE_UNMOUNTED;
+    fs->flash = &flash_driver;
+    fs->batch.open = false;
+    cache_clear(fs);
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    fs->index.valid = false;
+#endif
+#if CONFIG_NVMTNVJ_GC_STEP_TAGS_PER_BLOCK > 0
+    fs->gc.phase = GC_IDLE;
+#endif
+}
+
+int nvmtnvj_ctx_set_flash(nvmtnvj_t *fs, const nvmtnvj_flash_t *flash)
+{
+    if (fs->state != STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    fs->flash = flash ? flash : &flash_driver;
+    return 0;
+}
+
+int nvmtnvj_ctx_wear(nvmtnvj_t *fs, nvmtnvj_wear_t *wear)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    if (fs->rev == HDR_REV_LEGACY)
+        return ERR_NVMTNVJ_NOENT; // formatted without erase counts
+    word_t min, max;
+    uint64_t sum;
+    uint32_t count;
+    int res = blocks_wear(fs, &min, &max, &sum, &count);
+    ERR_RET(res);
+    wear->min = min;
+    wear->max = max;
+    wear->mean = count ? (uint32_t)(sum / count) : 0;
+    return 0;
+}
+
+// All from ram book keeping, no flash is read.
+int nvmtnvj_ctx_stats(nvmtnvj_t *fs, nvmtnvj_stats_t *stats)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    const bool spare = fs->spare_block_ix != UNDEF_IX;
+    stats->free_slots = fs->free_block_count * fs->tags_per_block;
+    if (fs->current_tag_ix < fs->tags_per_block)
+        stats->free_slots += fs->tags_per_block - fs->current_tag_ix;
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    if (fs->head.block_ix != UNDEF_IX && fs->head.tag_ix < fs->tags_per_block)
+        stats->free_slots += fs->tags_per_block - fs->head.tag_ix;
+#endif
+    stats->live_tags = NVMTNVJ_STATS_UNKNOWN;
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0
+    if (fs->index.valid && fs->index.complete)
+        stats->live_tags = fs->stats.live;
+#endif
+    stats->dead_tags = NVMTNVJ_STATS_UNKNOWN;
+    stats->freeable_tags = NVMTNVJ_STATS_UNKNOWN;
+    if (accounting_valid(fs))
+    {
+        stats->dead_tags = fs->stats.used - fs->stats.live;
+        stats->freeable_tags = fs->stats.freeable;
+    }
+    stats->data_blocks = fs->nbr_of_blocks - fs->free_block_count - (spare ? 1 : 0);
+    stats->free_blocks = fs->free_block_count;
+    stats->spare_blocks = spare ? 1 : 0;
+    stats->seq_nbr_span = seq_nbr_diff(fs->max_seq_nbr, fs->min_seq_nbr);
+    stats->bytes_written = fs->stats.bytes_written;
+    stats->erases = fs->stats.erases;
+    stats->gc_count = fs->stats.gcs;
+    stats->gc_copied_tags = fs->stats.copied_tags;
+    stats->gc_bytes_written = fs->stats.gc_bytes_written;
+    stats->gc_erases = fs->stats.gc_erases;
+    stats->lookups = fs->stats.lookups;
+    stats->lookup_depth_x100 =
+        fs->stats.lookups ? (uint32_t)((uint64_t)fs->stats.lookup_blocks * 100 / fs->stats.lookups) : 0;
+    return 0;
+}
+
+int nvmtnvj_ctx_max_value_size(nvmtnvj_t *fs)
+{
+    if (fs->state == STATE_UNMOUNTED)
+        return ERR_NVMTNVJ_MOUNT;
+    return fs->max_value_size;
+}
+
+nvmtnvj_t *nvmtnvj_ctx_get(uint32_t ix)
+{
+    return ix < CONFIG_NVMTNVJ_INSTANCES ? &instances[ix] : NULL;
+}
+
 void nvmtnvj_init(void)
 {
-    sys.state = STATE_UNMOUNTED;
+    for (uint32_t i = 0; i < CONFIG_NVMTNVJ_INSTANCES; i++)
+        nvmtnvj_ctx_init(&instances[i]);
+}
+
+int nvmtnvj_mount(uint32_t sector_start, uint32_t max_lookahead_sectors)
+{
+    return nvmtnvj_ctx_mount(default_fs, sector_start, max_lookahead_sectors);
+}
+
+int nvmtnvj_mount_work(uint32_t sector_start, uint32_t max_lookahead_sectors, void *work, uint32_t work_size)
+{
+    return nvmtnvj_ctx_mount_work(default_fs, sector_start, max_lookahead_sectors, work, work_size);
+}
+
+int nvmtnvj_unmount(void)
+{
+    return nvmtnvj_ctx_unmount(default_fs);
+}
+
+int nvmtnvj_read(uint16_t tag, uint8_t *dst)
+{
+    return nvmtnvj_ctx_read(default_fs, tag, dst);
+}
+
+int nvmtnvj_read_ptr(uint16_t tag, const uint8_t **ptr)
+{
+    return nvmtnvj_ctx_read_ptr(default_fs, tag, ptr);
+}
+
+int nvmtnvj_read_multi(const uint16_t *tags, uint32_t count, nvmtnvj_read_cb_t cb, void *user)
+{
+    return nvmtnvj_ctx_read_multi(default_fs, tags, count, cb, user);
+}
+
+int nvmtnvj_write(uint16_t tag, const uint8_t *src, uint8_t size)
+{
+    return nvmtnvj_ctx_write(default_fs, tag, src, size);
+}
+
+int nvmtnvj_write_cached(uint16_t tag, const uint8_t *src, uint8_t size)
+{
+    return nvmtnvj_ctx_write_cached(default_fs, tag, src, size);
+}
+
+int nvmtnvj_flush(void)
+{
+    return nvmtnvj_ctx_flush(default_fs);
+}
+
+int nvmtnvj_delete(uint16_t tag)
+{
+    return nvmtnvj_ctx_delete(default_fs, tag);
+}
+
+int nvmtnvj_size(uint16_t tag)
+{
+    return nvmtnvj_ctx_size(default_fs, tag);
+}
+
+int nvmtnvj_iter_init(nvmtnvj_iter_t *it, uint16_t min_id, uint16_t max_id, uint8_t *seen, uint32_t seen_size)
+{
+    return nvmtnvj_ctx_iter_init(default_fs, it, min_id, max_id, seen, seen_size);
+}
+
+int nvmtnvj_batch_begin(uint32_t count)
+{
+    return nvmtnvj_ctx_batch_begin(default_fs, count);
+}
+
+int nvmtnvj_batch_write(uint16_t tag, const uint8_t *src, uint8_t size)
+{
+    return nvmtnvj_ctx_batch_write(default_fs, tag, src, size);
+}
+
+int nvmtnvj_batch_delete(uint16_t tag)
+{
+    return nvmtnvj_ctx_batch_delete(default_fs, tag);
+}
+
+int nvmtnvj_batch_commit(void)
+{
+    return nvmtnvj_ctx_batch_commit(default_fs);
+}
+
+int nvmtnvj_batch_abort(void)
+{
+    return nvmtnvj_ctx_batch_abort(default_fs);
+}
+
+int nvmtnvj_gc(void)
+{
+    return nvmtnvj_ctx_gc(default_fs);
+}
+
+int nvmtnvj_gc_step(uint32_t budget)
+{
+    return nvmtnvj_ctx_gc_step(default_fs, budget);
+}
+
+int nvmtnvj_fix(void)
+{
+    return nvmtnvj_ctx_fix(default_fs);
+}
+
+int nvmtnvj_format(uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count, uint8_t max_value_size)
+{
+    return nvmtnvj_ctx_format(default_fs, sector_start, sectors_per_block, block_count, max_value_size);
+}
+
+int nvmtnvj_format_ext(uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count,
+                       uint8_t max_value_size, uint32_t flags)
+{
+    return nvmtnvj_ctx_format_ext(default_fs, sector_start, sectors_per_block, block_count, max_value_size, flags);
+}
+
+int nvmtnvj_wear(nvmtnvj_wear_t *wear)
+{
+    return nvmtnvj_ctx_wear(default_fs, wear);
+}
+
+int nvmtnvj_stats(nvmtnvj_stats_t *stats)
+{
+    return nvmtnvj_ctx_stats(default_fs, stats);
+}
+
+int nvmtnvj_max_value_size(void)
+{
+    return nvmtnvj_ctx_max_value_size(default_fs);
+}
+
+int nvmtnvj_checkpoint(void)
+{
+    return nvmtnvj_ctx_checkpoint(default_fs);
 }
 
 #if NVMTNVJ_TEST
 // expose some privates to ease unittests
 int nvmtnvj_test_tags_per_block(void)
 {
-    return sys.tags_per_block;
+    nvmtnvj_t *fs = default_fs;
+    return fs->tags_per_block;
+}
+
+// pointers only lead into the instance or a caller work buffer, a copy restores the ram state
+uint32_t nvmtnvj_test_ctx_size(void)
+{
+    return sizeof(nvmtnvj_t);
+}
+
+int nvmtnvj_test_copied_tags(void)
+{
+    nvmtnvj_t *fs = default_fs;
+    return fs->stats.copied_tags;
+}
+
+int nvmtnvj_test_hdr_reads(void)
+{
+    nvmtnvj_t *fs = default_fs;
+    return fs->stats.hdr_reads;
+}
+
+int nvmtnvj_test_spare_block(void)
+{
+    nvmtnvj_t *fs = default_fs;
+    return fs->spare_block_ix == UNDEF_IX ? -1 : (int)fs->spare_block_ix;
+}
+
+void nvmtnvj_test_hot_cold(int enable)
+{
+#if CONFIG_NVMTNVJ_HOT_COLD_WINDOW > 0
+    nvmtnvj_t *fs = default_fs;
+    fs->head.enabled = enable != 0;
+    fs->head.block_ix = UNDEF_IX;
+#else
+    (void)enable;
+#endif
+}
+
+int nvmtnvj_test_check_accounting(void)
+{
+#if CONFIG_NVMTNVJ_TAG_INDEX_SIZE > 0 && CONFIG_NVMTNVJ_BLOCK_INFO_COUNT > 0
+    nvmtnvj_t *fs = default_fs;
+    if (!accounting_valid(fs))
+        return 0;
+    int res;
+    uint32_t sorted_block_list[WORK_VLA_LEN(fs, fs->nbr_of_blocks)];
+    word_t sorted_seq_nbr_list[WORK_VLA_LEN(fs, fs->nbr_of_blocks)];
+    sorted_blocks_t sorted_blocks = work_sorted_blocks(fs, sorted_block_list, sorted_seq_nbr_list);
+    res = blocks_sort(fs, &sorted_blocks);
+    ERR_RET(res);
+    for (uint32_t i = 0; i < sorted_blocks.count; i++)
+    {
+        const uint32_t b = sorted_blocks.blocks[i];
+        tag_evict_info_t tag_info_vla[WORK_VLA_LEN(fs, fs->tags_per_block)];
+        tag_evict_info_t *tag_info = work_tag_info(fs, WORK_TAG_INFO_SCAN, tag_info_vla);
+        res = block_find_freeables(fs, i, &sorted_blocks, tag_info);
+        ERR_RET(res);
+        uint32_t used = 0;
+        uint32_t freeable = 0;
+        for (uint32_t t = 0; t < fs->tags_per_block; t++)
+        {
+            if (tag_info[t].status == TI_FREE)
+                continue;
+            used++;
+            // freeable deleted tags being most recent are not accounted
+            const tag_index_entry_t *e = index_find(fs, tag_info[t].id, false);
+            if (tag_info[t].status == TI_FREEABLE && (e == NULL || e->block_ix != b || e->tag_ix != t))
+                freeable++;
+        }
+        if (used != fs->block_info[b].used || freeable != fs->block_info[b].freeable)
+        {
+            _dbg("block %d accounting mismatch, used %d/%d, freeable %d/%d\n", b,
+                 fs->block_info[b].used, used, fs->block_info[b].freeable, freeable);
+            return ERR_NVMTNVJ_FATAL;
+        }
+    }
+#endif
+    return 0;
 }
 
 int nvmtnvj_test_dump(void)
 {
+    nvmtnvj_t *fs = default_fs;
     int res;
     block_header_t bhdr;
-    for (uint8_t b = 0; b < sys.nbr_of_blocks; b++)
+    for (uint32_t b = 0; b < fs->nbr_of_blocks; b++)
     {
-        res = block_read_hdr(b, &bhdr);
+        res = block_read_hdr(fs, b, &bhdr);
         ERR_RET(res);
-        switch (block_type(&bhdr))
+        switch (block_type(fs, &bhdr))
         {
         case BLOCK_TYPE_DATA:
             _dbg("block %d\tDATA, seq %08x\n", b, bhdr.seq_nbr);
-            for (uint32_t t = 0; t < sys.tags_per_block; t++)
+            tag_header_t thdr;
+            for (uint32_t t = 0; t < fs->tags_per_block; t = tag_next_ix(fs, &thdr, t))
             {
-                tag_header_t thdr;
-                res = tag_read_hdr_in_block(b, t, &thdr);
+                res = tag_read_hdr_in_block(fs, b, t, &thdr);
                 ERR_RET(res);
                 switch (thdr.state)
                 {
@@ -1372,6 +5019,18 @@ int nvmtnvj_test_dump(void)
                 case TAG_DELETED:
                     _dbg("\t%d\tDELE %04x\n", t, thdr.id);
                     break;
+                case TAG_BATCH_WRITTEN:
+                    _dbg("\t%d\tBWRI %04x\tsz:%d\tchk:%02x\n", t, thdr.id, thdr.len, thdr.chk);
+                    break;
+                case TAG_BATCH_DELETED:
+                    _dbg("\t%d\tBDEL %04x\n", t, thdr.id);
+                    break;
+                case TAG_BATCH_COMMIT:
+                    _dbg("\t%d\tBCOM %d\n", t, thdr.id);
+                    break;
+                default:
+                    _dbg("\t%d\t?? %02x\n", t, thdr.state);
+                    break;
                 }
             }
             break;
@@ -5,6 +5,7 @@
 #define _NVMTNVJ_H
 
 #include "bmtypes.h"
+#include "flash_driver.h"
 
 #ifndef ERR_NVTNVJ_BASE
 #define ERR_NVTNVJ_BASE (350)
@@ -26,22 +27,191 @@
 #define ERR_NVMTNVJ_NONUNIFORM -(ERR_NVTNVJ_BASE + 6)
 // sectors not in uniform size
 #define ERR_NVMTNVJ_FATAL -(ERR_NVTNVJ_BASE + 7)
+// value is not memory mapped
+#define ERR_NVMTNVJ_NOMAP -(ERR_NVTNVJ_BASE + 8)
+// operation not allowed with batch open, or no batch open
+#define ERR_NVMTNVJ_BATCH -(ERR_NVTNVJ_BASE + 9)
 
+// A journal instance, each with its own partition and state. There are
+// CONFIG_NVMTNVJ_INSTANCES of them. The nvmtnvj_ctx_ functions at the end operate on
+// given instance, the functions below on instance 0.
+typedef struct nvmtnvj_s nvmtnvj_t;
+
+// initiates all instances
 void nvmtnvj_init(void);
-int nvmtnvj_mount(uint32_t sector_start, uint8_t max_lookahead_sectors);
+int nvmtnvj_mount(uint32_t sector_start, uint32_t max_lookahead_sectors);
+// Mounts with a work buffer for scratch and block book keeping sized by geometry,
+// which otherwise are put on stack. Needed for large journals, see
+// nvmtnvj_work_size. The buffer must be 32-bit aligned and is used until unmount.
+int nvmtnvj_mount_work(uint32_t sector_start, uint32_t max_lookahead_sectors, void *work, uint32_t work_size);
+// Returns work buffer size needed by a journal of given geometry, block_size in bytes.
+uint32_t nvmtnvj_work_size(uint32_t block_size, uint32_t block_count, uint8_t max_value_size, uint32_t flags);
 int nvmtnvj_unmount(void);
 int nvmtnvj_read(uint16_t tag, uint8_t *dst);
+// Sets ptr to the value of tag directly in flash, and returns the value size. The
+// pointer is valid until the next write, delete or gc. Returns ERR_NVMTNVJ_NOMAP if
+// the flash is not memory mapped, or the value straddles two unadjacent sectors.
+int nvmtnvj_read_ptr(uint16_t tag, const uint8_t **ptr);
+// Called once per requested tag by nvmtnvj_read_multi, with the value and its size,
+// or with NULL and ERR_NVMTNVJ_NOENT if there is no such tag. The value is only valid
+// during the call.
+typedef void (*nvmtnvj_read_cb_t)(uint16_t tag, const uint8_t *data, int len, void *user);
+// Reads many tags in one pass over the journal, stopping as soon as all are found.
+int nvmtnvj_read_multi(const uint16_t *tags, uint32_t count, nvmtnvj_read_cb_t cb, void *user);
 int nvmtnvj_write(uint16_t tag, const uint8_t *src, uint8_t size);
+// Writes tag to the ram write cache, see CONFIG_NVMTNVJ_WRITE_CACHE_SIZE. Writes of
+// the value already held are dropped, and rewrites of a cached tag only update ram.
+// Values reach flash on nvmtnvj_flush, when enough entries are dirty, or on unmount,
+// and are lost on power loss until then.
+int nvmtnvj_write_cached(uint16_t tag, const uint8_t *src, uint8_t size);
+int nvmtnvj_flush(void);
 int nvmtnvj_delete(uint16_t tag);
 int nvmtnvj_size(uint16_t tag);
+
+// Iterates live tags with ids in [min_id, max_id], most recently written first. Each
+// tag is yielded once. seen is a bitmap over the id range of at least
+// NVMTNVJ_ITER_SEEN_SIZE bytes. Writing, deleting or gc during iteration is not
+// supported.
+#define NVMTNVJ_ITER_SEEN_SIZE(min_id, max_id) (((uint32_t)(max_id) - (min_id) + 8) / 8)
+typedef struct
+{
+    nvmtnvj_t *fs;
+    uint16_t min_id;
+    uint16_t max_id;
+    uint8_t *seen;
+    uint32_t block_ix;
+    uint32_t tag_ix;
+    uint32_t blocks_left;
+} nvmtnvj_iter_t;
+int nvmtnvj_iter_init(nvmtnvj_iter_t *it, uint16_t min_id, uint16_t max_id, uint8_t *seen, uint32_t seen_size);
+// Sets tag and copies its value to dst, returns the value size. Returns
+// ERR_NVMTNVJ_NOENT when there are no more tags.
+int nvmtnvj_iter_next(nvmtnvj_iter_t *it, uint16_t *tag, uint8_t *dst);
+// Batches are all-or-nothing: after a power loss either all or none of the entries
+// written and deleted between begin and commit are seen. Begin reserves room for
+// count entries in one block, plain writes, deletes and gc are refused until the
+// batch is committed or aborted.
+int nvmtnvj_batch_begin(uint32_t count);
+int nvmtnvj_batch_write(uint16_t tag, const uint8_t *src, uint8_t size);
+int nvmtnvj_batch_delete(uint16_t tag);
+int nvmtnvj_batch_commit(void);
+int nvmtnvj_batch_abort(void);
 int nvmtnvj_gc(void);
+// Performs at most budget units of incremental gc work, a unit being one tag copy or
+// one sector erase. Call when idle, e.g. when eventq_run has nothing to do.
+// Returns 0 when no more work is needed, 1 if more work remains.
+int nvmtnvj_gc_step(uint32_t budget);
 int nvmtnvj_fix(void);
-int nvmtnvj_format(uint32_t sector_start, uint8_t sectors_per_block, uint8_t block_count, uint8_t max_value_size);
+// Writes a checkpoint of the ram index and block accounting, letting next mount skip
+// scanning the journal as long as no gc or block switch happens before. Done by
+// unmount too, call before power is cut without unmount. Needs
+// CONFIG_NVMTNVJ_CHECKPOINT, and finishes an ongoing incremental gc.
+int nvmtnvj_checkpoint(void);
+// Erase counts of the blocks, e.g. to predict flash lifetime. Returns
+// ERR_NVMTNVJ_NOENT if formatted by a version not keeping erase counts.
+typedef struct
+{
+    uint32_t min;
+    uint32_t max;
+    uint32_t mean;
+} nvmtnvj_wear_t;
+int nvmtnvj_wear(nvmtnvj_wear_t *wear);
+// Health and performance figures, counters are since mount. Tag counts are
+// NVMTNVJ_STATS_UNKNOWN unless all tag ids fit the index, and for dead and freeable
+// tags also all blocks fit CONFIG_NVMTNVJ_BLOCK_INFO_COUNT or the work buffer.
+#define NVMTNVJ_STATS_UNKNOWN 0xffffffff
+typedef struct
+{
+    uint32_t free_slots;    // tag slots writable without gc
+    uint32_t live_tags;     // tags with a value
+    uint32_t dead_tags;     // entries superseded or deleting a tag
+    uint32_t freeable_tags; // dead entries gc can drop
+    uint32_t data_blocks;
+    uint32_t free_blocks;
+    uint32_t spare_blocks;
+    uint32_t seq_nbr_span; // from oldest to newest data block
+    uint32_t bytes_written;
+    uint32_t erases; // sectors erased
+    uint32_t gc_count;
+    uint32_t gc_copied_tags;
+    uint32_t gc_bytes_written;
+    uint32_t gc_erases;
+    uint32_t lookups;           // tags looked up by reads, sizes and deletes
+    uint32_t lookup_depth_x100; // average blocks searched per lookup, times 100
+} nvmtnvj_stats_t;
+int nvmtnvj_stats(nvmtnvj_stats_t *stats);
+// Returns the max value size of the mounted journal, longer values are truncated.
+int nvmtnvj_max_value_size(void);
+
+// Flash driver of an instance, functions behave as their flash_driver.h
+// counterparts. Lets instances live on different flash devices, e.g. internal and
+// spi flash. get_address_for_sector may be NULL if the flash is not memory mapped.
+typedef struct
+{
+    int (*read)(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length);
+    int (*write)(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length);
+    int (*erase)(uint32_t sector);
+    int (*get_sector_size)(uint32_t sector);
+    int (*get_sector_alignment)(uint32_t sector, flash_op_t operation);
+    int (*get_address_for_sector)(uint32_t sector, void **address);
+} nvmtnvj_flash_t;
+
+// returns instance ix, or NULL if there is no such instance
+nvmtnvj_t *nvmtnvj_ctx_get(uint32_t ix);
+void nvmtnvj_ctx_init(nvmtnvj_t *fs);
+// Sets the flash driver used by the instance from next format or mount on, the
+// instance must be unmounted. NULL, also set by init, selects the flash_ functions.
+// Sector numbers given to format and mount are those of the driver.
+int nvmtnvj_ctx_set_flash(nvmtnvj_t *fs, const nvmtnvj_flash_t *flash);
+int nvmtnvj_ctx_mount(nvmtnvj_t *fs, uint32_t sector_start, uint32_t max_lookahead_sectors);
+int nvmtnvj_ctx_mount_work(nvmtnvj_t *fs, uint32_t sector_start, uint32_t max_lookahead_sectors, void *work,
+                           uint32_t work_size);
+int nvmtnvj_ctx_unmount(nvmtnvj_t *fs);
+int nvmtnvj_ctx_read(nvmtnvj_t *fs, uint16_t tag, uint8_t *dst);
+int nvmtnvj_ctx_read_ptr(nvmtnvj_t *fs, uint16_t tag, const uint8_t **ptr);
+int nvmtnvj_ctx_read_multi(nvmtnvj_t *fs, const uint16_t *tags, uint32_t count, nvmtnvj_read_cb_t cb, void *user);
+int nvmtnvj_ctx_write(nvmtnvj_t *fs, uint16_t tag, const uint8_t *src, uint8_t size);
+int nvmtnvj_ctx_write_cached(nvmtnvj_t *fs, uint16_t tag, const uint8_t *src, uint8_t size);
+int nvmtnvj_ctx_flush(nvmtnvj_t *fs);
+int nvmtnvj_ctx_delete(nvmtnvj_t *fs, uint16_t tag);
+int nvmtnvj_ctx_size(nvmtnvj_t *fs, uint16_t tag);
+// the iterator keeps to the instance it was initiated for, see nvmtnvj_iter_next
+int nvmtnvj_ctx_iter_init(nvmtnvj_t *fs, nvmtnvj_iter_t *it, uint16_t min_id, uint16_t max_id, uint8_t *seen,
+                          uint32_t seen_size);
+int nvmtnvj_ctx_batch_begin(nvmtnvj_t *fs, uint32_t count);
+int nvmtnvj_ctx_batch_write(nvmtnvj_t *fs, uint16_t tag, const uint8_t *src, uint8_t size);
+int nvmtnvj_ctx_batch_delete(nvmtnvj_t *fs, uint16_t tag);
+int nvmtnvj_ctx_batch_commit(nvmtnvj_t *fs);
+int nvmtnvj_ctx_batch_abort(nvmtnvj_t *fs);
+int nvmtnvj_ctx_gc(nvmtnvj_t *fs);
+int nvmtnvj_ctx_gc_step(nvmtnvj_t *fs, uint32_t budget);
+int nvmtnvj_ctx_fix(nvmtnvj_t *fs);
+int nvmtnvj_ctx_checkpoint(nvmtnvj_t *fs);
+int nvmtnvj_ctx_format(nvmtnvj_t *fs, uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count,
+                       uint8_t max_value_size);
+int nvmtnvj_ctx_format_ext(nvmtnvj_t *fs, uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count,
+                           uint8_t max_value_size, uint32_t flags);
+int nvmtnvj_ctx_wear(nvmtnvj_t *fs, nvmtnvj_wear_t *wear);
+int nvmtnvj_ctx_stats(nvmtnvj_t *fs, nvmtnvj_stats_t *stats);
+int nvmtnvj_ctx_max_value_size(nvmtnvj_t *fs);
+// Formats block_count blocks of sectors_per_block sectors each, at most 65534 blocks.
+int nvmtnvj_format(uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count, uint8_t max_value_size);
+// Format with variable size entries, each taking only the flash words its value
+// needs rather than max_value_size. Needs CONFIG_NVMTNVJ_VARIABLE_SIZE_SLOTS.
+#define NVMTNVJ_FORMAT_VARIABLE_SIZE (1 << 0)
+int nvmtnvj_format_ext(uint32_t sector_start, uint16_t sectors_per_block, uint32_t block_count,
+                       uint8_t max_value_size, uint32_t flags);
 
 #if NVMTNVJ_TEST
 // expose some privates to ease unittests
 int nvmtnvj_test_tags_per_block(void);
+uint32_t nvmtnvj_test_ctx_size(void);
+int nvmtnvj_test_copied_tags(void);
+int nvmtnvj_test_hdr_reads(void);
+int nvmtnvj_test_spare_block(void);
+void nvmtnvj_test_hot_cold(int enable);
 int nvmtnvj_test_dump(void);
+int nvmtnvj_test_check_accounting(void);
 #endif
 
 #ifndef NVMTNVJ_DBG
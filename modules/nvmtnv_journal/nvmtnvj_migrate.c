@@ -0,0 +1,75 @@
+/* Copyright (c) 2025 Peter Andersson (pelleplutt1976<at>gmail.com) */
+/* MIT License (see ./LICENSE) */
+
+#include "nvmtnvj_migrate.h"
+#include "nvmtnv.h"
+
+#ifndef CONFIG_NVMTNVJ_MIGRATE_PROGRESS_TAG
+// journal tag keeping the nvmtnv position during migration, must not be used in the
+// nvmtnv filesystem
+#define CONFIG_NVMTNVJ_MIGRATE_PROGRESS_TAG 0xffff
+#endif
+
+#define MIGRATE_DONE 0xffffffff
+#define PROGRESS_SIZE 4
+
+int nvmtnvj_ctx_migrate_nvmtnv(nvmtnvj_t *fs, uint32_t batch_count)
+{
+    uint8_t value[UINT8_MAX];
+    uint32_t pos = 0;
+    int res = nvmtnvj_ctx_read(fs, CONFIG_NVMTNVJ_MIGRATE_PROGRESS_TAG, value);
+    if (res == PROGRESS_SIZE)
+        pos = value[0] | (value[1] << 8) | (value[2] << 16) | ((uint32_t)value[3] << 24);
+    else if (res != ERR_NVMTNVJ_NOENT)
+        return res < 0 ? res : ERR_NVMTNVJ_INVAL;
+    if (batch_count == 0)
+        return ERR_NVMTNVJ_INVAL;
+    const int max_size = nvmtnvj_ctx_max_value_size(fs);
+    if (max_size < 0)
+        return max_size;
+
+    int migrated = 0;
+    while (pos != MIGRATE_DONE)
+    {
+        // room for the progress tag too
+        res = nvmtnvj_ctx_batch_begin(fs, batch_count + 1);
+        if (res < 0)
+            return res;
+        for (uint32_t i = 0; res >= 0 && i < batch_count; i++)
+        {
+            uint16_t tag;
+            res = nvmtnv_next(&pos, &tag, value, sizeof(value));
+            if (res == ERR_NVMTNV_NOENT)
+            {
+                res = 0;
+                pos = MIGRATE_DONE;
+                break;
+            }
+            // neither the progress tag nor values the journal would truncate
+            if (res >= 0 && (tag == CONFIG_NVMTNVJ_MIGRATE_PROGRESS_TAG || res > max_size))
+                res = ERR_NVMTNVJ_INVAL;
+            if (res >= 0)
+                res = nvmtnvj_ctx_batch_write(fs, tag, value, (uint8_t)res);
+            migrated++;
+        }
+        if (res >= 0)
+        {
+            const uint8_t progress[PROGRESS_SIZE] = {pos, pos >> 8, pos >> 16, pos >> 24};
+            res = nvmtnvj_ctx_batch_write(fs, CONFIG_NVMTNVJ_MIGRATE_PROGRESS_TAG, progress, PROGRESS_SIZE);
+        }
+        if (res < 0)
+        {
+            nvmtnvj_ctx_batch_abort(fs);
+            return res;
+        }
+        res = nvmtnvj_ctx_batch_commit(fs);
+        if (res < 0)
+            return res;
+    }
+    return migrated;
+}
+
+int nvmtnvj_migrate_nvmtnv(uint32_t batch_count)
+{
+    return nvmtnvj_ctx_migrate_nvmtnv(nvmtnvj_ctx_get(0), batch_count);
+}
@@ -0,0 +1,24 @@
+/* Copyright (c) 2025 Peter Andersson (pelleplutt1976<at>gmail.com) */
+/* MIT License (see ./LICENSE) */
+
+#ifndef _NVMTNVJ_MIGRATE_H
+#define _NVMTNVJ_MIGRATE_H
+
+#include "nvmtnvj.h"
+
+// Copies all live tags of the mounted nvmtnv filesystem to a mounted journal, in one
+// pass over the nvmtnv sectors. Tags are written in batches of batch_count, each
+// batch also holding the nvmtnv position reached in journal tag
+// CONFIG_NVMTNVJ_MIGRATE_PROGRESS_TAG. After a power loss, mount both again and call
+// again to resume after the last committed batch. The nvmtnv filesystem must not be
+// modified until migration is done.
+// When done the progress tag is left marking the migration as done, further calls
+// return 0. Retire the nvmtnv sectors before deleting it, else next call migrates
+// all over again.
+// A value longer than the journal max value size fails the migration with
+// ERR_NVMTNVJ_INVAL, nothing of its batch is committed.
+// Returns number of tags migrated by this call, or nvmtnv or nvmtnvj error.
+int nvmtnvj_migrate_nvmtnv(uint32_t batch_count);
+int nvmtnvj_ctx_migrate_nvmtnv(nvmtnvj_t *fs, uint32_t batch_count);
+
+#endif // _NVMTNVJ_MIGRATE_H
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "testbench.h"
+#include "nvmtnvj.h"
+#include "flash_driver.h"
+
+// Benchmark workloads, one CSV row per workload and geometry. Flash traffic is
+// taken from the emulator counters, gc and lookup figures from nvmtnvj_stats.
+// Worst op figures are each the max over all ops, not necessarily the same op.
+
+#define BENCH_ID_BASE 0x0100
+
+typedef enum
+{
+	WL_UNIFORM,        // writes of random ids and sizes
+	WL_ZIPF,           // writes, ids ranked by zipf distribution, s = 1
+	WL_WRITE_ONCE,     // all ids written once, then reads
+	WL_DELETE_HEAVY,   // half of the ops delete
+	WL_MIXED_SIZES,    // mostly small values, now and then a full one
+	WL_COUNT,
+} bench_workload_t;
+
+static const char *const workload_names[WL_COUNT] = {
+	[WL_UNIFORM] = "uniform",
+	[WL_ZIPF] = "zipf",
+	[WL_WRITE_ONCE] = "write_once_read_many",
+	[WL_DELETE_HEAVY] = "delete_heavy",
+	[WL_MIXED_SIZES] = "mixed_sizes",
+};
+
+typedef struct
+{
+	uint32_t sector_size;
+	uint32_t sectors;
+	uint32_t sectors_per_block;
+	uint32_t max_value_size;
+} bench_geometry_t;
+
+typedef struct
+{
+	bench_workload_t workload;
+	bench_geometry_t g;
+	uint32_t ids;
+	uint32_t ops;
+	prand_t p;
+	double *zipf_cdf;
+} bench_t;
+
+typedef struct
+{
+	double secs;
+	uint32_t bytes_read;
+	uint32_t bytes_written;
+	uint32_t erases;
+} bench_cost_t;
+
+static double bench_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint16_t bench_zipf_id(bench_t *b)
+{
+	const double u = prand(&b->p, 31) / (double)(1u << 31);
+	uint32_t lo = 0;
+	uint32_t hi = b->ids - 1;
+	while (lo < hi)
+	{
+		const uint32_t mid = (lo + hi) / 2;
+		if (b->zipf_cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return BENCH_ID_BASE + lo;
+}
+
+static int bench_write(bench_t *b, uint16_t id, uint8_t size)
+{
+	uint8_t data[size];
+	for (uint8_t i = 0; i < size; i++)
+		data[i] = prand(&b->p, 8);
+	return nvmtnvj_write(id, data, size);
+}
+
+static int bench_op(bench_t *b, uint32_t i)
+{
+	uint8_t buf[256];
+	const uint32_t max = b->g.max_value_size;
+	const uint16_t id = BENCH_ID_BASE + prand(&b->p, 16) % b->ids;
+	int res;
+	switch (b->workload)
+	{
+	case WL_UNIFORM:
+		return bench_write(b, id, prand(&b->p, 8) % (max + 1));
+	case WL_ZIPF:
+		return bench_write(b, bench_zipf_id(b), prand(&b->p, 8) % (max + 1));
+	case WL_WRITE_ONCE:
+		if (i < b->ids)
+			return bench_write(b, BENCH_ID_BASE + i, prand(&b->p, 8) % (max + 1));
+		res = nvmtnvj_read(id, buf);
+		return res < 0 ? res : 0;
+	case WL_DELETE_HEAVY:
+		if (prand(&b->p, 1))
+			return nvmtnvj_delete(id);
+		return bench_write(b, id, prand(&b->p, 8) % (max + 1));
+	case WL_MIXED_SIZES:
+		return bench_write(b, id, prand(&b->p, 4) == 0 ? max : 1 + prand(&b->p, 2));
+	default:
+		return -1;
+	}
+}
+
+static bench_cost_t bench_cost_now(void)
+{
+	return (bench_cost_t){
+		.secs = bench_now(),
+		.bytes_read = flash_emul_get_bytes_read_count(),
+		.bytes_written = flash_emul_get_bytes_written_count(),
+		.erases = flash_emul_get_erase_ops_count(),
+	};
+}
+
+static int bench_run(bench_t *b)
+{
+	const bench_geometry_t *g = &b->g;
+	const uint32_t size = g->sector_size * g->sectors;
+	uint8_t *memory = calloc(1, size);
+	flash_emul_t f = {
+		.flags = FLASH_EMUL_DISALLOW_BIT_PULLING | FLASH_EMUL_WRITE_BY_OR,
+		.flash_address = memory,
+		.mem = memory,
+		.mem_size = size,
+		.sector_offset = 0,
+		.sector_size = g->sector_size,
+		.sectors = g->sectors};
+	flash_emul_set(&f);
+	flash_init();
+	nvmtnvj_init();
+	int res = nvmtnvj_format(0, g->sectors_per_block, g->sectors / g->sectors_per_block, g->max_value_size);
+	if (res == 0)
+		res = nvmtnvj_mount(0, g->sectors_per_block + 1);
+	if (res)
+	{
+		fprintf(stderr, "bench: format/mount failed, %d\n", res);
+		goto end;
+	}
+	flash_emul_reset_bytes_read_count();
+	flash_emul_reset_bytes_written_count();
+	flash_emul_reset_erase_ops_count();
+
+	bench_cost_t worst = {0};
+	const double t0 = bench_now();
+	for (uint32_t i = 0; i < b->ops; i++)
+	{
+		const bench_cost_t pre = bench_cost_now();
+		res = bench_op(b, i);
+		const bench_cost_t post = bench_cost_now();
+		if (res)
+		{
+			fprintf(stderr, "bench: %s op %d failed, %d\n", workload_names[b->workload], i, res);
+			goto end;
+		}
+		if (post.secs - pre.secs > worst.secs)
+			worst.secs = post.secs - pre.secs;
+		if (post.bytes_read - pre.bytes_read > worst.bytes_read)
+			worst.bytes_read = post.bytes_read - pre.bytes_read;
+		if (post.bytes_written - pre.bytes_written > worst.bytes_written)
+			worst.bytes_written = post.bytes_written - pre.bytes_written;
+		if (post.erases - pre.erases > worst.erases)
+			worst.erases = post.erases - pre.erases;
+	}
+	const double secs = bench_now() - t0;
+	const bench_cost_t total = bench_cost_now();
+	uint32_t erases_min = UINT32_MAX;
+	uint32_t erases_max = 0;
+	for (uint32_t s = 0; s < g->sectors; s++)
+	{
+		const uint32_t e = flash_emul_get_sector_erases(s);
+		erases_min = e < erases_min ? e : erases_min;
+		erases_max = e > erases_max ? e : erases_max;
+	}
+	nvmtnvj_stats_t st;
+	res = nvmtnvj_stats(&st);
+	if (res)
+		goto end;
+
+	// mount after unmount, as after reboot
+	res = nvmtnvj_unmount();
+	if (res)
+		goto end;
+	flash_emul_reset_bytes_read_count();
+	res = nvmtnvj_mount(0, g->sectors_per_block + 1);
+	if (res)
+		goto end;
+	const uint32_t mount_bytes_read = flash_emul_get_bytes_read_count();
+
+	printf("%s,%d,%d,%d,%d,%d,%d,%.0f,%d,%d,%d,%.2f,%d,%d,%.1f,%d,%d,%d,%d,%d,%d.%02d,%d\n",
+		   workload_names[b->workload], g->sector_size, g->sectors, g->sectors_per_block, g->max_value_size, b->ids,
+		   b->ops, secs > 0 ? b->ops / secs : 0, total.bytes_read, total.bytes_written, total.erases,
+		   (double)total.erases / g->sectors, erases_min, erases_max, worst.secs * 1e6, worst.bytes_read,
+		   worst.bytes_written, worst.erases, st.gc_count, st.gc_copied_tags, st.lookup_depth_x100 / 100,
+		   st.lookup_depth_x100 % 100, mount_bytes_read);
+end:
+	nvmtnvj_unmount();
+	flash_deinit();
+	free(memory);
+	return res;
+}
+
+static void bench_usage(void)
+{
+	printf("bench [-n <ops>] [-s <seed>] [-i <ids>] [-w <workload>] "
+		   "[-g <sector_size>,<sectors>,<sectors_per_block>,<max_value_size>]...\n"
+		   "workloads:");
+	for (uint32_t w = 0; w < WL_COUNT; w++)
+		printf(" %s", workload_names[w]);
+	printf("\n");
+}
+
+int bench_main(int argc, char **argv)
+{
+	uint32_t ops = 10000;
+	uint32_t seed = 1;
+	uint32_t ids = 64;
+	int workload = -1;
+	bench_geometry_t geometries[16];
+	uint32_t geometry_count = 0;
+	for (int i = 1; i < argc; i += 2)
+	{
+		if (i + 1 >= argc)
+		{
+			bench_usage();
+			return 1;
+		}
+		if (strcmp(argv[i], "-n") == 0)
+			ops = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			seed = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-i") == 0)
+			ids = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-w") == 0)
+		{
+			for (int w = 0; w < WL_COUNT; w++)
+				if (strcmp(argv[i + 1], workload_names[w]) == 0)
+					workload = w;
+			if (workload < 0)
+			{
+				bench_usage();
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-g") == 0 && geometry_count < sizeof(geometries) / sizeof(geometries[0]))
+		{
+			bench_geometry_t *g = &geometries[geometry_count++];
+			if (sscanf(argv[i + 1], "%u,%u,%u,%u", &g->sector_size, &g->sectors, &g->sectors_per_block,
+					   &g->max_value_size) != 4)
+			{
+				bench_usage();
+				return 1;
+			}
+		}
+		else
+		{
+			bench_usage();
+			return 1;
+		}
+	}
+	if (geometry_count == 0)
+		geometries[geometry_count++] = (bench_geometry_t){256, 32, 4, 16};
+	if (ids == 0 || ops == 0)
+	{
+		bench_usage();
+		return 1;
+	}
+
+	double zipf_cdf[ids];
+	double sum = 0;
+	for (uint32_t r = 0; r < ids; r++)
+		sum += 1.0 / (r + 1);
+	double acc = 0;
+	for (uint32_t r = 0; r < ids; r++)
+	{
+		acc += 1.0 / (r + 1) / sum;
+		zipf_cdf[r] = acc;
+	}
+	zipf_cdf[ids - 1] = 1.0;
+
+	printf("workload,sector_size,sectors,sectors_per_block,max_value_size,ids,ops,ops_per_sec,bytes_read,"
+		   "bytes_written,erases,erases_per_sector,erases_sector_min,erases_sector_max,worst_op_us,"
+		   "worst_op_bytes_read,worst_op_bytes_written,worst_op_erases,gc_count,gc_copied_tags,lookup_depth,"
+		   "mount_bytes_read\n");
+	int failed = 0;
+	for (uint32_t gi = 0; gi < geometry_count; gi++)
+	{
+		for (int w = 0; w < WL_COUNT; w++)
+		{
+			if (workload >= 0 && w != workload)
+				continue;
+			bench_t b = {.workload = w, .g = geometries[gi], .ids = ids, .ops = ops, .zipf_cdf = zipf_cdf};
+			prand_seed(&b.p, seed);
+			failed |= bench_run(&b) != 0;
+		}
+	}
+	return failed;
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "testbench.h"
+#include "flash_driver.h"
+
+// Push/pop cost of the flash emulator, copy-on-write snapshots against copying the
+// whole flash as push used to. Between push and pop a word is written to one sector
+// and another sector is erased, about what a tag write with gc touches.
+
+#define BENCH_SECTOR_SIZE 4096
+
+static double bench_now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void bench_touch(uint32_t sectors, uint32_t i)
+{
+	const uint8_t w[4] = {0x12, 0x34, 0x56, 0x78};
+	flash_write((i * 7) % sectors, (i * 4) % BENCH_SECTOR_SIZE, w, sizeof(w));
+	flash_erase((i * 13 + 1) % sectors);
+}
+
+static void bench_geometry(uint32_t size, uint32_t rounds)
+{
+	const uint32_t sectors = size / BENCH_SECTOR_SIZE;
+	uint8_t *memory = calloc(1, size);
+	flash_emul_t f = {
+		.flags = FLASH_EMUL_ALLOW_BIT_PULLING | FLASH_EMUL_WRITE_BY_OR,
+		.flash_address = memory,
+		.mem = memory,
+		.mem_size = size,
+		.sector_offset = 0,
+		.sector_size = BENCH_SECTOR_SIZE,
+		.sectors = sectors};
+	flash_emul_set(&f);
+	flash_init();
+
+	// full copy, as push did before
+	double t0 = bench_now();
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		uint8_t *copy = malloc(size);
+		memcpy(copy, memory, size);
+		bench_touch(sectors, i);
+		memcpy(memory, copy, size);
+		free(copy);
+	}
+	const double full = (bench_now() - t0) / rounds;
+
+	t0 = bench_now();
+	for (uint32_t i = 0; i < rounds; i++)
+	{
+		flash_emul_push();
+		bench_touch(sectors, i);
+		flash_emul_pop();
+	}
+	const double cow = (bench_now() - t0) / rounds;
+
+	printf("%6d KB\t%6d sectors\tfull copy %9.2f us\tcopy-on-write %7.2f us\t%7.1fx\n", size / 1024, sectors,
+		   full * 1e6, cow * 1e6, cow > 0 ? full / cow : 0);
+	flash_deinit();
+	free(memory);
+}
+
+int emulbench_main(int argc, char **argv)
+{
+	const uint32_t rounds = argc > 1 ? atoi(argv[1]) : 200;
+	printf("push, write and erase, pop, mean of %d rounds\n", rounds);
+	bench_geometry(512 * 1024, rounds);
+	bench_geometry(16 * 1024 * 1024, rounds);
+	return 0;
+}
@@ -8,18 +8,31 @@
 
 #define FLASH_INITIATED 0x12312345
 
-typedef struct list_entry
+// Sector contents from before the snapshot was pushed, saved when first touched.
+typedef struct saved_sector
 {
-    uint8_t *mem;
-    uint8_t *old_mem;
-    struct list_entry *next;
-} list_entry_t;
+    uint32_t sector_ix;
+    uint32_t prev_snapshot; // snapshot which saved the sector before this one
+    struct saved_sector *next;
+    uint8_t data[];
+} saved_sector_t;
+
+// Snapshots are copy-on-write, flash stays in emul.mem and pop writes back the saved
+// sectors. Push and pop cost is in the number of sectors touched in between.
+typedef struct snapshot
+{
+    uint32_t id;
+    saved_sector_t *saved;
+    struct snapshot *next;
+} snapshot_t;
 
 static uint32_t flash_initiated = 0;
 static flash_emul_t emul;
-static list_entry_t *list = NULL;
+static snapshot_t *list = NULL;
+static uint32_t snapshot_ids = 0;
 struct sector_meta {
     uint32_t erase_counts;
+    uint32_t snapshot; // id of snapshot which saved the sector, 0 if none
 } *sector_meta = NULL;
 
 void flash_emul_set(const flash_emul_t *f)
@@ -31,8 +44,8 @@ void flash_emul_set(const flash_emul_t *f)
     if (sector_meta) {
         free(sector_meta);
     }
-    sector_meta = malloc(emul.sectors * sizeof(sector_meta));
-    memset(sector_meta, 0, emul.sectors * sizeof(sector_meta));
+    sector_meta = malloc(emul.sectors * sizeof(*sector_meta));
+    memset(sector_meta, 0, emul.sectors * sizeof(*sector_meta));
 }
 
 const flash_emul_t *flash_emul_get(void)
@@ -53,28 +66,46 @@ uint32_t flash_emul_get_sector_erases(uint32_t sector) {
 
 void flash_emul_push(void)
 {
-    uint8_t *new_mem = malloc(emul.mem_size);
-    memcpy(new_mem, emul.mem, emul.mem_size);
-    list_entry_t *l = malloc(sizeof(list_entry_t));
-    l->mem = new_mem;
-    l->old_mem = emul.mem;
+    snapshot_t *l = malloc(sizeof(snapshot_t));
+    l->id = ++snapshot_ids;
+    l->saved = NULL;
     l->next = list;
     list = l;
-    emul.mem = new_mem;
 }
 
 int flash_emul_pop(void)
 {
     if (list == NULL)
         return -1;
-    list_entry_t *n = list->next;
-    emul.mem = list->old_mem;
-    free(list->mem);
+    snapshot_t *n = list->next;
+    while (list->saved)
+    {
+        saved_sector_t *s = list->saved;
+        memcpy(&emul.mem[s->sector_ix * emul.sector_size], s->data, emul.sector_size);
+        sector_meta[s->sector_ix].snapshot = s->prev_snapshot;
+        list->saved = s->next;
+        free(s);
+    }
     free(list);
     list = n;
     return 0;
 }
 
+// saves sector in current snapshot before it is changed
+static void sector_touch(uint32_t sector)
+{
+    const uint32_t ix = sector - emul.sector_offset;
+    if (list == NULL || sector_meta[ix].snapshot == list->id)
+        return;
+    saved_sector_t *s = malloc(sizeof(saved_sector_t) + emul.sector_size);
+    s->sector_ix = ix;
+    s->prev_snapshot = sector_meta[ix].snapshot;
+    memcpy(s->data, &emul.mem[ix * emul.sector_size], emul.sector_size);
+    s->next = list->saved;
+    list->saved = s;
+    sector_meta[ix].snapshot = list->id;
+}
+
 int flash_deinit(void)
 {
     flash_initiated = 0;
@@ -118,6 +149,8 @@ int flash_get_address_for_sector(uint32_t sector, void **address)
 {
     if (sector < emul.sector_offset || sector >= emul.sector_offset + emul.sectors)
         return -1;
+    if (emul.flash_address == NULL)
+        return -1; // not memory mapped
     *address = (uint8_t *)emul.flash_address + (sector - emul.sector_offset) * emul.sector_size;
     return 0;
 }
@@ -139,6 +172,8 @@ int flash_erase(uint32_t sector)
 {
     if (sector < emul.sector_offset || sector >= emul.sector_offset + emul.sectors)
         return -1;
+    emul.private.erase_ops++;
+    sector_touch(sector);
     const uint8_t e = erased_byte();
     for (uint32_t i = 0; i < emul.sector_size; i++)
         emul.mem[i + (sector - emul.sector_offset) * emul.sector_size] = e;
@@ -156,6 +191,8 @@ int flash_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t
         length = emul.sector_size - offset;
     if (emul.write_alignment > 0 && (offset % emul.write_alignment != 0 || length % emul.write_alignment != 0))
         return ERR_FLASH_ALIGN;
+    emul.private.write_ops++;
+    sector_touch(sector);
     const uint8_t e = erased_byte();
     for (uint32_t i = 0; i < length; i++)
     {
@@ -195,6 +232,7 @@ int flash_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length)
         length = emul.sector_size - offset;
     if (emul.read_alignment > 0 && (offset % emul.read_alignment != 0 || length % emul.read_alignment != 0))
         return ERR_FLASH_ALIGN;
+    emul.private.read_ops++;
     uint32_t ix = (sector - emul.sector_offset) * emul.sector_size + offset;
     for (uint32_t i = 0; i < length; i++)
     {
@@ -246,6 +284,22 @@ uint32_t flash_emul_get_bytes_written_count(void)
 {
     return emul.private.bytes_written;
 }
+void flash_emul_reset_write_ops_count(void)
+{
+    emul.private.write_ops = 0;
+}
+uint32_t flash_emul_get_write_ops_count(void)
+{
+    return emul.private.write_ops;
+}
+void flash_emul_reset_read_ops_count(void)
+{
+    emul.private.read_ops = 0;
+}
+uint32_t flash_emul_get_read_ops_count(void)
+{
+    return emul.private.read_ops;
+}
 void flash_emul_reset_bytes_read_count(void)
 {
     emul.private.bytes_read = 0;
@@ -254,3 +308,11 @@ uint32_t flash_emul_get_bytes_read_count(void)
 {
     return emul.private.bytes_read;
 }
+void flash_emul_reset_erase_ops_count(void)
+{
+    emul.private.erase_ops = 0;
+}
+uint32_t flash_emul_get_erase_ops_count(void)
+{
+    return emul.private.erase_ops;
+}
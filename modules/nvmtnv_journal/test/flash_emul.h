@@ -29,6 +29,9 @@ typedef struct
         uint32_t write_fail_countdown;
         uint32_t bytes_written;
         uint32_t bytes_read;
+        uint32_t write_ops;
+        uint32_t read_ops;
+        uint32_t erase_ops;
     } private;
 } flash_emul_t;
 
@@ -42,16 +45,28 @@ void flash_emul_read_scramble_after_bytes(uint32_t byte_countdown, uint32_t byte
 void flash_emul_write_fail_after_bytes(uint32_t byte_countdown);
 // any write operation will write given garbage data after given bytes
 void flash_emul_write_scramble_after_bytes(uint32_t byte_countdown, uint32_t bytes_to_scramble);
-// push current flash content
+// push current flash content, sectors are copied when first written or erased
 void flash_emul_push(void);
-// pop previously pushed flash content
+// pop previously pushed flash content, restoring sectors changed since push
 int flash_emul_pop(void);
 // reset byte write counter
 void flash_emul_reset_bytes_written_count(void);
 // return number of written bytes
 uint32_t flash_emul_get_bytes_written_count(void);
+// reset write operation counter
+void flash_emul_reset_write_ops_count(void);
+// return number of flash_write calls
+uint32_t flash_emul_get_write_ops_count(void);
+// reset read operation counter
+void flash_emul_reset_read_ops_count(void);
+// return number of flash_read calls
+uint32_t flash_emul_get_read_ops_count(void);
 // reset byte read counter
 void flash_emul_reset_bytes_read_count(void);
 // return number of read bytes
 uint32_t flash_emul_get_bytes_read_count(void);
-uint32_t flash_emul_get_sector_erases(uint32_t sector);
\ No newline at end of file
+uint32_t flash_emul_get_sector_erases(uint32_t sector);
+// reset sector erase counter
+void flash_emul_reset_erase_ops_count(void);
+// return number of flash_erase calls
+uint32_t flash_emul_get_erase_ops_count(void);
\ No newline at end of file
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "testbench.h"
+#include "nvmtnvj.h"
+#include "flash_driver.h"
+
+// Power-fail sweep. A workload is recorded from a seed and replayed with power cut
+// at every byte of every flash write. Before each operation the flash and the ram
+// state are saved, each cut point is then tried on a copy: cut, mount, fix, compare
+// with the model, restore. Cut points are dealt round robin to forked workers, each
+// replaying the whole workload uncut and only trying its own cut points.
+// A torn value read back as valid data is a failure like any other.
+
+#define PF_SECTOR_SIZE 128
+#define PF_SECTORS 16
+#define PF_SECTORS_PER_BLOCK 2
+#define PF_VALUE_MAX 16
+#define PF_ID_BASE 0x0100
+#define PF_IDS 16
+#define PF_BATCH_MAX 3
+// pf_check result for a torn value passing the chk
+#define PF_TORN -2
+
+enum
+{
+	OP_TAG,
+	OP_BATCH,
+	OP_GC_STEP,
+	OP_CHECKPOINT,
+};
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t count; // tags, or gc budget
+	uint16_t id[PF_BATCH_MAX];
+	int16_t len[PF_BATCH_MAX]; // -1 deletes
+	uint8_t data[PF_BATCH_MAX][PF_VALUE_MAX];
+} pf_op_t;
+
+typedef struct
+{
+	uint32_t cuts;
+	uint32_t failed;
+	uint32_t first_op;
+	uint32_t first_cut;
+} pf_result_t;
+
+static void pf_record(pf_op_t *ops, uint32_t count, uint32_t seed)
+{
+	prand_t p;
+	prand_seed(&p, seed);
+	for (uint32_t i = 0; i < count; i++)
+	{
+		pf_op_t *op = &ops[i];
+		memset(op, 0, sizeof(*op));
+		const uint32_t r = prand(&p, 8) % 20;
+		op->type = r < 15 ? OP_TAG : (r < 17 ? OP_BATCH : (r < 19 ? OP_GC_STEP : OP_CHECKPOINT));
+		if (op->type == OP_GC_STEP)
+		{
+			op->count = 1 + prand(&p, 3);
+			continue;
+		}
+		if (op->type == OP_CHECKPOINT)
+			continue;
+		op->count = op->type == OP_BATCH ? 2 + prand(&p, 8) % (PF_BATCH_MAX - 1) : 1;
+		for (uint32_t t = 0; t < op->count; t++)
+		{
+			// distinct ids within a batch
+			uint16_t id;
+			bool dup;
+			do
+			{
+				id = PF_ID_BASE + prand(&p, 8) % PF_IDS;
+				dup = false;
+				for (uint32_t u = 0; u < t; u++)
+					dup |= op->id[u] == id;
+			} while (dup);
+			op->id[t] = id;
+			op->len[t] = prand(&p, 3) == 0 ? -1 : (int16_t)(prand(&p, 8) % (PF_VALUE_MAX + 1));
+			for (int16_t b = 0; b < op->len[t]; b++)
+				op->data[t][b] = prand(&p, 8);
+		}
+	}
+}
+
+static int pf_run(const pf_op_t *op)
+{
+	int res = 0;
+	switch (op->type)
+	{
+	case OP_TAG:
+		if (op->len[0] < 0)
+			return nvmtnvj_delete(op->id[0]);
+		return nvmtnvj_write(op->id[0], op->data[0], op->len[0]);
+	case OP_BATCH:
+		res = nvmtnvj_batch_begin(op->count);
+		for (uint32_t t = 0; t < op->count && res == 0; t++)
+		{
+			if (op->len[t] < 0)
+				res = nvmtnvj_batch_delete(op->id[t]);
+			else
+				res = nvmtnvj_batch_write(op->id[t], op->data[t], op->len[t]);
+		}
+		return res == 0 ? nvmtnvj_batch_commit() : res;
+	case OP_GC_STEP:
+		res = nvmtnvj_gc_step(op->count);
+		return res < 0 && res != ERR_NVMTNVJ_INVAL ? res : 0;
+	case OP_CHECKPOINT:
+		res = nvmtnvj_checkpoint();
+		return res == ERR_NVMTNVJ_INVAL ? 0 : res;
+	}
+	return -1;
+}
+
+static void pf_apply(const pf_op_t *op)
+{
+	if (op->type != OP_TAG && op->type != OP_BATCH)
+		return;
+	for (uint32_t t = 0; t < op->count; t++)
+	{
+		if (op->len[t] < 0)
+			test_tag_delete(op->id[t]);
+		else
+			test_tag_store(op->id[t], op->data[t], op->len[t]);
+	}
+}
+
+static bool pf_tag_is(uint16_t id, int len, const uint8_t *data)
+{
+	uint8_t buf[255];
+	const int res = nvmtnvj_read(id, buf);
+	if (len < 0)
+		return res == ERR_NVMTNVJ_NOENT;
+	return res == len && memcmp(buf, data, len) == 0;
+}
+
+// value programmed up to some byte, the rest left erased
+static bool pf_tag_is_torn(uint16_t id, int len, const uint8_t *data)
+{
+	uint8_t buf[255];
+	const uint8_t erased = flash_emul_get()->flags & FLASH_EMUL_WRITE_BY_AND ? 0xff : 0x00;
+	if (len < 0 || nvmtnvj_read(id, buf) != len)
+		return false;
+	int i = 0;
+	while (i < len && buf[i] == data[i])
+		i++;
+	while (i < len && buf[i] == erased)
+		i++;
+	return i == len;
+}
+
+// Tags of the cut operation may be old or new, but all of a batch alike
+static int pf_check(const pf_op_t *op)
+{
+	int batch_new = -1;
+	for (uint16_t id = PF_ID_BASE; id < PF_ID_BASE + PF_IDS; id++)
+	{
+		int t = -1;
+		for (uint32_t u = 0; (op->type == OP_TAG || op->type == OP_BATCH) && u < op->count; u++)
+			if (op->id[u] == id)
+				t = u;
+		if (t < 0)
+		{
+			if (test_tag_compare(id) != 0)
+				return -1;
+			continue;
+		}
+		const uint8_t *old_data = NULL;
+		uint8_t old_len = 0;
+		const bool old = test_tag_get(id, &old_data, &old_len) < 0 ? pf_tag_is(id, -1, NULL)
+																   : pf_tag_is(id, old_len, old_data);
+		const bool new = pf_tag_is(id, op->len[t], op->data[t]);
+		if (!old && !new)
+			return pf_tag_is_torn(id, op->len[t], op->data[t]) ? PF_TORN : -1;
+		if (old != new)
+		{
+			if (batch_new >= 0 && batch_new != new)
+				return -1;
+			batch_new = new;
+		}
+	}
+	return nvmtnvj_test_check_accounting();
+}
+
+static int pf_power_cycle(void)
+{
+	nvmtnvj_init();
+	int res = nvmtnvj_mount(0, PF_SECTORS_PER_BLOCK + 1);
+	if (res == ERR_NVMTNVJ_FS_ABORTED)
+		res = nvmtnvj_fix();
+	return res;
+}
+
+static int pf_setup(uint8_t *memory)
+{
+	memset(memory, 0x00, PF_SECTOR_SIZE * PF_SECTORS);
+	flash_emul_t f = {
+		.flags = FLASH_EMUL_DISALLOW_BIT_PULLING | FLASH_EMUL_WRITE_BY_OR,
+		.flash_address = memory,
+		.mem = memory,
+		.mem_size = PF_SECTOR_SIZE * PF_SECTORS,
+		.read_alignment = 0,
+		.sector_offset = 0,
+		.sector_size = PF_SECTOR_SIZE,
+		.sectors = PF_SECTORS,
+		.write_alignment = 0};
+	flash_emul_set(&f);
+	flash_init();
+	nvmtnvj_init();
+	test_tags_clear();
+	int res = nvmtnvj_format(0, PF_SECTORS_PER_BLOCK, PF_SECTORS / PF_SECTORS_PER_BLOCK, PF_VALUE_MAX);
+	if (res == 0)
+		res = nvmtnvj_mount(0, PF_SECTORS_PER_BLOCK + 1);
+	return res;
+}
+
+static void pf_fail(pf_result_t *r, uint32_t op_ix, uint32_t cut, int res)
+{
+	if (res == PF_TORN)
+		printf("powerfail: op %d cut %d failed, torn value passed the chk\n", op_ix, cut);
+	else
+		printf("powerfail: op %d cut %d failed, %d\n", op_ix, cut, res);
+	if (r->failed++ == 0)
+	{
+		r->first_op = op_ix;
+		r->first_cut = cut;
+	}
+}
+
+static void pf_worker(const pf_op_t *ops, uint32_t count, uint32_t worker, uint32_t workers, pf_result_t *r)
+{
+	uint8_t *memory = malloc(PF_SECTOR_SIZE * PF_SECTORS);
+	nvmtnvj_t *fs = nvmtnvj_ctx_get(0);
+	const uint32_t ctx_size = nvmtnvj_test_ctx_size();
+	uint8_t *ctx = malloc(ctx_size);
+	uint32_t cut_ix = 0;
+	int res = pf_setup(memory);
+	if (res)
+	{
+		pf_fail(r, 0, 0, res);
+		goto end;
+	}
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const pf_op_t *op = &ops[i];
+		memcpy(ctx, fs, ctx_size);
+
+		// bytes written by the operation uncut
+		flash_emul_push();
+		flash_emul_reset_bytes_written_count();
+		res = pf_run(op);
+		const uint32_t bytes = flash_emul_get_bytes_written_count();
+		flash_emul_pop();
+		memcpy(fs, ctx, ctx_size);
+		if (res)
+		{
+			pf_fail(r, i, 0, res);
+			break;
+		}
+
+		for (uint32_t cut = 1; cut <= bytes; cut++, cut_ix++)
+		{
+			if (cut_ix % workers != worker)
+				continue;
+			r->cuts++;
+			flash_emul_push();
+			flash_emul_write_fail_after_bytes(cut);
+			res = pf_run(op);
+			flash_emul_write_fail_after_bytes(0);
+			if (res == 0 && cut < bytes)
+				res = -1; // cut went unnoticed
+			else
+				res = pf_power_cycle();
+			if (res == 0)
+				res = pf_check(op);
+			if (res)
+				pf_fail(r, i, cut, res);
+			flash_emul_pop();
+			memcpy(fs, ctx, ctx_size);
+		}
+
+		res = pf_run(op);
+		if (res)
+		{
+			pf_fail(r, i, 0, res);
+			break;
+		}
+		pf_apply(op);
+	}
+end:
+	flash_deinit();
+	test_tags_clear();
+	free(ctx);
+	free(memory);
+}
+
+int powerfail_run(uint32_t ops, uint32_t seed, uint32_t workers)
+{
+	pf_op_t *op_list = malloc(ops * sizeof(pf_op_t));
+	pf_record(op_list, ops, seed);
+	if (workers == 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int fds[2];
+	if (pipe(fds))
+		return -1;
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	fflush(stdout);
+	for (uint32_t w = 0; w < workers; w++)
+	{
+		pid_t pid = fork();
+		if (pid < 0)
+			return -1;
+		if (pid == 0)
+		{
+			pf_result_t r = {0};
+			pf_worker(op_list, ops, w, workers, &r);
+			int wr = write(fds[1], &r, sizeof(r));
+			fflush(stdout);
+			_exit(wr == sizeof(r) ? 0 : 1);
+		}
+	}
+	close(fds[1]);
+	pf_result_t total = {0};
+	uint32_t reports = 0;
+	pf_result_t r;
+	while (read(fds[0], &r, sizeof(r)) == sizeof(r))
+	{
+		if (r.failed && (total.failed == 0 || r.first_op < total.first_op ||
+						 (r.first_op == total.first_op && r.first_cut < total.first_cut)))
+		{
+			total.first_op = r.first_op;
+			total.first_cut = r.first_cut;
+		}
+		total.cuts += r.cuts;
+		total.failed += r.failed;
+		reports++;
+	}
+	close(fds[0]);
+	while (wait(NULL) > 0)
+		;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	free(op_list);
+
+	const double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("powerfail: %d ops, seed %d, %d workers, %d cut points in %.2f s, %.0f cut points/s\n", ops, seed,
+		   workers, total.cuts, secs, secs > 0 ? total.cuts / secs : 0);
+	if (reports != workers)
+	{
+		printf("powerfail: %d of %d workers lost\n", workers - reports, workers);
+		return -1;
+	}
+	if (total.failed)
+	{
+		printf("powerfail: %d failed, first at op %d cut %d\n", total.failed, total.first_op, total.first_cut);
+		return -1;
+	}
+	return 0;
+}
+
+int powerfail_main(int argc, char **argv)
+{
+	uint32_t ops = 500;
+	uint32_t seed = 1;
+	uint32_t workers = 0;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+			ops = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			seed = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-j") == 0)
+			workers = atoi(argv[i + 1]);
+		else
+			break;
+	}
+	return powerfail_run(ops, seed, workers) == 0 ? 0 : 1;
+}
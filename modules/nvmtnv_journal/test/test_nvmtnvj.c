@@ -3,9 +3,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include "testrunner.h"
 #include "testbench.h"
 #include "nvmtnvj.h"
+#include "nvmtnvj_migrate.h"
+#include "nvmtnv.h"
 #include "flash_driver.h"
 
 #define PAGE_SIZE 128
@@ -86,6 +89,35 @@ TEST(write_read_delete)
 }
 TEST_END;
 
+TEST(read_ptr)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	const uint8_t *ptr = NULL;
+	TEST_CHECK_EQ(nvmtnvj_write(0x1111, (const uint8_t *)"hello", 5), 0);
+	TEST_CHECK_EQ(nvmtnvj_write(0x2222, (const uint8_t *)"", 0), 0);
+	TEST_CHECK_EQ(nvmtnvj_write(0x1111, (const uint8_t *)"hellooo", 7), 0);
+	TEST_CHECK_EQ(nvmtnvj_read_ptr(0x1111, &ptr), 7);
+	TEST_CHECK_GE((intptr_t)ptr, (intptr_t)memory);
+	TEST_CHECK_LE((intptr_t)ptr + 7, (intptr_t)memory + sizeof(memory));
+	TEST_CHECK_EQ(memcmp(ptr, "hellooo", 7), 0);
+	TEST_CHECK_EQ(nvmtnvj_read_ptr(0x2222, &ptr), 0);
+	TEST_CHECK_EQ(nvmtnvj_read_ptr(0x3333, &ptr), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_delete(0x1111), 0);
+	TEST_CHECK_EQ(nvmtnvj_read_ptr(0x1111, &ptr), ERR_NVMTNVJ_NOENT);
+
+	// flash not memory mapped
+	TEST_CHECK_EQ(nvmtnvj_write(0x1111, (const uint8_t *)"hello", 5), 0);
+	flash_emul_t f = *flash_emul_get();
+	f.flash_address = NULL;
+	flash_emul_set(&f);
+	TEST_CHECK_EQ(nvmtnvj_read_ptr(0x1111, &ptr), ERR_NVMTNVJ_NOMAP);
+	uint8_t data[TAG_MAX_SIZE];
+	TEST_CHECK_EQ(nvmtnvj_read(0x1111, data), 5);
+	return 0;
+}
+TEST_END;
+
 TEST(aborted_write)
 {
 	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
@@ -93,8 +125,11 @@ TEST(aborted_write)
 	uint8_t data[8];
 
 	flash_emul_reset_bytes_written_count();
+	flash_emul_reset_write_ops_count();
 	TEST_CHECK_EQ(nvmtnvj_write(0x1111, (const uint8_t *)"12345678", 8), 0);
 	uint32_t wr = flash_emul_get_bytes_written_count();
+	// value programmed at once, then the first word with the state
+	TEST_CHECK_EQ(flash_emul_get_write_ops_count(), 2);
 	TEST_CHECK_EQ(nvmtnvj_read(0x1111, data), 8);
 	TEST_CHECK_EQ(memcmp(data, "12345678", 8), 0);
 
@@ -181,6 +216,9 @@ typedef struct
 	uint32_t seq_nbr;
 	uint32_t data_flag;
 	uint32_t evict_flag;
+	uint32_t erase_count;
+	uint16_t wide_nbr_of_blocks;
+	uint16_t wide_sectors_per_block;
 } test_block_header_t;
 
 static void set_block_seq_nbr(uint32_t block_ix, uint32_t seq_nbr)
@@ -301,97 +339,1720 @@ TEST(mount_scan_first_sector_borked)
 }
 TEST_END;
 
-#define WEAR_CYCLES 10000
+TEST(index_lookup)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	prand_t p;
+	prand_seed(&p, 1231);
 
-TEST(wear_balanced)
+	// oldest tag in first block, push it back by filling two more blocks
+	TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(0x1000, TAG_MAX_SIZE, &p), 0);
+	for (uint32_t i = 0; i < tags_per_block * 2; i++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(0x2000 + (i % 8), TAG_MAX_SIZE, &p), 0);
+	TEST_CHECK_EQ(nvmtnvj_delete(0x2000), 0);
+	test_tag_delete(0x2000);
+
+	uint8_t data[TAG_MAX_SIZE];
+	flash_emul_reset_bytes_read_count();
+	TEST_CHECK_GE(nvmtnvj_read(0x1000, data), 0);
+	// one tag header and the data
+	TEST_CHECK_LE(flash_emul_get_bytes_read_count(), 5 + TAG_MAX_SIZE);
+	flash_emul_reset_bytes_read_count();
+	TEST_CHECK_EQ(nvmtnvj_read(0x2000, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_read(0x3000, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(flash_emul_get_bytes_read_count(), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+
+	// index rebuilt on mount
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	flash_emul_reset_bytes_read_count();
+	TEST_CHECK_GE(nvmtnvj_read(0x1000, data), 0);
+	TEST_CHECK_LE(flash_emul_get_bytes_read_count(), 5 + TAG_MAX_SIZE);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+
+	// index follows evicted tags
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	return 0;
+}
+TEST_END;
+
+TEST(index_overflow)
 {
-	uint32_t cycles = WEAR_CYCLES;
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
 	prand_t p;
-	prand_seed(&p, 111231);
+	prand_seed(&p, 4321);
+	// more unique ids than the index can hold
+	for (uint32_t i = 0; i < tags_per_block * (blocks - 1) - 1; i++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(0x100 + i * 3, TAG_MAX_SIZE, &p), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_delete(0x100), 0);
+	test_tag_delete(0x100);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+
+	// unindexed lookup traverses all blocks, block headers are cached and tag
+	// headers are read a window at a time
+	uint8_t data[TAG_MAX_SIZE];
+	flash_emul_reset_read_ops_count();
+	TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(flash_emul_get_read_ops_count(),
+				  (blocks - 1) * BLOCK_PAGES * PAGE_SIZE / CONFIG_NVMTNVJ_READ_AHEAD_SIZE);
+	return 0;
+}
+TEST_END;
+
+static struct
+{
+	uint32_t calls;
+	uint32_t mismatches;
+} read_multi_res;
+
+static void read_multi_cb(uint16_t tag, const uint8_t *data, int len, void *user)
+{
+	const uint8_t *exp_data;
+	uint8_t exp_len;
+	read_multi_res.calls++;
+	if (test_tag_get(tag, &exp_data, &exp_len) < 0)
+	{
+		if (len != ERR_NVMTNVJ_NOENT || data != NULL)
+			read_multi_res.mismatches++;
+	}
+	else if (len != exp_len || memcmp(data, exp_data, len) != 0)
+	{
+		read_multi_res.mismatches++;
+	}
+}
+
+TEST(read_multi)
+{
 	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
-	TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
-	// assume a tag takes max_size * 2 bytes on flash
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
 	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
 	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
-	// assume our tag id space spans half of available data blocks to allow for 50% chance of rewrite
-	const uint16_t max_tag_id = tags_per_block * (blocks - 1) / 2;
-	while (cycles--)
+	prand_t p;
+	prand_seed(&p, 8642);
+	// more unique ids than the index can hold
+	const uint32_t count = tags_per_block * (blocks - 1) - 2;
+	uint16_t ids[count + 3];
+	for (uint32_t i = 0; i < count; i++)
 	{
-		uint16_t id = prand(&p, 16) % max_tag_id;
+		ids[i] = 0x200 + i;
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(ids[i], TAG_MAX_SIZE, &p), 0);
+	}
+	TEST_CHECK_EQ(nvmtnvj_delete(0x200), 0);
+	test_tag_delete(0x200);
+	ids[count] = 0x0001;	 // never written
+	ids[count + 1] = 0x0201; // twice
+	ids[count + 2] = 0x0200; // deleted
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+
+	// all in one sweep, plus reading each found value
+	memset(&read_multi_res, 0, sizeof(read_multi_res));
+	flash_emul_reset_read_ops_count();
+	TEST_CHECK_EQ(nvmtnvj_read_multi(ids, count + 3, read_multi_cb, NULL), 0);
+	TEST_CHECK_LE(flash_emul_get_read_ops_count(),
+				  (blocks - 1) * BLOCK_PAGES * PAGE_SIZE / CONFIG_NVMTNVJ_READ_AHEAD_SIZE + count);
+	TEST_CHECK_EQ(read_multi_res.calls, count + 3);
+	TEST_CHECK_EQ(read_multi_res.mismatches, 0);
+
+	// stops early when all are found in the most recent block
+	flash_emul_reset_read_ops_count();
+	memset(&read_multi_res, 0, sizeof(read_multi_res));
+	TEST_CHECK_EQ(nvmtnvj_read_multi(&ids[count - 2], 2, read_multi_cb, NULL), 0);
+	TEST_CHECK_LE(flash_emul_get_read_ops_count(), 2 + 2);
+	TEST_CHECK_EQ(read_multi_res.calls, 2);
+	TEST_CHECK_EQ(read_multi_res.mismatches, 0);
+
+	// with a complete index there is no sweep, missing ids cost nothing
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	test_tags_clear();
+	for (uint32_t i = 0; i < 3; i++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(ids[i], TAG_MAX_SIZE, &p), 0);
+	flash_emul_reset_read_ops_count();
+	memset(&read_multi_res, 0, sizeof(read_multi_res));
+	TEST_CHECK_EQ(nvmtnvj_read_multi(ids, count + 3, read_multi_cb, NULL), 0);
+	TEST_CHECK_LE(flash_emul_get_read_ops_count(), 3 * 2);
+	TEST_CHECK_EQ(read_multi_res.calls, count + 3);
+	TEST_CHECK_EQ(read_multi_res.mismatches, 0);
+	return 0;
+}
+TEST_END;
+
+TEST(iter)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	prand_t p;
+	prand_seed(&p, 97531);
+	for (int i = 0; i < 200; i++)
+	{
+		uint16_t id = 0x300 + prand(&p, 16) % 24;
 		if (prand(&p, 2) == 0)
 		{
-			// delete 1/4
 			test_tag_delete(id);
 			TEST_CHECK_EQ(nvmtnvj_delete(id), 0);
 		}
 		else
 		{
-			// write 3/4
 			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
 		}
 	}
-	// check all data is consistent
-	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	// aborted rewrite of a live tag must yield the older value
+	uint16_t live_id = 0x300;
+	while (test_tag_get(live_id, NULL, NULL) < 0)
+		live_id++;
+	// the workload leaves the current block full, gc first so that the aborted write
+	// is the tag and not the gc making room for it
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	nvmtnvj_stats_t stats;
+	TEST_CHECK_EQ(nvmtnvj_stats(&stats), 0);
+	TEST_CHECK_GT(stats.free_slots, 0);
+	flash_emul_write_fail_after_bytes(7);
+	TEST_CHECK_EQ(nvmtnvj_write(live_id, (const uint8_t *)"abortabo", 8), FLASH_EMUL_FORCE_FAIL);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
 
-	// make sure we wear equally
-	uint32_t max_diff = 0;
-	uint32_t base = flash_emul_get_sector_erases(0);
+	uint8_t seen[NVMTNVJ_ITER_SEEN_SIZE(0x300, 0x317)];
+	nvmtnvj_iter_t it;
+	TEST_CHECK_EQ(nvmtnvj_iter_init(&it, 0x300, 0x317, seen, sizeof(seen) - 1), ERR_NVMTNVJ_INVAL);
+	for (int range = 0; range < 2; range++)
+	{
+		// all, and then a part of the range
+		const uint16_t max_id = range == 0 ? 0x317 : 0x307;
+		TEST_CHECK_EQ(nvmtnvj_iter_init(&it, 0x300, max_id, seen, sizeof(seen)), 0);
+		uint32_t yielded = 0;
+		uint8_t data[TAG_MAX_SIZE];
+		uint16_t id;
+		int len;
+		while ((len = nvmtnvj_iter_next(&it, &id, data)) >= 0)
+		{
+			const uint8_t *exp_data;
+			uint8_t exp_len;
+			TEST_CHECK_EQ(test_tag_get(id, &exp_data, &exp_len), 0);
+			TEST_CHECK_EQ(len, exp_len);
+			TEST_CHECK_EQ(memcmp(data, exp_data, len), 0);
+			TEST_CHECK_LE(id, max_id);
+			yielded++;
+		}
+		TEST_CHECK_EQ(len, ERR_NVMTNVJ_NOENT);
+		TEST_CHECK_EQ(nvmtnvj_iter_next(&it, &id, data), ERR_NVMTNVJ_NOENT);
+		uint32_t live = 0;
+		for (uint16_t i = 0x300; i <= max_id; i++)
+			live += test_tag_get(i, NULL, NULL) == 0 ? 1 : 0;
+		// each live tag once, as each yielded tag is live
+		TEST_CHECK_EQ(yielded, live);
+	}
+	return 0;
+}
+TEST_END;
+
+TEST(write_cache)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_write(0x10, (const uint8_t *)"onflash", 7), 0);
+	uint8_t data[TAG_MAX_SIZE];
+	const uint8_t *ptr;
+
+	// rewrites of a cached tag coalesce in ram
+	flash_emul_reset_bytes_written_count();
+	for (int i = 0; i < 10; i++)
+	{
+		uint8_t v[4] = {'v', 'a', 'l', '0' + i};
+		TEST_CHECK_EQ(nvmtnvj_write_cached(0x20, v, 4), 0);
+	}
+	// same value as on flash is never dirty
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x10, (const uint8_t *)"onflash", 7), 0);
+	TEST_CHECK_EQ(flash_emul_get_bytes_written_count(), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x20, data), 4);
+	TEST_CHECK_EQ(memcmp(data, "val9", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_read_ptr(0x20, &ptr), 4);
+	TEST_CHECK_EQ(memcmp(ptr, "val9", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_size(0x20), 4);
+	TEST_CHECK_EQ(nvmtnvj_flush(), 0);
+	TEST_CHECK_NEQ(flash_emul_get_bytes_written_count(), 0);
+
+	// writing same value again is dropped, cached or not
+	flash_emul_reset_bytes_written_count();
+	TEST_CHECK_EQ(nvmtnvj_write(0x20, (const uint8_t *)"val9", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x20, (const uint8_t *)"val9", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_flush(), 0);
+	TEST_CHECK_EQ(flash_emul_get_bytes_written_count(), 0);
+
+	// deleted before flushed never reaches flash
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x30, (const uint8_t *)"gone", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_delete(0x30), 0);
+	TEST_CHECK_EQ(nvmtnvj_flush(), 0);
+	TEST_CHECK_EQ(flash_emul_get_bytes_written_count(), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x30, data), ERR_NVMTNVJ_NOENT);
+
+	// watermark of dirty entries flushes
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x40, (const uint8_t *)"a", 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x41, (const uint8_t *)"b", 1), 0);
+	TEST_CHECK_EQ(flash_emul_get_bytes_written_count(), 0);
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x42, (const uint8_t *)"c", 1), 0);
+	TEST_CHECK_NEQ(flash_emul_get_bytes_written_count(), 0);
+
+	// more tags than cache entries
+	for (int i = 0; i < 20; i++)
+		TEST_CHECK_EQ(nvmtnvj_write_cached(0x100 + i, (const uint8_t *)&i, sizeof(i)), 0);
+	TEST_CHECK_EQ(nvmtnvj_write_cached(0x20, (const uint8_t *)"last", 4), 0);
+
+	// unmount flushes
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x20, data), 4);
+	TEST_CHECK_EQ(memcmp(data, "last", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x10, data), 7);
+	TEST_CHECK_EQ(nvmtnvj_read(0x42, data), 1);
+	for (int i = 0; i < 20; i++)
+	{
+		int v;
+		TEST_CHECK_EQ(nvmtnvj_read(0x100 + i, (uint8_t *)&v), sizeof(v));
+		TEST_CHECK_EQ(v, i);
+	}
+	return 0;
+}
+TEST_END;
+
+TEST(gc_accounting)
+{
+	TEST_CHECK_EQ(prime_gc_state(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	const uint32_t block_size = BLOCK_PAGES * PAGE_SIZE;
+	prand_t p;
+	prand_seed(&p, 5555);
+	for (int gcs = 0; gcs < 8; gcs++)
+	{
+		for (uint32_t i = 0; i < tags_per_block / 2; i++)
+			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(prand(&p, 16) % 20, TAG_MAX_SIZE, &p), 0);
+		TEST_CHECK_EQ(nvmtnvj_delete(gcs), 0);
+		test_tag_delete(gcs);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+		flash_emul_reset_bytes_read_count();
+		TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+		// only the evicted block is mapped and copied, give or take a read-ahead window
+		TEST_CHECK_LE(flash_emul_get_bytes_read_count(), block_size * 2 + CONFIG_NVMTNVJ_READ_AHEAD_SIZE);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+		TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	}
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	return 0;
+}
+TEST_END;
+
+static uint32_t total_sector_erases(void)
+{
+	uint32_t erases = 0;
 	for (uint32_t i = 0; i < flash_emul_get()->sectors; i++)
+		erases += flash_emul_get_sector_erases(i);
+	return erases;
+}
+
+TEST(stats)
+{
+	prand_t p;
+	prand_seed(&p, 424242);
+	nvmtnvj_stats_t st;
+	TEST_CHECK_EQ(nvmtnvj_stats(&st), ERR_NVMTNVJ_MOUNT);
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
+	TEST_CHECK_EQ(nvmtnvj_stats(&st), 0);
+	TEST_CHECK_EQ(st.live_tags, 0);
+	TEST_CHECK_EQ(st.dead_tags, 0);
+	TEST_CHECK_EQ(st.spare_blocks, 1);
+	TEST_CHECK_EQ(st.data_blocks + st.free_blocks + st.spare_blocks, blocks);
+	TEST_CHECK_EQ(st.free_slots, (st.free_blocks + 1) * tags_per_block);
+	const uint32_t free_slots = st.free_slots;
+
+	// 6 tags, 3 of them rewritten and 2 others deleted
+	for (uint16_t id = 0; id < 6; id++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
+	for (uint16_t id = 0; id < 3; id++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
+	for (uint16_t id = 4; id < 6; id++)
 	{
-		uint32_t erases = flash_emul_get_sector_erases(i);
-		uint32_t diff = erases > base ? (erases - base) : (base - erases);
-		if (diff > max_diff)
-			max_diff = diff;
+		TEST_CHECK_EQ(nvmtnvj_delete(id), 0);
+		test_tag_delete(id);
 	}
-	TEST_CHECK_LE(max_diff, 2);
+	uint8_t buf[TAG_MAX_SIZE];
+	for (uint16_t id = 0; id < 4; id++)
+		TEST_CHECK_GT(nvmtnvj_read(id, buf), 0);
+	TEST_CHECK_EQ(nvmtnvj_stats(&st), 0);
+	TEST_CHECK_EQ(st.free_slots, free_slots - 11);
+	TEST_CHECK_EQ(st.live_tags, 4);
+	TEST_CHECK_EQ(st.dead_tags, 7);
+	// delete entries are kept until the tag is gone from older blocks
+	TEST_CHECK_EQ(st.freeable_tags, 5);
+	// deletes look up the tag too
+	TEST_CHECK_EQ(st.lookups, 6);
+	// served by index
+	TEST_CHECK_EQ(st.lookup_depth_x100, 100);
+	TEST_CHECK_EQ(st.gc_count, 0);
+	TEST_CHECK_EQ(st.gc_bytes_written, 0);
+
+	const uint32_t copies_before = nvmtnvj_test_copied_tags();
+	uint32_t erases = total_sector_erases();
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	TEST_CHECK_EQ(nvmtnvj_stats(&st), 0);
+	TEST_CHECK_EQ(st.gc_count, 1);
+	TEST_CHECK_EQ(st.gc_copied_tags, nvmtnvj_test_copied_tags() - copies_before);
+	TEST_CHECK_EQ(st.gc_erases, total_sector_erases() - erases);
+	TEST_CHECK_GT(st.gc_bytes_written, 0);
+	TEST_CHECK_LE(st.gc_bytes_written, st.bytes_written);
+	TEST_CHECK_EQ(st.live_tags, 4);
+	TEST_CHECK_EQ(st.data_blocks + st.free_blocks + st.spare_blocks, blocks);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	const nvmtnvj_stats_t st_gc = st;
+
+	// counters restart on mount, tag counts are the same
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_stats(&st), 0);
+	TEST_CHECK_EQ(st.gc_count, 0);
+	TEST_CHECK_EQ(st.lookups, 0);
+	TEST_CHECK_EQ(st.free_slots, st_gc.free_slots);
+	TEST_CHECK_EQ(st.live_tags, st_gc.live_tags);
+	TEST_CHECK_EQ(st.dead_tags, st_gc.dead_tags);
+	TEST_CHECK_EQ(st.freeable_tags, st_gc.freeable_tags);
+	TEST_CHECK_EQ(st.seq_nbr_span, st_gc.seq_nbr_span);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
 	return 0;
 }
 TEST_END;
 
-TEST(wear_unbalanced)
+TEST(powerfail_sweep)
+{
+	// short sweep, make powerfail runs a longer one
+	TEST_CHECK_EQ(powerfail_run(60, 4711, 2), 0);
+	return 0;
+}
+TEST_END;
+
+TEST(checkpoint)
 {
-	uint32_t cycles = WEAR_CYCLES;
 	prand_t p;
-	prand_seed(&p, 231111);
+	prand_seed(&p, 31337);
 	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
-	TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(fill_up_until_gc(&p), 0);
+	TEST_CHECK_EQ(fill_up_until_gc(&p), 0);
+	TEST_CHECK_EQ(nvmtnvj_delete(1), 0);
+	test_tag_delete(1);
+
+	// power lost without checkpoint, mount scans
+	nvmtnvj_init();
+	flash_emul_reset_bytes_read_count();
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	const uint32_t scan_bytes = flash_emul_get_bytes_read_count();
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// unmount writes checkpoint, mount reads it instead
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	flash_emul_reset_bytes_read_count();
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_LT(flash_emul_get_bytes_read_count() * 2, scan_bytes);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// nothing written, nothing to checkpoint
+	flash_emul_reset_bytes_written_count();
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(flash_emul_get_bytes_written_count(), 0);
+
+	// entries written after checkpoint are picked up after power loss
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(2, TAG_MAX_SIZE, &p), 0);
+	TEST_CHECK_EQ(nvmtnvj_delete(3), 0);
+	test_tag_delete(3);
+	nvmtnvj_init();
+	flash_emul_reset_bytes_read_count();
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_LT(flash_emul_get_bytes_read_count() * 2, scan_bytes);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// gc erases checkpoints in spare block before copying, and makes them stale
+	TEST_CHECK_EQ(nvmtnvj_checkpoint(), 0);
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(4, TAG_MAX_SIZE, &p), 0);
+	nvmtnvj_init();
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	for (int i = 0; i < 4; i++)
+	{
+		TEST_CHECK_EQ(fill_up_until_gc(&p), 0);
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+		TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+		TEST_CHECK_EQ(test_tag_compare_all(), 0);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	}
+	return 0;
+}
+TEST_END;
+
+TEST(checkpoint_blocks)
+{
+	prand_t p;
+	prand_seed(&p, 424242);
+	const int blocks = PAGE_COUNT / BLOCK_PAGES;
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, blocks, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	for (uint16_t id = 0; id < 6; id++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id % 3, TAG_MAX_SIZE, &p), 0);
+	// gc before the free blocks are used leaves them after the spare block, where
+	// mount does not read their headers
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	TEST_CHECK_LT(nvmtnvj_test_spare_block(), blocks - 1);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_hdr_reads(), nvmtnvj_test_spare_block() + 1);
+
+	// block switch after checkpoint voids it, the new block is found after power loss
+	nvmtnvj_stats_t st;
+	TEST_CHECK_EQ(nvmtnvj_stats(&st), 0);
+	const uint32_t free_blocks = st.free_blocks;
+	TEST_CHECK_GT(free_blocks, 0);
+	for (uint16_t id = 0; st.free_blocks == free_blocks; id = (id + 1) % 3)
+	{
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
+		TEST_CHECK_EQ(nvmtnvj_stats(&st), 0);
+	}
+	TEST_CHECK_EQ(st.gc_count, 0);
+	nvmtnvj_init();
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_GE(nvmtnvj_test_hdr_reads(), blocks);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// wherever gc leaves the spare block, only headers up to it are read
+	int skipped = 0;
+	for (int i = 0; i < 40; i++)
+	{
+		for (uint16_t id = 0; id < 3; id++)
+			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+		TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+		TEST_CHECK_EQ(nvmtnvj_test_hdr_reads(), nvmtnvj_test_spare_block() + 1);
+		skipped += nvmtnvj_test_hdr_reads() < blocks;
+		TEST_CHECK_EQ(test_tag_compare_all(), 0);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	}
+	TEST_CHECK_GT(skipped, 0);
+	return 0;
+}
+TEST_END;
+
+TEST(gc_step)
+{
+	prand_t p;
+	prand_seed(&p, 777123);
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
 	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
 	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
-	// assume our tag id space spans half of available data blocks to allow for 50% chance of rewrite
 	const uint16_t max_tag_id = tags_per_block * (blocks - 1) / 2;
-	// fill a block with tags never to be deleted
-	for (uint16_t fix_tag_id = max_tag_id; fix_tag_id < max_tag_id + tags_per_block; fix_tag_id++)
-		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(fix_tag_id, TAG_MAX_SIZE, &p), 0);
-	// cycle
-	while (cycles--)
+	uint32_t gc_erases = 0;
+	for (int cycles = 0; cycles < 3000; cycles++)
 	{
 		uint16_t id = prand(&p, 16) % max_tag_id;
+		uint32_t erases = total_sector_erases();
 		if (prand(&p, 2) == 0)
 		{
-			// delete 1/4
 			test_tag_delete(id);
 			TEST_CHECK_EQ(nvmtnvj_delete(id), 0);
 		}
 		else
 		{
-			// write 3/4
 			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
 		}
+		// with enough idle steps, writes never erase
+		TEST_CHECK_EQ(total_sector_erases(), erases);
+		int res = nvmtnvj_gc_step(2);
+		TEST_CHECK_GE(res, 0);
+		TEST_CHECK_LE(res, 1);
+		gc_erases += total_sector_erases() - erases;
+		if (cycles % 500 == 0)
+		{
+			TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+			TEST_CHECK_EQ(test_tag_compare_all(), 0);
+		}
 	}
-	// check all data is consistent
+	TEST_CHECK_GE(gc_erases, 3000 / tags_per_block);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	// an explicit gc completes ongoing steps
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
 	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	return 0;
+}
+TEST_END;
 
-	// make sure we wear unequally
-	uint32_t max_diff = 0;
-	uint32_t base = flash_emul_get_sector_erases(0);
-	for (uint32_t i = 0; i < flash_emul_get()->sectors; i++)
+TEST(gc_step_aborted)
+{
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
+	// power loss after each step, with writes interleaved
+	for (uint32_t steps = 0; steps < tags_per_block * 3; steps++)
 	{
-		uint32_t erases = flash_emul_get_sector_erases(i);
-		uint32_t diff = erases > base ? (erases - base) : (base - erases);
-		if (diff > max_diff)
-			max_diff = diff;
-	}
-	TEST_CHECK_GE(max_diff, (WEAR_CYCLES / tags_per_block) / 2);
+		prand_t p;
+		prand_seed(&p, 98765);
+		test_tags_clear();
+		TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+		TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+		for (uint32_t i = 0; i < tags_per_block * (blocks - 2); i++)
+			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(i % 12, TAG_MAX_SIZE, &p), 0);
+		for (uint32_t i = 0; i < steps; i++)
+		{
+			TEST_CHECK_GE(nvmtnvj_gc_step(1), 0);
+			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(prand(&p, 16) % 12, TAG_MAX_SIZE, &p), 0);
+		}
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+		int res = nvmtnvj_mount(0, BLOCK_PAGES + 1);
+		if (res == ERR_NVMTNVJ_FS_ABORTED)
+		{
+			TEST_CHECK_EQ(nvmtnvj_fix(), 0);
+		}
+		else
+		{
+			TEST_CHECK_EQ(res, 0);
+		}
+		TEST_CHECK_EQ(test_tag_compare_all(), 0);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	}
+	return 0;
+}
+TEST_END;
+
+#define WEAR_CYCLES 10000
+
+TEST(wear_balanced)
+{
+	uint32_t cycles = WEAR_CYCLES;
+	prand_t p;
+	prand_seed(&p, 111231);
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+	// assume a tag takes max_size * 2 bytes on flash
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
+	// assume our tag id space spans half of available data blocks to allow for 50% chance of rewrite
+	const uint16_t max_tag_id = tags_per_block * (blocks - 1) / 2;
+	while (cycles--)
+	{
+		uint16_t id = prand(&p, 16) % max_tag_id;
+		if (prand(&p, 2) == 0)
+		{
+			// delete 1/4
+			test_tag_delete(id);
+			TEST_CHECK_EQ(nvmtnvj_delete(id), 0);
+		}
+		else
+		{
+			// write 3/4
+			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
+		}
+		if (cycles % 1000 == 0)
+			TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	}
+	// check all data is consistent
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+
+	// make sure we wear equally
+	uint32_t max_diff = 0;
+	uint32_t base = flash_emul_get_sector_erases(0);
+	for (uint32_t i = 0; i < flash_emul_get()->sectors; i++)
+	{
+		uint32_t erases = flash_emul_get_sector_erases(i);
+		uint32_t diff = erases > base ? (erases - base) : (base - erases);
+		if (diff > max_diff)
+			max_diff = diff;
+	}
+	TEST_CHECK_LE(max_diff, 2);
+	return 0;
+}
+TEST_END;
+
+TEST(wear_unbalanced)
+{
+	uint32_t cycles = WEAR_CYCLES;
+	prand_t p;
+	prand_seed(&p, 231111);
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	const uint32_t blocks = PAGE_COUNT / BLOCK_PAGES;
+	// assume our tag id space spans half of available data blocks to allow for 50% chance of rewrite
+	const uint16_t max_tag_id = tags_per_block * (blocks - 1) / 2;
+	// fill a block with tags never to be deleted
+	for (uint16_t fix_tag_id = max_tag_id; fix_tag_id < max_tag_id + tags_per_block; fix_tag_id++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(fix_tag_id, TAG_MAX_SIZE, &p), 0);
+	// cycle
+	while (cycles--)
+	{
+		uint16_t id = prand(&p, 16) % max_tag_id;
+		if (prand(&p, 2) == 0)
+		{
+			// delete 1/4
+			test_tag_delete(id);
+			TEST_CHECK_EQ(nvmtnvj_delete(id), 0);
+		}
+		else
+		{
+			// write 3/4
+			TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p), 0);
+		}
+	}
+	// check all data is consistent
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+
+	// static wear levelling rotates the block of fixed tags, so wear stays even
+	uint32_t min_erases = (uint32_t)-1, max_erases = 0, sum_erases = 0;
+	for (uint32_t b = 0; b < blocks; b++)
+	{
+		uint32_t erases = flash_emul_get_sector_erases(b * BLOCK_PAGES);
+		if (erases < min_erases)
+			min_erases = erases;
+		if (erases > max_erases)
+			max_erases = erases;
+		sum_erases += erases;
+	}
+	TEST_CHECK_LE(max_erases - min_erases, 8);
+	nvmtnvj_wear_t wear;
+	TEST_CHECK_EQ(nvmtnvj_wear(&wear), 0);
+	TEST_CHECK_EQ(wear.min, min_erases);
+	TEST_CHECK_EQ(wear.max, max_erases);
+	TEST_CHECK_EQ(wear.mean, sum_erases / blocks);
+	return 0;
+}
+TEST_END;
+
+TEST(wear_legacy_format)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	const int tags_per_block = nvmtnvj_test_tags_per_block();
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	// rewrite the fresh filesystem as formatted before erase counts were kept, dropping
+	// the checkpoint written by unmount
+	for (uint32_t b = 0; b < PAGE_COUNT / BLOCK_PAGES; b++)
+	{
+		uint8_t *hdr = memory + b * BLOCK_PAGES * PAGE_SIZE;
+		hdr[offsetof(test_block_header_t, magic)] = 0xba;
+		memset(hdr + offsetof(test_block_header_t, erase_count), 0, BLOCK_PAGES * PAGE_SIZE -
+			   offsetof(test_block_header_t, erase_count));
+	}
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	nvmtnvj_wear_t wear;
+	TEST_CHECK_EQ(nvmtnvj_wear(&wear), ERR_NVMTNVJ_NOENT);
+	// shorter header leaves room for one more tag
+	TEST_CHECK_EQ(nvmtnvj_test_tags_per_block(), tags_per_block + 1);
+
+	prand_t p;
+	prand_seed(&p, 424242);
+	for (int i = 0; i < 4; i++)
+		TEST_CHECK_EQ(fill_up_until_gc(&p), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(memory[0], 0xba);
+	return 0;
+}
+TEST_END;
+
+TEST(mount_narrow_format)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	// rewrite the fresh filesystem as formatted before 16-bit geometry
+	for (uint32_t b = 0; b < PAGE_COUNT / BLOCK_PAGES; b++)
+	{
+		uint8_t *hdr = memory + b * BLOCK_PAGES * PAGE_SIZE;
+		hdr[offsetof(test_block_header_t, magic)] = 0xbc;
+		memset(hdr + offsetof(test_block_header_t, wide_nbr_of_blocks), 0, sizeof(test_block_header_t) -
+			   offsetof(test_block_header_t, wide_nbr_of_blocks));
+	}
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	prand_t p;
+	prand_seed(&p, 777);
+	for (int i = 0; i < 4; i++)
+		TEST_CHECK_EQ(fill_up_until_gc(&p), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	nvmtnvj_wear_t wear;
+	TEST_CHECK_EQ(nvmtnvj_wear(&wear), 0);
+	TEST_CHECK_GE(wear.max, 2);
+	TEST_CHECK_EQ(memory[0], 0xbc);
+	return 0;
+}
+TEST_END;
+
+#define LARGE_BLOCKS 600
+static uint8_t large_memory[PAGE_SIZE * LARGE_BLOCKS];
+
+TEST(large_geometry)
+{
+	// more blocks than fit the narrow header, one page each
+	memset(large_memory, 0x00, sizeof(large_memory));
+	flash_emul_t f = *flash_emul_get();
+	f.flash_address = large_memory;
+	f.mem = large_memory;
+	f.mem_size = sizeof(large_memory);
+	f.sectors = LARGE_BLOCKS;
+	flash_emul_set(&f);
+	TEST_CHECK_EQ(nvmtnvj_format(0, 1, 0xffff, TAG_MAX_SIZE), ERR_NVMTNVJ_INVAL);
+	TEST_CHECK_EQ(nvmtnvj_format(0, 1, LARGE_BLOCKS, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(large_memory[offsetof(test_block_header_t, nbr_of_blocks)], 0xff);
+
+	// without work buffer, scratch is on stack
+	TEST_CHECK_EQ(nvmtnvj_mount(0, 2), 0);
+	const uint32_t tags_per_block = nvmtnvj_test_tags_per_block();
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+
+	const uint32_t work_size = nvmtnvj_work_size(PAGE_SIZE, LARGE_BLOCKS, TAG_MAX_SIZE, 0);
+	uint32_t *work = malloc(work_size);
+	TEST_CHECK_EQ(nvmtnvj_mount_work(0, 2, work, work_size / 2), ERR_NVMTNVJ_INVAL);
+	TEST_CHECK_EQ(nvmtnvj_mount_work(0, 2, work, work_size), 0);
+	prand_t p;
+	prand_seed(&p, 60000);
+	// go round the journal twice
+	for (uint32_t i = 0; i < tags_per_block * LARGE_BLOCKS * 2; i++)
+		TEST_CHECK_EQ(store_random_tag_in_nvm_and_testtag(prand(&p, 16) % 24, TAG_MAX_SIZE, &p), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// block headers are cached in the work buffer, gc reads no headers
+	flash_emul_reset_read_ops_count();
+	TEST_CHECK_EQ(nvmtnvj_gc(), 0);
+	TEST_CHECK_LE(flash_emul_get_read_ops_count(), tags_per_block * 4);
+
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount_work(0, 2, work, work_size), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	free(work);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, 2), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	return 0;
+}
+TEST_END;
+
+TEST(instances)
+{
+	// two journals side by side, one page per block
+	nvmtnvj_t *a = nvmtnvj_ctx_get(0);
+	nvmtnvj_t *b = nvmtnvj_ctx_get(1);
+	TEST_CHECK_NEQ(a, NULL);
+	TEST_CHECK_NEQ(b, NULL);
+	TEST_CHECK_EQ(nvmtnvj_ctx_get(2), NULL);
+	const uint32_t blocks = PAGE_COUNT / 2;
+	TEST_CHECK_EQ(nvmtnvj_ctx_format(a, 0, 1, blocks, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_format(b, blocks, 1, blocks, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(a, 0, 2), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(b, blocks, 2), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_write(a, 0x0001, (const uint8_t *)"aaaa", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_write(b, 0x0001, (const uint8_t *)"bbbbbb", 6), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_write(b, 0x0002, (const uint8_t *)"b2", 2), 0);
+
+	uint32_t b_erases[PAGE_COUNT];
+	for (uint32_t s = blocks; s < PAGE_COUNT; s++)
+		b_erases[s] = flash_emul_get_sector_erases(s);
+	// gc in one journal leaves the other alone
+	uint8_t data[TAG_MAX_SIZE];
+	for (uint32_t i = 0; i < 200; i++)
+	{
+		uint8_t v[TAG_MAX_SIZE];
+		memset(v, i, sizeof(v));
+		TEST_CHECK_EQ(nvmtnvj_ctx_write(a, 0x0100 + i % 8, v, sizeof(v)), 0);
+	}
+	TEST_CHECK_GE(flash_emul_get_sector_erases(0), 2);
+	for (uint32_t s = blocks; s < PAGE_COUNT; s++)
+		TEST_CHECK_EQ(flash_emul_get_sector_erases(s), b_erases[s]);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(a, 0x0001, data), 4);
+	TEST_CHECK_EQ(memcmp(data, "aaaa", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(a, 0x0002, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(b, 0x0001, data), 6);
+	TEST_CHECK_EQ(memcmp(data, "bbbbbb", 6), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(b, 0x0100, data), ERR_NVMTNVJ_NOENT);
+
+	// plain functions operate on first instance
+	TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), 4);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(a, 0x0001, data), ERR_NVMTNVJ_MOUNT);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(b, 0x0002, data), 2);
+	TEST_CHECK_EQ(nvmtnvj_ctx_unmount(b), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(b, blocks, 2), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(b, 0x0001, data), 6);
+	return 0;
+}
+TEST_END;
+
+// second flash device, erased to zeroes like the emulator
+#define DEV_SECTORS 4
+static uint8_t dev_memory[PAGE_SIZE * DEV_SECTORS];
+static uint32_t dev_erases;
+
+static int dev_get_sector_size(uint32_t sector)
+{
+	return sector < DEV_SECTORS ? PAGE_SIZE : ERR_FLASH_BADSECTOR;
+}
+
+static int dev_get_sector_alignment(uint32_t sector, flash_op_t operation)
+{
+	return sector < DEV_SECTORS ? 0 : ERR_FLASH_BADSECTOR;
+}
+
+static int dev_read(uint32_t sector, uint32_t offset, uint8_t *data, uint32_t length)
+{
+	if (sector >= DEV_SECTORS || offset >= PAGE_SIZE)
+		return ERR_FLASH_BADSECTOR;
+	if (offset + length > PAGE_SIZE)
+		length = PAGE_SIZE - offset;
+	memcpy(data, &dev_memory[sector * PAGE_SIZE + offset], length);
+	return length;
+}
+
+static int dev_write(uint32_t sector, uint32_t offset, const uint8_t *data, uint32_t length)
+{
+	if (sector >= DEV_SECTORS || offset >= PAGE_SIZE)
+		return ERR_FLASH_BADSECTOR;
+	if (offset + length > PAGE_SIZE)
+		length = PAGE_SIZE - offset;
+	for (uint32_t i = 0; i < length; i++)
+		dev_memory[sector * PAGE_SIZE + offset + i] |= data[i];
+	return length;
+}
+
+static int dev_erase(uint32_t sector)
+{
+	if (sector >= DEV_SECTORS)
+		return ERR_FLASH_BADSECTOR;
+	memset(&dev_memory[sector * PAGE_SIZE], 0, PAGE_SIZE);
+	dev_erases++;
+	return 0;
+}
+
+// not memory mapped
+static const nvmtnvj_flash_t dev_flash = {
+	.read = dev_read,
+	.write = dev_write,
+	.erase = dev_erase,
+	.get_sector_size = dev_get_sector_size,
+	.get_sector_alignment = dev_get_sector_alignment,
+};
+
+TEST(instances_flash)
+{
+	// same sectors on two devices
+	nvmtnvj_t *a = nvmtnvj_ctx_get(0);
+	nvmtnvj_t *b = nvmtnvj_ctx_get(1);
+	memset(dev_memory, 0xa5, sizeof(dev_memory));
+	dev_erases = 0;
+	TEST_CHECK_EQ(nvmtnvj_ctx_set_flash(b, &dev_flash), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_format(a, 0, 1, DEV_SECTORS, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_format(b, 0, 1, DEV_SECTORS, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(dev_erases, DEV_SECTORS);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(a, 0, 2), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(b, 0, 2), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_set_flash(b, NULL), ERR_NVMTNVJ_MOUNT);
+	TEST_CHECK_EQ(nvmtnvj_ctx_write(a, 0x0001, (const uint8_t *)"aaaa", 4), 0);
+	uint8_t emul_memory[sizeof(memory)];
+	memcpy(emul_memory, memory, sizeof(memory));
+	for (uint32_t i = 0; i < 100; i++)
+	{
+		uint8_t v[TAG_MAX_SIZE];
+		memset(v, i, sizeof(v));
+		TEST_CHECK_EQ(nvmtnvj_ctx_write(b, 0x0100 + i % 4, v, sizeof(v)), 0);
+	}
+	TEST_CHECK_EQ(nvmtnvj_ctx_write(b, 0x0001, (const uint8_t *)"bbbbbb", 6), 0);
+	// b has gc'd on its own device only
+	TEST_CHECK_GT(dev_erases, DEV_SECTORS);
+	TEST_CHECK_EQ(memcmp(emul_memory, memory, sizeof(memory)), 0);
+
+	uint8_t data[TAG_MAX_SIZE];
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(a, 0x0001, data), 4);
+	TEST_CHECK_EQ(memcmp(data, "aaaa", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(a, 0x0100, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(b, 0x0001, data), 6);
+	TEST_CHECK_EQ(memcmp(data, "bbbbbb", 6), 0);
+	const uint8_t *ptr;
+	TEST_CHECK_EQ(nvmtnvj_ctx_read_ptr(a, 0x0001, &ptr), 4);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read_ptr(b, 0x0001, &ptr), ERR_NVMTNVJ_NOMAP);
+
+	// driver kept over remount
+	TEST_CHECK_EQ(nvmtnvj_ctx_unmount(b), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(b, 0, 2), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_read(b, 0x0103, data), TAG_MAX_SIZE);
+	TEST_CHECK_EQ(data[0], 99);
+	TEST_CHECK_EQ(nvmtnvj_ctx_unmount(b), 0);
+	TEST_CHECK_EQ(nvmtnvj_ctx_unmount(a), 0);
+	// init goes back to the flash_ functions, where b finds no journal
+	nvmtnvj_ctx_init(b);
+	TEST_CHECK_EQ(nvmtnvj_ctx_mount(b, DEV_SECTORS, 2), ERR_NVMTNVJ_NOFS);
+	return 0;
+}
+TEST_END;
+
+TEST(batch)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	uint8_t data[8];
+	TEST_CHECK_EQ(nvmtnvj_write(0x0003, (const uint8_t *)"gone", 4), 0);
+
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0001, (const uint8_t *)"a", 1), ERR_NVMTNVJ_BATCH);
+	TEST_CHECK_EQ(nvmtnvj_batch_begin(nvmtnvj_test_tags_per_block()), ERR_NVMTNVJ_INVAL);
+	TEST_CHECK_EQ(nvmtnvj_batch_begin(3), 0);
+	TEST_CHECK_EQ(nvmtnvj_write(0x0001, (const uint8_t *)"a", 1), ERR_NVMTNVJ_BATCH);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0001, (const uint8_t *)"first", 5), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0002, (const uint8_t *)"second", 6), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_delete(0x0003), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0004, (const uint8_t *)"x", 1), ERR_NVMTNVJ_FULL);
+	// not visible until committed
+	TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_batch_commit(), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), 5);
+	TEST_CHECK_EQ(memcmp(data, "first", 5), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x0003, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// survives remount and being moved by gc
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x0002, data), 6);
+	TEST_CHECK_EQ(memcmp(data, "second", 6), 0);
+	for (int i = 0; i < 40; i++)
+	{
+		TEST_CHECK_EQ(nvmtnvj_batch_begin(2), 0);
+		TEST_CHECK_EQ(nvmtnvj_batch_write(0x0010, (const uint8_t *)&i, sizeof(i)), 0);
+		TEST_CHECK_EQ(nvmtnvj_batch_write(0x0011, (const uint8_t *)&i, sizeof(i)), 0);
+		TEST_CHECK_EQ(nvmtnvj_batch_commit(), 0);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+	}
+	TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), 5);
+	TEST_CHECK_EQ(memcmp(data, "first", 5), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+	int v;
+	TEST_CHECK_EQ(nvmtnvj_read(0x0011, (uint8_t *)&v), sizeof(v));
+	TEST_CHECK_EQ(v, 39);
+	TEST_CHECK_EQ(nvmtnvj_read(0x0002, data), 6);
+
+	return 0;
+}
+TEST_END;
+
+// entries of committed batches are found by read_multi, through index and sweep
+TEST(read_multi_batch)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	test_tags_clear();
+	TEST_CHECK_EQ(nvmtnvj_write(0x0003, (const uint8_t *)"gone", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_begin(3), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0001, (const uint8_t *)"first", 5), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0002, (const uint8_t *)"second", 6), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_delete(0x0003), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_commit(), 0);
+	test_tag_store(0x0001, (const uint8_t *)"first", 5);
+	test_tag_store(0x0002, (const uint8_t *)"second", 6);
+	const uint16_t few[] = {0x0001, 0x0002, 0x0003, 0x0004};
+	memset(&read_multi_res, 0, sizeof(read_multi_res));
+	TEST_CHECK_EQ(nvmtnvj_read_multi(few, 4, read_multi_cb, NULL), 0);
+	TEST_CHECK_EQ(read_multi_res.calls, 4);
+	TEST_CHECK_EQ(read_multi_res.mismatches, 0);
+
+	// more ids than the index holds, resolved by the sweep
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	test_tags_clear();
+	const uint32_t count = CONFIG_NVMTNVJ_TAG_INDEX_SIZE + 2;
+	uint16_t ids[count];
+	for (uint32_t i = 0; i < count; i++)
+	{
+		const uint8_t v[2] = {i, i >> 8};
+		ids[i] = 0x100 + i;
+		if (i == count - 2)
+		{
+			TEST_CHECK_EQ(nvmtnvj_batch_begin(2), 0);
+		}
+		if (i < count - 2)
+		{
+			TEST_CHECK_EQ(nvmtnvj_write(ids[i], v, sizeof(v)), 0);
+		}
+		else
+		{
+			TEST_CHECK_EQ(nvmtnvj_batch_write(ids[i], v, sizeof(v)), 0);
+		}
+		test_tag_store(ids[i], v, sizeof(v));
+	}
+	TEST_CHECK_EQ(nvmtnvj_batch_commit(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	memset(&read_multi_res, 0, sizeof(read_multi_res));
+	TEST_CHECK_EQ(nvmtnvj_read_multi(ids, count, read_multi_cb, NULL), 0);
+	TEST_CHECK_EQ(read_multi_res.calls, count);
+	TEST_CHECK_EQ(read_multi_res.mismatches, 0);
+	return 0;
+}
+TEST_END;
+
+TEST(batch_aborted)
+{
+	TEST_CHECK_EQ(nvmtnvj_format(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, TAG_MAX_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	uint8_t data[8];
+	TEST_CHECK_EQ(nvmtnvj_write(0x0001, (const uint8_t *)"old1", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_write(0x0002, (const uint8_t *)"old2", 4), 0);
+
+	// power lost at every byte of a batch
+	uint32_t cut = 1;
+	int res;
+	do
+	{
+		flash_emul_push();
+		TEST_CHECK_EQ(nvmtnvj_batch_begin(2), 0);
+		flash_emul_write_fail_after_bytes(cut);
+		res = nvmtnvj_batch_write(0x0001, (const uint8_t *)"new1", 4);
+		if (res == 0)
+			res = nvmtnvj_batch_write(0x0002, (const uint8_t *)"new2", 4);
+		if (res == 0)
+			res = nvmtnvj_batch_commit();
+		flash_emul_write_fail_after_bytes(0);
+		nvmtnvj_unmount();
+		TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+		TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), 4);
+		const int committed = memcmp(data, "new1", 4) == 0;
+		TEST_CHECK_EQ(nvmtnvj_read(0x0002, data), 4);
+		TEST_CHECK_EQ(memcmp(data, committed ? "new2" : "old2", 4), 0);
+		// the very last byte of the commit marker may fail after programming
+		TEST_CHECK_GE(committed, res == 0);
+		// a batch written after the aborted one must not be mistaken for it
+		TEST_CHECK_EQ(nvmtnvj_batch_begin(1), 0);
+		TEST_CHECK_EQ(nvmtnvj_batch_write(0x0003, (const uint8_t *)"next", 4), 0);
+		TEST_CHECK_EQ(nvmtnvj_batch_commit(), 0);
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+		TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+		TEST_CHECK_EQ(nvmtnvj_read(0x0003, data), 4);
+		TEST_CHECK_EQ(nvmtnvj_read(0x0002, data), 4);
+		TEST_CHECK_EQ(memcmp(data, committed ? "new2" : "old2", 4), 0);
+		TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+		TEST_CHECK_EQ(flash_emul_pop(), 0);
+		TEST_CHECK_EQ(nvmtnvj_mount(0, 8), 0);
+		cut++;
+	} while (res != 0);
+
+	// explicitly aborted batch
+	TEST_CHECK_EQ(nvmtnvj_batch_begin(2), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(0x0001, (const uint8_t *)"new1", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_abort(), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(0x0001, data), 4);
+	TEST_CHECK_EQ(memcmp(data, "old1", 4), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	return 0;
+}
+TEST_END;
+
+// mostly small values, as counters and flags, now and then a large one
+static int store_mixed_size_tag(uint16_t id, uint8_t max_size, prand_t *p)
+{
+	uint8_t size = prand(p, 3) == 0 ? prand(p, 8) % (max_size + 1) : prand(p, 8) % 4;
+	uint8_t data[max_size];
+	for (uint8_t i = 0; i < size; i++)
+		data[i] = prand(p, 8);
+	test_tag_store(id, data, size);
+	return nvmtnvj_write(id, data, size);
+}
+
+#define VAR_MAX_SIZE 32
+
+TEST(variable_size)
+{
+	prand_t p;
+	prand_seed(&p, 918273);
+	TEST_CHECK_EQ(nvmtnvj_format_ext(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, VAR_MAX_SIZE,
+									 NVMTNVJ_FORMAT_VARIABLE_SIZE), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	uint8_t data[VAR_MAX_SIZE];
+	for (uint8_t len = 0; len <= VAR_MAX_SIZE; len += 4)
+	{
+		for (uint8_t i = 0; i < len; i++)
+			data[i] = len + i;
+		test_tag_store(len, data, len);
+		TEST_CHECK_EQ(nvmtnvj_write(len, data, len), 0);
+	}
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// last entry wins, also when an aborted entry comes after. The entry is measured
+	// on a rewrite staying in the current block, the aborted write must fit there too,
+	// and is cut halfway as the end of the entry is only padding
+	TEST_CHECK_EQ(nvmtnvj_write(100, (const uint8_t *)"12345678", 8), 0);
+	nvmtnvj_stats_t stats;
+	TEST_CHECK_EQ(nvmtnvj_stats(&stats), 0);
+	uint32_t free_slots = stats.free_slots;
+	flash_emul_reset_bytes_written_count();
+	TEST_CHECK_EQ(nvmtnvj_write(100, (const uint8_t *)"12345678", 8), 0);
+	uint32_t wr = flash_emul_get_bytes_written_count();
+	TEST_CHECK_EQ(nvmtnvj_stats(&stats), 0);
+	TEST_CHECK_LT(stats.free_slots, free_slots);
+	TEST_CHECK_GE(stats.free_slots, free_slots - stats.free_slots);
+	flash_emul_write_fail_after_bytes(wr / 2);
+	TEST_CHECK_EQ(nvmtnvj_write(100, (const uint8_t *)"abcdefgh", 8), FLASH_EMUL_FORCE_FAIL);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(100, data), 8);
+	TEST_CHECK_EQ(memcmp(data, "12345678", 8), 0);
+	TEST_CHECK_EQ(nvmtnvj_write(101, (const uint8_t *)"x", 1), 0);
+	TEST_CHECK_EQ(nvmtnvj_read(100, data), 8);
+	TEST_CHECK_EQ(memcmp(data, "12345678", 8), 0);
+	test_tag_store(100, (const uint8_t *)"12345678", 8);
+	test_tag_store(101, (const uint8_t *)"x", 1);
+
+	// batches walk entries by length too
+	TEST_CHECK_EQ(nvmtnvj_batch_begin(2), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_write(102, (const uint8_t *)"batched value", 13), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_delete(101), 0);
+	TEST_CHECK_EQ(nvmtnvj_batch_commit(), 0);
+	test_tag_store(102, (const uint8_t *)"batched value", 13);
+	test_tag_delete(101);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+
+	// through a number of gcs
+	for (int i = 0; i < 2000; i++)
+	{
+		uint16_t id = prand(&p, 16) % 40;
+		if (prand(&p, 3) == 0)
+		{
+			test_tag_delete(id);
+			TEST_CHECK_EQ(nvmtnvj_delete(id), 0);
+		}
+		else
+		{
+			TEST_CHECK_EQ(store_mixed_size_tag(id, VAR_MAX_SIZE, &p), 0);
+		}
+		if (i % 100 == 0)
+		{
+			TEST_CHECK_EQ(test_tag_compare_all(), 0);
+			TEST_CHECK_EQ(nvmtnvj_test_check_accounting(), 0);
+		}
+	}
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	TEST_CHECK_EQ(nvmtnvj_mount(0, BLOCK_PAGES + 1), 0);
+	TEST_CHECK_EQ(test_tag_compare_all(), 0);
+	return 0;
+}
+TEST_END;
+
+// same mixed size workload on fixed and variable size formats
+static int run_mixed_size_workload(uint32_t flags, uint32_t *erases)
+{
+	prand_t p;
+	prand_seed(&p, 5647382);
+	test_tags_clear();
+	const uint32_t erases_before = total_sector_erases();
+	int res = nvmtnvj_format_ext(0, BLOCK_PAGES, PAGE_COUNT / BLOCK_PAGES, VAR_MAX_SIZE, flags);
+	if (res == 0)
+		res = nvmtnvj_mount(0, BLOCK_PAGES + 1);
+	for (int i = 0; res == 0 && i < 5000; i++)
+		res = store_mixed_size_tag(prand(&p, 16) % 8, VAR_MAX_SIZE, &p);
+	if (res == 0)
+		res = test_tag_compare_all();
+	*erases = total_sector_erases() - erases_before;
+	if (res == 0)
+		res = nvmtnvj_unmount();
+	return res;
+}
+
+TEST(variable_size_erases)
+{
+	uint32_t fixed_erases, variable_erases;
+	TEST_CHECK_EQ(run_mixed_size_workload(0, &fixed_erases), 0);
+	TEST_CHECK_EQ(run_mixed_size_workload(NVMTNVJ_FORMAT_VARIABLE_SIZE, &variable_erases), 0);
+	printf("  sector erases, fixed size: %d, variable size: %d\n", fixed_erases, variable_erases);
+	TEST_CHECK_LE(variable_erases * 4, fixed_erases);
+	return 0;
+}
+TEST_END;
+
+// few hot tags rewritten all the time, and static tags rewritten now and then
+static int run_hot_cold_workload(int hot_cold, uint8_t block_pages, uint32_t *copies, uint32_t *writes)
+{
+	prand_t p;
+	prand_seed(&p, 24680);
+	test_tags_clear();
+	int res = nvmtnvj_format(0, block_pages, PAGE_COUNT / block_pages, TAG_MAX_SIZE);
+	if (res == 0)
+		res = nvmtnvj_mount(0, block_pages + 1);
+	nvmtnvj_test_hot_cold(hot_cold);
+	const uint32_t static_tags = nvmtnvj_test_tags_per_block();
+	for (uint32_t i = 0; res == 0 && i < static_tags; i++)
+		res = store_random_tag_in_nvm_and_testtag(0x100 + i, TAG_MAX_SIZE, &p);
+	const uint32_t copies_before = nvmtnvj_test_copied_tags();
+	*writes = 0;
+	for (int i = 0; res == 0 && i < 3000; i++)
+	{
+		uint16_t id = prand(&p, 4) == 0 ? 0x100 + prand(&p, 16) % static_tags : prand(&p, 16) % 3;
+		res = store_random_tag_in_nvm_and_testtag(id, TAG_MAX_SIZE, &p);
+		(*writes)++;
+	}
+	*copies = nvmtnvj_test_copied_tags() - copies_before;
+	if (res == 0)
+		res = test_tag_compare_all();
+	if (res == 0)
+		res = nvmtnvj_unmount();
+	if (res == 0)
+		res = nvmtnvj_mount(0, block_pages + 1);
+	if (res == 0)
+		res = test_tag_compare_all();
+	if (res == 0)
+		res = nvmtnvj_unmount();
+	return res;
+}
+
+TEST(hot_cold)
+{
+	for (uint8_t block_pages = BLOCK_PAGES; block_pages > 0; block_pages--)
+	{
+		uint32_t single_copies, dual_copies, writes;
+		TEST_CHECK_EQ(run_hot_cold_workload(0, block_pages, &single_copies, &writes), 0);
+		TEST_CHECK_EQ(run_hot_cold_workload(1, block_pages, &dual_copies, &writes), 0);
+		printf("  %d blocks, copied tags per write, single head: %.3f, hot/cold heads: %.3f\n",
+			   PAGE_COUNT / block_pages, (double)single_copies / writes, (double)dual_copies / writes);
+		TEST_CHECK_LE(dual_copies, single_copies);
+	}
+	return 0;
+}
+TEST_END;
+
+#define MIG_SECTOR_SIZE 4096
+#define MIG_NVMTNV_SECTORS 160
+#define MIG_JOURNAL_BLOCKS 160
+#define MIG_VALUE_SIZE 8
+#define MIG_BATCH 16
+static uint8_t mig_memory[MIG_SECTOR_SIZE * (MIG_NVMTNV_SECTORS + MIG_JOURNAL_BLOCKS)];
+static uint32_t *mig_work;
+
+static uint8_t migrate_value(uint16_t id, uint8_t *v)
+{
+	const uint8_t size = 1 + id % MIG_VALUE_SIZE;
+	for (uint8_t i = 0; i < size; i++)
+		v[i] = id * 31 + i * 7;
+	return size;
+}
+
+// every 13th tag is deleted
+static int migrate_live(uint16_t id)
+{
+	return id % 13 != 5;
+}
+
+static int migrate_mount_journal(void)
+{
+	int res = nvmtnvj_mount_work(MIG_NVMTNV_SECTORS, 2, mig_work,
+								 nvmtnvj_work_size(MIG_SECTOR_SIZE, MIG_JOURNAL_BLOCKS, MIG_VALUE_SIZE, 0));
+	if (res == ERR_NVMTNVJ_FS_ABORTED)
+		res = nvmtnvj_fix();
+	return res;
+}
+
+// fills nvmtnv with tags, and formats the journal behind it
+static int migrate_setup(uint32_t tags)
+{
+	// nvmtnv wants erased flash as ones, the journal in this build as zeroes
+	flash_emul_t f = {
+		.flags = FLASH_EMUL_ALLOW_BIT_PULLING | FLASH_EMUL_WRITE_BY_AND,
+		.flash_address = mig_memory,
+		.mem = mig_memory,
+		.mem_size = sizeof(mig_memory),
+		.sector_offset = 0,
+		.sector_size = MIG_SECTOR_SIZE,
+		.sectors = MIG_NVMTNV_SECTORS + MIG_JOURNAL_BLOCKS};
+	flash_emul_set(&f);
+	int res = nvmtnv_format(0, MIG_NVMTNV_SECTORS, MIG_VALUE_SIZE);
+	if (res == 0)
+		res = nvmtnv_mount(0);
+	uint8_t v[MIG_VALUE_SIZE];
+	for (uint16_t id = 0; res >= 0 && id < tags; id++)
+	{
+		if (id % 7 == 0)
+			res = nvmtnv_write(id, (const uint8_t *)"old", 3);
+		if (res >= 0)
+			res = nvmtnv_write(id, v, migrate_value(id, v));
+		if (res >= 0 && !migrate_live(id))
+			res = nvmtnv_delete(id);
+	}
+	if (res < 0)
+		return res;
+	f.flags = FLASH_EMUL_DISALLOW_BIT_PULLING | FLASH_EMUL_WRITE_BY_OR;
+	flash_emul_set(&f);
+	nvmtnvj_init();
+	return nvmtnvj_format(MIG_NVMTNV_SECTORS, 1, MIG_JOURNAL_BLOCKS, MIG_VALUE_SIZE);
+}
+
+static int migrate_check(uint32_t tags)
+{
+	uint8_t seen[NVMTNVJ_ITER_SEEN_SIZE(0, tags - 1)];
+	nvmtnvj_iter_t it;
+	int res = nvmtnvj_iter_init(&it, 0, tags - 1, seen, sizeof(seen));
+	if (res)
+		return res;
+	uint32_t found = 0;
+	uint16_t id;
+	uint8_t data[MIG_VALUE_SIZE];
+	while ((res = nvmtnvj_iter_next(&it, &id, data)) >= 0)
+	{
+		uint8_t v[MIG_VALUE_SIZE];
+		if (!migrate_live(id) || res != migrate_value(id, v) || memcmp(data, v, res))
+			return -1;
+		found++;
+	}
+	if (res != ERR_NVMTNVJ_NOENT)
+		return res;
+	for (uint16_t t = 0; t < tags; t++)
+		found -= migrate_live(t);
+	return found == 0 ? 0 : -1;
+}
+
+TEST(migrate_nvmtnv)
+{
+	mig_work = malloc(nvmtnvj_work_size(MIG_SECTOR_SIZE, MIG_JOURNAL_BLOCKS, MIG_VALUE_SIZE, 0));
+	const uint32_t sizes[] = {1000, 10000, 30000};
+	for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		TEST_CHECK_EQ(migrate_setup(sizes[i]), 0);
+		TEST_CHECK_EQ(migrate_mount_journal(), 0);
+		flash_emul_reset_bytes_read_count();
+		flash_emul_reset_bytes_written_count();
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		const int migrated = nvmtnvj_migrate_nvmtnv(MIG_BATCH);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("  migrated %5d tags in %7.1f ms, %7d bytes read, %7d bytes written\n", migrated,
+			   (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6, flash_emul_get_bytes_read_count(),
+			   flash_emul_get_bytes_written_count());
+		TEST_CHECK_GT(migrated, 0);
+		TEST_CHECK_EQ(migrate_check(sizes[i]), 0);
+		TEST_CHECK_EQ(nvmtnvj_migrate_nvmtnv(MIG_BATCH), 0);
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	}
+
+	// cut power during migration and resume
+	const uint32_t tags = 1000;
+	TEST_CHECK_EQ(migrate_setup(tags), 0);
+	flash_emul_push();
+	TEST_CHECK_EQ(migrate_mount_journal(), 0);
+	flash_emul_reset_bytes_written_count();
+	const int total = nvmtnvj_migrate_nvmtnv(MIG_BATCH);
+	TEST_CHECK_GT(total, 0);
+	const uint32_t bytes = flash_emul_get_bytes_written_count();
+	TEST_CHECK_EQ(flash_emul_pop(), 0);
+	for (uint32_t cut = 1; cut < bytes; cut += bytes / 7)
+	{
+		flash_emul_push();
+		nvmtnvj_init();
+		TEST_CHECK_EQ(migrate_mount_journal(), 0);
+		flash_emul_write_fail_after_bytes(cut);
+		TEST_CHECK_LT(nvmtnvj_migrate_nvmtnv(MIG_BATCH), 0);
+		flash_emul_write_fail_after_bytes(0);
+		nvmtnvj_init();
+		TEST_CHECK_EQ(nvmtnv_mount(0), 0);
+		TEST_CHECK_EQ(migrate_mount_journal(), 0);
+		const int resumed = nvmtnvj_migrate_nvmtnv(MIG_BATCH);
+		TEST_CHECK_GE(resumed, 0);
+		TEST_CHECK_LE(resumed, total);
+		if (cut > bytes / 2)
+			TEST_CHECK_LT(resumed, total / 2);
+		TEST_CHECK_EQ(migrate_check(tags), 0);
+		TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+		TEST_CHECK_EQ(flash_emul_pop(), 0);
+	}
+
+	// values longer than the journal takes fail the migration rather than being truncated
+	TEST_CHECK_EQ(migrate_setup(100), 0);
+	TEST_CHECK_EQ(nvmtnvj_format(MIG_NVMTNV_SECTORS, 1, MIG_JOURNAL_BLOCKS, MIG_VALUE_SIZE / 2), 0);
+	// more slots per block with smaller values, so a larger work buffer
+	free(mig_work);
+	const uint32_t work_size = nvmtnvj_work_size(MIG_SECTOR_SIZE, MIG_JOURNAL_BLOCKS, MIG_VALUE_SIZE / 2, 0);
+	mig_work = malloc(work_size);
+	TEST_CHECK_EQ(nvmtnvj_mount_work(MIG_NVMTNV_SECTORS, 2, mig_work, work_size), 0);
+	TEST_CHECK_EQ(nvmtnvj_migrate_nvmtnv(MIG_BATCH), ERR_NVMTNVJ_INVAL);
+	uint8_t data[MIG_VALUE_SIZE];
+	TEST_CHECK_EQ(nvmtnvj_read(0, data), ERR_NVMTNVJ_NOENT);
+	TEST_CHECK_EQ(nvmtnvj_unmount(), 0);
+	free(mig_work);
+	return 0;
+}
+TEST_END;
+
+#define NV_SECTOR_SIZE 256
+#define NV_SECTORS 6
+#define NV_VALUE_SIZE 8
+#define NV_IDS 24
+static uint8_t nv_memory[NV_SECTOR_SIZE * NV_SECTORS];
+
+// formats and mounts nvmtnv on nv_memory, 15 tag slots per sector
+static int nv_setup(void)
+{
+	flash_emul_t f = {
+		.flags = FLASH_EMUL_ALLOW_BIT_PULLING | FLASH_EMUL_WRITE_BY_AND,
+		.flash_address = nv_memory,
+		.mem = nv_memory,
+		.mem_size = sizeof(nv_memory),
+		.sector_offset = 0,
+		.sector_size = NV_SECTOR_SIZE,
+		.sectors = NV_SECTORS};
+	flash_emul_set(&f);
+	int res = nvmtnv_format(0, NV_SECTORS, NV_VALUE_SIZE);
+	if (res == 0)
+		res = nvmtnv_mount(0);
+	return res;
+}
+
+static int nv_write_id(uint16_t id, uint8_t gen)
+{
+	uint8_t data[NV_VALUE_SIZE];
+	for (int i = 0; i < NV_VALUE_SIZE; i++)
+		data[i] = id * 7 + gen + i;
+	return nvmtnv_write(id, data, sizeof(data));
+}
+
+static int nv_check_id(uint16_t id, uint8_t gen)
+{
+	uint8_t data[NV_VALUE_SIZE];
+	int res = nvmtnv_read(id, data, sizeof(data));
+	if (res < 0)
+		return res;
+	if (res != NV_VALUE_SIZE)
+		return -1;
+	for (int i = 0; i < NV_VALUE_SIZE; i++)
+		if (data[i] != (uint8_t)(id * 7 + gen + i))
+			return -1;
+	return 0;
+}
+
+TEST(nvmtnv_fix_evicting)
+{
+	TEST_CHECK_EQ(nv_setup(), 0);
+	for (uint16_t id = 0; id < 10; id++)
+		TEST_CHECK_EQ(nv_write_id(id, 0), NV_VALUE_SIZE);
+	// sector 0 marked as evicting, power cut before anything was moved
+	memset(nv_memory, 0, sizeof(uint32_t));
+	TEST_CHECK_EQ(nvmtnv_mount(0), 0);
+	TEST_CHECK_EQ(nvmtnv_fix(), 0);
+	for (uint16_t id = 0; id < 10; id++)
+		TEST_CHECK_EQ(nv_check_id(id, 0), 0);
+	return 0;
+}
+TEST_END;
+
+TEST(nvmtnv_gc_live)
+{
+	TEST_CHECK_EQ(nv_setup(), 0);
+	// sector 0 full of live tags, evicting it frees nothing
+	for (uint16_t id = 0; id < 15; id++)
+		TEST_CHECK_EQ(nv_write_id(id, 0), NV_VALUE_SIZE);
+	flash_emul_reset_erase_ops_count();
+	for (int gen = 0; gen < 200; gen++)
+		TEST_CHECK_EQ(nv_write_id(15, gen), NV_VALUE_SIZE);
+	for (uint16_t id = 0; id < 15; id++)
+		TEST_CHECK_EQ(nv_check_id(id, 0), 0);
+	TEST_CHECK_EQ(nv_check_id(15, 199), 0);
+	// every eviction frees a sector of deleted tags
+	TEST_CHECK_LE(flash_emul_get_erase_ops_count(), 200 / 14);
+	return 0;
+}
+TEST_END;
+
+TEST(nvmtnv_evict_counts)
+{
+	TEST_CHECK_EQ(nv_setup(), 0);
+	for (uint16_t id = 0; id < 15; id++)
+		TEST_CHECK_EQ(nv_write_id(id, 0), NV_VALUE_SIZE);
+	flash_emul_reset_erase_ops_count();
+	for (int gen = 0; gen < 100; gen++)
+	{
+		TEST_CHECK_EQ(nv_write_id(15, gen), NV_VALUE_SIZE);
+		TEST_CHECK_EQ(nvmtnv_test_check_counts(), 0);
+	}
+	TEST_CHECK_GT(flash_emul_get_erase_ops_count(), 1);
+	return 0;
+}
+TEST_END;
+
+TEST(nvmtnv_writing_counts)
+{
+	TEST_CHECK_EQ(nv_setup(), 0);
+	for (uint16_t id = 0; id < 4; id++)
+		TEST_CHECK_EQ(nv_write_id(id, 0), NV_VALUE_SIZE);
+	// cut in the data of a new tag, leaving its state writing
+	flash_emul_write_fail_after_bytes(sizeof(uint32_t) * 2 + 2);
+	TEST_CHECK_LT(nv_write_id(4, 0), 0);
+	flash_emul_write_fail_after_bytes(0);
+	TEST_CHECK_EQ(nvmtnv_mount(0), 0);
+	TEST_CHECK_EQ(nvmtnv_test_check_counts(), 0);
+	TEST_CHECK_EQ(nv_check_id(4, 0), ERR_NVMTNV_NOENT);
+	for (uint16_t id = 0; id < 4; id++)
+		TEST_CHECK_EQ(nv_check_id(id, 0), 0);
+	return 0;
+}
+TEST_END;
+
+TEST(nvmtnv_half_changing)
+{
+	TEST_CHECK_EQ(nv_setup(), 0);
+	for (uint16_t id = 0; id < 4; id++)
+		TEST_CHECK_EQ(nv_write_id(id, 0), NV_VALUE_SIZE);
+	// cut in the state of the old tag while marking it changing
+	flash_emul_write_fail_after_bytes(3);
+	TEST_CHECK_LT(nv_write_id(2, 1), 0);
+	flash_emul_write_fail_after_bytes(0);
+	TEST_CHECK_EQ(nvmtnv_mount(0), 0);
+	TEST_CHECK_EQ(nvmtnv_test_check_counts(), 0);
+	for (uint16_t id = 0; id < 4; id++)
+		TEST_CHECK_EQ(nv_check_id(id, 0), 0);
+	return 0;
+}
+TEST_END;
+
+static struct
+{
+	uint8_t size; // 0 if deleted
+	uint8_t data[NV_VALUE_SIZE];
+} nv_shadow[NV_IDS];
+
+// reads id and checks it against the shadow or, after a power cut while updating it,
+// against the new value, size 0 meaning deleted. The shadow then follows flash.
+static int nv_verify(uint16_t id, const uint8_t *new_data, int new_size)
+{
+	uint8_t data[NV_VALUE_SIZE];
+	int res = nvmtnv_read(id, data, sizeof(data));
+	if (res == ERR_NVMTNV_NOENT)
+		res = 0;
+	if (res < 0)
+		return res;
+	if (res == nv_shadow[id].size && memcmp(data, nv_shadow[id].data, res) == 0)
+		return 0;
+	if (res != new_size || memcmp(data, new_data, res))
+		return -1;
+	nv_shadow[id].size = res;
+	memcpy(nv_shadow[id].data, data, res);
+	return 0;
+}
+
+// random writes and deletes on nvmtnv, cutting power now and then. Returns a sum of
+// the flash contents after every operation, and bytes read by the operations.
+static int run_nvmtnv_workload(int lookup, uint32_t *sum, uint32_t *bytes_read, uint32_t *erases)
+{
+	prand_t p;
+	prand_seed(&p, 97531);
+	memset(nv_shadow, 0, sizeof(nv_shadow));
+	int res = nv_setup();
+	nvmtnv_test_lookup(lookup);
+	flash_emul_reset_erase_ops_count();
+	*sum = 0;
+	*bytes_read = 0;
+	for (int i = 0; res == 0 && i < 3000; i++)
+	{
+		const uint16_t id = prand(&p, 16) % NV_IDS;
+		uint8_t data[NV_VALUE_SIZE];
+		int size = 0;
+		if (prand(&p, 3) != 0)
+		{
+			size = 1 + prand(&p, 8) % NV_VALUE_SIZE;
+			for (int j = 0; j < size; j++)
+				data[j] = prand(&p, 8);
+		}
+		// cut anywhere in the tag states and data, or in a gc started by the write
+		const int cut = i % 50 == 49;
+		if (cut)
+			flash_emul_write_fail_after_bytes(1 + prand(&p, 8) % 48);
+		flash_emul_reset_bytes_read_count();
+		res = size ? nvmtnv_write(id, data, size) : nvmtnv_delete(id);
+		if (cut)
+		{
+			flash_emul_write_fail_after_bytes(0);
+			res = nvmtnv_mount(0);
+			if (res == 0)
+				res = nvmtnv_fix();
+			if (res == 0)
+				res = nv_verify(id, data, size);
+		}
+		else if (res >= 0)
+		{
+			res = 0;
+			nv_shadow[id].size = size;
+			memcpy(nv_shadow[id].data, data, size);
+		}
+		*bytes_read += flash_emul_get_bytes_read_count();
+		if (res == 0)
+			res = nvmtnv_test_check_lookup();
+		for (uint32_t j = 0; j < sizeof(nv_memory); j++)
+			*sum = *sum * 31 + nv_memory[j];
+	}
+	for (uint16_t id = 0; res == 0 && id < NV_IDS; id++)
+		res = nv_verify(id, 0, -1);
+	*erases = flash_emul_get_erase_ops_count();
+	// map and cursor rebuilt at mount
+	if (res == 0)
+		res = nvmtnv_mount(0);
+	if (res == 0)
+		res = nvmtnv_test_check_lookup();
+	for (uint16_t id = 0; res == 0 && id < NV_IDS; id++)
+		res = nv_verify(id, 0, -1);
+	nvmtnv_test_lookup(1);
+	return res;
+}
+
+TEST(nvmtnv_lookup)
+{
+	uint32_t scan_sum, scan_read, scan_erases, lookup_sum, lookup_read, lookup_erases;
+	TEST_CHECK_EQ(run_nvmtnv_workload(0, &scan_sum, &scan_read, &scan_erases), 0);
+	uint8_t scan_memory[sizeof(nv_memory)];
+	memcpy(scan_memory, nv_memory, sizeof(nv_memory));
+	TEST_CHECK_EQ(run_nvmtnv_workload(1, &lookup_sum, &lookup_read, &lookup_erases), 0);
+	printf("  bytes read, scanning: %d, map and cursors: %d, %d evictions\n", scan_read, lookup_read,
+		   lookup_erases);
+	// same flash contents after every operation
+	TEST_CHECK_EQ(memcmp(scan_memory, nv_memory, sizeof(nv_memory)), 0);
+	TEST_CHECK_EQ(lookup_sum, scan_sum);
+	TEST_CHECK_EQ(lookup_erases, scan_erases);
+	// cursors are moved by evictions
+	TEST_CHECK_GT(lookup_erases, 20);
+	TEST_CHECK_LT(lookup_read * 2, scan_read);
 	return 0;
 }
 TEST_END;
@@ -400,11 +2061,42 @@ SUITE_TESTS(nvmtnvj);
 ADD_TEST(format);
 ADD_TEST(mount);
 ADD_TEST(write_read_delete);
+ADD_TEST(read_ptr);
 ADD_TEST(aborted_write);
 ADD_TEST(aborted_gc);
 ADD_TEST(mount_seq_wrap);
 ADD_TEST(fill);
 ADD_TEST(mount_scan_first_sector_borked);
+ADD_TEST(index_lookup);
+ADD_TEST(index_overflow);
+ADD_TEST(read_multi);
+ADD_TEST(iter);
+ADD_TEST(write_cache);
+ADD_TEST(gc_accounting);
+ADD_TEST(stats);
+ADD_TEST(checkpoint);
+ADD_TEST(checkpoint_blocks);
+ADD_TEST(powerfail_sweep);
+ADD_TEST(gc_step);
+ADD_TEST(gc_step_aborted);
 ADD_TEST(wear_balanced);
 ADD_TEST(wear_unbalanced);
+ADD_TEST(wear_legacy_format);
+ADD_TEST(mount_narrow_format);
+ADD_TEST(large_geometry);
+ADD_TEST(instances);
+ADD_TEST(instances_flash);
+ADD_TEST(batch);
+ADD_TEST(read_multi_batch);
+ADD_TEST(batch_aborted);
+ADD_TEST(variable_size);
+ADD_TEST(variable_size_erases);
+ADD_TEST(hot_cold);
+ADD_TEST(migrate_nvmtnv);
+ADD_TEST(nvmtnv_fix_evicting);
+ADD_TEST(nvmtnv_gc_live);
+ADD_TEST(nvmtnv_evict_counts);
+ADD_TEST(nvmtnv_writing_counts);
+ADD_TEST(nvmtnv_half_changing);
+ADD_TEST(nvmtnv_lookup);
 SUITE_END(nvmtnvj);
@@ -185,6 +185,12 @@ int store_random_tag_in_nvm_and_testtag(uint16_t id, uint8_t max_size, prand_t *
 
 int main(int argc, char **argv)
 {
+	if (argc > 1 && strcmp(argv[1], "powerfail") == 0)
+		return powerfail_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "emulbench") == 0)
+		return emulbench_main(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+		return bench_main(argc - 1, argv + 1);
 	test_init(NULL);
 	run_tests(argc, argv);
 	return 0;
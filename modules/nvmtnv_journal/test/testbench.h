@@ -22,4 +22,13 @@ int test_tag_compare(uint16_t id);
 
 int store_random_tag_in_nvm_and_testtag(uint16_t id, uint8_t max_size, prand_t *p);
 
+// cuts power at every written byte of a workload recorded from seed, spread over
+// workers processes, 0 for one per core
+int powerfail_run(uint32_t ops, uint32_t seed, uint32_t workers);
+int powerfail_main(int argc, char **argv);
+// push/pop cost of the flash emulator at 512 KB and 16 MB
+int emulbench_main(int argc, char **argv);
+// benchmark workloads, CSV to stdout
+int bench_main(int argc, char **argv);
+
 #endif // _TESTBENCH_H_
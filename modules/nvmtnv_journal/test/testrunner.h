@@ -101,7 +101,7 @@ typedef struct test_res_s
 			printf("  TEST FAIL %s:%d\n", __FILE__, __LINE__); \
 			goto __fail_stop;                                  \
 		}                                                      \
-	}
+	} while (0)
 #define TEST_CHECK_EQ(x, y)                                                        \
 	do                                                                             \
 	{                                                                              \